@@ -0,0 +1,89 @@
+"""Measure the per-call overhead of read() and write() at small packet sizes.
+
+The two ends of the socketpair setup of bench_datapath.py are used and each
+iteration writes one packet to the first device and reads it from the
+second one, so no peer process is needed and the system calls cost the same
+in every mode. The 'os' mode does both with os.write() and os.read() on the
+file descriptors of the devices, the other modes replace one of them by a
+method of the device: the difference with the 'os' mode is the overhead of
+the method. 'write_copy' converts a bytearray to bytes before writing it,
+as callers had to when write() only accepted strings. Results are printed
+as one JSON object per line.
+"""
+
+import json
+import optparse
+import os
+import sys
+
+from bench_datapath import clock, socketpair_setup, udp_packet
+
+
+def modes(tx_dev, rx_dev, pkt):
+    tx_fd = tx_dev.fileno()
+    rx_fd = rx_dev.fileno()
+    size = len(pkt) + 1
+    buf = bytearray(size)
+    ba = bytearray(pkt)
+    mv = memoryview(ba)
+    yield 'os', lambda: os.write(tx_fd, pkt) and os.read(rx_fd, size)
+    yield 'write', lambda: tx_dev.write(pkt) and os.read(rx_fd, size)
+    yield 'write_bytearray', lambda: tx_dev.write(ba) and os.read(rx_fd, size)
+    yield 'write_memoryview', lambda: tx_dev.write(mv) and os.read(rx_fd, size)
+    yield 'write_copy', lambda: tx_dev.write(bytes(ba)) and os.read(rx_fd, size)
+    yield 'read', lambda: os.write(tx_fd, pkt) and rx_dev.read(size)
+    yield 'try_read', lambda: os.write(tx_fd, pkt) and rx_dev.try_read(size)
+    yield 'read_into', lambda: os.write(tx_fd, pkt) and rx_dev.read_into(buf)
+
+
+def timed(call, duration):
+    count = 0
+    start = clock()
+    end = start + duration
+    now = start
+    while now < end:
+        for i in range(1000):
+            call()
+        count += 1000
+        now = clock()
+    return (now - start) / count
+
+
+def main():
+    parser = optparse.OptionParser()
+    parser.add_option('--sizes', default='28,64,256',
+            help='comma separated IP packet sizes [%default]')
+    parser.add_option('--time', type='float', default=1.0,
+            help='duration of each measure in seconds [%default]')
+    parser.add_option('--repeat', type='int', default=3,
+            help='number of measures of each mode, the best one is kept [%default]')
+    opt, args = parser.parse_args()
+
+    tx_dev, rx_dev = socketpair_setup()
+    for size in [int(size) for size in opt.sizes.split(',')]:
+        pkt = udp_packet(size)
+        base = None
+        for name, call in modes(tx_dev, rx_dev, pkt):
+            try:
+                call()
+            except TypeError as e:
+                # e.g. buffers given to write() by older versions
+                sys.stderr.write('%s unsupported (%s)\n' % (name, e))
+                continue
+            elapsed = min(timed(call, opt.time) for i in range(opt.repeat))
+            if base is None:
+                base = elapsed
+            print(json.dumps({
+                'bench': 'calls',
+                'mode': name,
+                'size': len(pkt),
+                'ns_per_iteration': round(elapsed * 1e9, 1),
+                'overhead_ns': round((elapsed - base) * 1e9, 1),
+            }))
+            sys.stdout.flush()
+    tx_dev.close()
+    rx_dev.close()
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
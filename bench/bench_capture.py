@@ -0,0 +1,101 @@
+"""Compare the throughput of a device with and without a capture running.
+
+The devices and the measures are those of bench_datapath.py: for each
+packet size, a few read and write modes are run without capture, then with
+start_capture() writing to a file in --dir. The overhead of the capture is
+given in percent of the packet rate without capture. Results are printed as
+one JSON object per line.
+"""
+
+import json
+import optparse
+import os
+import signal
+import sys
+import tempfile
+
+import pytun
+
+from bench_datapath import measure, netns_setup, peer, socketpair_setup, udp_packet, arena_of
+
+
+def modes(tx_dev, rx_dev, pkt, batch):
+    size = len(pkt) + 1
+    arena = bytearray(size * batch)
+    buf = bytearray(size)
+    tx_arena, offsets = arena_of(pkt, batch)
+    yield 'rx', 'read_into', rx_dev, lambda: rx_dev.read_into(buf) and 1
+    yield 'rx', 'read_many_into', rx_dev, lambda: len(rx_dev.read_many_into(arena, batch, size)) - 1
+    yield 'tx', 'write', tx_dev, lambda: tx_dev.write(pkt) and 1
+    yield 'tx', 'write_many_offsets', tx_dev, lambda: tx_dev.write_many(tx_arena, offsets)
+
+
+def run(setup, devices, size, batch, duration, directory, snaplen, ring_bytes):
+    tx_dev, rx_dev = devices
+    pkt = udp_packet(size)
+    path = os.path.join(directory, 'bench_capture.pcapng')
+    for direction, name, dev, call in modes(tx_dev, rx_dev, pkt, batch):
+        result = {'bench': 'capture', 'setup': setup, 'path': direction, 'mode': name,
+                  'size': len(pkt), 'batch': batch}
+        for capture in (False, True):
+            if capture:
+                dev.start_capture(path, snaplen, ring_bytes)
+            pid = peer(rx_dev if direction == 'tx' else tx_dev, direction, pkt, batch)
+            try:
+                res = measure(dev, call, None, duration)
+            finally:
+                os.kill(pid, signal.SIGKILL)
+                os.waitpid(pid, 0)
+            key = 'on' if capture else 'off'
+            if capture:
+                result['captured'] = dev.capture_stats()['packets']
+                result['overwritten'] = dev.capture_stats()['overwritten']
+                dev.stop_capture()
+                os.unlink(path)
+            result['pps_' + key] = res['pps']
+            result['p99_us_' + key] = res['p99_us']
+        result['overhead_pct'] = round((1 - result['pps_on'] / result['pps_off']) * 100, 2)
+        print(json.dumps(result))
+        sys.stdout.flush()
+
+
+def main():
+    parser = optparse.OptionParser()
+    parser.add_option('--setup', choices=('auto', 'netns', 'socketpair'), default='auto',
+            help='devices to use: auto, netns or socketpair [%default]')
+    parser.add_option('--sizes', default='64,1500,9000',
+            help='comma separated IP packet sizes [%default]')
+    parser.add_option('--batch', type='int', default=64,
+            help='number of packets per batch [%default]')
+    parser.add_option('--time', type='float', default=1.0,
+            help='duration of each measure in seconds [%default]')
+    parser.add_option('--dir', default=tempfile.gettempdir(),
+            help='directory of the capture file [%default]')
+    parser.add_option('--snaplen', type='int', default=65535,
+            help='snaplen of the capture [%default]')
+    parser.add_option('--ring-bytes', type='int', default=64 << 20,
+            help='size of the capture file [%default]')
+    opt, args = parser.parse_args()
+
+    setup = opt.setup
+    devices = None
+    if setup in ('auto', 'netns'):
+        try:
+            devices = netns_setup()
+            setup = 'netns'
+        except (OSError, pytun.Error) as e:
+            if setup == 'netns':
+                raise
+            sys.stderr.write('netns setup unavailable (%s), using socketpair\n' % e)
+    if devices is None:
+        devices = socketpair_setup()
+        setup = 'socketpair'
+
+    for size in [int(size) for size in opt.sizes.split(',')]:
+        run(setup, devices, size, opt.batch, opt.time, opt.dir, opt.snaplen, opt.ring_bytes)
+    for dev in devices:
+        dev.close()
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,89 @@
+"""Measure the throughput of the checksum kernels on one core.
+
+For each kernel listed in pytun.CHECKSUM_KERNELS, checksum() is called on
+buffers of several sizes; verify_checksums() and fix_checksums() are run on
+batches of UDP packets and a pure Python implementation is given as a
+reference. Results are printed as one JSON object per line, throughputs in
+GB/s of checksummed data.
+"""
+
+import json
+import optparse
+import os
+import socket
+import struct
+import sys
+import time
+
+import pytun
+
+
+def py_checksum(data):
+    if len(data) % 2:
+        data += b'\0'
+    s = sum(struct.unpack('!%dH' % (len(data) // 2), data))
+    while s >> 16:
+        s = (s & 0xffff) + (s >> 16)
+    return ~s & 0xffff
+
+
+def udp_packet(size):
+    udp = struct.pack('!HHHH', 5000, 5001, 8 + size, 0) + os.urandom(size)
+    ip = struct.pack('!BBHHHBBH4s4s', 0x45, 0, 20 + len(udp), 0, 0, 64, 17, 0,
+                     socket.inet_aton('10.0.0.1'), socket.inet_aton('10.0.0.2'))
+    return bytearray(ip + udp)
+
+
+def timed(func, nbytes, min_time):
+    count = 0
+    start = time.time()
+    while True:
+        func()
+        count += 1
+        elapsed = time.time() - start
+        if elapsed >= min_time:
+            break
+    return {
+        'calls': count,
+        'gbps': round(nbytes * count / elapsed / 1e9, 3),
+        'ns_per_call': round(elapsed / count * 1e9, 1),
+    }
+
+
+def main():
+    parser = optparse.OptionParser()
+    parser.add_option('--sizes', default='64,576,1500,9000,65536',
+            help='comma separated buffer sizes [%default]')
+    parser.add_option('--batch', type='int', default=64,
+            help='number of packets per batch [%default]')
+    parser.add_option('--time', type='float', default=1.0,
+            help='minimum duration of each measure in seconds [%default]')
+    opt, args = parser.parse_args()
+    sizes = [int(size) for size in opt.sizes.split(',')]
+
+    for size in sizes:
+        buf = os.urandom(size)
+        for kernel in pytun.CHECKSUM_KERNELS:
+            result = timed(lambda: pytun.checksum(buf, kernel=kernel), size, opt.time)
+            result.update({'bench': 'checksum', 'kernel': kernel, 'size': size})
+            print(json.dumps(result))
+        result = timed(lambda: py_checksum(buf), size, opt.time)
+        result.update({'bench': 'checksum', 'kernel': 'python', 'size': size})
+        print(json.dumps(result))
+
+    flags = pytun.IFF_TUN | pytun.IFF_NO_PI
+    for size in sizes:
+        if size > 65507:
+            continue
+        pkts = [udp_packet(size) for i in range(opt.batch)]
+        nbytes = sum(len(pkt) for pkt in pkts)
+        for name, func in (('fix_checksums', pytun.fix_checksums),
+                           ('verify_checksums', pytun.verify_checksums)):
+            result = timed(lambda: func(pkts, flags=flags), nbytes, opt.time)
+            result.update({'bench': name, 'kernel': pytun.CHECKSUM_KERNELS[0],
+                           'size': size, 'batch': opt.batch})
+            print(json.dumps(result))
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,268 @@
+"""Measure the throughput and the latency of every read/write mode of a
+device at fixed packet sizes.
+
+A peer process keeps the device busy while the mode under test runs for a
+fixed duration: for read modes the peer writes packets as fast as it can,
+for write modes it drains them. The packet rate, the throughput, the number
+of system calls per packet (from the counters of the device, or from the
+io_uring counters) and percentiles of the duration of each call are
+reported.
+
+Two setups are available:
+
+- netns: two TUN devices in a private network namespace with forwarding
+  enabled. Packets written to the first one are routed by the kernel to the
+  second one. Needs CAP_NET_ADMIN.
+- socketpair: the two ends of an AF_UNIX SOCK_SEQPACKET socket pair passed
+  to TunTapDevice() with the dev argument. It only measures the overhead of
+  pytun itself and is used when the netns setup is not available.
+
+Results are printed as one JSON object per line.
+"""
+
+import ctypes
+import ctypes.util
+import json
+import optparse
+import os
+import signal
+import socket
+import struct
+import sys
+import time
+
+import pytun
+
+clock = getattr(time, 'perf_counter', time.time)
+
+CLONE_NEWNET = 0x40000000
+TX_ADDR, TX_DSTADDR = '10.201.0.1', '10.201.0.2'
+RX_ADDR, RX_DSTADDR = '10.202.0.1', '10.202.0.2'
+PORT = 9000
+MAX_SIZE = 65535
+FLAGS = pytun.IFF_TUN | pytun.IFF_NO_PI
+
+
+def udp_packet(size):
+    """Return an IPv4/UDP packet of size bytes going through both devices"""
+    size = max(28, min(size, MAX_SIZE))
+    udp = struct.pack('!HHHH', PORT, PORT, size - 20, 0) + b'x' * (size - 28)
+    ip = struct.pack('!BBHHHBBH4s4s', 0x45, 0, size, 0, 0, 64, 17, 0,
+                     socket.inet_aton(TX_DSTADDR), socket.inet_aton(RX_DSTADDR))
+    ip = ip[:10] + struct.pack('!H', pytun.checksum(ip)) + ip[12:]
+    return ip + udp
+
+
+def unshare_net():
+    if hasattr(os, 'unshare'):
+        os.unshare(CLONE_NEWNET)
+        return
+    libc = ctypes.CDLL(ctypes.util.find_library('c'), use_errno=True)
+    if libc.unshare(CLONE_NEWNET) < 0:
+        err = ctypes.get_errno()
+        raise OSError(err, os.strerror(err))
+
+
+def sysctl(path, value):
+    try:
+        with open(os.path.join('/proc/sys', path), 'w') as f:
+            f.write(value)
+    except (IOError, OSError):
+        pass
+
+
+def netns_setup():
+    unshare_net()
+    sysctl('net/ipv4/ip_forward', '1')
+    sysctl('net/ipv4/conf/all/rp_filter', '0')
+    sysctl('net/ipv4/conf/default/rp_filter', '0')
+    devices = []
+    for name, addr, dstaddr in (('dptx', TX_ADDR, TX_DSTADDR), ('dprx', RX_ADDR, RX_DSTADDR)):
+        dev = pytun.TunTapDevice(name, FLAGS)
+        dev.configure(addr=addr, dstaddr=dstaddr, netmask='255.255.255.255',
+                      mtu=MAX_SIZE, up=True)
+        devices.append(dev)
+    return devices
+
+
+def socketpair_setup():
+    a, b = socket.socketpair(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+    for sock in (a, b):
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_SNDBUF, 1 << 22)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 22)
+    devices = [pytun.TunTapDevice(flags=FLAGS, dev=a), pytun.TunTapDevice(flags=FLAGS, dev=b)]
+    a.close()
+    b.close()
+    return devices
+
+
+def arena_of(pkt, batch):
+    arena = bytearray(pkt * batch)
+    offsets = list(range(0, len(arena) + 1, len(pkt)))
+    return arena, offsets
+
+
+def rx_modes(dev, size, batch):
+    """Yield (name, call, calls counter) for each read mode. call() returns
+    the number of packets read"""
+    buf = bytearray(size + 1)
+    arena = bytearray((size + 1) * batch)
+    yield 'read', lambda: len(dev.read(size + 1)) and 1, None
+    yield 'read_into', lambda: dev.read_into(buf) and 1, None
+    yield 'read_many', lambda: len(dev.read_many(batch, size + 1)), None
+    yield 'read_many_into', lambda: len(dev.read_many_into(arena, batch, size + 1)) - 1, None
+    ring = pytun.PacketRing(dev, batch, size + 1)
+
+    def ring_call():
+        n = ring.fill()
+        for slot in ring:
+            slot.release()
+        return n
+    yield 'packet_ring', ring_call, None
+    if hasattr(pytun, 'Uring'):
+        uring = pytun.Uring(dev, batch, size + 1)
+        yield 'uring_' + uring.backend, lambda: len(uring.read_many()), \
+            lambda: uring.stats()['enters']
+
+
+def tx_modes(dev, pkt, batch):
+    """Yield (name, call, calls counter) for each write mode. call() returns
+    the number of packets written"""
+    pkts = [pkt] * batch
+    arena, offsets = arena_of(pkt, batch)
+    yield 'write', lambda: dev.write(pkt) and 1, None
+    yield 'write_many', lambda: dev.write_many(pkts), None
+    yield 'write_many_offsets', lambda: dev.write_many(arena, offsets), None
+    if hasattr(pytun, 'Uring'):
+        uring = pytun.Uring(dev, batch, len(pkt))
+        yield 'uring_' + uring.backend + '_write', lambda: uring.write_many(pkts) or batch, \
+            lambda: uring.stats()['enters']
+
+
+def peer(dev, path, pkt, batch):
+    """Fork a process keeping the device under test busy"""
+    pid = os.fork()
+    if pid:
+        return pid
+    try:
+        if path == 'rx':
+            arena, offsets = arena_of(pkt, batch)
+            while True:
+                dev.write_many(arena, offsets)
+        else:
+            arena = bytearray((len(pkt) + 1) * batch)
+            while True:
+                dev.read_many_into(arena, batch, len(pkt) + 1)
+    finally:
+        os._exit(0)
+
+
+def percentile(values, p):
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+
+def measure(dev, call, counter, duration):
+    samples = []
+    packets = 0
+    stats = dev.stats()
+    calls = counter() if counter else None
+    start = clock()
+    end = start + duration
+    now = start
+    while now < end:
+        packets += call()
+        t = clock()
+        samples.append(t - now)
+        now = t
+    elapsed = now - start
+    after = dev.stats()
+    if counter:
+        syscalls = counter() - calls
+    else:
+        syscalls = (after.reads - stats.reads) + (after.writes - stats.writes)
+    samples.sort()
+    return {
+        'packets': packets,
+        'calls': len(samples),
+        'pps': round(packets / elapsed, 1),
+        'gbps': None,
+        'syscalls_per_packet': round(float(syscalls) / max(packets, 1), 4),
+        'p50_us': round(percentile(samples, 0.5) * 1e6, 2),
+        'p90_us': round(percentile(samples, 0.9) * 1e6, 2),
+        'p99_us': round(percentile(samples, 0.99) * 1e6, 2),
+        'p999_us': round(percentile(samples, 0.999) * 1e6, 2),
+        'max_us': round(samples[-1] * 1e6, 2),
+    }
+
+
+def run(setup, devices, size, batch, duration, only):
+    tx_dev, rx_dev = devices
+    pkt = udp_packet(size)
+    results = []
+    for path, dev, modes in (('rx', rx_dev, rx_modes(rx_dev, len(pkt), batch)),
+                             ('tx', tx_dev, tx_modes(tx_dev, pkt, batch))):
+        other = tx_dev if path == 'rx' else rx_dev
+        for name, call, counter in modes:
+            if only and name not in only:
+                continue
+            pid = peer(other, path, pkt, batch)
+            try:
+                result = measure(dev, call, counter, duration)
+            finally:
+                os.kill(pid, signal.SIGKILL)
+                os.waitpid(pid, 0)
+            # Empty the device before the next mode
+            rx_dev.nonblocking = True
+            try:
+                while rx_dev.read_many(1024, len(pkt) + 1):
+                    pass
+            except pytun.Error:
+                pass
+            rx_dev.nonblocking = False
+            result['gbps'] = round(result['pps'] * len(pkt) * 8 / 1e9, 3)
+            result.update({'bench': 'datapath', 'setup': setup, 'path': path,
+                           'mode': name, 'size': len(pkt), 'batch': batch})
+            results.append(result)
+            print(json.dumps(result))
+            sys.stdout.flush()
+    return results
+
+
+def main():
+    parser = optparse.OptionParser()
+    parser.add_option('--setup', choices=('auto', 'netns', 'socketpair'), default='auto',
+            help='devices to use: auto, netns or socketpair [%default]')
+    parser.add_option('--sizes', default='64,512,1500,9000,65535',
+            help='comma separated IP packet sizes [%default]')
+    parser.add_option('--batch', type='int', default=64,
+            help='number of packets per batch [%default]')
+    parser.add_option('--time', type='float', default=1.0,
+            help='duration of each measure in seconds [%default]')
+    parser.add_option('--modes', default='',
+            help='comma separated modes to run, all if empty')
+    opt, args = parser.parse_args()
+    sizes = [int(size) for size in opt.sizes.split(',')]
+    only = set(opt.modes.split(',')) if opt.modes else None
+
+    setup = opt.setup
+    devices = None
+    if setup in ('auto', 'netns'):
+        try:
+            devices = netns_setup()
+            setup = 'netns'
+        except (OSError, pytun.Error) as e:
+            if setup == 'netns':
+                raise
+            sys.stderr.write('netns setup unavailable (%s), using socketpair\n' % e)
+    if devices is None:
+        devices = socketpair_setup()
+        setup = 'socketpair'
+
+    for size in sizes:
+        run(setup, devices, size, opt.batch, opt.time, only)
+    for dev in devices:
+        dev.close()
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
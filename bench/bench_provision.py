@@ -0,0 +1,64 @@
+"""Compare the time taken to provision many TAP devices with ioctl() calls
+(one attribute at a time) and with pytun.create_many() (batched rtnetlink
+requests).
+
+Each device gets an IPv4 address, a netmask, an MTU and is brought up.
+Needs CAP_NET_ADMIN. Results are printed as one JSON object per line.
+"""
+
+import json
+import optparse
+import sys
+import time
+
+import pytun
+
+
+def address(i):
+    return '10.%d.%d.1' % (100 + i // 256, i % 256)
+
+
+def provision_ioctl(count):
+    devices = []
+    for i in range(count):
+        tap = pytun.TunTapDevice('pvb%d' % i, pytun.IFF_TAP)
+        tap.addr = address(i)
+        tap.netmask = '255.255.255.0'
+        tap.mtu = 1400
+        tap.up()
+        devices.append(tap)
+    return devices
+
+
+def provision_netlink(count):
+    return pytun.create_many('pvb%d', count, pytun.IFF_TAP,
+            lambda i: {'addrs': address(i) + '/24', 'mtu': 1400, 'up': True})
+
+
+def run(mode, count):
+    provision = provision_ioctl if mode == 'ioctl' else provision_netlink
+    start = time.time()
+    devices = provision(count)
+    elapsed = time.time() - start
+    for tap in devices:
+        tap.close()
+    return {
+        'bench': 'provision',
+        'mode': mode,
+        'devices': count,
+        'seconds': round(elapsed, 6),
+        'devices_per_second': round(count / elapsed, 1),
+    }
+
+
+def main():
+    parser = optparse.OptionParser()
+    parser.add_option('--count', type='int', default=2000,
+            help='number of devices to provision [%default]')
+    opt, args = parser.parse_args()
+    for mode in ('ioctl', 'netlink'):
+        print(json.dumps(run(mode, opt.count)))
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,109 @@
+"""Compare the packet rate of pytun.Relay with a Python select() loop.
+
+Packets sent to an address routed through a TUN device are forwarded by the
+relay to a UDP peer on the loopback, which counts them. Needs CAP_NET_ADMIN.
+Results are printed as one JSON object per line.
+"""
+
+import json
+import optparse
+import select
+import socket
+import sys
+import threading
+import time
+
+import pytun
+
+TUN_ADDR = '10.199.0.1'
+TUN_DSTADDR = '10.199.0.2'
+
+
+def python_loop(tun, sock, peer, stop):
+    mtu = tun.mtu
+    while not stop.is_set():
+        r, _, _ = select.select([tun, sock], [], [], 0.1)
+        if tun in r:
+            sock.sendto(tun.read(mtu), peer)
+        if sock in r:
+            buf, addr = sock.recvfrom(65535)
+            if addr == peer:
+                tun.write(buf)
+
+
+def run(mode, count, size):
+    tun = pytun.TunTapDevice(flags=pytun.IFF_TUN | pytun.IFF_NO_PI)
+    tun.addr = TUN_ADDR
+    tun.dstaddr = TUN_DSTADDR
+    tun.netmask = '255.255.255.255'
+    tun.up()
+    relay_sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    relay_sock.bind(('127.0.0.1', 0))
+    peer = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    peer.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 24)
+    peer.bind(('127.0.0.1', 0))
+    peer.setblocking(False)
+    peer_addr = peer.getsockname()
+
+    stop = threading.Event()
+    if mode == 'relay':
+        worker = pytun.Relay(tun, relay_sock, peer_addr)
+        worker.start()
+    else:
+        worker = threading.Thread(target=python_loop, args=(tun, relay_sock, peer_addr, stop))
+        worker.start()
+
+    src = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    payload = b'x' * size
+    received = 0
+    start = time.time()
+    for i in range(count):
+        src.sendto(payload, (TUN_DSTADDR, 9))
+        if i % 64 == 63:
+            # Drain the peer as we go to avoid overflowing its buffer
+            try:
+                while True:
+                    peer.recv(65536)
+                    received += 1
+            except (socket.error, OSError):
+                pass
+    peer.settimeout(0.5)
+    try:
+        while received < count:
+            peer.recv(65536)
+            received += 1
+    except socket.timeout:
+        pass
+    elapsed = time.time() - start
+
+    if mode == 'relay':
+        worker.stop()
+    else:
+        stop.set()
+        worker.join()
+    tun.close()
+
+    return {
+        'bench': 'relay',
+        'mode': mode,
+        'size': size,
+        'sent': count,
+        'received': received,
+        'seconds': round(elapsed, 6),
+        'pps': round(received / elapsed, 1),
+    }
+
+
+def main():
+    parser = optparse.OptionParser()
+    parser.add_option('--count', type='int', default=100000,
+            help='number of packets to send [%default]')
+    parser.add_option('--size', type='int', default=64,
+            help='size of the UDP payload [%default]')
+    opt, args = parser.parse_args()
+    for mode in ('python', 'relay'):
+        print(json.dumps(run(mode, opt.count, opt.size)))
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,132 @@
+"""Compare pytun.replay() with a Python loop writing the packets of a pcap
+file, and measure the timing error of replay() with the original timing.
+
+A pcap file of --count UDP packets spaced by 1/--rate seconds is generated,
+then written to the device of bench_datapath.py as fast as possible by
+replay() and by Python loops, while a peer process drains the device.
+Results are printed as one JSON object per line.
+"""
+
+import json
+import optparse
+import os
+import signal
+import struct
+import sys
+import tempfile
+import time
+
+import pytun
+
+from bench_datapath import netns_setup, peer, socketpair_setup, udp_packet
+
+clock = getattr(time, 'perf_counter', time.time)
+
+
+def write_pcap(path, pkt, count, rate):
+    with open(path, 'wb') as f:
+        # LINKTYPE_RAW, microsecond timestamps
+        f.write(struct.pack('<IHHiIII', 0xa1b2c3d4, 2, 4, 0, 0, 65535, 101))
+        for i in range(count):
+            ts = int(i * 1e6 / rate)
+            f.write(struct.pack('<IIII', ts // 1000000, ts % 1000000, len(pkt), len(pkt)))
+            f.write(pkt)
+
+
+def read_pcap(path):
+    pkts = []
+    with open(path, 'rb') as f:
+        data = f.read()
+    off = 24
+    while off + 16 <= len(data):
+        caplen = struct.unpack_from('<I', data, off + 8)[0]
+        pkts.append(data[off + 16:off + 16 + caplen])
+        off += 16 + caplen
+    return pkts
+
+
+def python_write(dev, path):
+    for pkt in read_pcap(path):
+        dev.write(pkt)
+
+
+def python_write_many(dev, path):
+    dev.write_many(read_pcap(path))
+
+
+def run(setup, devices, size, count, rate, batch, directory):
+    tx_dev, rx_dev = devices
+    pkt = udp_packet(size)
+    path = os.path.join(directory, 'bench_replay.pcap')
+    write_pcap(path, pkt, count, rate)
+    tests = [
+        ('python_write', lambda: python_write(tx_dev, path)),
+        ('python_write_many', lambda: python_write_many(tx_dev, path)),
+        ('replay', lambda: pytun.replay(tx_dev, path, speed=0, batch=batch)),
+        ('replay_timed', lambda: pytun.replay(tx_dev, path, speed=1.0, batch=batch)),
+    ]
+    for name, func in tests:
+        pid = peer(rx_dev, 'tx', pkt, batch)
+        try:
+            start = clock()
+            res = func()
+            elapsed = clock() - start
+        finally:
+            os.kill(pid, signal.SIGKILL)
+            os.waitpid(pid, 0)
+        result = {
+            'bench': 'replay',
+            'setup': setup,
+            'mode': name,
+            'size': len(pkt),
+            'packets': count,
+            'seconds': round(elapsed, 6),
+            'pps': round(count / elapsed, 1),
+        }
+        if res is not None and 'timing_error_ns' in res:
+            result['recorded_pps'] = rate
+            result['achieved_pps'] = round(res['pps'], 1)
+            result['timing_error_ns'] = res['timing_error_ns']
+        print(json.dumps(result))
+        sys.stdout.flush()
+    os.unlink(path)
+
+
+def main():
+    parser = optparse.OptionParser()
+    parser.add_option('--setup', choices=('auto', 'netns', 'socketpair'), default='auto',
+            help='devices to use: auto, netns or socketpair [%default]')
+    parser.add_option('--sizes', default='64,1500',
+            help='comma separated IP packet sizes [%default]')
+    parser.add_option('--count', type='int', default=100000,
+            help='number of packets in the pcap file [%default]')
+    parser.add_option('--rate', type='float', default=50000,
+            help='packet rate recorded in the pcap file [%default]')
+    parser.add_option('--batch', type='int', default=64,
+            help='maximum number of packets per burst [%default]')
+    parser.add_option('--dir', default=tempfile.gettempdir(),
+            help='directory of the pcap file [%default]')
+    opt, args = parser.parse_args()
+
+    setup = opt.setup
+    devices = None
+    if setup in ('auto', 'netns'):
+        try:
+            devices = netns_setup()
+            setup = 'netns'
+        except (OSError, pytun.Error) as e:
+            if setup == 'netns':
+                raise
+            sys.stderr.write('netns setup unavailable (%s), using socketpair\n' % e)
+    if devices is None:
+        devices = socketpair_setup()
+        setup = 'socketpair'
+
+    for size in [int(size) for size in opt.sizes.split(',')]:
+        run(setup, devices, size, opt.count, opt.rate, opt.batch, opt.dir)
+    for dev in devices:
+        dev.close()
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,128 @@
+"""Compare a Shaper with a token bucket implemented in Python.
+
+Packets are written to the device of bench_datapath.py for --time seconds
+at a target rate given in Mbit/s, once with write_many() and a Shaper set
+on the device, once with write() paced by a Python token bucket sleeping
+with time.sleep(). The achieved rate, its error compared to the target and
+the CPU time used per second are reported, one JSON object per line.
+"""
+
+import json
+import optparse
+import os
+import signal
+import sys
+import time
+
+import pytun
+
+from bench_datapath import netns_setup, peer, socketpair_setup, udp_packet
+
+clock = getattr(time, 'perf_counter', time.time)
+
+
+def python_shaped(dev, pkt, rate, burst, duration):
+    tokens = burst
+    last = clock()
+    end = last + duration
+    written = 0
+    while True:
+        now = clock()
+        if now >= end:
+            break
+        tokens = min(burst, tokens + (now - last) * rate)
+        last = now
+        if tokens < len(pkt):
+            time.sleep((len(pkt) - tokens) / rate)
+            continue
+        tokens -= len(pkt)
+        dev.write(pkt)
+        written += 1
+    return written
+
+
+def native_shaped(dev, pkt, rate, burst, duration, batch):
+    dev.shaper = pytun.Shaper(rate, burst=burst)
+    pkts = [pkt] * batch
+    end = clock() + duration
+    written = 0
+    try:
+        while clock() < end:
+            written += dev.write_many(pkts)
+    finally:
+        dev.shaper = None
+    return written
+
+
+def run(setup, devices, size, mbps, duration, batch):
+    tx_dev, rx_dev = devices
+    pkt = udp_packet(size)
+    rate = mbps * 1e6 / 8
+    burst = max(len(pkt), rate / 100)
+    tests = [
+        ('python', lambda: python_shaped(tx_dev, pkt, rate, burst, duration)),
+        ('shaper', lambda: native_shaped(tx_dev, pkt, rate, burst, duration, batch)),
+    ]
+    for name, func in tests:
+        pid = peer(rx_dev, 'tx', pkt, batch)
+        try:
+            cpu = os.times()
+            start = clock()
+            written = func()
+            elapsed = clock() - start
+            cpu_after = os.times()
+        finally:
+            os.kill(pid, signal.SIGKILL)
+            os.waitpid(pid, 0)
+        achieved = written * len(pkt) * 8 / elapsed / 1e6
+        used = (cpu_after[0] - cpu[0]) + (cpu_after[1] - cpu[1])
+        print(json.dumps({
+            'bench': 'shaper',
+            'setup': setup,
+            'mode': name,
+            'size': len(pkt),
+            'target_mbps': mbps,
+            'achieved_mbps': round(achieved, 3),
+            'error_pct': round((achieved / mbps - 1) * 100, 3),
+            'cpu_per_second': round(used / elapsed, 4),
+        }))
+        sys.stdout.flush()
+
+
+def main():
+    parser = optparse.OptionParser()
+    parser.add_option('--setup', choices=('auto', 'netns', 'socketpair'), default='auto',
+            help='devices to use: auto, netns or socketpair [%default]')
+    parser.add_option('--sizes', default='64,1500',
+            help='comma separated IP packet sizes [%default]')
+    parser.add_option('--rates', default='10,100,1000',
+            help='comma separated target rates in Mbit/s [%default]')
+    parser.add_option('--batch', type='int', default=64,
+            help='number of packets per write_many() call [%default]')
+    parser.add_option('--time', type='float', default=2.0,
+            help='duration of each measure in seconds [%default]')
+    opt, args = parser.parse_args()
+
+    setup = opt.setup
+    devices = None
+    if setup in ('auto', 'netns'):
+        try:
+            devices = netns_setup()
+            setup = 'netns'
+        except (OSError, pytun.Error) as e:
+            if setup == 'netns':
+                raise
+            sys.stderr.write('netns setup unavailable (%s), using socketpair\n' % e)
+    if devices is None:
+        devices = socketpair_setup()
+        setup = 'socketpair'
+
+    for size in [int(size) for size in opt.sizes.split(',')]:
+        for mbps in [float(rate) for rate in opt.rates.split(',')]:
+            run(setup, devices, size, mbps, opt.time, opt.batch)
+    for dev in devices:
+        dev.close()
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
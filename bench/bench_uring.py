@@ -0,0 +1,174 @@
+"""Compare the io_uring backend (pytun.Uring) with plain read()/write().
+
+For each backend, packets sent to an address routed through a TUN device
+are read from the device (rx), packets written to the device are received
+by a local UDP socket (tx) and the latency between sending a packet and
+reading it from the device is measured one packet at a time. Needs
+CAP_NET_ADMIN. Results are printed as one JSON object per line.
+"""
+
+import json
+import optparse
+import socket
+import struct
+import sys
+import time
+
+import pytun
+
+TUN_ADDR = '10.198.0.1'
+TUN_DSTADDR = '10.198.0.2'
+PORT = 9000
+
+
+def ip_checksum(hdr):
+    s = sum(struct.unpack('!10H', hdr))
+    while s >> 16:
+        s = (s & 0xffff) + (s >> 16)
+    return ~s & 0xffff
+
+
+def udp_packet(size):
+    udp = struct.pack('!HHHH', PORT, PORT, 8 + size, 0) + b'x' * size
+    ip = struct.pack('!BBHHHBBH4s4s', 0x45, 0, 20 + len(udp), 0, 0, 64, 17, 0,
+                     socket.inet_aton(TUN_DSTADDR), socket.inet_aton(TUN_ADDR))
+    ip = ip[:10] + struct.pack('!H', ip_checksum(ip)) + ip[12:]
+    return ip + udp
+
+
+class Plain(object):
+    name = 'syscall'
+
+    def __init__(self, tun):
+        self.tun = tun
+        self.syscalls = 0
+
+    def read_many(self):
+        self.syscalls += 1
+        return [self.tun.read(2048)]
+
+    def write_many(self, pkts):
+        for pkt in pkts:
+            self.tun.write(pkt)
+        self.syscalls += len(pkts)
+
+
+class Ring(object):
+    name = 'io_uring'
+
+    def __init__(self, tun):
+        self.uring = pytun.Uring(tun, 64, 2048)
+        self.name = self.uring.backend
+
+    @property
+    def syscalls(self):
+        return self.uring.stats()['enters']
+
+    def read_many(self):
+        return self.uring.read_many()
+
+    def write_many(self, pkts):
+        self.uring.write_many(pkts)
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+
+def run(cls, count, size, latency_count):
+    tun = pytun.TunTapDevice(flags=pytun.IFF_TUN | pytun.IFF_NO_PI)
+    tun.addr = TUN_ADDR
+    tun.dstaddr = TUN_DSTADDR
+    tun.netmask = '255.255.255.255'
+    tun.up()
+    backend = cls(tun)
+    src = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    dst = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    dst.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 24)
+    dst.bind((TUN_ADDR, PORT))
+    dst.setblocking(False)
+    payload = b'x' * size
+    results = []
+
+    # Device reads
+    syscalls = backend.syscalls
+    received = 0
+    start = time.time()
+    while received < count:
+        burst = min(64, count - received)
+        for i in range(burst):
+            src.sendto(payload, (TUN_DSTADDR, PORT))
+        done = 0
+        while done < burst:
+            done += len(backend.read_many())
+        received += done
+    elapsed = time.time() - start
+    results.append({
+        'path': 'rx',
+        'packets': received,
+        'pps': round(received / elapsed, 1),
+        'syscalls_per_packet': round(float(backend.syscalls - syscalls) / received, 4),
+    })
+
+    # Device writes
+    pkts = [udp_packet(size)] * 64
+    syscalls = backend.syscalls
+    sent = 0
+    delivered = 0
+    start = time.time()
+    while sent < count:
+        burst = pkts[:count - sent]
+        backend.write_many(burst)
+        sent += len(burst)
+        try:
+            while True:
+                dst.recv(65536)
+                delivered += 1
+        except (socket.error, OSError):
+            pass
+    elapsed = time.time() - start
+    results.append({
+        'path': 'tx',
+        'packets': sent,
+        'delivered': delivered,
+        'pps': round(sent / elapsed, 1),
+        'syscalls_per_packet': round(float(backend.syscalls - syscalls) / sent, 4),
+    })
+
+    # Latency from sendto() to the packet being returned by the backend
+    samples = []
+    for i in range(latency_count):
+        start = time.time()
+        src.sendto(payload, (TUN_DSTADDR, PORT))
+        backend.read_many()
+        samples.append((time.time() - start) * 1e6)
+    results.append({
+        'path': 'latency',
+        'packets': latency_count,
+        'p50_us': round(percentile(samples, 0.5), 2),
+        'p99_us': round(percentile(samples, 0.99), 2),
+    })
+
+    tun.close()
+    for result in results:
+        result.update({'bench': 'uring', 'backend': backend.name, 'size': size})
+    return results
+
+
+def main():
+    parser = optparse.OptionParser()
+    parser.add_option('--count', type='int', default=100000,
+            help='number of packets for the rx and tx tests [%default]')
+    parser.add_option('--size', type='int', default=64,
+            help='size of the UDP payload [%default]')
+    parser.add_option('--latency-count', type='int', default=10000,
+            help='number of packets for the latency test [%default]')
+    opt, args = parser.parse_args()
+    for cls in (Plain, Ring):
+        for result in run(cls, opt.count, opt.size, opt.latency_count):
+            print(json.dumps(result))
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
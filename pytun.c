@@ -1,25 +1,215 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <structmember.h>
+#if PY_MAJOR_VERSION < 3
+#include <structseq.h>
+#endif
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <dirent.h>
 #include <net/if.h>
 #include <net/if_arp.h>
 #include <net/ethernet.h>
 #include <linux/if_tun.h>
+#include <linux/filter.h>
+#include <linux/virtio_net.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_ENTER_GETEVENTS)
+#define PYTUN_HAVE_IO_URING
+#endif
+#endif
+#endif
+#if defined(TUNSETFILTEREBPF) && defined(__NR_bpf)
+#include <linux/bpf.h>
+#define PYTUN_HAVE_EBPF
+#endif
+#include <netinet/in.h>
 #include <arpa/inet.h>
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
 
 #ifndef PyVarObject_HEAD_INIT
 #define PyVarObject_HEAD_INIT(type, size) \
     PyObject_HEAD_INIT(type) size,
 #endif
 
-static PyObject* pytun_error = NULL;
+/* Largest vnet header size supported */
+#define PYTUN_VNET_HDR_MAX 64
+
+#ifdef VIRTIO_NET_HDR_GSO_UDP_L4
+#define PYTUN_GSO_UDP_L4 VIRTIO_NET_HDR_GSO_UDP_L4
+#else
+#define PYTUN_GSO_UDP_L4 5
+#endif
+
+/* From Python 3.9 the module uses a multi-phase initialization: its types
+   and its exception are created for each module object and kept in its
+   state, so that it can be imported in several interpreters. Older versions
+   use a single-phase initialization with a static state. */
+#if PY_MAJOR_VERSION >= 3 && PY_MINOR_VERSION >= 9
+#define PYTUN_MODULE_STATE
+#endif
+
+/* Critical sections protect the objects in free-threaded builds and are
+   no-ops with the GIL */
+#ifndef Py_BEGIN_CRITICAL_SECTION
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
+#define Py_BEGIN_CRITICAL_SECTION2(a, b) {
+#define Py_END_CRITICAL_SECTION2() }
+#endif
+
+/* Instances of heap types hold a reference to their type from Python 3.8,
+   which must be visited by the GC from Python 3.9 */
+#if PY_MAJOR_VERSION >= 3 && PY_MINOR_VERSION >= 8
+#define PYTUN_TYPE_DECREF(type) Py_DECREF(type)
+#else
+#define PYTUN_TYPE_DECREF(type) (void)(type)
+#endif
+#if PY_MAJOR_VERSION >= 3 && PY_MINOR_VERSION >= 9
+#define PYTUN_VISIT_TYPE(self) Py_VISIT(Py_TYPE(self))
+#else
+#define PYTUN_VISIT_TYPE(self)
+#endif
+
+/* The methods of the per-packet path get their arguments as an array with
+   METH_FASTCALL from Python 3.7, without building a tuple. On older versions
+   they are called through a METH_VARARGS wrapper unpacking the tuple. */
+#if PY_MAJOR_VERSION >= 3 && PY_MINOR_VERSION >= 7
+#define PYTUN_METH_FASTCALL METH_FASTCALL
+#define PYTUN_FASTCALL_WRAPPER(func)
+#define PYTUN_FASTCALL_FUNC(func) func
+#else
+#define PYTUN_METH_FASTCALL METH_VARARGS
+#define PYTUN_FASTCALL_WRAPPER(func) \
+    static PyObject* func##_varargs(PyObject* self, PyObject* args) \
+    { \
+        return func(self, PySequence_Fast_ITEMS(args), PyTuple_GET_SIZE(args)); \
+    }
+#define PYTUN_FASTCALL_FUNC(func) func##_varargs
+#endif
+
+#if PY_MAJOR_VERSION < 3
+/* Python 2 has no PyType_FromSpec(): the types are created from their spec
+   by pytun_type_from_spec() */
+typedef struct
+{
+    int slot;
+    void* pfunc;
+} PyType_Slot;
+
+typedef struct
+{
+    const char* name;
+    int basicsize;
+    int itemsize;
+    unsigned int flags;
+    PyType_Slot* slots;
+} PyType_Spec;
+
+#define Py_bf_getbuffer 1
+#define Py_bf_releasebuffer 2
+#define Py_sq_length 45
+#define Py_tp_clear 51
+#define Py_tp_dealloc 52
+#define Py_tp_doc 56
+#define Py_tp_iter 62
+#define Py_tp_iternext 63
+#define Py_tp_methods 64
+#define Py_tp_new 65
+#define Py_tp_traverse 71
+#define Py_tp_members 72
+#define Py_tp_getset 73
+#endif
+#ifndef Py_bf_getbuffer
+/* Only supported by PyType_FromSpec() from Python 3.9, the buffer slots are
+   set by pytun_type_from_spec() on older versions */
+#define Py_bf_getbuffer 1
+#define Py_bf_releasebuffer 2
+#endif
+
+/* Flags of the types, ignored by the versions which don't have them (the
+   types which can't be instantiated get no tp_new then) */
+#ifndef Py_TPFLAGS_IMMUTABLETYPE
+#define Py_TPFLAGS_IMMUTABLETYPE 0
+#endif
+#ifndef Py_TPFLAGS_DISALLOW_INSTANTIATION
+#define Py_TPFLAGS_DISALLOW_INSTANTIATION 0
+#endif
+
+/* Types and exception of a module object */
+struct pytun_state
+{
+    PyObject* error;
+    PyTypeObject* tuntap_type;
+    PyTypeObject* stats_type;
+    PyTypeObject* vnet_hdr_type;
+    PyTypeObject* packet_slot_type;
+    PyTypeObject* packet_ring_type;
+    PyTypeObject* mq_type;
+    PyTypeObject* relay_type;
+    PyTypeObject* uring_type;
+    PyTypeObject* poller_type;
+    PyTypeObject* packet_view_type;
+    PyTypeObject* flow_table_type;
+    PyTypeObject* rewriter_type;
+    PyTypeObject* shaper_type;
+};
+typedef struct pytun_state pytun_state_t;
+
+#ifdef PYTUN_MODULE_STATE
+static struct PyModuleDef pytun_module;
+
+static pytun_state_t* pytun_module_state(PyObject* m)
+{
+    return (pytun_state_t*)PyModule_GetState(m);
+}
+
+/* None of the types can be subclassed, so the module of an object is the
+   one of its type */
+static pytun_state_t* pytun_state_of_type(PyTypeObject* type)
+{
+    return (pytun_state_t*)PyType_GetModuleState(type);
+}
+
+#else
+static pytun_state_t pytun_legacy_state;
+
+static pytun_state_t* pytun_module_state(PyObject* m)
+{
+    return &pytun_legacy_state;
+}
+
+static pytun_state_t* pytun_state_of_type(PyTypeObject* type)
+{
+    return &pytun_legacy_state;
+}
+
+#endif
+
+#define pytun_state_of(obj) pytun_state_of_type(Py_TYPE(obj))
 
 PyDoc_STRVAR(pytun_error_doc,
 "This exception is raised when an error occurs. The accompanying value is\n\
@@ -28,973 +218,13630 @@ representing an error returned by a system call, similar to the value\n\
 accompanying os.error. See the module errno, which contains names for the\n\
 error codes defined by the underlying operating system.");
 
-static void raise_error(const char* errmsg)
+/* Raise the exception of the module whose state is state. Helpers having no
+   object at hand take the state from their caller. */
+static void raise_error(pytun_state_t* state, const char* errmsg)
 {
-    PyErr_SetString(pytun_error, errmsg);
+    PyErr_SetString(state->error, errmsg);
 }
 
-static void raise_error_from_errno(void)
+static void raise_error_from_errno(pytun_state_t* state)
 {
-    PyErr_SetFromErrno(pytun_error);
+    PyErr_SetFromErrno(state->error);
 }
 
-static int if_ioctl(int cmd, struct ifreq* req)
+static PyObject* pytun_new_string(const void* data, Py_ssize_t len)
 {
-    int ret;
-    int sock;
+#if PY_MAJOR_VERSION >= 3
+    return PyBytes_FromStringAndSize(data, len);
+#else
+    return PyString_FromStringAndSize(data, len);
+#endif
+}
 
-    Py_BEGIN_ALLOW_THREADS
-    sock = socket(AF_INET, SOCK_DGRAM, 0);
-    Py_END_ALLOW_THREADS
-    if (sock < 0)
+static unsigned char* pytun_string_data(PyObject* s)
+{
+#if PY_MAJOR_VERSION >= 3
+    return (unsigned char*)PyBytes_AS_STRING(s);
+#else
+    return (unsigned char*)PyString_AS_STRING(s);
+#endif
+}
+
+/* Socket used to issue the interface ioctl() calls, created on first use and
+   shared by all the devices (and interpreters). It is closed in the child
+   after a fork(). */
+static int pytun_ctl_sock = -1;
+
+static void pytun_ctl_atfork_child(void)
+{
+    if (pytun_ctl_sock >= 0)
     {
-        raise_error_from_errno();
-        return -1;
+        close(pytun_ctl_sock);
+        pytun_ctl_sock = -1;
     }
-    Py_BEGIN_ALLOW_THREADS
-    ret = ioctl(sock, cmd, req);
-    Py_END_ALLOW_THREADS
-    if (ret < 0)
+}
+
+static int pytun_ctl_socket(pytun_state_t* state)
+{
+    int sock = __atomic_load_n(&pytun_ctl_sock, __ATOMIC_ACQUIRE);
+    int expected = -1;
+
+    if (sock < 0)
     {
-        raise_error_from_errno();
+        sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (sock < 0)
+        {
+            raise_error_from_errno(state);
+            return -1;
+        }
+        /* Another thread may have created it meanwhile */
+        if (!__atomic_compare_exchange_n(&pytun_ctl_sock, &expected, sock, 0, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE))
+        {
+            close(sock);
+            sock = expected;
+        }
     }
-    Py_BEGIN_ALLOW_THREADS
-    close(sock);
-    Py_END_ALLOW_THREADS
 
-    return ret;
+    return sock;
 }
 
-struct pytun_tuntap
+/* Datapath counters of a device, updated on every read and write */
+struct pytun_stats
 {
-    PyObject_HEAD
-    int fd;
-    char name[IFNAMSIZ];
+    unsigned PY_LONG_LONG reads;
+    unsigned PY_LONG_LONG rx_packets;
+    unsigned PY_LONG_LONG rx_bytes;
+    unsigned PY_LONG_LONG writes;
+    unsigned PY_LONG_LONG tx_packets;
+    unsigned PY_LONG_LONG tx_bytes;
+    unsigned PY_LONG_LONG eagain;
+    unsigned PY_LONG_LONG truncated_reads;
+    unsigned PY_LONG_LONG short_writes;
+    unsigned PY_LONG_LONG read_errors;
+    unsigned PY_LONG_LONG write_errors;
+    unsigned PY_LONG_LONG nogil_ns;
+    unsigned PY_LONG_LONG shaped;
 };
-typedef struct pytun_tuntap pytun_tuntap_t;
+typedef struct pytun_stats pytun_stats_t;
 
-static PyObject* pytun_tuntap_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
+/* Counters are updated without the GIL by every thread using the object
+   (device, queue, relay or ring) and read with PYTUN_STAT_LOAD() */
+#define PYTUN_STAT_ADD(st, field, n) __atomic_fetch_add(&(st)->field, (n), __ATOMIC_RELAXED)
+#define PYTUN_STAT_LOAD(value) __atomic_load_n(&(value), __ATOMIC_RELAXED)
+
+static uint64_t pytun_now_ns(void)
 {
-    pytun_tuntap_t* tuntap = NULL;
-    const char* name = "";
-    int flags = IFF_TUN;
-    const char* dev = "/dev/net/tun";
-    char* kwlist[] = {"name", "flags", "dev", NULL};
-    int ret;
-    const char* errmsg = NULL;
-    struct ifreq req;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|sis", kwlist, &name, &flags, &dev))
+/* Account for a read() of at most len bytes which returned ret. A read
+   filling the whole buffer may have truncated the packet. */
+static void pytun_stats_read(pytun_stats_t* st, ssize_t ret, size_t len)
+{
+    PYTUN_STAT_ADD(st, reads, 1);
+    if (ret < 0)
     {
-        return NULL;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            PYTUN_STAT_ADD(st, eagain, 1);
+        }
+        else if (errno != EINTR)
+        {
+            PYTUN_STAT_ADD(st, read_errors, 1);
+        }
+        return;
     }
+    PYTUN_STAT_ADD(st, rx_packets, 1);
+    PYTUN_STAT_ADD(st, rx_bytes, ret);
+    if ((size_t)ret == len)
+    {
+        PYTUN_STAT_ADD(st, truncated_reads, 1);
+    }
+}
 
-    /* Check flags value */
-    if (!(flags & (IFF_TUN | IFF_TAP)))
+/* Account for a write() of len bytes which returned ret */
+static void pytun_stats_write(pytun_stats_t* st, ssize_t ret, size_t len)
+{
+    PYTUN_STAT_ADD(st, writes, 1);
+    if (ret < 0)
     {
-        errmsg = "Bad flags: either IFF_TUN or IFF_TAP must be set";
-        goto error;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            PYTUN_STAT_ADD(st, eagain, 1);
+        }
+        else if (errno != EINTR)
+        {
+            PYTUN_STAT_ADD(st, write_errors, 1);
+        }
+        return;
     }
-    if ((flags & IFF_TUN) && (flags & IFF_TAP))
+    PYTUN_STAT_ADD(st, tx_packets, 1);
+    PYTUN_STAT_ADD(st, tx_bytes, ret);
+    if ((size_t)ret < len)
     {
-        errmsg = "Bad flags: IFF_TUN and IFF_TAP could not both be set";
-        goto error;
+        PYTUN_STAT_ADD(st, short_writes, 1);
     }
+}
 
-    /* Check the name length */
-    if (strlen(name) >= IFNAMSIZ)
+/* Account for a write refused by the shaper of the device, admit being 0
+   if it dropped the packet and -1 if it would have to wait, and set errno
+   accordingly */
+static void pytun_stats_shaped(pytun_stats_t* st, int admit)
+{
+    if (admit == 0)
     {
-        errmsg = "Interface name too long";
-        goto error;
+        PYTUN_STAT_ADD(st, shaped, 1);
+        errno = ENOBUFS;
     }
-
-    tuntap = (pytun_tuntap_t*)type->tp_alloc(type, 0);
-    if (tuntap == NULL)
+    else
     {
-        goto error;
+        PYTUN_STAT_ADD(st, eagain, 1);
+        errno = EAGAIN;
     }
+}
 
-    /* Open the TUN/TAP device */
-    Py_BEGIN_ALLOW_THREADS
-    tuntap->fd = open(dev, O_RDWR);
+/* Same as Py_BEGIN/END_ALLOW_THREADS, also accounting for the time spent
+   without the GIL in the counters st */
+#define PYTUN_BEGIN_ALLOW_THREADS(st) \
+    Py_BEGIN_ALLOW_THREADS \
+    { \
+        uint64_t pytun_nogil_start = pytun_now_ns();
+#define PYTUN_END_ALLOW_THREADS(st) \
+        PYTUN_STAT_ADD(st, nogil_ns, pytun_now_ns() - pytun_nogil_start); \
+    } \
     Py_END_ALLOW_THREADS
-    if (tuntap->fd < 0)
+
+/* pcapng capture of the packets going through a device. The capture file is
+   mapped in memory and its blocks are written in a ring: once the file is
+   full, the oldest packets are overwritten. The unused parts of the ring are
+   covered by blocks of a type reserved for local use, which readers skip,
+   so that the file can be read at any time. */
+#define PYTUN_PCAPNG_SHB 0x0A0D0D0A
+#define PYTUN_PCAPNG_IDB 0x00000001
+#define PYTUN_PCAPNG_EPB 0x00000006
+#define PYTUN_PCAPNG_SKIP 0x80000000
+#define PYTUN_PCAPNG_MIN_BLOCK 12
+#define PYTUN_PCAPNG_PAD(len) (((len) + 3) & ~(size_t)3)
+/* Size of an enhanced packet block holding caplen bytes with an epb_flags
+   option */
+#define PYTUN_PCAPNG_EPB_SIZE(caplen) (28 + PYTUN_PCAPNG_PAD(caplen) + 16)
+
+/* Directions of the packets, as seen from the interface (epb_flags) */
+#define PYTUN_CAPTURE_IN 1  /* written to the device */
+#define PYTUN_CAPTURE_OUT 2 /* read from the device */
+
+struct pytun_capture
+{
+    pthread_mutex_t lock;
+    int active;
+    /* Set by start_capture() while it creates the file, with the lock
+       released */
+    int starting;
+    int fd;
+    unsigned int snaplen;
+    /* Bytes to skip at the beginning of each packet (tun_pi, vnet header) */
+    unsigned int skip;
+    char* map;
+    size_t size;
+    /* The ring goes from start (after the section header and interface
+       blocks) to size. The blocks are in [start, head) and, once the ring
+       has wrapped, the oldest ones are in [tail, end). */
+    size_t start;
+    size_t head;
+    size_t tail;
+    size_t end;
+    int wrapped;
+    unsigned PY_LONG_LONG packets;
+    unsigned PY_LONG_LONG bytes;
+    unsigned PY_LONG_LONG overwritten;
+    unsigned PY_LONG_LONG dropped;
+};
+typedef struct pytun_capture pytun_capture_t;
+
+static void pytun_capture_put16(char* p, uint16_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+static void pytun_capture_put32(char* p, uint32_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+/* Cover len bytes at off with a block skipped by readers */
+static void pytun_capture_skip_block(pytun_capture_t* cap, size_t off, size_t len)
+{
+    if (len == 0)
     {
-        goto error;
+        return;
     }
+    pytun_capture_put32(cap->map + off, PYTUN_PCAPNG_SKIP);
+    pytun_capture_put32(cap->map + off + 4, len);
+    pytun_capture_put32(cap->map + off + len - 4, len);
+}
 
-    /* Prepare the structure used to issue ioctl() calls */
-    memset(&req, 0, sizeof(req));
-    if (*name)
+/* Return the offset where a block of len bytes can be written, overwriting
+   the oldest blocks if needed, or (size_t)-1 if the block can't fit in the
+   ring. The space left after the block is covered by a skip block. Must be
+   called with the lock held. */
+static size_t pytun_capture_reserve(pytun_capture_t* cap, size_t len)
+{
+    size_t ring = cap->size - cap->start;
+    size_t limit;
+    size_t off;
+
+    if (len != ring && len + PYTUN_PCAPNG_MIN_BLOCK > ring)
     {
-        strcpy(req.ifr_name, name);
+        return (size_t)-1;
     }
-
-    /* Create the TUN/TAP interface */
-    req.ifr_flags = flags;
-    Py_BEGIN_ALLOW_THREADS
-    ret = ioctl(tuntap->fd, TUNSETIFF, &req);
-    Py_END_ALLOW_THREADS
-    if (ret < 0)
+    for (;;)
     {
-        goto error;
+        if (cap->wrapped && cap->tail == cap->end)
+        {
+            /* All the blocks after head have been overwritten, the blocks
+               left are in order in [start, head) */
+            cap->wrapped = 0;
+        }
+        limit = cap->wrapped ? cap->tail : cap->size;
+        if (limit - cap->head == len || limit - cap->head >= len + PYTUN_PCAPNG_MIN_BLOCK)
+        {
+            off = cap->head;
+            cap->head += len;
+            pytun_capture_skip_block(cap, cap->head, limit - cap->head);
+            return off;
+        }
+        if (cap->wrapped)
+        {
+            /* Overwrite the oldest block */
+            uint32_t blen;
+
+            memcpy(&blen, cap->map + cap->tail + 4, sizeof(blen));
+            cap->tail += blen;
+            cap->overwritten++;
+        }
+        else
+        {
+            /* Go back to the beginning of the ring, the end of the file
+               is already covered by a skip block */
+            cap->end = cap->head;
+            cap->head = cap->tail = cap->start;
+            cap->wrapped = 1;
+        }
     }
-    strcpy(tuntap->name, req.ifr_name);
+}
 
-    return (PyObject*)tuntap;
+/* Add a packet of len bytes going in direction dir to the capture, as is */
+static void pytun_capture_payload(pytun_capture_t* cap, int dir, const char* data, size_t len)
+{
+    struct timespec ts;
+    uint64_t ns;
+    size_t caplen;
+    size_t blen;
+    size_t off;
+    char* p;
 
-error:
+    if (!__atomic_load_n(&cap->active, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+    caplen = len < cap->snaplen ? len : cap->snaplen;
+    blen = PYTUN_PCAPNG_EPB_SIZE(caplen);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 
-    if (errmsg != NULL)
+    pthread_mutex_lock(&cap->lock);
+    if (!cap->active)
     {
-        raise_error(errmsg);
+        pthread_mutex_unlock(&cap->lock);
+        return;
     }
-    else if (errno != 0)
+    off = pytun_capture_reserve(cap, blen);
+    if (off == (size_t)-1)
     {
-        raise_error_from_errno();
+        cap->dropped++;
+        pthread_mutex_unlock(&cap->lock);
+        return;
     }
+    p = cap->map + off;
+    pytun_capture_put32(p, PYTUN_PCAPNG_EPB);
+    pytun_capture_put32(p + 4, blen);
+    pytun_capture_put32(p + 8, 0);
+    pytun_capture_put32(p + 12, ns >> 32);
+    pytun_capture_put32(p + 16, ns & 0xffffffff);
+    pytun_capture_put32(p + 20, caplen);
+    pytun_capture_put32(p + 24, len);
+    memcpy(p + 28, data, caplen);
+    memset(p + 28 + caplen, 0, PYTUN_PCAPNG_PAD(caplen) - caplen);
+    p += 28 + PYTUN_PCAPNG_PAD(caplen);
+    /* epb_flags option, followed by opt_endofopt */
+    pytun_capture_put16(p, 2);
+    pytun_capture_put16(p + 2, 4);
+    pytun_capture_put32(p + 4, dir);
+    pytun_capture_put32(p + 8, 0);
+    pytun_capture_put32(p + 12, blen);
+    cap->packets++;
+    cap->bytes += caplen;
+    pthread_mutex_unlock(&cap->lock);
+}
 
-    if (tuntap != NULL)
+/* Add a packet read from or written to the device to the capture, skipping
+   the packet information and the vnet header if any */
+static void pytun_capture_packet(pytun_capture_t* cap, int dir, const char* data, ssize_t len)
+{
+    if (len < 0 || (size_t)len <= cap->skip)
     {
-        if (tuntap->fd >= 0)
-        {
-            Py_BEGIN_ALLOW_THREADS
-            close(tuntap->fd);
-            Py_END_ALLOW_THREADS
-        }
-        type->tp_free(tuntap);
+        return;
     }
-
-    return NULL;
+    pytun_capture_payload(cap, dir, data + cap->skip, len - cap->skip);
 }
 
-static void pytun_tuntap_dealloc(PyObject* self)
+/* Stop the capture, if any, and leave the capture file with its packets in
+   order. Returns 0 on success, -1 with errno set otherwise. */
+static int pytun_capture_stop(pytun_capture_t* cap)
 {
-    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    size_t oldlen;
+    size_t newlen;
+    size_t used;
+    char* tmp;
+    int ret = 0;
 
-    if (tuntap->fd >= 0)
+    pthread_mutex_lock(&cap->lock);
+    if (!cap->active)
     {
-        Py_BEGIN_ALLOW_THREADS
-        close(tuntap->fd);
-        Py_END_ALLOW_THREADS
+        pthread_mutex_unlock(&cap->lock);
+        return 0;
+    }
+    __atomic_store_n(&cap->active, 0, __ATOMIC_RELEASE);
+
+    used = cap->head;
+    if (cap->wrapped && cap->tail != cap->end)
+    {
+        /* Move the oldest blocks before the newest ones */
+        oldlen = cap->end - cap->tail;
+        newlen = cap->head - cap->start;
+        tmp = malloc(newlen);
+        if (tmp != NULL)
+        {
+            memcpy(tmp, cap->map + cap->start, newlen);
+            memmove(cap->map + cap->start, cap->map + cap->tail, oldlen);
+            memcpy(cap->map + cap->start + oldlen, tmp, newlen);
+            free(tmp);
+            used = cap->start + oldlen + newlen;
+        }
+        else
+        {
+            /* The file is still readable, with the packets out of order */
+            used = cap->size;
+        }
     }
-    self->ob_type->tp_free(self);
+    munmap(cap->map, cap->size);
+    cap->map = NULL;
+    if (ftruncate(cap->fd, used) < 0)
+    {
+        ret = -1;
+    }
+    if (close(cap->fd) < 0)
+    {
+        ret = -1;
+    }
+    cap->fd = -1;
+    pthread_mutex_unlock(&cap->lock);
+
+    return ret;
 }
 
-static PyObject* pytun_tuntap_get_name(PyObject* self, void* d)
+/* Token bucket shaping the writes to a device. The bucket holds at most
+   burst bytes and is refilled at rate bytes per second. A packet needing
+   more tokens than available waits until they are refilled: the tokens may
+   go down to -queue_limit, packets which would need more are dropped. A
+   bucket may have a parent, e.g shared by the buckets of several devices,
+   which must admit the packet too. Buckets are reference counted as native
+   threads may use them. */
+struct pytun_tb
 {
-    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    pthread_mutex_t lock;
+    int refs;
+    struct pytun_tb* parent;
+    double rate;
+    double burst;
+    double queue_limit;
+    double tokens;
+    uint64_t last;
+    unsigned PY_LONG_LONG packets;
+    unsigned PY_LONG_LONG bytes;
+    unsigned PY_LONG_LONG delayed;
+    unsigned PY_LONG_LONG delay_ns;
+    unsigned PY_LONG_LONG dropped;
+    unsigned PY_LONG_LONG dropped_bytes;
+};
+typedef struct pytun_tb pytun_tb_t;
 
-#if PY_MAJOR_VERSION >= 3
-    return PyUnicode_FromString(tuntap->name);
-#else
-    return PyString_FromString(tuntap->name);
-#endif
+/* Maximum depth of a hierarchy of buckets */
+#define PYTUN_TB_MAX_DEPTH 8
+
+static void pytun_tb_incref(pytun_tb_t* tb)
+{
+    __atomic_add_fetch(&tb->refs, 1, __ATOMIC_RELAXED);
 }
 
-static PyObject* pytun_tuntap_get_addr(PyObject* self, void* d)
+static void pytun_tb_decref(pytun_tb_t* tb)
 {
-    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
-    struct ifreq req;
-    const char* addr;
+    pytun_tb_t* parent;
 
-    memset(&req, 0, sizeof(req));
-    strcpy(req.ifr_name, tuntap->name);
-    if (if_ioctl(SIOCGIFADDR, &req) < 0)
+    while (tb != NULL && __atomic_sub_fetch(&tb->refs, 1, __ATOMIC_ACQ_REL) == 0)
     {
-        return NULL;
+        parent = tb->parent;
+        pthread_mutex_destroy(&tb->lock);
+        free(tb);
+        tb = parent;
     }
-    addr = inet_ntoa(((struct sockaddr_in*)&req.ifr_addr)->sin_addr);
-    if (addr == NULL)
+}
+
+/* Add the tokens earned since the last update. Must be called with the lock
+   held. */
+static void pytun_tb_refill(pytun_tb_t* tb, uint64_t now)
+{
+    if (now > tb->last)
     {
-        raise_error("Failed to retrieve addr");
-        return NULL;
+        tb->tokens += (now - tb->last) * tb->rate / 1e9;
+        if (tb->tokens > tb->burst)
+        {
+            tb->tokens = tb->burst;
+        }
     }
-
-#if PY_MAJOR_VERSION >= 3
-    return PyUnicode_FromString(addr);
-#else
-    return PyString_FromString(addr);
-#endif
+    tb->last = now;
 }
 
-static int pytun_tuntap_set_addr(PyObject* self, PyObject* value, void* d)
+/* Take len bytes from tb and its parents, waiting until the packet is
+   allowed to be sent. Returns 1 once the packet may be written, 0 if it has
+   been dropped. If nowait is set, returns -1 without taking anything
+   instead of waiting: the packet is admitted once the buckets have len
+   tokens, or are full for a packet larger than their burst, which then
+   delays the next packets. Must be called without holding the GIL. */
+static int pytun_tb_admit(pytun_tb_t* tb, size_t len, int nowait)
 {
-    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
-    int ret = 0;
-    struct ifreq req;
-#if PY_MAJOR_VERSION >= 3
-    PyObject* tmp_addr;
-#endif
-    const char* addr;
-    struct sockaddr_in* sin;
+    pytun_tb_t* chain[PYTUN_TB_MAX_DEPTH];
+    int depth = 0;
+    int admit = 1;
+    int i;
+    uint64_t now;
+    uint64_t wait = 0;
+    uint64_t w;
+    struct timespec ts;
 
-#if PY_MAJOR_VERSION >= 3
-    tmp_addr = PyUnicode_AsASCIIString(value);
-    addr = tmp_addr != NULL ? PyBytes_AS_STRING(tmp_addr) : NULL;
-#else
-    addr = PyString_AsString(value);
-#endif
-    if (addr == NULL)
+    for (; tb != NULL && depth < PYTUN_TB_MAX_DEPTH; tb = tb->parent)
     {
-        ret = -1;
-        goto out;
+        chain[depth++] = tb;
     }
-    memset(&req, 0, sizeof(req));
-    strcpy(req.ifr_name, tuntap->name);
-    sin = (struct sockaddr_in*)&req.ifr_addr;
-    sin->sin_family = AF_INET;
-    if (inet_aton(addr, &sin->sin_addr) == 0)
+
+    /* Buckets are always locked from the child to the root */
+    now = pytun_now_ns();
+    for (i = 0; i < depth; i++)
     {
-        raise_error("Bad IP address");
-        ret = -1;
-        goto out;
+        pthread_mutex_lock(&chain[i]->lock);
+        pytun_tb_refill(chain[i], now);
+        if (nowait && chain[i]->tokens < ((double)len < chain[i]->burst ? (double)len : chain[i]->burst))
+        {
+            admit = -1;
+        }
     }
-    if (if_ioctl(SIOCSIFADDR, &req) < 0)
+    for (i = 0; i < depth && admit > 0; i++)
     {
-        ret = -1;
-        goto out;
+        if (chain[i]->tokens - len < -chain[i]->queue_limit)
+        {
+            chain[i]->dropped++;
+            chain[i]->dropped_bytes += len;
+            admit = 0;
+        }
+    }
+    for (i = depth - 1; i >= 0; i--)
+    {
+        if (admit > 0)
+        {
+            chain[i]->tokens -= len;
+            chain[i]->packets++;
+            chain[i]->bytes += len;
+            if (chain[i]->tokens < 0 && !nowait)
+            {
+                w = (uint64_t)(-chain[i]->tokens * 1e9 / chain[i]->rate);
+                chain[i]->delayed++;
+                chain[i]->delay_ns += w;
+                if (w > wait)
+                {
+                    wait = w;
+                }
+            }
+        }
+        pthread_mutex_unlock(&chain[i]->lock);
+    }
+    if (admit <= 0)
+    {
+        return admit;
     }
 
-out:
-#if PY_MAJOR_VERSION >= 3
-    Py_XDECREF(tmp_addr);
-#endif
+    if (wait > 0)
+    {
+        now += wait;
+        ts.tv_sec = now / 1000000000;
+        ts.tv_nsec = now % 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        {
+        }
+    }
 
-    return ret;
+    return 1;
 }
 
-static PyObject* pytun_tuntap_get_dstaddr(PyObject* self, void* d)
+/* Give back the len bytes taken by pytun_tb_admit() for a packet which
+   couldn't be written */
+static void pytun_tb_refund(pytun_tb_t* tb, size_t len)
 {
-    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
-    struct ifreq req;
-    const char* dstaddr;
-
-    memset(&req, 0, sizeof(req));
-    strcpy(req.ifr_name, tuntap->name);
-    if (if_ioctl(SIOCGIFDSTADDR, &req) < 0)
+    for (; tb != NULL; tb = tb->parent)
     {
-        return NULL;
+        pthread_mutex_lock(&tb->lock);
+        tb->tokens += len;
+        if (tb->tokens > tb->burst)
+        {
+            tb->tokens = tb->burst;
+        }
+        tb->packets--;
+        tb->bytes -= len;
+        pthread_mutex_unlock(&tb->lock);
     }
-    dstaddr = inet_ntoa(((struct sockaddr_in*)&req.ifr_dstaddr)->sin_addr);
-    if (dstaddr == NULL)
+}
+
+struct pytun_shaper
+{
+    PyObject_HEAD
+    pytun_tb_t* tb;
+    PyObject* parent;
+};
+typedef struct pytun_shaper pytun_shaper_t;
+
+struct pytun_tuntap
+{
+    PyObject_HEAD
+    int fd;
+    /* Twice the number of uses of fd, plus 1 once the device is closed */
+    unsigned int fd_uses;
+    int flags;
+    int vnet_hdr_sz;
+    char name[IFNAMSIZ];
+    pytun_stats_t stats;
+    pytun_capture_t capture;
+    /* Protects the name, which any thread may refresh, and the shaper of
+       the writes, which is used without the GIL */
+    pthread_mutex_t lock;
+    pytun_tb_t* shaper;
+    PyObject* shaper_obj;
+};
+typedef struct pytun_tuntap pytun_tuntap_t;
+
+/* The descriptor of a device is used with the GIL released, possibly by
+   several threads at once. close() can't close it under their feet as it
+   could be reused by another open() before they issue their call: each call
+   holds a use of the descriptor, which is closed when the device has been
+   closed and the last use is dropped. */
+
+/* Return the descriptor of the device and hold a use of it, or -1 with
+   errno set to EBADF if the device is closed. May be called without the
+   GIL. */
+static int pytun_tuntap_get_fd(pytun_tuntap_t* tuntap)
+{
+    unsigned int uses = __atomic_load_n(&tuntap->fd_uses, __ATOMIC_RELAXED);
+
+    do
     {
-        raise_error("Failed to retrieve dstaddr");
-        return NULL;
+        if (uses & 1)
+        {
+            errno = EBADF;
+            return -1;
+        }
     }
+    while (!__atomic_compare_exchange_n(&tuntap->fd_uses, &uses, uses + 2, 1, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED));
 
-#if PY_MAJOR_VERSION >= 3
-    return PyUnicode_FromString(dstaddr);
-#else
-    return PyString_FromString(dstaddr);
-#endif
+    return tuntap->fd;
 }
 
-static int pytun_tuntap_set_dstaddr(PyObject* self, PyObject* value, void* d)
+/* Drop a use of the descriptor taken with pytun_tuntap_get_fd(), closing
+   it if it was the last one of a closed device. errno is preserved. */
+static void pytun_tuntap_put_fd(pytun_tuntap_t* tuntap)
 {
-    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
-    int ret = 0;
-    struct ifreq req;
-#if PY_MAJOR_VERSION >= 3
-    PyObject* tmp_dstaddr;
-#endif
-    const char* dstaddr;
-    struct sockaddr_in* sin;
+    int err;
 
-#if PY_MAJOR_VERSION >= 3
-    tmp_dstaddr = PyUnicode_AsASCIIString(value);
-    dstaddr = tmp_dstaddr != NULL ? PyBytes_AS_STRING(tmp_dstaddr) : NULL;
-#else
-    dstaddr = PyString_AsString(value);
-#endif
-    if (dstaddr == NULL)
-    {
-        ret = -1;
-        goto out;
-    }
-    memset(&req, 0, sizeof(req));
-    strcpy(req.ifr_name, tuntap->name);
-    sin = (struct sockaddr_in*)&req.ifr_dstaddr;
-    sin->sin_family = AF_INET;
-    if (inet_aton(dstaddr, &sin->sin_addr) == 0)
+    if (__atomic_sub_fetch(&tuntap->fd_uses, 2, __ATOMIC_ACQ_REL) == 1)
     {
-        raise_error("Bad IP address");
-        ret = -1;
-        goto out;
+        err = errno;
+        close(tuntap->fd);
+        errno = err;
     }
-    if (if_ioctl(SIOCSIFDSTADDR, &req) < 0)
+}
+
+static int pytun_tuntap_closed(pytun_tuntap_t* tuntap)
+{
+    return __atomic_load_n(&tuntap->fd_uses, __ATOMIC_ACQUIRE) & 1;
+}
+
+/* ioctl() and fcntl() on the descriptor of the device. Return -1 with errno
+   set on failure. May be called without the GIL. */
+static int pytun_tuntap_fd_ioctl(pytun_tuntap_t* tuntap, unsigned long cmd, unsigned long arg)
+{
+    int fd = pytun_tuntap_get_fd(tuntap);
+    int ret;
+
+    if (fd < 0)
     {
-        ret = -1;
-        goto out;
+        return -1;
     }
-
-out:
-#if PY_MAJOR_VERSION >= 3
-    Py_XDECREF(tmp_dstaddr);
-#endif
+    ret = ioctl(fd, cmd, arg);
+    pytun_tuntap_put_fd(tuntap);
 
     return ret;
 }
 
-static PyObject* pytun_tuntap_get_hwaddr(PyObject* self, void* d)
+static int pytun_tuntap_fd_fcntl(pytun_tuntap_t* tuntap, int cmd, long arg)
 {
-    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
-    struct ifreq req;
+    int fd = pytun_tuntap_get_fd(tuntap);
+    int ret;
 
-    memset(&req, 0, sizeof(req));
-    strcpy(req.ifr_name, tuntap->name);
-    if (if_ioctl(SIOCGIFHWADDR, &req) < 0)
+    if (fd < 0)
     {
-        return NULL;
+        return -1;
     }
+    ret = fcntl(fd, cmd, arg);
+    pytun_tuntap_put_fd(tuntap);
 
-#if PY_MAJOR_VERSION >= 3
-    return PyBytes_FromStringAndSize(req.ifr_hwaddr.sa_data, ETH_ALEN);
-#else
-    return PyString_FromStringAndSize(req.ifr_hwaddr.sa_data, ETH_ALEN);
-#endif
+    return ret;
 }
 
-static int pytun_tuntap_set_hwaddr(PyObject* self, PyObject* value, void* d)
+/* Objects whose methods use their own buffers with the GIL released (rings,
+   io_uring queues, pollers) can't be used by several threads at once: such
+   a method enters the object with pytun_busy_enter(), which raises an error
+   if another thread is already in, and leaves it with pytun_busy_leave(). */
+static int pytun_busy_enter(pytun_state_t* state, int* busy)
 {
-    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
-    struct ifreq req;
-    char* hwaddr;
-    Py_ssize_t len;
-
-#if PY_MAJOR_VERSION >= 3
-    if (PyBytes_AsStringAndSize(value, &hwaddr, &len) == -1)
-#else
-    if (PyString_AsStringAndSize(value, &hwaddr, &len) == -1)
-#endif
+    if (__atomic_exchange_n(busy, 1, __ATOMIC_ACQUIRE))
     {
+        raise_error(state, "Object in use by another thread");
         return -1;
     }
-    if (len != ETH_ALEN)
+
+    return 0;
+}
+
+static void pytun_busy_leave(int* busy)
+{
+    __atomic_store_n(busy, 0, __ATOMIC_RELEASE);
+}
+
+/* Return a new reference to the shaper of the device, or NULL if it has
+   none */
+static pytun_tb_t* pytun_tuntap_shaper(pytun_tuntap_t* tuntap)
+{
+    pytun_tb_t* tb;
+
+    if (__atomic_load_n(&tuntap->shaper, __ATOMIC_ACQUIRE) == NULL)
     {
-        raise_error("Bad MAC address");
-        return -1;
+        return NULL;
     }
-    memset(&req, 0, sizeof(req));
-    strcpy(req.ifr_name, tuntap->name);
-    req.ifr_hwaddr.sa_family = ARPHRD_ETHER;
-    memcpy(req.ifr_hwaddr.sa_data, hwaddr, len);
-    if (if_ioctl(SIOCSIFHWADDR, &req) < 0)
+    pthread_mutex_lock(&tuntap->lock);
+    tb = tuntap->shaper;
+    if (tb != NULL)
     {
-        return -1;
+        pytun_tb_incref(tb);
     }
+    pthread_mutex_unlock(&tuntap->lock);
 
-    return 0;
+    return tb;
 }
 
-static PyObject* pytun_tuntap_get_netmask(PyObject* self, void* d)
+/* Update the cached name of the device, which may have been renamed since
+   it was created. Returns 1 if the name changed. */
+static int pytun_tuntap_refresh_name(pytun_tuntap_t* tuntap)
 {
-    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
     struct ifreq req;
-    const char* netmask;
+    int changed = 0;
+    int fd;
 
     memset(&req, 0, sizeof(req));
-    strcpy(req.ifr_name, tuntap->name);
-    if (if_ioctl(SIOCGIFNETMASK, &req) < 0)
+    fd = pytun_tuntap_get_fd(tuntap);
+    if (fd < 0)
     {
-        return NULL;
+        return 0;
     }
-    netmask = inet_ntoa(((struct sockaddr_in*)&req.ifr_netmask)->sin_addr);
-    if (netmask == NULL)
+    if (ioctl(fd, TUNGETIFF, &req) == 0)
     {
-        raise_error("Failed to retrieve netmask");
-        return NULL;
+        pthread_mutex_lock(&tuntap->lock);
+        if (strncmp(req.ifr_name, tuntap->name, IFNAMSIZ) != 0)
+        {
+            memcpy(tuntap->name, req.ifr_name, IFNAMSIZ);
+            tuntap->name[IFNAMSIZ - 1] = '\0';
+            changed = 1;
+        }
+        pthread_mutex_unlock(&tuntap->lock);
     }
+    pytun_tuntap_put_fd(tuntap);
 
-#if PY_MAJOR_VERSION >= 3
-    return PyUnicode_FromString(netmask);
-#else
-    return PyString_FromString(netmask);
-#endif
+    return changed;
 }
 
-static int pytun_tuntap_set_netmask(PyObject* self, PyObject* value, void* d)
+/* Copy the name of the device to name, of IFNAMSIZ bytes */
+static void pytun_tuntap_name(pytun_tuntap_t* tuntap, char* name)
 {
-    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
-    int ret = 0;
-    struct ifreq req;
-#if PY_MAJOR_VERSION >= 3
-    PyObject* tmp_netmask;
-#endif
-    const char* netmask;
-    struct sockaddr_in* sin;
+    pthread_mutex_lock(&tuntap->lock);
+    memcpy(name, tuntap->name, IFNAMSIZ);
+    pthread_mutex_unlock(&tuntap->lock);
+}
 
-#if PY_MAJOR_VERSION >= 3
-    tmp_netmask = PyUnicode_AsASCIIString(value);
-    netmask = tmp_netmask != NULL ? PyBytes_AS_STRING(tmp_netmask) : NULL;
-#else
-    netmask = PyString_AsString(value);
-#endif
-    if (netmask == NULL)
+/* Issue an interface ioctl() for the device. If the interface is not found,
+   try again once with the current name of the device. */
+static int pytun_tuntap_ioctl(pytun_tuntap_t* tuntap, int cmd, struct ifreq* req)
+{
+    int ret;
+    int sock;
+
+    sock = pytun_ctl_socket(pytun_state_of(tuntap));
+    if (sock < 0)
     {
-        ret = -1;
-        goto out;
+        return -1;
     }
-    memset(&req, 0, sizeof(req));
-    strcpy(req.ifr_name, tuntap->name);
-    sin = (struct sockaddr_in*)&req.ifr_netmask;
-    sin->sin_family = AF_INET;
-    if (inet_aton(netmask, &sin->sin_addr) == 0)
+    Py_BEGIN_ALLOW_THREADS
+    ret = ioctl(sock, cmd, req);
+    Py_END_ALLOW_THREADS
+    if (ret < 0 && errno == ENODEV && pytun_tuntap_refresh_name(tuntap))
     {
-        raise_error("Bad IP address");
-        ret = -1;
-        goto out;
+        pytun_tuntap_name(tuntap, req->ifr_name);
+        Py_BEGIN_ALLOW_THREADS
+        ret = ioctl(sock, cmd, req);
+        Py_END_ALLOW_THREADS
     }
-    if (if_ioctl(SIOCSIFNETMASK, &req) < 0)
+    if (ret < 0)
     {
-        ret = -1;
-        goto out;
+        raise_error_from_errno(pytun_state_of(tuntap));
     }
 
-out:
-#if PY_MAJOR_VERSION >= 3
-    Py_XDECREF(tmp_netmask);
-#endif
-
     return ret;
 }
 
-static PyObject* pytun_tuntap_get_mtu(PyObject* self, void* d)
+/* A batch of rtnetlink requests, sent with as few system calls as possible.
+   The name of the device each request applies to is kept to report errors. */
+struct pytun_nl_batch
 {
-    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
-    struct ifreq req;
+    char* buf;
+    size_t len;
+    size_t cap;
+    size_t last;
+    unsigned int nmsgs;
+    PyObject* names;
+};
+typedef struct pytun_nl_batch pytun_nl_batch_t;
 
-    memset(&req, 0, sizeof(req));
-    strcpy(req.ifr_name, tuntap->name);
-    if (if_ioctl(SIOCGIFMTU, &req) < 0)
-    {
-        return NULL;
-    }
+/* Largest number of bytes of requests sent at once. Each acknowledgment
+   costs about 1 KiB of receive buffer, the chunks must be small enough for
+   all of them to fit. */
+#define PYTUN_NL_CHUNK 16384
+#define PYTUN_NL_RCVBUF (1 << 20)
 
-#if PY_MAJOR_VERSION >= 3
-    return PyLong_FromLong(req.ifr_mtu);
-#else
-    return PyInt_FromLong(req.ifr_mtu);
-#endif
+static int pytun_nl_batch_init(pytun_nl_batch_t* b)
+{
+    memset(b, 0, sizeof(*b));
+    b->names = PyList_New(0);
+
+    return b->names != NULL ? 0 : -1;
 }
 
-static int pytun_tuntap_set_mtu(PyObject* self, PyObject* value, void* d)
+static void pytun_nl_batch_free(pytun_nl_batch_t* b)
 {
-    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
-    struct ifreq req;
-    int mtu;
+    PyMem_Free(b->buf);
+    Py_XDECREF(b->names);
+    memset(b, 0, sizeof(*b));
+}
 
-    mtu = PyLong_AsLong(value);
-    if (mtu <= 0)
+static int pytun_nl_grow(pytun_nl_batch_t* b, size_t n)
+{
+    size_t cap;
+    char* buf;
+
+    if (b->len + n <= b->cap)
     {
-        if (!PyErr_Occurred())
-        {
-            raise_error("Bad MTU, should be > 0");
-        }
-        return -1;
+        return 0;
     }
-    memset(&req, 0, sizeof(req));
-    strcpy(req.ifr_name, tuntap->name);
-    req.ifr_mtu = mtu;
-    if (if_ioctl(SIOCSIFMTU, &req) < 0)
+    cap = b->cap != 0 ? b->cap : 4096;
+    while (cap < b->len + n)
+    {
+        cap *= 2;
+    }
+    buf = PyMem_Realloc(b->buf, cap);
+    if (buf == NULL)
     {
+        PyErr_NoMemory();
         return -1;
     }
+    memset(buf + b->cap, 0, cap - b->cap);
+    b->buf = buf;
+    b->cap = cap;
 
     return 0;
 }
 
-static PyGetSetDef pytun_tuntap_prop[] =
+/* Append a request with its family header. Its attributes are appended with
+   pytun_nl_attr(). */
+static int pytun_nl_msg(pytun_nl_batch_t* b, int type, int flags, const void* hdr,
+                        size_t hdrlen, const char* name)
 {
+    struct nlmsghdr* nlh;
+    PyObject* obj;
+    int ret;
+
+    if (pytun_nl_grow(b, NLMSG_SPACE(hdrlen)) < 0)
     {
-     "name",
-     pytun_tuntap_get_name,
-     NULL,
-     NULL,
-     NULL
-    },
-    {
-     "addr",
-     pytun_tuntap_get_addr,
-     pytun_tuntap_set_addr,
-     NULL,
-     NULL
-    },
-    {
-     "dstaddr",
-     pytun_tuntap_get_dstaddr,
-     pytun_tuntap_set_dstaddr,
-     NULL, NULL
-    },
-    {
-     "hwaddr",
-     pytun_tuntap_get_hwaddr,
-     pytun_tuntap_set_hwaddr,
-     NULL,
-     NULL
-    },
+        return -1;
+    }
+#if PY_MAJOR_VERSION >= 3
+    obj = PyUnicode_FromString(name);
+#else
+    obj = PyString_FromString(name);
+#endif
+    if (obj == NULL)
     {
-     "netmask",
-     pytun_tuntap_get_netmask,
-     pytun_tuntap_set_netmask,
-     NULL,
-     NULL
-    },
+        return -1;
+    }
+    ret = PyList_Append(b->names, obj);
+    Py_DECREF(obj);
+    if (ret < 0)
     {
-     "mtu",
-     pytun_tuntap_get_mtu,
-     pytun_tuntap_set_mtu,
-     NULL,
-     NULL
-    },
-    {NULL, NULL, NULL, NULL, NULL}
-};
+        return -1;
+    }
+    nlh = (struct nlmsghdr*)(b->buf + b->len);
+    memset(nlh, 0, NLMSG_SPACE(hdrlen));
+    nlh->nlmsg_len = NLMSG_LENGTH(hdrlen);
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    nlh->nlmsg_seq = b->nmsgs++;
+    memcpy(NLMSG_DATA(nlh), hdr, hdrlen);
+    b->last = b->len;
+    b->len += NLMSG_ALIGN(nlh->nlmsg_len);
 
-static PyObject* pytun_tuntap_close(PyObject* self)
+    return 0;
+}
+
+static int pytun_nl_attr(pytun_nl_batch_t* b, int type, const void* data, size_t len)
 {
-    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    struct nlmsghdr* nlh;
+    struct rtattr* rta;
 
-    if (tuntap->fd >= 0)
+    if (pytun_nl_grow(b, RTA_SPACE(len)) < 0)
     {
-        Py_BEGIN_ALLOW_THREADS
-        close(tuntap->fd), tuntap->fd = -1;
-        Py_END_ALLOW_THREADS
+        return -1;
     }
+    nlh = (struct nlmsghdr*)(b->buf + b->last);
+    rta = (struct rtattr*)(b->buf + b->len);
+    memset(rta, 0, RTA_SPACE(len));
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+    nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+    b->len = b->last + NLMSG_ALIGN(nlh->nlmsg_len);
 
-    Py_RETURN_NONE;
+    return 0;
 }
 
-PyDoc_STRVAR(pytun_tuntap_close_doc,
-"close() -> None.\n\
-Close the device.");
-
-static PyObject* pytun_tuntap_up(PyObject* self)
+/* Send the requests of the batch by chunks and wait for their
+   acknowledgments. Returns 0, or the errno of the first request that failed
+   with its index in *failed, or -1 with errno set if the netlink socket
+   itself failed. Must be called without holding the GIL. */
+static int pytun_nl_transact(pytun_nl_batch_t* b, char* rbuf, size_t rbuflen, unsigned int* failed)
 {
-    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
-    struct ifreq req;
+    struct sockaddr_nl kernel;
+    struct nlmsghdr* nlh;
+    struct nlmsgerr* nlerr;
+    size_t pos = 0;
+    size_t end;
+    unsigned int count;
+    unsigned int acked;
+    ssize_t n;
+    int left;
+    int one = 1;
+    int rcvbuf = PYTUN_NL_RCVBUF;
+    int err = 0;
+    int sock;
 
-    memset(&req, 0, sizeof(req));
-    strcpy(req.ifr_name, tuntap->name);
-    if (if_ioctl(SIOCGIFFLAGS, &req) < 0)
+    sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (sock < 0)
     {
-        return NULL;
+        return -1;
     }
-    if (!(req.ifr_flags & IFF_UP))
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0)
     {
-        req.ifr_flags |= IFF_UP;
-        if (if_ioctl(SIOCSIFFLAGS, &req) < 0)
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+#ifdef NETLINK_CAP_ACK
+    /* Don't echo the requests back in the error messages */
+    setsockopt(sock, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+#endif
+    (void)one;
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+
+    while (pos < b->len)
+    {
+        /* Gather whole requests up to the chunk size */
+        end = pos;
+        count = 0;
+        do
         {
-            return NULL;
+            nlh = (struct nlmsghdr*)(b->buf + end);
+            end += NLMSG_ALIGN(nlh->nlmsg_len);
+            count++;
+        } while (end < b->len && end - pos + ((struct nlmsghdr*)(b->buf + end))->nlmsg_len <= PYTUN_NL_CHUNK);
+
+        if (sendto(sock, b->buf + pos, end - pos, 0, (struct sockaddr*)&kernel, sizeof(kernel)) < 0)
+        {
+            goto error;
+        }
+        for (acked = 0; acked < count;)
+        {
+            n = recv(sock, rbuf, rbuflen, 0);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                goto error;
+            }
+            left = n;
+            for (nlh = (struct nlmsghdr*)rbuf; NLMSG_OK(nlh, left); nlh = NLMSG_NEXT(nlh, left))
+            {
+                if (nlh->nlmsg_type != NLMSG_ERROR)
+                {
+                    continue;
+                }
+                nlerr = (struct nlmsgerr*)NLMSG_DATA(nlh);
+                if (nlerr->error != 0 && err == 0)
+                {
+                    err = -nlerr->error;
+                    *failed = nlh->nlmsg_seq;
+                }
+                acked++;
+            }
         }
+        pos = end;
     }
+    close(sock);
 
-    Py_RETURN_NONE;
-}
+    return err;
 
-PyDoc_STRVAR(pytun_tuntap_up_doc,
-"up() -> None.\n\
-Bring up the device.");
+error:
+    err = errno;
+    close(sock);
+    errno = err;
 
-static PyObject* pytun_tuntap_down(PyObject* self)
+    return -1;
+}
+
+/* Send the batch, raising an error naming the device of the first request
+   that failed */
+static int pytun_nl_batch_send(pytun_state_t* state, pytun_nl_batch_t* b)
 {
-    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
-    struct ifreq req;
+    char* rbuf;
+    unsigned int failed = 0;
+    PyObject* name;
+    PyObject* value;
+    int ret;
 
-    memset(&req, 0, sizeof(req));
-    strcpy(req.ifr_name, tuntap->name);
-    if (if_ioctl(SIOCGIFFLAGS, &req) < 0)
+    if (b->len == 0)
     {
-        return NULL;
+        return 0;
     }
-    if (req.ifr_flags & IFF_UP)
+    rbuf = PyMem_Malloc(65536);
+    if (rbuf == NULL)
     {
-        req.ifr_flags &= ~IFF_UP;
-        if (if_ioctl(SIOCSIFFLAGS, &req) < 0)
+        PyErr_NoMemory();
+        return -1;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    ret = pytun_nl_transact(b, rbuf, 65536, &failed);
+    Py_END_ALLOW_THREADS
+    PyMem_Free(rbuf);
+    if (ret < 0)
+    {
+        raise_error_from_errno(state);
+        return -1;
+    }
+    if (ret > 0)
+    {
+        name = failed < (unsigned int)PyList_GET_SIZE(b->names) ? PyList_GET_ITEM(b->names, failed) : Py_None;
+        value = Py_BuildValue("(isO)", ret, strerror(ret), name);
+        if (value != NULL)
         {
-            return NULL;
+            PyErr_SetObject(state->error, value);
+            Py_DECREF(value);
         }
+        return -1;
     }
 
-    Py_RETURN_NONE;
+    return 0;
 }
 
-PyDoc_STRVAR(pytun_tuntap_down_doc,
-"down() -> None.\n\
-Bring down the device.");
-
-static PyObject* pytun_tuntap_read(PyObject* self, PyObject* args)
+/* Parse an address of the form "addr[/prefixlen]" */
+static int pytun_nl_parse_addr(pytun_state_t* state, PyObject* obj, int* family, unsigned char* addr, int* prefixlen)
 {
-    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
-    unsigned int rdlen;
-    ssize_t outlen;
-    PyObject *buf;
-
-    if (!PyArg_ParseTuple(args, "I:read", &rdlen))
-    {
-        return NULL;
-    }
+    PyObject* tmp = NULL;
+    const char* str;
+    char buf[INET6_ADDRSTRLEN + 8];
+    char* slash;
+    char* end;
+    long len;
+    int ret = -1;
 
-    /* Allocate a new string */
 #if PY_MAJOR_VERSION >= 3
-    buf = PyBytes_FromStringAndSize(NULL, rdlen);
+    tmp = PyUnicode_AsASCIIString(obj);
+    str = tmp != NULL ? PyBytes_AS_STRING(tmp) : NULL;
 #else
-    buf = PyString_FromStringAndSize(NULL, rdlen);
+    str = PyString_AsString(obj);
 #endif
-    if (buf == NULL)
+    if (str == NULL)
     {
-        return NULL;
+        goto out;
     }
-
-    /* Read data */
-    Py_BEGIN_ALLOW_THREADS
-#if PY_MAJOR_VERSION >= 3
-    outlen = read(tuntap->fd, PyBytes_AS_STRING(buf), rdlen);
-#else
-    outlen = read(tuntap->fd, PyString_AS_STRING(buf), rdlen);
-#endif
-    Py_END_ALLOW_THREADS
-    if (outlen < 0)
+    if (strlen(str) >= sizeof(buf))
     {
-        /* An error occurred, release the string and return an error */
-        raise_error_from_errno();
-        Py_DECREF(buf);
-        return NULL;
+        raise_error(state, "Bad IP address");
+        goto out;
     }
-    if (outlen < rdlen)
+    strcpy(buf, str);
+    slash = strchr(buf, '/');
+    if (slash != NULL)
     {
-        /* We did not read as many bytes as we anticipated, resize the
-           string if possible and be successful. */
-#if PY_MAJOR_VERSION >= 3
-        if (_PyBytes_Resize(&buf, outlen) < 0)
-#else
-        if (_PyString_Resize(&buf, outlen) < 0)
-#endif
+        *slash++ = '\0';
+    }
+    if (inet_pton(AF_INET, buf, addr) == 1)
+    {
+        *family = AF_INET;
+        *prefixlen = 32;
+    }
+    else if (inet_pton(AF_INET6, buf, addr) == 1)
+    {
+        *family = AF_INET6;
+        *prefixlen = 128;
+    }
+    else
+    {
+        raise_error(state, "Bad IP address");
+        goto out;
+    }
+    if (slash != NULL)
+    {
+        len = strtol(slash, &end, 10);
+        if (*slash == '\0' || *end != '\0' || len < 0 || len > *prefixlen)
         {
-            return NULL;
+            raise_error(state, "Bad prefix length");
+            goto out;
         }
+        *prefixlen = len;
     }
+    ret = 0;
 
-    return buf;
-}
+out:
+    Py_XDECREF(tmp);
 
-PyDoc_STRVAR(pytun_tuntap_read_doc,
-"read(size) -> read at most size bytes, returned as a string.");
+    return ret;
+}
 
-static PyObject* pytun_tuntap_write(PyObject* self, PyObject* args)
+static int pytun_tuntap_ifindex(pytun_tuntap_t* tuntap)
 {
-    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
-    char* buf;
-    Py_ssize_t len;
-    ssize_t written;
-
-    if (!PyArg_ParseTuple(args, "s#:write", &buf, &len))
-    {
-        return NULL;
-    }
+    struct ifreq req;
 
-    Py_BEGIN_ALLOW_THREADS
-    written = write(tuntap->fd, buf, len);
-    Py_END_ALLOW_THREADS
-    if (written < 0)
+    memset(&req, 0, sizeof(req));
+    pytun_tuntap_name(tuntap, req.ifr_name);
+    if (pytun_tuntap_ioctl(tuntap, SIOCGIFINDEX, &req) < 0)
     {
-        raise_error_from_errno();
-        return NULL;
+        return -1;
     }
 
-#if PY_MAJOR_VERSION >= 3
-    return PyLong_FromSsize_t(written);
-#else
-    return PyInt_FromSsize_t(written);
-#endif
-}
-
-PyDoc_STRVAR(pytun_tuntap_write_doc,
-"write(str) -> number of bytes written.\n\
-Write str to device.");
-
-static PyObject* pytun_tuntap_fileno(PyObject* self)
-{
-#if PY_MAJOR_VERSION >= 3
-    return PyLong_FromLong(((pytun_tuntap_t*)self)->fd);
-#else
-    return PyInt_FromLong(((pytun_tuntap_t*)self)->fd);
-#endif
+    return req.ifr_ifindex;
 }
 
-PyDoc_STRVAR(pytun_tuntap_fileno_doc,
-"fileno() -> integer \"file descriptor\".");
-
-static PyObject* pytun_tuntap_persist(PyObject* self, PyObject* args)
+/* Queue a RTM_NEWADDR or RTM_DELADDR request. An IPv4 peer address may be
+   given for point-to-point devices. */
+static int pytun_nl_addr(pytun_nl_batch_t* b, pytun_tuntap_t* tuntap, int ifindex, int type,
+                         PyObject* addr, PyObject* peer)
 {
-    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
-    PyObject* tmp = NULL;
-    int persist;
-    int ret;
-
-    if (!PyArg_ParseTuple(args, "|O!:persist", &PyBool_Type, &tmp))
-    {
-        return NULL;
-    }
+    struct ifaddrmsg ifa;
+    unsigned char local[sizeof(struct in6_addr)];
+    unsigned char remote[sizeof(struct in6_addr)];
+    char name[IFNAMSIZ];
+    int family;
+    int peer_family;
+    int prefixlen;
+    int peer_prefixlen;
 
-    if (tmp == NULL || tmp == Py_True)
+    if (pytun_nl_parse_addr(pytun_state_of(tuntap), addr, &family, local, &prefixlen) < 0)
     {
-        persist = 1;
+        return -1;
     }
-    else
+    memcpy(remote, local, sizeof(remote));
+    if (peer != NULL && peer != Py_None && family == AF_INET)
     {
-        persist = 0;
+        if (pytun_nl_parse_addr(pytun_state_of(tuntap), peer, &peer_family, remote, &peer_prefixlen) < 0)
+        {
+            return -1;
+        }
+        if (peer_family != AF_INET)
+        {
+            raise_error(pytun_state_of(tuntap), "Bad peer address");
+            return -1;
+        }
     }
-
-    Py_BEGIN_ALLOW_THREADS
-    ret = ioctl(tuntap->fd, TUNSETPERSIST, persist);
-    Py_END_ALLOW_THREADS
-    if (ret < 0)
+    memset(&ifa, 0, sizeof(ifa));
+    ifa.ifa_family = family;
+    ifa.ifa_prefixlen = prefixlen;
+    ifa.ifa_index = ifindex;
+    pytun_tuntap_name(tuntap, name);
+    if (pytun_nl_msg(b, type, type == RTM_NEWADDR ? NLM_F_CREATE | NLM_F_REPLACE : 0,
+                     &ifa, sizeof(ifa), name) < 0 ||
+        pytun_nl_attr(b, IFA_LOCAL, local, family == AF_INET ? 4 : 16) < 0 ||
+        pytun_nl_attr(b, IFA_ADDRESS, remote, family == AF_INET ? 4 : 16) < 0)
     {
-        raise_error_from_errno();
-        return NULL;
+        return -1;
     }
 
-    Py_RETURN_NONE;
+    return 0;
 }
 
-PyDoc_STRVAR(pytun_tuntap_persist_doc,
-"persist(flag) -> None.\n\
-Make the TUN/TAP persistent if flags is True else\n\
-make it non-persistent.");
-
-#ifdef IFF_MULTI_QUEUE
-static PyObject* pytun_tuntap_mq_attach(PyObject* self, PyObject* args)
+/* Queue the requests applying config, a dict with the optional keys mtu,
+   hwaddr, addrs, dstaddr and up, to the device */
+static int pytun_nl_config(pytun_nl_batch_t* b, pytun_tuntap_t* tuntap, PyObject* config)
 {
-    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
-    PyObject* tmp = NULL;
-    struct ifreq req;
+    struct ifinfomsg ifi;
+    PyObject* mtu;
+    PyObject* hwaddr;
+    PyObject* addrs;
+    PyObject* dstaddr;
+    PyObject* up;
+    PyObject* seq;
+    char* data;
+    char name[IFNAMSIZ];
+    Py_ssize_t len;
+    Py_ssize_t i;
+    uint32_t value;
+    int ifindex;
     int ret;
 
-    if (!PyArg_ParseTuple(args, "|O!:attach", &PyBool_Type, &tmp))
+    if (!PyDict_Check(config))
     {
-        return NULL;
+        PyErr_SetString(PyExc_TypeError, "config must be a dict");
+        return -1;
+    }
+    ifindex = pytun_tuntap_ifindex(tuntap);
+    if (ifindex < 0)
+    {
+        return -1;
     }
+    mtu = PyDict_GetItemString(config, "mtu");
+    hwaddr = PyDict_GetItemString(config, "hwaddr");
+    addrs = PyDict_GetItemString(config, "addrs");
+    dstaddr = PyDict_GetItemString(config, "dstaddr");
+    up = PyDict_GetItemString(config, "up");
 
-    memset(&req, 0, sizeof(req));
-    if (tmp == NULL || tmp == Py_True)
+    memset(&ifi, 0, sizeof(ifi));
+    ifi.ifi_family = AF_UNSPEC;
+    ifi.ifi_index = ifindex;
+    if (up != NULL && up != Py_None)
     {
-        req.ifr_flags = IFF_ATTACH_QUEUE;
+        ret = PyObject_IsTrue(up);
+        if (ret < 0)
+        {
+            return -1;
+        }
+        ifi.ifi_flags = ret ? IFF_UP : 0;
+        ifi.ifi_change = IFF_UP;
     }
-    else
+    pytun_tuntap_name(tuntap, name);
+    if (pytun_nl_msg(b, RTM_NEWLINK, 0, &ifi, sizeof(ifi), name) < 0)
+    {
+        return -1;
+    }
+    if (mtu != NULL && mtu != Py_None)
+    {
+        value = PyLong_AsUnsignedLong(mtu);
+        if (PyErr_Occurred() || value == 0)
+        {
+            if (!PyErr_Occurred())
+            {
+                raise_error(pytun_state_of(tuntap), "Bad MTU, should be > 0");
+            }
+            return -1;
+        }
+        if (pytun_nl_attr(b, IFLA_MTU, &value, sizeof(value)) < 0)
+        {
+            return -1;
+        }
+    }
+    if (hwaddr != NULL && hwaddr != Py_None)
+    {
+#if PY_MAJOR_VERSION >= 3
+        if (PyBytes_AsStringAndSize(hwaddr, &data, &len) == -1)
+#else
+        if (PyString_AsStringAndSize(hwaddr, &data, &len) == -1)
+#endif
+        {
+            return -1;
+        }
+        if (len != ETH_ALEN)
+        {
+            raise_error(pytun_state_of(tuntap), "Bad MAC address");
+            return -1;
+        }
+        if (pytun_nl_attr(b, IFLA_ADDRESS, data, len) < 0)
+        {
+            return -1;
+        }
+    }
+
+    if (addrs == NULL || addrs == Py_None)
+    {
+        return 0;
+    }
+#if PY_MAJOR_VERSION >= 3
+    if (PyUnicode_Check(addrs))
+#else
+    if (PyString_Check(addrs) || PyUnicode_Check(addrs))
+#endif
+    {
+        return pytun_nl_addr(b, tuntap, ifindex, RTM_NEWADDR, addrs, dstaddr);
+    }
+    seq = PySequence_Fast(addrs, "addrs must be a string or a sequence of strings");
+    if (seq == NULL)
+    {
+        return -1;
+    }
+    for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++)
+    {
+        if (pytun_nl_addr(b, tuntap, ifindex, RTM_NEWADDR, PySequence_Fast_GET_ITEM(seq, i), dstaddr) < 0)
+        {
+            Py_DECREF(seq);
+            return -1;
+        }
+    }
+    Py_DECREF(seq);
+
+    return 0;
+}
+
+static PyObject* pytun_tuntap_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+    pytun_tuntap_t* tuntap = NULL;
+    const char* name = "";
+    int flags = IFF_TUN;
+    const char* dev = "/dev/net/tun";
+    PyObject* dev_obj = NULL;
+    int dev_fd = -1;
+    int nonblocking = 0;
+    char* kwlist[] = {"name", "flags", "dev", "nonblocking", NULL};
+    int ret;
+    const char* errmsg = NULL;
+    struct ifreq req;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|siOi", kwlist, &name, &flags, &dev_obj, &nonblocking))
+    {
+        return NULL;
+    }
+
+    /* dev is either the path of the clone device or an open file descriptor
+       (or an object with a fileno() method) */
+    if (dev_obj != NULL && dev_obj != Py_None)
+    {
+        if (PyUnicode_Check(dev_obj) || PyBytes_Check(dev_obj))
+        {
+            if (!PyArg_Parse(dev_obj, "s", &dev))
+            {
+                return NULL;
+            }
+        }
+        else
+        {
+            dev_fd = PyObject_AsFileDescriptor(dev_obj);
+            if (dev_fd < 0)
+            {
+                return NULL;
+            }
+        }
+    }
+
+    /* Check flags value */
+    if (!(flags & (IFF_TUN | IFF_TAP)))
+    {
+        errmsg = "Bad flags: either IFF_TUN or IFF_TAP must be set";
+        goto error;
+    }
+    if ((flags & IFF_TUN) && (flags & IFF_TAP))
+    {
+        errmsg = "Bad flags: IFF_TUN and IFF_TAP could not both be set";
+        goto error;
+    }
+
+    /* Check the name length */
+    if (strlen(name) >= IFNAMSIZ)
+    {
+        errmsg = "Interface name too long";
+        goto error;
+    }
+
+    tuntap = (pytun_tuntap_t*)type->tp_alloc(type, 0);
+    if (tuntap == NULL)
+    {
+        goto error;
+    }
+    pthread_mutex_init(&tuntap->capture.lock, NULL);
+    tuntap->capture.fd = -1;
+    pthread_mutex_init(&tuntap->lock, NULL);
+
+    if (dev_fd >= 0)
+    {
+        /* Use a duplicate of the descriptor, the caller keeps its own. Both
+           share the open file description and thus O_NONBLOCK: there is no
+           way to get another description attached to the same interface. */
+        tuntap->fd = fcntl(dev_fd, F_DUPFD_CLOEXEC, 0);
+        if (tuntap->fd < 0)
+        {
+            goto error;
+        }
+        if (nonblocking)
+        {
+            ret = fcntl(tuntap->fd, F_GETFL);
+            if (ret < 0 || fcntl(tuntap->fd, F_SETFL, ret | O_NONBLOCK) < 0)
+            {
+                goto error;
+            }
+        }
+        memset(&req, 0, sizeof(req));
+        if (ioctl(tuntap->fd, TUNGETIFF, &req) == 0)
+        {
+            /* Already attached to an interface (e.g passed by another
+               process) */
+            strcpy(tuntap->name, req.ifr_name);
+            tuntap->flags = req.ifr_flags;
+        }
+        else
+        {
+            /* Not a TUN/TAP device (e.g a socketpair standing in for a
+               device in tests): packets are read and written as is */
+            tuntap->name[0] = '\0';
+            tuntap->flags = flags;
+        }
+        tuntap->vnet_hdr_sz = sizeof(struct virtio_net_hdr);
+        return (PyObject*)tuntap;
+    }
+
+    /* Open the TUN/TAP device */
+    Py_BEGIN_ALLOW_THREADS
+    tuntap->fd = open(dev, nonblocking ? O_RDWR | O_NONBLOCK : O_RDWR);
+    Py_END_ALLOW_THREADS
+    if (tuntap->fd < 0)
+    {
+        goto error;
+    }
+
+    /* Prepare the structure used to issue ioctl() calls */
+    memset(&req, 0, sizeof(req));
+    if (*name)
+    {
+        strcpy(req.ifr_name, name);
+    }
+
+    /* Create the TUN/TAP interface */
+    req.ifr_flags = flags;
+    Py_BEGIN_ALLOW_THREADS
+    ret = ioctl(tuntap->fd, TUNSETIFF, &req);
+    Py_END_ALLOW_THREADS
+    if (ret < 0)
+    {
+        goto error;
+    }
+    strcpy(tuntap->name, req.ifr_name);
+    tuntap->flags = flags;
+    tuntap->vnet_hdr_sz = sizeof(struct virtio_net_hdr);
+
+    return (PyObject*)tuntap;
+
+error:
+
+    if (errmsg != NULL)
+    {
+        raise_error(pytun_state_of_type(type), errmsg);
+    }
+    else if (errno != 0)
+    {
+        raise_error_from_errno(pytun_state_of_type(type));
+    }
+
+    if (tuntap != NULL)
+    {
+        if (tuntap->fd >= 0)
+        {
+            Py_BEGIN_ALLOW_THREADS
+            close(tuntap->fd);
+            Py_END_ALLOW_THREADS
+        }
+        pthread_mutex_destroy(&tuntap->capture.lock);
+        pthread_mutex_destroy(&tuntap->lock);
+        type->tp_free(tuntap);
+        PYTUN_TYPE_DECREF(type);
+    }
+
+    return NULL;
+}
+
+static void pytun_tuntap_dealloc(PyObject* self)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    PyTypeObject* type = Py_TYPE(self);
+
+    if (!pytun_tuntap_closed(tuntap))
+    {
+        Py_BEGIN_ALLOW_THREADS
+        close(tuntap->fd);
+        Py_END_ALLOW_THREADS
+    }
+    pytun_capture_stop(&tuntap->capture);
+    pthread_mutex_destroy(&tuntap->capture.lock);
+    pytun_tb_decref(tuntap->shaper);
+    Py_XDECREF(tuntap->shaper_obj);
+    pthread_mutex_destroy(&tuntap->lock);
+    type->tp_free(self);
+    PYTUN_TYPE_DECREF(type);
+}
+
+static PyObject* pytun_tuntap_get_name(PyObject* self, void* d)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    char name[IFNAMSIZ];
+
+    pytun_tuntap_refresh_name(tuntap);
+    pytun_tuntap_name(tuntap, name);
+
+#if PY_MAJOR_VERSION >= 3
+    return PyUnicode_FromString(name);
+#else
+    return PyString_FromString(name);
+#endif
+}
+
+static PyObject* pytun_tuntap_get_addr(PyObject* self, void* d)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    struct ifreq req;
+    const char* addr;
+
+    memset(&req, 0, sizeof(req));
+    pytun_tuntap_name(tuntap, req.ifr_name);
+    if (pytun_tuntap_ioctl(tuntap, SIOCGIFADDR, &req) < 0)
+    {
+        return NULL;
+    }
+    addr = inet_ntoa(((struct sockaddr_in*)&req.ifr_addr)->sin_addr);
+    if (addr == NULL)
+    {
+        raise_error(pytun_state_of(self), "Failed to retrieve addr");
+        return NULL;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    return PyUnicode_FromString(addr);
+#else
+    return PyString_FromString(addr);
+#endif
+}
+
+static int pytun_tuntap_set_addr(PyObject* self, PyObject* value, void* d)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    int ret = 0;
+    struct ifreq req;
+#if PY_MAJOR_VERSION >= 3
+    PyObject* tmp_addr;
+#endif
+    const char* addr;
+    struct sockaddr_in* sin;
+
+#if PY_MAJOR_VERSION >= 3
+    tmp_addr = PyUnicode_AsASCIIString(value);
+    addr = tmp_addr != NULL ? PyBytes_AS_STRING(tmp_addr) : NULL;
+#else
+    addr = PyString_AsString(value);
+#endif
+    if (addr == NULL)
+    {
+        ret = -1;
+        goto out;
+    }
+    memset(&req, 0, sizeof(req));
+    pytun_tuntap_name(tuntap, req.ifr_name);
+    sin = (struct sockaddr_in*)&req.ifr_addr;
+    sin->sin_family = AF_INET;
+    if (inet_aton(addr, &sin->sin_addr) == 0)
+    {
+        raise_error(pytun_state_of(self), "Bad IP address");
+        ret = -1;
+        goto out;
+    }
+    if (pytun_tuntap_ioctl(tuntap, SIOCSIFADDR, &req) < 0)
+    {
+        ret = -1;
+        goto out;
+    }
+
+out:
+#if PY_MAJOR_VERSION >= 3
+    Py_XDECREF(tmp_addr);
+#endif
+
+    return ret;
+}
+
+static PyObject* pytun_tuntap_get_dstaddr(PyObject* self, void* d)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    struct ifreq req;
+    const char* dstaddr;
+
+    memset(&req, 0, sizeof(req));
+    pytun_tuntap_name(tuntap, req.ifr_name);
+    if (pytun_tuntap_ioctl(tuntap, SIOCGIFDSTADDR, &req) < 0)
+    {
+        return NULL;
+    }
+    dstaddr = inet_ntoa(((struct sockaddr_in*)&req.ifr_dstaddr)->sin_addr);
+    if (dstaddr == NULL)
+    {
+        raise_error(pytun_state_of(self), "Failed to retrieve dstaddr");
+        return NULL;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    return PyUnicode_FromString(dstaddr);
+#else
+    return PyString_FromString(dstaddr);
+#endif
+}
+
+static int pytun_tuntap_set_dstaddr(PyObject* self, PyObject* value, void* d)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    int ret = 0;
+    struct ifreq req;
+#if PY_MAJOR_VERSION >= 3
+    PyObject* tmp_dstaddr;
+#endif
+    const char* dstaddr;
+    struct sockaddr_in* sin;
+
+#if PY_MAJOR_VERSION >= 3
+    tmp_dstaddr = PyUnicode_AsASCIIString(value);
+    dstaddr = tmp_dstaddr != NULL ? PyBytes_AS_STRING(tmp_dstaddr) : NULL;
+#else
+    dstaddr = PyString_AsString(value);
+#endif
+    if (dstaddr == NULL)
+    {
+        ret = -1;
+        goto out;
+    }
+    memset(&req, 0, sizeof(req));
+    pytun_tuntap_name(tuntap, req.ifr_name);
+    sin = (struct sockaddr_in*)&req.ifr_dstaddr;
+    sin->sin_family = AF_INET;
+    if (inet_aton(dstaddr, &sin->sin_addr) == 0)
+    {
+        raise_error(pytun_state_of(self), "Bad IP address");
+        ret = -1;
+        goto out;
+    }
+    if (pytun_tuntap_ioctl(tuntap, SIOCSIFDSTADDR, &req) < 0)
+    {
+        ret = -1;
+        goto out;
+    }
+
+out:
+#if PY_MAJOR_VERSION >= 3
+    Py_XDECREF(tmp_dstaddr);
+#endif
+
+    return ret;
+}
+
+static PyObject* pytun_tuntap_get_hwaddr(PyObject* self, void* d)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    struct ifreq req;
+
+    memset(&req, 0, sizeof(req));
+    pytun_tuntap_name(tuntap, req.ifr_name);
+    if (pytun_tuntap_ioctl(tuntap, SIOCGIFHWADDR, &req) < 0)
+    {
+        return NULL;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    return PyBytes_FromStringAndSize(req.ifr_hwaddr.sa_data, ETH_ALEN);
+#else
+    return PyString_FromStringAndSize(req.ifr_hwaddr.sa_data, ETH_ALEN);
+#endif
+}
+
+static int pytun_tuntap_set_hwaddr(PyObject* self, PyObject* value, void* d)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    struct ifreq req;
+    char* hwaddr;
+    Py_ssize_t len;
+
+#if PY_MAJOR_VERSION >= 3
+    if (PyBytes_AsStringAndSize(value, &hwaddr, &len) == -1)
+#else
+    if (PyString_AsStringAndSize(value, &hwaddr, &len) == -1)
+#endif
+    {
+        return -1;
+    }
+    if (len != ETH_ALEN)
+    {
+        raise_error(pytun_state_of(self), "Bad MAC address");
+        return -1;
+    }
+    memset(&req, 0, sizeof(req));
+    pytun_tuntap_name(tuntap, req.ifr_name);
+    req.ifr_hwaddr.sa_family = ARPHRD_ETHER;
+    memcpy(req.ifr_hwaddr.sa_data, hwaddr, len);
+    if (pytun_tuntap_ioctl(tuntap, SIOCSIFHWADDR, &req) < 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyObject* pytun_tuntap_get_netmask(PyObject* self, void* d)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    struct ifreq req;
+    const char* netmask;
+
+    memset(&req, 0, sizeof(req));
+    pytun_tuntap_name(tuntap, req.ifr_name);
+    if (pytun_tuntap_ioctl(tuntap, SIOCGIFNETMASK, &req) < 0)
+    {
+        return NULL;
+    }
+    netmask = inet_ntoa(((struct sockaddr_in*)&req.ifr_netmask)->sin_addr);
+    if (netmask == NULL)
+    {
+        raise_error(pytun_state_of(self), "Failed to retrieve netmask");
+        return NULL;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    return PyUnicode_FromString(netmask);
+#else
+    return PyString_FromString(netmask);
+#endif
+}
+
+static int pytun_tuntap_set_netmask(PyObject* self, PyObject* value, void* d)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    int ret = 0;
+    struct ifreq req;
+#if PY_MAJOR_VERSION >= 3
+    PyObject* tmp_netmask;
+#endif
+    const char* netmask;
+    struct sockaddr_in* sin;
+
+#if PY_MAJOR_VERSION >= 3
+    tmp_netmask = PyUnicode_AsASCIIString(value);
+    netmask = tmp_netmask != NULL ? PyBytes_AS_STRING(tmp_netmask) : NULL;
+#else
+    netmask = PyString_AsString(value);
+#endif
+    if (netmask == NULL)
+    {
+        ret = -1;
+        goto out;
+    }
+    memset(&req, 0, sizeof(req));
+    pytun_tuntap_name(tuntap, req.ifr_name);
+    sin = (struct sockaddr_in*)&req.ifr_netmask;
+    sin->sin_family = AF_INET;
+    if (inet_aton(netmask, &sin->sin_addr) == 0)
+    {
+        raise_error(pytun_state_of(self), "Bad IP address");
+        ret = -1;
+        goto out;
+    }
+    if (pytun_tuntap_ioctl(tuntap, SIOCSIFNETMASK, &req) < 0)
+    {
+        ret = -1;
+        goto out;
+    }
+
+out:
+#if PY_MAJOR_VERSION >= 3
+    Py_XDECREF(tmp_netmask);
+#endif
+
+    return ret;
+}
+
+static PyObject* pytun_tuntap_get_mtu(PyObject* self, void* d)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    struct ifreq req;
+
+    memset(&req, 0, sizeof(req));
+    pytun_tuntap_name(tuntap, req.ifr_name);
+    if (pytun_tuntap_ioctl(tuntap, SIOCGIFMTU, &req) < 0)
+    {
+        return NULL;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    return PyLong_FromLong(req.ifr_mtu);
+#else
+    return PyInt_FromLong(req.ifr_mtu);
+#endif
+}
+
+static int pytun_tuntap_set_mtu(PyObject* self, PyObject* value, void* d)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    struct ifreq req;
+    int mtu;
+
+    if (value == NULL)
+    {
+        PyErr_SetString(PyExc_TypeError, "Cannot delete the MTU");
+        return -1;
+    }
+    mtu = PyLong_AsLong(value);
+    if (mtu <= 0)
+    {
+        if (!PyErr_Occurred())
+        {
+            raise_error(pytun_state_of(self), "Bad MTU, should be > 0");
+        }
+        return -1;
+    }
+    memset(&req, 0, sizeof(req));
+    pytun_tuntap_name(tuntap, req.ifr_name);
+    req.ifr_mtu = mtu;
+    if (pytun_tuntap_ioctl(tuntap, SIOCSIFMTU, &req) < 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+#ifdef TUNSETVNETHDRSZ
+static PyObject* pytun_tuntap_get_vnet_hdr_sz(PyObject* self, void* d)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    int sz;
+    int ret;
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = pytun_tuntap_fd_ioctl(tuntap, TUNGETVNETHDRSZ, (unsigned long)&sz);
+    Py_END_ALLOW_THREADS
+    if (ret < 0)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        return NULL;
+    }
+    tuntap->vnet_hdr_sz = sz;
+
+#if PY_MAJOR_VERSION >= 3
+    return PyLong_FromLong(sz);
+#else
+    return PyInt_FromLong(sz);
+#endif
+}
+
+static int pytun_tuntap_set_vnet_hdr_sz(PyObject* self, PyObject* value, void* d)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    int sz;
+    int ret;
+
+    if (value == NULL)
+    {
+        PyErr_SetString(PyExc_TypeError, "Cannot delete the vnet header size");
+        return -1;
+    }
+    sz = PyLong_AsLong(value);
+    if (sz < (int)sizeof(struct virtio_net_hdr) || sz > PYTUN_VNET_HDR_MAX)
+    {
+        if (!PyErr_Occurred())
+        {
+            raise_error(pytun_state_of(self), "Bad vnet header size");
+        }
+        return -1;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    ret = pytun_tuntap_fd_ioctl(tuntap, TUNSETVNETHDRSZ, (unsigned long)&sz);
+    Py_END_ALLOW_THREADS
+    if (ret < 0)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        return -1;
+    }
+    tuntap->vnet_hdr_sz = sz;
+
+    return 0;
+}
+#endif
+
+static PyObject* pytun_tuntap_get_nonblocking(PyObject* self, void* d)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    int fl;
+
+    fl = pytun_tuntap_fd_fcntl(tuntap, F_GETFL, 0);
+    if (fl < 0)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        return NULL;
+    }
+
+    return PyBool_FromLong(fl & O_NONBLOCK);
+}
+
+static int pytun_tuntap_set_nonblocking(PyObject* self, PyObject* value, void* d)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    int nonblocking;
+    int fl;
+
+    if (value == NULL)
+    {
+        PyErr_SetString(PyExc_TypeError, "Cannot delete the non-blocking mode");
+        return -1;
+    }
+    nonblocking = PyObject_IsTrue(value);
+    if (nonblocking < 0)
+    {
+        return -1;
+    }
+    fl = pytun_tuntap_fd_fcntl(tuntap, F_GETFL, 0);
+    if (fl < 0 || pytun_tuntap_fd_fcntl(tuntap, F_SETFL, nonblocking ? fl | O_NONBLOCK : fl & ~O_NONBLOCK) < 0)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyObject* pytun_tuntap_get_shaper(PyObject* self, void* d)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    PyObject* shaper;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    shaper = tuntap->shaper_obj != NULL ? tuntap->shaper_obj : Py_None;
+    Py_INCREF(shaper);
+    Py_END_CRITICAL_SECTION();
+
+    return shaper;
+}
+
+static int pytun_tuntap_set_shaper(PyObject* self, PyObject* value, void* d)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    pytun_tb_t* tb = NULL;
+    pytun_tb_t* old;
+    PyObject* old_obj;
+
+    if (value != NULL && value != Py_None)
+    {
+        if (!PyObject_TypeCheck(value, pytun_state_of(self)->shaper_type))
+        {
+            PyErr_SetString(PyExc_TypeError, "shaper must be a Shaper or None");
+            return -1;
+        }
+        tb = ((pytun_shaper_t*)value)->tb;
+        pytun_tb_incref(tb);
+        Py_INCREF(value);
+    }
+    else
+    {
+        value = NULL;
+    }
+
+    /* Writes in progress keep their own reference to the old bucket */
+    Py_BEGIN_CRITICAL_SECTION(self);
+    pthread_mutex_lock(&tuntap->lock);
+    old = tuntap->shaper;
+    __atomic_store_n(&tuntap->shaper, tb, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&tuntap->lock);
+    old_obj = tuntap->shaper_obj;
+    tuntap->shaper_obj = value;
+    Py_END_CRITICAL_SECTION();
+    pytun_tb_decref(old);
+    Py_XDECREF(old_obj);
+
+    return 0;
+}
+
+static PyGetSetDef pytun_tuntap_prop[] =
+{
+    {
+     "name",
+     pytun_tuntap_get_name,
+     NULL,
+     NULL,
+     NULL
+    },
+    {
+     "addr",
+     pytun_tuntap_get_addr,
+     pytun_tuntap_set_addr,
+     NULL,
+     NULL
+    },
+    {
+     "dstaddr",
+     pytun_tuntap_get_dstaddr,
+     pytun_tuntap_set_dstaddr,
+     NULL, NULL
+    },
+    {
+     "hwaddr",
+     pytun_tuntap_get_hwaddr,
+     pytun_tuntap_set_hwaddr,
+     NULL,
+     NULL
+    },
+    {
+     "netmask",
+     pytun_tuntap_get_netmask,
+     pytun_tuntap_set_netmask,
+     NULL,
+     NULL
+    },
+    {
+     "mtu",
+     pytun_tuntap_get_mtu,
+     pytun_tuntap_set_mtu,
+     NULL,
+     NULL
+    },
+#ifdef TUNSETVNETHDRSZ
+    {
+     "vnet_hdr_sz",
+     pytun_tuntap_get_vnet_hdr_sz,
+     pytun_tuntap_set_vnet_hdr_sz,
+     NULL,
+     NULL
+    },
+#endif
+    {
+     "nonblocking",
+     pytun_tuntap_get_nonblocking,
+     pytun_tuntap_set_nonblocking,
+     NULL,
+     NULL
+    },
+    {
+     "shaper",
+     pytun_tuntap_get_shaper,
+     pytun_tuntap_set_shaper,
+     "Shaper pacing the writes to the device, or None",
+     NULL
+    },
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyObject* pytun_tuntap_close(PyObject* self)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    unsigned int uses;
+
+    uses = __atomic_fetch_or(&tuntap->fd_uses, 1, __ATOMIC_ACQ_REL);
+    if (!(uses & 1))
+    {
+        Py_BEGIN_ALLOW_THREADS
+        /* Otherwise the last call in progress closes the descriptor */
+        if (uses == 0)
+        {
+            close(tuntap->fd);
+        }
+        pytun_capture_stop(&tuntap->capture);
+        Py_END_ALLOW_THREADS
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pytun_tuntap_close_doc,
+"close() -> None.\n\
+Close the device, stopping the capture if any. Calls in progress in other\n\
+threads keep the descriptor open until they return (a blocking read() is\n\
+not interrupted), later calls fail with EBADF.");
+
+static PyObject* pytun_tuntap_up(PyObject* self)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    struct ifreq req;
+
+    memset(&req, 0, sizeof(req));
+    pytun_tuntap_name(tuntap, req.ifr_name);
+    if (pytun_tuntap_ioctl(tuntap, SIOCGIFFLAGS, &req) < 0)
+    {
+        return NULL;
+    }
+    if (!(req.ifr_flags & IFF_UP))
+    {
+        req.ifr_flags |= IFF_UP;
+        if (pytun_tuntap_ioctl(tuntap, SIOCSIFFLAGS, &req) < 0)
+        {
+            return NULL;
+        }
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pytun_tuntap_up_doc,
+"up() -> None.\n\
+Bring up the device.");
+
+static PyObject* pytun_tuntap_down(PyObject* self)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    struct ifreq req;
+
+    memset(&req, 0, sizeof(req));
+    pytun_tuntap_name(tuntap, req.ifr_name);
+    if (pytun_tuntap_ioctl(tuntap, SIOCGIFFLAGS, &req) < 0)
+    {
+        return NULL;
+    }
+    if (req.ifr_flags & IFF_UP)
+    {
+        req.ifr_flags &= ~IFF_UP;
+        if (pytun_tuntap_ioctl(tuntap, SIOCSIFFLAGS, &req) < 0)
+        {
+            return NULL;
+        }
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pytun_tuntap_down_doc,
+"down() -> None.\n\
+Bring down the device.");
+
+static PyObject* pytun_tuntap_configure(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    PyObject* addr = NULL;
+    PyObject* dstaddr = NULL;
+    PyObject* netmask = NULL;
+    PyObject* mtu = NULL;
+    PyObject* hwaddr = NULL;
+    PyObject* up = NULL;
+    char* kwlist[] = {"addr", "dstaddr", "netmask", "mtu", "hwaddr", "up", NULL};
+    int ret;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOOOOO:configure", kwlist,
+                                     &addr, &dstaddr, &netmask, &mtu, &hwaddr, &up))
+    {
+        return NULL;
+    }
+
+    if (hwaddr != NULL && hwaddr != Py_None && pytun_tuntap_set_hwaddr(self, hwaddr, NULL) < 0)
+    {
+        return NULL;
+    }
+    if (mtu != NULL && mtu != Py_None && pytun_tuntap_set_mtu(self, mtu, NULL) < 0)
+    {
+        return NULL;
+    }
+    if (addr != NULL && addr != Py_None && pytun_tuntap_set_addr(self, addr, NULL) < 0)
+    {
+        return NULL;
+    }
+    if (netmask != NULL && netmask != Py_None && pytun_tuntap_set_netmask(self, netmask, NULL) < 0)
+    {
+        return NULL;
+    }
+    if (dstaddr != NULL && dstaddr != Py_None && pytun_tuntap_set_dstaddr(self, dstaddr, NULL) < 0)
+    {
+        return NULL;
+    }
+    if (up != NULL && up != Py_None)
+    {
+        ret = PyObject_IsTrue(up);
+        if (ret < 0)
+        {
+            return NULL;
+        }
+        return ret ? pytun_tuntap_up(self) : pytun_tuntap_down(self);
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pytun_tuntap_configure_doc,
+"configure(addr=None, dstaddr=None, netmask=None, mtu=None, hwaddr=None, up=None) -> None.\n\
+Set the given parameters of the device in one call, in the order hwaddr,\n\
+mtu, addr, netmask, dstaddr, then bring the device up or down if up is\n\
+given. Parameters left to None are not changed.");
+
+static PyObject* pytun_tuntap_change_addr(PyObject* self, PyObject* args, int type)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    pytun_nl_batch_t b;
+    PyObject* addr;
+    PyObject* peer = NULL;
+    PyObject* res = NULL;
+    int ifindex;
+
+    if (!PyArg_ParseTuple(args, type == RTM_NEWADDR ? "O|O:add_addr" : "O|O:del_addr", &addr, &peer))
+    {
+        return NULL;
+    }
+    ifindex = pytun_tuntap_ifindex(tuntap);
+    if (ifindex < 0 || pytun_nl_batch_init(&b) < 0)
+    {
+        return NULL;
+    }
+    if (pytun_nl_addr(&b, tuntap, ifindex, type, addr, peer) < 0 || pytun_nl_batch_send(pytun_state_of(self), &b) < 0)
+    {
+        goto out;
+    }
+    Py_INCREF(Py_None);
+    res = Py_None;
+
+out:
+    pytun_nl_batch_free(&b);
+
+    return res;
+}
+
+static PyObject* pytun_tuntap_add_addr(PyObject* self, PyObject* args)
+{
+    return pytun_tuntap_change_addr(self, args, RTM_NEWADDR);
+}
+
+PyDoc_STRVAR(pytun_tuntap_add_addr_doc,
+"add_addr(addr, peer=None) -> None.\n\
+Add the IPv4 or IPv6 address addr, of the form 'addr[/prefixlen]', to the\n\
+device with rtnetlink. Unlike the addr attribute, several addresses may be\n\
+added. peer is the IPv4 address of the other end of a point-to-point\n\
+device.");
+
+static PyObject* pytun_tuntap_del_addr(PyObject* self, PyObject* args)
+{
+    return pytun_tuntap_change_addr(self, args, RTM_DELADDR);
+}
+
+PyDoc_STRVAR(pytun_tuntap_del_addr_doc,
+"del_addr(addr, peer=None) -> None.\n\
+Remove an address added with add_addr().");
+
+/* Read at most rdlen bytes from the device. If try_only is set, return None
+   instead of raising an error if no packet is pending. */
+static PyObject* pytun_tuntap_do_read(pytun_tuntap_t* tuntap, unsigned int rdlen, int try_only)
+{
+    ssize_t outlen = -1;
+    PyObject *buf;
+    int fd;
+
+    /* Allocate a new string */
+#if PY_MAJOR_VERSION >= 3
+    buf = PyBytes_FromStringAndSize(NULL, rdlen);
+#else
+    buf = PyString_FromStringAndSize(NULL, rdlen);
+#endif
+    if (buf == NULL)
+    {
+        return NULL;
+    }
+
+    /* Read data */
+    PYTUN_BEGIN_ALLOW_THREADS(&tuntap->stats)
+    if ((fd = pytun_tuntap_get_fd(tuntap)) >= 0)
+    {
+#if PY_MAJOR_VERSION >= 3
+        outlen = read(fd, PyBytes_AS_STRING(buf), rdlen);
+#else
+        outlen = read(fd, PyString_AS_STRING(buf), rdlen);
+#endif
+        pytun_tuntap_put_fd(tuntap);
+    }
+    pytun_stats_read(&tuntap->stats, outlen, rdlen);
+#if PY_MAJOR_VERSION >= 3
+    pytun_capture_packet(&tuntap->capture, PYTUN_CAPTURE_OUT, PyBytes_AS_STRING(buf), outlen);
+#else
+    pytun_capture_packet(&tuntap->capture, PYTUN_CAPTURE_OUT, PyString_AS_STRING(buf), outlen);
+#endif
+    PYTUN_END_ALLOW_THREADS(&tuntap->stats)
+    if (outlen < 0)
+    {
+        if (try_only && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            Py_DECREF(buf);
+            Py_RETURN_NONE;
+        }
+        /* An error occurred, release the string and return an error */
+        raise_error_from_errno(pytun_state_of(tuntap));
+        Py_DECREF(buf);
+        return NULL;
+    }
+    if (outlen < rdlen)
+    {
+        /* We did not read as many bytes as we anticipated, resize the
+           string if possible and be successful. */
+#if PY_MAJOR_VERSION >= 3
+        if (_PyBytes_Resize(&buf, outlen) < 0)
+#else
+        if (_PyString_Resize(&buf, outlen) < 0)
+#endif
+        {
+            return NULL;
+        }
+    }
+
+    return buf;
+}
+
+/* Parse the arguments of read() and try_read(): a single size which fits in
+   an unsigned int */
+static int pytun_parse_read_args(const char* name, PyObject* const* args, Py_ssize_t nargs,
+                                 unsigned int* rdlen)
+{
+    Py_ssize_t size;
+
+    if (nargs != 1)
+    {
+        PyErr_Format(PyExc_TypeError, "%s() takes exactly one argument (%zd given)", name, nargs);
+        return -1;
+    }
+    size = PyNumber_AsSsize_t(args[0], PyExc_OverflowError);
+    if (size == -1 && PyErr_Occurred())
+    {
+        return -1;
+    }
+    if (size < 0 || (size_t)size > UINT_MAX)
+    {
+        PyErr_SetString(PyExc_OverflowError, "size out of range");
+        return -1;
+    }
+    *rdlen = size;
+
+    return 0;
+}
+
+static PyObject* pytun_tuntap_read(PyObject* self, PyObject* const* args, Py_ssize_t nargs)
+{
+    unsigned int rdlen;
+
+    if (pytun_parse_read_args("read", args, nargs, &rdlen) < 0)
+    {
+        return NULL;
+    }
+
+    return pytun_tuntap_do_read((pytun_tuntap_t*)self, rdlen, 0);
+}
+
+PYTUN_FASTCALL_WRAPPER(pytun_tuntap_read)
+
+PyDoc_STRVAR(pytun_tuntap_read_doc,
+"read(size) -> read at most size bytes, returned as a string.");
+
+static PyObject* pytun_tuntap_try_read(PyObject* self, PyObject* const* args, Py_ssize_t nargs)
+{
+    unsigned int rdlen;
+
+    if (pytun_parse_read_args("try_read", args, nargs, &rdlen) < 0)
+    {
+        return NULL;
+    }
+
+    return pytun_tuntap_do_read((pytun_tuntap_t*)self, rdlen, 1);
+}
+
+PYTUN_FASTCALL_WRAPPER(pytun_tuntap_try_read)
+
+PyDoc_STRVAR(pytun_tuntap_try_read_doc,
+"try_read(size) -> read at most size bytes, or None.\n\
+Same as read() but return None instead of raising an error if the device is\n\
+non-blocking and has no packet pending.");
+
+static PyObject* pytun_tuntap_read_into(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    Py_buffer buf;
+    Py_ssize_t nbytes = 0;
+    Py_ssize_t offset = 0;
+    char* kwlist[] = {"buffer", "nbytes", "offset", NULL};
+    ssize_t outlen = -1;
+    int fd;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "w*|nn:read_into", kwlist, &buf, &nbytes, &offset))
+    {
+        return NULL;
+    }
+
+    /* Check the requested area lies within the buffer */
+    if (offset < 0 || offset > buf.len)
+    {
+        PyBuffer_Release(&buf);
+        PyErr_SetString(PyExc_ValueError, "offset out of range");
+        return NULL;
+    }
+    if (nbytes < 0)
+    {
+        PyBuffer_Release(&buf);
+        PyErr_SetString(PyExc_ValueError, "negative nbytes");
+        return NULL;
+    }
+    if (nbytes == 0)
+    {
+        nbytes = buf.len - offset;
+    }
+    else if (nbytes > buf.len - offset)
+    {
+        PyBuffer_Release(&buf);
+        PyErr_SetString(PyExc_ValueError, "nbytes is greater than the space left in the buffer");
+        return NULL;
+    }
+
+    /* Read data directly into the caller's buffer */
+    PYTUN_BEGIN_ALLOW_THREADS(&tuntap->stats)
+    if ((fd = pytun_tuntap_get_fd(tuntap)) >= 0)
+    {
+        outlen = read(fd, (char*)buf.buf + offset, nbytes);
+        pytun_tuntap_put_fd(tuntap);
+    }
+    pytun_stats_read(&tuntap->stats, outlen, nbytes);
+    pytun_capture_packet(&tuntap->capture, PYTUN_CAPTURE_OUT, (char*)buf.buf + offset, outlen);
+    PYTUN_END_ALLOW_THREADS(&tuntap->stats)
+    PyBuffer_Release(&buf);
+    if (outlen < 0)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        return NULL;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    return PyLong_FromSsize_t(outlen);
+#else
+    return PyInt_FromSsize_t(outlen);
+#endif
+}
+
+PyDoc_STRVAR(pytun_tuntap_read_into_doc,
+"read_into(buffer, nbytes=0, offset=0) -> number of bytes read.\n\
+Read at most nbytes bytes into the writable buffer, starting at offset.\n\
+If nbytes is 0, read at most as many bytes as there is space left in the\n\
+buffer after offset.");
+
+/* Return 1 if a read() on fd would not block, 0 otherwise. */
+static int pytun_fd_readable(int fd)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+/* Return 1 if fd is in non-blocking mode, 0 otherwise. */
+static int pytun_fd_nonblocking(int fd)
+{
+    int fl;
+
+    fl = fcntl(fd, F_GETFL);
+
+    return fl >= 0 && (fl & O_NONBLOCK);
+}
+
+/* Read up to max packets from fd and store them back-to-back in buf. Each
+   read() is given at most size bytes (or all the space left if size is 0).
+   Only the first read() may block: a non-blocking fd is read until EAGAIN,
+   a blocking one is polled before each subsequent read() and the loop stops
+   as soon as it would block. On return,
+   offsets[0..n] holds the start of each packet followed by the end of the
+   last one. Returns the number of packets read, or -1 with errno set if the
+   first read() failed. Each read() is accounted for in st and the packets
+   are added to cap. Must be called without holding the GIL. */
+static Py_ssize_t pytun_read_batch(int fd, char* buf, size_t buflen, size_t size, Py_ssize_t max,
+                                   Py_ssize_t* offsets, pytun_stats_t* st, pytun_capture_t* cap)
+{
+    Py_ssize_t n = 0;
+    size_t pos = 0;
+    size_t rdlen;
+    ssize_t outlen;
+    int nonblocking = 0;
+
+    offsets[0] = 0;
+    while (n < max && pos < buflen)
+    {
+        rdlen = buflen - pos;
+        if (size != 0)
+        {
+            if (rdlen < size)
+            {
+                break;
+            }
+            rdlen = size;
+        }
+        if (n == 1)
+        {
+            nonblocking = pytun_fd_nonblocking(fd);
+        }
+        if (n > 0 && !nonblocking && !pytun_fd_readable(fd))
+        {
+            break;
+        }
+        outlen = read(fd, buf + pos, rdlen);
+        pytun_stats_read(st, outlen, rdlen);
+        pytun_capture_packet(cap, PYTUN_CAPTURE_OUT, buf + pos, outlen);
+        if (outlen < 0)
+        {
+            if (n == 0 && errno == EAGAIN)
+            {
+                /* Non-blocking fd with nothing to read: not an error */
+                break;
+            }
+            if (n == 0)
+            {
+                return -1;
+            }
+            /* Report the packets already read, the error (other than
+               EAGAIN) will be reported by the next call */
+            break;
+        }
+        pos += outlen;
+        offsets[++n] = pos;
+    }
+
+    return n;
+}
+
+static PyObject* pytun_tuntap_read_many(PyObject* self, PyObject* args)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    Py_ssize_t max_packets;
+    unsigned int size;
+    Py_ssize_t* offsets = NULL;
+    char* arena = NULL;
+    Py_ssize_t n;
+    Py_ssize_t i;
+    PyObject* pkts = NULL;
+    PyObject* pkt;
+    int fd;
+
+    if (!PyArg_ParseTuple(args, "nI:read_many", &max_packets, &size))
+    {
+        return NULL;
+    }
+    if (max_packets <= 0 || size == 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "max_packets and size must be > 0");
+        return NULL;
+    }
+    if ((size_t)max_packets > PY_SSIZE_T_MAX / size)
+    {
+        return PyErr_NoMemory();
+    }
+
+    /* Read all the packets in a single scratch arena, then copy each of them
+       in a string of the right size */
+    arena = PyMem_Malloc(max_packets * size);
+    offsets = PyMem_New(Py_ssize_t, max_packets + 1);
+    if (arena == NULL || offsets == NULL)
+    {
+        PyErr_NoMemory();
+        goto out;
+    }
+
+    PYTUN_BEGIN_ALLOW_THREADS(&tuntap->stats)
+    n = -1;
+    if ((fd = pytun_tuntap_get_fd(tuntap)) >= 0)
+    {
+        n = pytun_read_batch(fd, arena, max_packets * size, size, max_packets, offsets,
+                             &tuntap->stats, &tuntap->capture);
+        pytun_tuntap_put_fd(tuntap);
+    }
+    PYTUN_END_ALLOW_THREADS(&tuntap->stats)
+    if (n < 0)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        goto out;
+    }
+
+    pkts = PyList_New(n);
+    if (pkts == NULL)
+    {
+        goto out;
+    }
+    for (i = 0; i < n; i++)
+    {
+#if PY_MAJOR_VERSION >= 3
+        pkt = PyBytes_FromStringAndSize(arena + offsets[i], offsets[i + 1] - offsets[i]);
+#else
+        pkt = PyString_FromStringAndSize(arena + offsets[i], offsets[i + 1] - offsets[i]);
+#endif
+        if (pkt == NULL)
+        {
+            Py_CLEAR(pkts);
+            goto out;
+        }
+        PyList_SET_ITEM(pkts, i, pkt);
+    }
+
+out:
+    PyMem_Free(offsets);
+    PyMem_Free(arena);
+
+    return pkts;
+}
+
+PyDoc_STRVAR(pytun_tuntap_read_many_doc,
+"read_many(max_packets, size) -> list of strings.\n\
+Read up to max_packets packets of at most size bytes each. Only the first\n\
+read may block, reading stops as soon as the device has no more packets\n\
+pending. An empty list is returned if the device is non-blocking and there\n\
+is nothing to read.");
+
+static PyObject* pytun_tuntap_read_many_into(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    Py_buffer buf;
+    Py_ssize_t max_packets = 0;
+    Py_ssize_t size = 0;
+    char* kwlist[] = {"buffer", "max_packets", "size", NULL};
+    Py_ssize_t* offsets;
+    Py_ssize_t n;
+    Py_ssize_t i;
+    PyObject* res = NULL;
+    PyObject* off;
+    int fd;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "w*|nn:read_many_into", kwlist, &buf, &max_packets, &size))
+    {
+        return NULL;
+    }
+    if (max_packets < 0 || size < 0)
+    {
+        PyBuffer_Release(&buf);
+        PyErr_SetString(PyExc_ValueError, "max_packets and size must be >= 0");
+        return NULL;
+    }
+    /* Don't size the offsets for more packets than the buffer can hold. By
+       default packets are assumed to be at least ETH_HLEN bytes long (a
+       TAP frame header, an IP header is longer): shorter ones, e.g from a
+       socketpair, end the call before the buffer is full. */
+    if (size != 0)
+    {
+        if (max_packets == 0 || max_packets > buf.len / size)
+        {
+            max_packets = buf.len / size;
+        }
+    }
+    else if (max_packets == 0)
+    {
+        max_packets = buf.len / ETH_HLEN + 1;
+    }
+    else if (max_packets > buf.len + 1)
+    {
+        max_packets = buf.len + 1;
+    }
+
+    offsets = PyMem_New(Py_ssize_t, max_packets + 1);
+    if (offsets == NULL)
+    {
+        PyBuffer_Release(&buf);
+        return PyErr_NoMemory();
+    }
+
+    PYTUN_BEGIN_ALLOW_THREADS(&tuntap->stats)
+    n = -1;
+    if ((fd = pytun_tuntap_get_fd(tuntap)) >= 0)
+    {
+        n = pytun_read_batch(fd, buf.buf, buf.len, size, max_packets, offsets,
+                             &tuntap->stats, &tuntap->capture);
+        pytun_tuntap_put_fd(tuntap);
+    }
+    PYTUN_END_ALLOW_THREADS(&tuntap->stats)
+    PyBuffer_Release(&buf);
+    if (n < 0)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        goto out;
+    }
+
+    res = PyList_New(n + 1);
+    if (res == NULL)
+    {
+        goto out;
+    }
+    for (i = 0; i <= n; i++)
+    {
+#if PY_MAJOR_VERSION >= 3
+        off = PyLong_FromSsize_t(offsets[i]);
+#else
+        off = PyInt_FromSsize_t(offsets[i]);
+#endif
+        if (off == NULL)
+        {
+            Py_CLEAR(res);
+            goto out;
+        }
+        PyList_SET_ITEM(res, i, off);
+    }
+
+out:
+    PyMem_Free(offsets);
+
+    return res;
+}
+
+PyDoc_STRVAR(pytun_tuntap_read_many_into_doc,
+"read_many_into(buffer, max_packets=0, size=0) -> list of offsets.\n\
+Read up to max_packets packets and store them back-to-back in the writable\n\
+buffer. Each read is given at most size bytes, or all the space left in the\n\
+buffer if size is 0 (a packet larger than the space it is given is\n\
+truncated). If max_packets is 0, read until the buffer is full or\n\
+the device has no more packets pending, but at most len(buffer) // 14 + 1\n\
+packets if size is 0. The returned list holds the offset of each packet\n\
+followed by the offset of the end of the last one, so packet i is\n\
+buffer[offsets[i]:offsets[i + 1]].");
+
+/* Write len bytes to the device. If try_only is set, return None instead of
+   raising an error or waiting for the shaper if the write would block. */
+static PyObject* pytun_tuntap_do_write(pytun_tuntap_t* tuntap, const char* buf, Py_ssize_t len, int try_only)
+{
+    pytun_tb_t* tb = pytun_tuntap_shaper(tuntap);
+    ssize_t written = -1;
+    int admit;
+    int fd;
+
+    PYTUN_BEGIN_ALLOW_THREADS(&tuntap->stats)
+    if ((fd = pytun_tuntap_get_fd(tuntap)) >= 0)
+    {
+        admit = tb != NULL ? pytun_tb_admit(tb, len, try_only) : 1;
+        if (admit > 0)
+        {
+            written = write(fd, buf, len);
+            pytun_stats_write(&tuntap->stats, written, len);
+            pytun_capture_packet(&tuntap->capture, PYTUN_CAPTURE_IN, buf, written);
+            if (written < 0 && tb != NULL)
+            {
+                pytun_tb_refund(tb, len);
+            }
+        }
+        else
+        {
+            pytun_stats_shaped(&tuntap->stats, admit);
+        }
+        pytun_tuntap_put_fd(tuntap);
+    }
+    PYTUN_END_ALLOW_THREADS(&tuntap->stats)
+    pytun_tb_decref(tb);
+    if (written < 0)
+    {
+        if (try_only && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            Py_RETURN_NONE;
+        }
+        raise_error_from_errno(pytun_state_of(tuntap));
+        return NULL;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    return PyLong_FromSsize_t(written);
+#else
+    return PyInt_FromSsize_t(written);
+#endif
+}
+
+/* Parse the arguments of write() and try_write(): a single string or
+   contiguous buffer, which must be released with PyBuffer_Release() */
+static int pytun_parse_write_args(const char* name, PyObject* const* args, Py_ssize_t nargs, Py_buffer* buf)
+{
+#if PY_MAJOR_VERSION >= 3
+    const char* str;
+    Py_ssize_t len;
+#endif
+
+    if (nargs != 1)
+    {
+        PyErr_Format(PyExc_TypeError, "%s() takes exactly one argument (%zd given)", name, nargs);
+        return -1;
+    }
+#if PY_MAJOR_VERSION >= 3
+    /* Strings are written encoded in UTF-8 */
+    if (PyUnicode_Check(args[0]))
+    {
+        str = PyUnicode_AsUTF8AndSize(args[0], &len);
+        if (str == NULL)
+        {
+            return -1;
+        }
+        return PyBuffer_FillInfo(buf, args[0], (void*)str, len, 1, PyBUF_SIMPLE);
+    }
+
+    return PyObject_GetBuffer(args[0], buf, PyBUF_SIMPLE);
+#else
+    return PyArg_Parse(args[0], "s*", buf) ? 0 : -1;
+#endif
+}
+
+static PyObject* pytun_tuntap_write(PyObject* self, PyObject* const* args, Py_ssize_t nargs)
+{
+    Py_buffer buf;
+    PyObject* res;
+
+    if (pytun_parse_write_args("write", args, nargs, &buf) < 0)
+    {
+        return NULL;
+    }
+    res = pytun_tuntap_do_write((pytun_tuntap_t*)self, buf.buf, buf.len, 0);
+    PyBuffer_Release(&buf);
+
+    return res;
+}
+
+PYTUN_FASTCALL_WRAPPER(pytun_tuntap_write)
+
+PyDoc_STRVAR(pytun_tuntap_write_doc,
+"write(data) -> number of bytes written.\n\
+Write data, a string or any contiguous buffer (bytes, bytearray,\n\
+memoryview...), to device. If the device has a shaper, the write waits\n\
+until it conforms to its rate, and Error is raised with errno ENOBUFS if\n\
+the shaper drops it (counted in the shaped field of stats()).");
+
+static PyObject* pytun_tuntap_try_write(PyObject* self, PyObject* const* args, Py_ssize_t nargs)
+{
+    Py_buffer buf;
+    PyObject* res;
+
+    if (pytun_parse_write_args("try_write", args, nargs, &buf) < 0)
+    {
+        return NULL;
+    }
+    res = pytun_tuntap_do_write((pytun_tuntap_t*)self, buf.buf, buf.len, 1);
+    PyBuffer_Release(&buf);
+
+    return res;
+}
+
+PYTUN_FASTCALL_WRAPPER(pytun_tuntap_try_write)
+
+PyDoc_STRVAR(pytun_tuntap_try_write_doc,
+"try_write(data) -> number of bytes written, or None.\n\
+Same as write() but return None instead of raising an error if the device\n\
+is non-blocking and the write would block, or instead of waiting if the\n\
+shaper of the device doesn't have enough tokens for it.");
+
+/* Write the n packets described by iov to fd, one write() per packet.
+   Returns the number of packets written before the first error, or -1 with
+   errno set if a write() failed before any packet was written. Each write()
+   is accounted for in st and the packets are added to cap. If tb is not
+   NULL, the packets are shaped by tb: the packets it drops are counted as
+   written, accounted for in st and added to *dropped. Must be called
+   without holding the GIL. */
+static Py_ssize_t pytun_write_batch(int fd, const struct iovec* iov, Py_ssize_t n, pytun_stats_t* st,
+                                    pytun_capture_t* cap, pytun_tb_t* tb, Py_ssize_t* dropped)
+{
+    Py_ssize_t i;
+    Py_ssize_t ndropped = 0;
+    ssize_t ret;
+
+    for (i = 0; i < n; i++)
+    {
+        if (tb != NULL && !pytun_tb_admit(tb, iov[i].iov_len, 0))
+        {
+            pytun_stats_shaped(st, 0);
+            (*dropped)++;
+            ndropped++;
+            continue;
+        }
+        ret = write(fd, iov[i].iov_base, iov[i].iov_len);
+        pytun_stats_write(st, ret, iov[i].iov_len);
+        pytun_capture_packet(cap, PYTUN_CAPTURE_IN, iov[i].iov_base, ret);
+        if (ret < 0)
+        {
+            if (tb != NULL)
+            {
+                pytun_tb_refund(tb, iov[i].iov_len);
+            }
+            /* Dropped packets don't hide the error */
+            return i == ndropped ? -1 : i;
+        }
+    }
+
+    return n;
+}
+
+/* Convert a sequence of n + 1 increasing offsets delimiting n packets in a
+   buffer of buflen bytes to a newly allocated array. */
+static Py_ssize_t* pytun_parse_offsets(PyObject* seq, Py_ssize_t buflen, Py_ssize_t* n)
+{
+    PyObject* fast;
+    Py_ssize_t* offsets;
+    Py_ssize_t len;
+    Py_ssize_t i;
+
+    fast = PySequence_Fast(seq, "offsets must be a sequence");
+    if (fast == NULL)
+    {
+        return NULL;
+    }
+    len = PySequence_Fast_GET_SIZE(fast);
+    if (len == 0)
+    {
+        Py_DECREF(fast);
+        PyErr_SetString(PyExc_ValueError, "offsets must not be empty");
+        return NULL;
+    }
+    offsets = PyMem_New(Py_ssize_t, len);
+    if (offsets == NULL)
+    {
+        Py_DECREF(fast);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for (i = 0; i < len; i++)
+    {
+        offsets[i] = PyNumber_AsSsize_t(PySequence_Fast_GET_ITEM(fast, i), PyExc_OverflowError);
+        if (offsets[i] == -1 && PyErr_Occurred())
+        {
+            goto error;
+        }
+        if (offsets[i] < (i > 0 ? offsets[i - 1] : 0) || offsets[i] > buflen)
+        {
+            PyErr_SetString(PyExc_ValueError, "offsets must be increasing and lie within the buffer");
+            goto error;
+        }
+    }
+    Py_DECREF(fast);
+    *n = len - 1;
+
+    return offsets;
+
+error:
+    Py_DECREF(fast);
+    PyMem_Free(offsets);
+
+    return NULL;
+}
+
+static PyObject* pytun_tuntap_write_many(PyObject* self, PyObject* args)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    PyObject* packets;
+    PyObject* offsets_seq = NULL;
+    PyObject* fast = NULL;
+    Py_buffer* bufs = NULL;
+    Py_ssize_t nbufs = 0;
+    Py_ssize_t* offsets = NULL;
+    struct iovec* iov = NULL;
+    Py_ssize_t n = 0;
+    Py_ssize_t written;
+    Py_ssize_t dropped = 0;
+    pytun_tb_t* tb;
+    Py_ssize_t i;
+    PyObject* res = NULL;
+    int fd;
+
+    if (!PyArg_ParseTuple(args, "O|O:write_many", &packets, &offsets_seq))
+    {
+        return NULL;
+    }
+
+    if (offsets_seq != NULL)
+    {
+        /* A single buffer holding the packets back-to-back */
+        bufs = PyMem_New(Py_buffer, 1);
+        if (bufs == NULL)
+        {
+            PyErr_NoMemory();
+            goto out;
+        }
+        if (PyObject_GetBuffer(packets, &bufs[0], PyBUF_SIMPLE) < 0)
+        {
+            goto out;
+        }
+        nbufs = 1;
+        offsets = pytun_parse_offsets(offsets_seq, bufs[0].len, &n);
+        if (offsets == NULL)
+        {
+            goto out;
+        }
+        iov = PyMem_New(struct iovec, n > 0 ? n : 1);
+        if (iov == NULL)
+        {
+            PyErr_NoMemory();
+            goto out;
+        }
+        for (i = 0; i < n; i++)
+        {
+            iov[i].iov_base = (char*)bufs[0].buf + offsets[i];
+            iov[i].iov_len = offsets[i + 1] - offsets[i];
+        }
+    }
+    else
+    {
+        /* An iterable of packets, pin all of them before writing */
+        fast = PySequence_Fast(packets, "packets must be an iterable");
+        if (fast == NULL)
+        {
+            goto out;
+        }
+        n = PySequence_Fast_GET_SIZE(fast);
+        bufs = PyMem_New(Py_buffer, n > 0 ? n : 1);
+        iov = PyMem_New(struct iovec, n > 0 ? n : 1);
+        if (bufs == NULL || iov == NULL)
+        {
+            PyErr_NoMemory();
+            goto out;
+        }
+        for (i = 0; i < n; i++)
+        {
+            if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(fast, i), &bufs[i], PyBUF_SIMPLE) < 0)
+            {
+                goto out;
+            }
+            nbufs++;
+            iov[i].iov_base = bufs[i].buf;
+            iov[i].iov_len = bufs[i].len;
+        }
+    }
+
+    if (n == 0)
+    {
+        written = 0;
+    }
+    else
+    {
+        tb = pytun_tuntap_shaper(tuntap);
+        PYTUN_BEGIN_ALLOW_THREADS(&tuntap->stats)
+        written = -1;
+        if ((fd = pytun_tuntap_get_fd(tuntap)) >= 0)
+        {
+            written = pytun_write_batch(fd, iov, n, &tuntap->stats, &tuntap->capture, tb, &dropped);
+            pytun_tuntap_put_fd(tuntap);
+        }
+        PYTUN_END_ALLOW_THREADS(&tuntap->stats)
+        pytun_tb_decref(tb);
+        if (written < 0)
+        {
+            raise_error_from_errno(pytun_state_of(self));
+            goto out;
+        }
+        written -= dropped;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    res = PyLong_FromSsize_t(written);
+#else
+    res = PyInt_FromSsize_t(written);
+#endif
+
+out:
+    for (i = 0; i < nbufs; i++)
+    {
+        PyBuffer_Release(&bufs[i]);
+    }
+    PyMem_Free(bufs);
+    PyMem_Free(iov);
+    PyMem_Free(offsets);
+    Py_XDECREF(fast);
+
+    return res;
+}
+
+PyDoc_STRVAR(pytun_tuntap_write_many_doc,
+"write_many(packets) -> number of packets written.\n\
+write_many(buffer, offsets) -> number of packets written.\n\
+Write each packet of the iterable packets to device, or each packet stored\n\
+back-to-back in buffer as delimited by offsets (see read_many_into()).\n\
+All the packets are written with a single release of the GIL. If a write\n\
+fails, the number of packets written before the failure is returned, the\n\
+error is only raised if the first write fails. Packets dropped by the\n\
+shaper of the device are not counted.");
+
+static PyObject* pytun_tuntap_fileno(PyObject* self)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    int fd = pytun_tuntap_closed(tuntap) ? -1 : tuntap->fd;
+
+#if PY_MAJOR_VERSION >= 3
+    return PyLong_FromLong(fd);
+#else
+    return PyInt_FromLong(fd);
+#endif
+}
+
+PyDoc_STRVAR(pytun_tuntap_fileno_doc,
+"fileno() -> integer \"file descriptor\".");
+
+static PyObject* pytun_tuntap_persist(PyObject* self, PyObject* args)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    PyObject* tmp = NULL;
+    int persist;
+    int ret;
+
+    if (!PyArg_ParseTuple(args, "|O!:persist", &PyBool_Type, &tmp))
+    {
+        return NULL;
+    }
+
+    if (tmp == NULL || tmp == Py_True)
+    {
+        persist = 1;
+    }
+    else
+    {
+        persist = 0;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = pytun_tuntap_fd_ioctl(tuntap, TUNSETPERSIST, persist);
+    Py_END_ALLOW_THREADS
+    if (ret < 0)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pytun_tuntap_persist_doc,
+"persist(flag) -> None.\n\
+Make the TUN/TAP persistent if flags is True else\n\
+make it non-persistent.");
+
+#ifdef IFF_MULTI_QUEUE
+static PyObject* pytun_tuntap_mq_attach(PyObject* self, PyObject* args)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    PyObject* tmp = NULL;
+    struct ifreq req;
+    int ret;
+
+    if (!PyArg_ParseTuple(args, "|O!:attach", &PyBool_Type, &tmp))
+    {
+        return NULL;
+    }
+
+    memset(&req, 0, sizeof(req));
+    if (tmp == NULL || tmp == Py_True)
+    {
+        req.ifr_flags = IFF_ATTACH_QUEUE;
+    }
+    else
     {
         req.ifr_flags = IFF_DETACH_QUEUE;
     }
 
     Py_BEGIN_ALLOW_THREADS
-    ret = ioctl(tuntap->fd, TUNSETQUEUE, &req);
+    ret = pytun_tuntap_fd_ioctl(tuntap, TUNSETQUEUE, (unsigned long)&req);
+    Py_END_ALLOW_THREADS
+    if (ret < 0)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pytun_tuntap_mq_attach_doc,
+"mq_attach(flag) -> None.\n\
+Enable the queue if flags is True else\n\
+disable the queue.");
+#endif
+
+static PyObject* pytun_tuntap_set_offload(PyObject* self, PyObject* args)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    unsigned int offload;
+    int ret;
+
+    if (!PyArg_ParseTuple(args, "I:set_offload", &offload))
+    {
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = pytun_tuntap_fd_ioctl(tuntap, TUNSETOFFLOAD, offload);
+    Py_END_ALLOW_THREADS
+    if (ret < 0)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pytun_tuntap_set_offload_doc,
+"set_offload(flags) -> None.\n\
+Set the offloads (a combination of TUN_F_* flags) the reader of the device\n\
+is able to handle. With TUN_F_TSO4/TUN_F_TSO6 the kernel may hand over TCP\n\
+packets of up to 64 KiB described by their vnet header.");
+
+/* Convert a classic BPF program, either a buffer of struct sock_filter or
+   a sequence of (code, jt, jf, k) tuples, to a newly allocated array */
+static struct sock_filter* pytun_bpf_program(pytun_state_t* state, PyObject* obj, unsigned short* len)
+{
+    struct sock_filter* insns;
+    Py_buffer buf;
+    PyObject* seq;
+    PyObject* item;
+    Py_ssize_t n;
+    Py_ssize_t i;
+    unsigned int code;
+    unsigned int jt;
+    unsigned int jf;
+    unsigned int k;
+
+    if (PyObject_CheckBuffer(obj))
+    {
+        if (PyObject_GetBuffer(obj, &buf, PyBUF_SIMPLE) < 0)
+        {
+            return NULL;
+        }
+        n = buf.len / sizeof(struct sock_filter);
+        if (buf.len % sizeof(struct sock_filter) != 0 || n == 0 || n > BPF_MAXINSNS)
+        {
+            PyBuffer_Release(&buf);
+            raise_error(state, "Bad BPF program");
+            return NULL;
+        }
+        insns = PyMem_New(struct sock_filter, n);
+        if (insns == NULL)
+        {
+            PyBuffer_Release(&buf);
+            PyErr_NoMemory();
+            return NULL;
+        }
+        memcpy(insns, buf.buf, buf.len);
+        PyBuffer_Release(&buf);
+        *len = n;
+        return insns;
+    }
+
+    seq = PySequence_Fast(obj, "program must be a buffer or a sequence of (code, jt, jf, k) tuples");
+    if (seq == NULL)
+    {
+        return NULL;
+    }
+    n = PySequence_Fast_GET_SIZE(seq);
+    if (n == 0 || n > BPF_MAXINSNS)
+    {
+        Py_DECREF(seq);
+        raise_error(state, "Bad BPF program");
+        return NULL;
+    }
+    insns = PyMem_New(struct sock_filter, n);
+    if (insns == NULL)
+    {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for (i = 0; i < n; i++)
+    {
+        item = PySequence_Fast_GET_ITEM(seq, i);
+        if (!PyArg_ParseTuple(item, "IIII:BPF instruction", &code, &jt, &jf, &k))
+        {
+            PyMem_Free(insns);
+            Py_DECREF(seq);
+            return NULL;
+        }
+        insns[i].code = code;
+        insns[i].jt = jt;
+        insns[i].jf = jf;
+        insns[i].k = k;
+    }
+    Py_DECREF(seq);
+    *len = n;
+
+    return insns;
+}
+
+#ifdef PYTUN_HAVE_EBPF
+/* Classic BPF to eBPF translation: A is kept in R0, X in R7 and the scratch
+   memory on the stack, R6 holds the skb as needed by the LD_ABS/LD_IND
+   instructions */
+#define PYTUN_EBPF_A BPF_REG_0
+#define PYTUN_EBPF_X BPF_REG_7
+#define PYTUN_EBPF_CTX BPF_REG_6
+#define PYTUN_EBPF_TMP BPF_REG_8
+#define PYTUN_EBPF_MEM(k) ((short)(-(int)(BPF_MEMWORDS - (k)) * 4))
+
+static void pytun_ebpf_emit(struct bpf_insn* out, unsigned int* n, unsigned char code,
+                            unsigned char dst, unsigned char src, short off, int imm)
+{
+    if (out != NULL)
+    {
+        out[*n].code = code;
+        out[*n].dst_reg = dst;
+        out[*n].src_reg = src;
+        out[*n].off = off;
+        out[*n].imm = imm;
+    }
+    (*n)++;
+}
+
+/* Translate a classic BPF program to an eBPF socket filter program, much
+   like the kernel does for SO_ATTACH_FILTER. It is called a first time with
+   out set to NULL to compute the index of each classic instruction in map,
+   then a second time to emit the code. Return the number of eBPF
+   instructions or -1 if the program is invalid */
+static int pytun_bpf_convert(const struct sock_filter* prog, unsigned int len,
+                             struct bpf_insn* out, unsigned int* map)
+{
+    const struct sock_filter* f;
+    unsigned int n = 0;
+    unsigned int i;
+    unsigned int t1;
+    unsigned int t2;
+    unsigned char dst;
+    unsigned char op;
+
+    if (BPF_CLASS(prog[len - 1].code) != BPF_RET)
+    {
+        return -1;
+    }
+    pytun_ebpf_emit(out, &n, BPF_ALU64 | BPF_MOV | BPF_X, PYTUN_EBPF_CTX, BPF_REG_1, 0, 0);
+    pytun_ebpf_emit(out, &n, BPF_ALU | BPF_MOV | BPF_K, PYTUN_EBPF_A, 0, 0, 0);
+    pytun_ebpf_emit(out, &n, BPF_ALU | BPF_MOV | BPF_K, PYTUN_EBPF_X, 0, 0, 0);
+    for (i = 0; i < BPF_MEMWORDS; i++)
+    {
+        pytun_ebpf_emit(out, &n, BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, PYTUN_EBPF_MEM(i), 0);
+    }
+
+#define PYTUN_EBPF_OFF(t) ((short)(out != NULL ? (int)map[t] - (int)(n + 1) : 0))
+    for (i = 0; i < len; i++)
+    {
+        f = &prog[i];
+        map[i] = n;
+        op = BPF_OP(f->code);
+        switch (BPF_CLASS(f->code))
+        {
+        case BPF_LD:
+        case BPF_LDX:
+            dst = BPF_CLASS(f->code) == BPF_LD ? PYTUN_EBPF_A : PYTUN_EBPF_X;
+            switch (BPF_MODE(f->code))
+            {
+            case BPF_ABS:
+            case BPF_IND:
+                if (BPF_CLASS(f->code) != BPF_LD)
+                {
+                    return -1;
+                }
+                pytun_ebpf_emit(out, &n, f->code, 0,
+                                BPF_MODE(f->code) == BPF_IND ? PYTUN_EBPF_X : 0, 0, f->k);
+                break;
+            case BPF_LEN:
+                pytun_ebpf_emit(out, &n, BPF_LDX | BPF_MEM | BPF_W, dst, PYTUN_EBPF_CTX,
+                                offsetof(struct __sk_buff, len), 0);
+                break;
+            case BPF_IMM:
+                pytun_ebpf_emit(out, &n, BPF_ALU | BPF_MOV | BPF_K, dst, 0, 0, f->k);
+                break;
+            case BPF_MEM:
+                if (f->k >= BPF_MEMWORDS)
+                {
+                    return -1;
+                }
+                pytun_ebpf_emit(out, &n, BPF_LDX | BPF_MEM | BPF_W, dst, BPF_REG_10,
+                                PYTUN_EBPF_MEM(f->k), 0);
+                break;
+            case BPF_MSH:
+                /* X = (pkt[k] & 0xf) << 2, A is preserved */
+                if (BPF_CLASS(f->code) != BPF_LDX)
+                {
+                    return -1;
+                }
+                pytun_ebpf_emit(out, &n, BPF_ALU64 | BPF_MOV | BPF_X, PYTUN_EBPF_TMP, PYTUN_EBPF_A, 0, 0);
+                pytun_ebpf_emit(out, &n, BPF_LD | BPF_B | BPF_ABS, 0, 0, 0, f->k);
+                pytun_ebpf_emit(out, &n, BPF_ALU | BPF_AND | BPF_K, PYTUN_EBPF_A, 0, 0, 0xf);
+                pytun_ebpf_emit(out, &n, BPF_ALU | BPF_LSH | BPF_K, PYTUN_EBPF_A, 0, 0, 2);
+                pytun_ebpf_emit(out, &n, BPF_ALU | BPF_MOV | BPF_X, PYTUN_EBPF_X, PYTUN_EBPF_A, 0, 0);
+                pytun_ebpf_emit(out, &n, BPF_ALU64 | BPF_MOV | BPF_X, PYTUN_EBPF_A, PYTUN_EBPF_TMP, 0, 0);
+                break;
+            default:
+                return -1;
+            }
+            break;
+        case BPF_ST:
+        case BPF_STX:
+            if (f->k >= BPF_MEMWORDS)
+            {
+                return -1;
+            }
+            pytun_ebpf_emit(out, &n, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10,
+                            BPF_CLASS(f->code) == BPF_ST ? PYTUN_EBPF_A : PYTUN_EBPF_X,
+                            PYTUN_EBPF_MEM(f->k), 0);
+            break;
+        case BPF_ALU:
+            if (op > BPF_XOR)
+            {
+                return -1;
+            }
+            if (op == BPF_NEG)
+            {
+                pytun_ebpf_emit(out, &n, BPF_ALU | BPF_NEG, PYTUN_EBPF_A, 0, 0, 0);
+            }
+            else if (BPF_SRC(f->code) == BPF_X)
+            {
+                if (op == BPF_DIV || op == BPF_MOD)
+                {
+                    /* Division by zero rejects the packet */
+                    pytun_ebpf_emit(out, &n, BPF_JMP | BPF_JNE | BPF_K, PYTUN_EBPF_X, 0, 2, 0);
+                    pytun_ebpf_emit(out, &n, BPF_ALU | BPF_MOV | BPF_K, PYTUN_EBPF_A, 0, 0, 0);
+                    pytun_ebpf_emit(out, &n, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+                }
+                pytun_ebpf_emit(out, &n, BPF_ALU | op | BPF_X, PYTUN_EBPF_A, PYTUN_EBPF_X, 0, 0);
+            }
+            else
+            {
+                if ((op == BPF_DIV || op == BPF_MOD) && f->k == 0)
+                {
+                    return -1;
+                }
+                pytun_ebpf_emit(out, &n, BPF_ALU | op | BPF_K, PYTUN_EBPF_A, 0, 0, f->k);
+            }
+            break;
+        case BPF_JMP:
+            if (op == BPF_JA)
+            {
+                t1 = i + 1 + f->k;
+                if (t1 >= len)
+                {
+                    return -1;
+                }
+                pytun_ebpf_emit(out, &n, BPF_JMP | BPF_JA, 0, 0, PYTUN_EBPF_OFF(t1), 0);
+                break;
+            }
+            if (op != BPF_JEQ && op != BPF_JGT && op != BPF_JGE && op != BPF_JSET)
+            {
+                return -1;
+            }
+            t1 = i + 1 + f->jt;
+            t2 = i + 1 + f->jf;
+            if (t1 >= len || t2 >= len)
+            {
+                return -1;
+            }
+            if (BPF_SRC(f->code) == BPF_X)
+            {
+                pytun_ebpf_emit(out, &n, BPF_JMP | op | BPF_X, PYTUN_EBPF_A, PYTUN_EBPF_X, PYTUN_EBPF_OFF(t1), 0);
+            }
+            else if (f->k & 0x80000000)
+            {
+                /* The immediate would be sign extended to 64 bits */
+                pytun_ebpf_emit(out, &n, BPF_ALU | BPF_MOV | BPF_K, PYTUN_EBPF_TMP, 0, 0, f->k);
+                pytun_ebpf_emit(out, &n, BPF_JMP | op | BPF_X, PYTUN_EBPF_A, PYTUN_EBPF_TMP, PYTUN_EBPF_OFF(t1), 0);
+            }
+            else
+            {
+                pytun_ebpf_emit(out, &n, BPF_JMP | op | BPF_K, PYTUN_EBPF_A, 0, PYTUN_EBPF_OFF(t1), f->k);
+            }
+            if (f->jf != 0)
+            {
+                pytun_ebpf_emit(out, &n, BPF_JMP | BPF_JA, 0, 0, PYTUN_EBPF_OFF(t2), 0);
+            }
+            break;
+        case BPF_RET:
+            if (BPF_RVAL(f->code) == BPF_K)
+            {
+                pytun_ebpf_emit(out, &n, BPF_ALU | BPF_MOV | BPF_K, PYTUN_EBPF_A, 0, 0, f->k);
+            }
+            else if (BPF_RVAL(f->code) != BPF_A)
+            {
+                return -1;
+            }
+            pytun_ebpf_emit(out, &n, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+            break;
+        case BPF_MISC:
+            if (BPF_MISCOP(f->code) == BPF_TAX)
+            {
+                pytun_ebpf_emit(out, &n, BPF_ALU | BPF_MOV | BPF_X, PYTUN_EBPF_X, PYTUN_EBPF_A, 0, 0);
+            }
+            else
+            {
+                pytun_ebpf_emit(out, &n, BPF_ALU | BPF_MOV | BPF_X, PYTUN_EBPF_A, PYTUN_EBPF_X, 0, 0);
+            }
+            break;
+        default:
+            return -1;
+        }
+    }
+#undef PYTUN_EBPF_OFF
+
+    return n;
+}
+
+/* Load a classic BPF program as an eBPF socket filter, return its fd */
+static int pytun_bpf_load(pytun_state_t* state, const struct sock_filter* prog, unsigned int len)
+{
+    union bpf_attr attr;
+    struct bpf_insn* insns = NULL;
+    unsigned int* map;
+    int n;
+    int fd = -1;
+
+    map = PyMem_New(unsigned int, len);
+    if (map == NULL)
+    {
+        PyErr_NoMemory();
+        return -1;
+    }
+    n = pytun_bpf_convert(prog, len, NULL, map);
+    if (n < 0)
+    {
+        raise_error(state, "Bad BPF program");
+        goto out;
+    }
+    insns = PyMem_New(struct bpf_insn, n);
+    if (insns == NULL)
+    {
+        PyErr_NoMemory();
+        goto out;
+    }
+    pytun_bpf_convert(prog, len, insns, map);
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+    attr.insn_cnt = n;
+    attr.insns = (uintptr_t)insns;
+    attr.license = (uintptr_t)"GPL";
+    Py_BEGIN_ALLOW_THREADS
+    fd = syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+    Py_END_ALLOW_THREADS
+    if (fd < 0)
+    {
+        raise_error_from_errno(state);
+    }
+
+out:
+    PyMem_Free(insns);
+    PyMem_Free(map);
+
+    return fd;
+}
+#endif
+
+static PyObject* pytun_tuntap_attach_filter(PyObject* self, PyObject* args)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    PyObject* program;
+    struct sock_fprog fprog;
+    int ret;
+
+    if (!PyArg_ParseTuple(args, "O:attach_filter", &program))
+    {
+        return NULL;
+    }
+    fprog.filter = pytun_bpf_program(pytun_state_of(self), program, &fprog.len);
+    if (fprog.filter == NULL)
+    {
+        return NULL;
+    }
+
+    if (tuntap->flags & IFF_TAP)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        ret = pytun_tuntap_fd_ioctl(tuntap, TUNATTACHFILTER, (unsigned long)&fprog);
+        Py_END_ALLOW_THREADS
+    }
+    else
+    {
+#ifdef PYTUN_HAVE_EBPF
+        /* The kernel only runs classic filters on TAP devices */
+        int prog_fd = pytun_bpf_load(pytun_state_of(self), fprog.filter, fprog.len);
+        if (prog_fd < 0)
+        {
+            PyMem_Free(fprog.filter);
+            return NULL;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        ret = pytun_tuntap_fd_ioctl(tuntap, TUNSETFILTEREBPF, (unsigned long)&prog_fd);
+        close(prog_fd);
+        Py_END_ALLOW_THREADS
+#else
+        ret = -1;
+        errno = EINVAL;
+#endif
+    }
+    PyMem_Free(fprog.filter);
+    if (ret < 0)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pytun_tuntap_attach_filter_doc,
+"attach_filter(program) -> None.\n\
+Attach a classic BPF program to the device, either a buffer of struct\n\
+sock_filter (as returned by compile_filter()) or a sequence of (code, jt,\n\
+jf, k) tuples (as printed by tcpdump -ddd). Packets rejected by the program\n\
+are dropped by the kernel instead of being queued for reading. The program\n\
+sees packets without the tun_pi prefix, starting at the IP header for TUN\n\
+devices and at the Ethernet header for TAP devices. As the kernel only runs\n\
+classic programs on TAP devices, the program of a TUN device is translated\n\
+to eBPF and replaces the one set with set_filter_ebpf().");
+
+static PyObject* pytun_tuntap_detach_filter(PyObject* self)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    struct sock_fprog fprog;
+    int ret;
+
+    if (tuntap->flags & IFF_TAP)
+    {
+        memset(&fprog, 0, sizeof(fprog));
+        Py_BEGIN_ALLOW_THREADS
+        ret = pytun_tuntap_fd_ioctl(tuntap, TUNDETACHFILTER, (unsigned long)&fprog);
+        Py_END_ALLOW_THREADS
+    }
+    else
+    {
+#ifdef PYTUN_HAVE_EBPF
+        int prog_fd = -1;
+        Py_BEGIN_ALLOW_THREADS
+        ret = pytun_tuntap_fd_ioctl(tuntap, TUNSETFILTEREBPF, (unsigned long)&prog_fd);
+        Py_END_ALLOW_THREADS
+#else
+        ret = -1;
+        errno = EINVAL;
+#endif
+    }
+    if (ret < 0)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pytun_tuntap_detach_filter_doc,
+"detach_filter() -> None.\n\
+Detach the classic BPF program attached with attach_filter().");
+
+#if defined(TUNSETFILTEREBPF) || defined(TUNSETSTEERINGEBPF)
+static PyObject* pytun_tuntap_set_ebpf(PyObject* self, PyObject* args, unsigned long cmd, const char* fmt)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    int prog_fd;
+    int ret;
+
+    if (!PyArg_ParseTuple(args, fmt, &prog_fd))
+    {
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = pytun_tuntap_fd_ioctl(tuntap, cmd, (unsigned long)&prog_fd);
+    Py_END_ALLOW_THREADS
+    if (ret < 0)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+#endif
+
+#ifdef TUNSETFILTEREBPF
+static PyObject* pytun_tuntap_set_filter_ebpf(PyObject* self, PyObject* args)
+{
+    return pytun_tuntap_set_ebpf(self, args, TUNSETFILTEREBPF, "i:set_filter_ebpf");
+}
+
+PyDoc_STRVAR(pytun_tuntap_set_filter_ebpf_doc,
+"set_filter_ebpf(prog_fd) -> None.\n\
+Attach the eBPF socket filter program prog_fd (e.g loaded with libbpf) to\n\
+the device, it is shared by all the queues. Use -1 to detach it.");
+#endif
+
+#ifdef TUNSETSTEERINGEBPF
+static PyObject* pytun_tuntap_set_steering_ebpf(PyObject* self, PyObject* args)
+{
+    return pytun_tuntap_set_ebpf(self, args, TUNSETSTEERINGEBPF, "i:set_steering_ebpf");
+}
+
+PyDoc_STRVAR(pytun_tuntap_set_steering_ebpf_doc,
+"set_steering_ebpf(prog_fd) -> None.\n\
+Select the queue of each packet of a multi-queue device with the eBPF\n\
+socket filter program prog_fd, its return value modulo the number of\n\
+queues being the index of the queue. Use -1 to go back to the default flow\n\
+hash steering.");
+#endif
+
+static PyStructSequence_Field pytun_stats_fields[] =
+{
+    {"reads", "read operations"},
+    {"rx_packets", "packets read"},
+    {"rx_bytes", "bytes read"},
+    {"writes", "write operations"},
+    {"tx_packets", "packets written"},
+    {"tx_bytes", "bytes written"},
+    {"eagain", "reads and writes which would have blocked"},
+    {"truncated_reads", "reads which filled the whole buffer, the packet may have been truncated"},
+    {"short_writes", "writes of less bytes than requested"},
+    {"read_errors", "failed reads"},
+    {"write_errors", "failed writes"},
+    {"nogil_ns", "nanoseconds spent in reads and writes with the GIL released"},
+    {"shaped", "packets dropped by the shaper of the device"},
+    {NULL, NULL}
+};
+
+/* The fields of pytun_stats_t, in the order of pytun_stats_fields */
+#define PYTUN_STATS_FIELDS (sizeof(pytun_stats_t) / sizeof(unsigned PY_LONG_LONG))
+
+static PyStructSequence_Desc pytun_stats_desc =
+{
+    "pytun.DeviceStats",
+    "Datapath counters of a device.",
+    pytun_stats_fields,
+    PYTUN_STATS_FIELDS
+};
+
+static PyObject* pytun_tuntap_stats(PyObject* self)
+{
+    const unsigned PY_LONG_LONG* values = (const unsigned PY_LONG_LONG*)&((pytun_tuntap_t*)self)->stats;
+    PyObject* res;
+    PyObject* value;
+    size_t i;
+
+    res = PyStructSequence_New(pytun_state_of(self)->stats_type);
+    if (res == NULL)
+    {
+        return NULL;
+    }
+    for (i = 0; i < PYTUN_STATS_FIELDS; i++)
+    {
+        value = PyLong_FromUnsignedLongLong(PYTUN_STAT_LOAD(values[i]));
+        if (value == NULL)
+        {
+            Py_DECREF(res);
+            return NULL;
+        }
+        PyStructSequence_SET_ITEM(res, i, value);
+    }
+
+    return res;
+}
+
+PyDoc_STRVAR(pytun_tuntap_stats_doc,
+"stats() -> DeviceStats.\n\
+Return the counters of the reads and writes made on this device object,\n\
+including those made by batch methods, rings, pollers, relays and io_uring\n\
+backends using it.");
+
+static PyObject* pytun_tuntap_reset_stats(PyObject* self)
+{
+    unsigned PY_LONG_LONG* values = (unsigned PY_LONG_LONG*)&((pytun_tuntap_t*)self)->stats;
+    size_t i;
+
+    for (i = 0; i < PYTUN_STATS_FIELDS; i++)
+    {
+        __atomic_store_n(&values[i], 0, __ATOMIC_RELAXED);
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pytun_tuntap_reset_stats_doc,
+"reset_stats() -> None.\n\
+Reset the counters returned by stats().");
+
+static PyObject* pytun_tuntap_kernel_stats(PyObject* self)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    const unsigned PY_LONG_LONG* values = (const unsigned PY_LONG_LONG*)&tuntap->stats;
+    char path[sizeof("/sys/class/net//statistics/") + IFNAMSIZ + 256];
+    char key[sizeof("kernel_") + 256];
+    char line[32];
+    char name[IFNAMSIZ];
+    DIR* dir;
+    struct dirent* entry;
+    FILE* f;
+    PyObject* res;
+    PyObject* value;
+    size_t i;
+    int ok;
+
+    res = PyDict_New();
+    if (res == NULL)
+    {
+        return NULL;
+    }
+    for (i = 0; i < PYTUN_STATS_FIELDS; i++)
+    {
+        value = PyLong_FromUnsignedLongLong(PYTUN_STAT_LOAD(values[i]));
+        if (value == NULL || PyDict_SetItemString(res, pytun_stats_fields[i].name, value) < 0)
+        {
+            Py_XDECREF(value);
+            Py_DECREF(res);
+            return NULL;
+        }
+        Py_DECREF(value);
+    }
+
+    pytun_tuntap_refresh_name(tuntap);
+    pytun_tuntap_name(tuntap, name);
+    snprintf(path, sizeof(path), "/sys/class/net/%s/statistics", name);
+    dir = opendir(path);
+    if (dir == NULL)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        Py_DECREF(res);
+        return NULL;
+    }
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/%s", name, entry->d_name);
+        f = fopen(path, "r");
+        if (f == NULL)
+        {
+            continue;
+        }
+        ok = fgets(line, sizeof(line), f) != NULL;
+        fclose(f);
+        if (!ok)
+        {
+            continue;
+        }
+        snprintf(key, sizeof(key), "kernel_%s", entry->d_name);
+        value = PyLong_FromUnsignedLongLong(strtoull(line, NULL, 10));
+        if (value == NULL || PyDict_SetItemString(res, key, value) < 0)
+        {
+            Py_XDECREF(value);
+            Py_DECREF(res);
+            closedir(dir);
+            return NULL;
+        }
+        Py_DECREF(value);
+    }
+    closedir(dir);
+
+    return res;
+}
+
+PyDoc_STRVAR(pytun_tuntap_kernel_stats_doc,
+"kernel_stats() -> dict.\n\
+Return the counters of stats() along with those kept by the kernel for the\n\
+device in /sys/class/net/<name>/statistics, prefixed with kernel_. As seen\n\
+from the kernel, packets read from the device are transmitted:\n\
+kernel_tx_dropped counts the packets dropped because the queue of the\n\
+device was full, i.e because they were not read fast enough.");
+
+static PyObject* pytun_tuntap_start_capture(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    pytun_capture_t* cap = &tuntap->capture;
+    const char* path;
+    unsigned int snaplen = 65535;
+    Py_ssize_t ring_bytes = 64 << 20;
+    char* kwlist[] = {"path", "snaplen", "ring_bytes", NULL};
+    char name[IFNAMSIZ];
+    size_t namelen;
+    size_t idblen;
+    size_t start;
+    size_t size;
+    char* map = MAP_FAILED;
+    char* p;
+    int fd;
+    int busy;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|In:start_capture", kwlist, &path, &snaplen, &ring_bytes))
+    {
+        return NULL;
+    }
+    if (snaplen == 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "snaplen must be positive");
+        return NULL;
+    }
+    /* Claim the capture, the other callers fail until it is started or
+       given up */
+    pthread_mutex_lock(&cap->lock);
+    busy = cap->active || cap->starting;
+    if (!busy)
+    {
+        cap->starting = 1;
+    }
+    pthread_mutex_unlock(&cap->lock);
+    if (busy)
+    {
+        raise_error(pytun_state_of(self), "Capture already started");
+        return NULL;
+    }
+
+    /* Section header block, then the interface description block with the
+       if_name and if_tsresol (nanoseconds) options */
+    pytun_tuntap_refresh_name(tuntap);
+    pytun_tuntap_name(tuntap, name);
+    namelen = strlen(name);
+    idblen = 20 + (namelen ? 4 + PYTUN_PCAPNG_PAD(namelen) : 0) + 8 + 4;
+    start = 28 + idblen;
+    size = (size_t)ring_bytes & ~(size_t)3;
+    if (ring_bytes < 0 || size < start + PYTUN_PCAPNG_EPB_SIZE(0) + PYTUN_PCAPNG_MIN_BLOCK)
+    {
+        PyErr_SetString(PyExc_ValueError, "ring_bytes is too small");
+        goto error;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0 && ftruncate(fd, size) == 0)
+    {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    }
+    Py_END_ALLOW_THREADS
+    if (map == MAP_FAILED)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        goto error;
+    }
+
+    p = map;
+    pytun_capture_put32(p, PYTUN_PCAPNG_SHB);
+    pytun_capture_put32(p + 4, 28);
+    pytun_capture_put32(p + 8, 0x1A2B3C4D);
+    pytun_capture_put16(p + 12, 1);
+    pytun_capture_put16(p + 14, 0);
+    pytun_capture_put32(p + 16, 0xffffffff);
+    pytun_capture_put32(p + 20, 0xffffffff);
+    pytun_capture_put32(p + 24, 28);
+    p += 28;
+    pytun_capture_put32(p, PYTUN_PCAPNG_IDB);
+    pytun_capture_put32(p + 4, idblen);
+    /* LINKTYPE_ETHERNET or LINKTYPE_RAW */
+    pytun_capture_put16(p + 8, (tuntap->flags & IFF_TAP) ? 1 : 101);
+    pytun_capture_put16(p + 10, 0);
+    pytun_capture_put32(p + 12, snaplen);
+    p += 16;
+    if (namelen)
+    {
+        pytun_capture_put16(p, 2);
+        pytun_capture_put16(p + 2, namelen);
+        memset(p + 4, 0, PYTUN_PCAPNG_PAD(namelen));
+        memcpy(p + 4, name, namelen);
+        p += 4 + PYTUN_PCAPNG_PAD(namelen);
+    }
+    pytun_capture_put16(p, 9);
+    pytun_capture_put16(p + 2, 1);
+    pytun_capture_put32(p + 4, 0);
+    p[4] = 9;
+    pytun_capture_put32(p + 8, 0);
+    pytun_capture_put32(p + 12, idblen);
+
+    pthread_mutex_lock(&cap->lock);
+    cap->fd = fd;
+    cap->map = map;
+    cap->size = size;
+    cap->snaplen = snaplen;
+    cap->skip = ((tuntap->flags & IFF_NO_PI) ? 0 : sizeof(struct tun_pi)) +
+                ((tuntap->flags & IFF_VNET_HDR) ? tuntap->vnet_hdr_sz : 0);
+    cap->start = cap->head = cap->tail = cap->end = start;
+    cap->wrapped = 0;
+    cap->packets = cap->bytes = cap->overwritten = cap->dropped = 0;
+    pytun_capture_skip_block(cap, start, size - start);
+    cap->starting = 0;
+    __atomic_store_n(&cap->active, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&cap->lock);
+
+    Py_RETURN_NONE;
+
+error:
+    pthread_mutex_lock(&cap->lock);
+    cap->starting = 0;
+    pthread_mutex_unlock(&cap->lock);
+
+    return NULL;
+}
+
+PyDoc_STRVAR(pytun_tuntap_start_capture_doc,
+"start_capture(path, snaplen=65535, ring_bytes=64MiB) -> None.\n\
+Write the packets read from and written to the device, whichever method is\n\
+used, to the pcapng file path. At most snaplen bytes of each packet are\n\
+kept, along with its timestamp and its direction as seen from the\n\
+interface: packets read from the device are outbound, packets written to\n\
+it are inbound. The file is ring_bytes long and mapped in memory: once it\n\
+is full, the oldest packets are overwritten.");
+
+static PyObject* pytun_tuntap_stop_capture(PyObject* self)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    int ret;
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = pytun_capture_stop(&tuntap->capture);
+    Py_END_ALLOW_THREADS
+    if (ret < 0)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pytun_tuntap_stop_capture_doc,
+"stop_capture() -> None.\n\
+Stop the capture started by start_capture(). The packets left in the file\n\
+are put back in order and the file is truncated to their size.");
+
+static PyObject* pytun_tuntap_capture_stats(PyObject* self)
+{
+    pytun_capture_t* cap = &((pytun_tuntap_t*)self)->capture;
+    PyObject* res;
+
+    pthread_mutex_lock(&cap->lock);
+    res = Py_BuildValue("{s:O,s:K,s:K,s:K,s:K}",
+                        "active", cap->active ? Py_True : Py_False,
+                        "packets", cap->packets,
+                        "bytes", cap->bytes,
+                        "overwritten", cap->overwritten,
+                        "dropped", cap->dropped);
+    pthread_mutex_unlock(&cap->lock);
+
+    return res;
+}
+
+PyDoc_STRVAR(pytun_tuntap_capture_stats_doc,
+"capture_stats() -> dict.\n\
+Return the counters of the current or last capture: the number of packets\n\
+and bytes captured, of packets overwritten by newer ones and of packets\n\
+dropped because they didn't fit in the file.");
+
+static PyStructSequence_Field pytun_vnet_hdr_fields[] =
+{
+    {"flags", "VIRTIO_NET_HDR_F_* flags"},
+    {"gso_type", "VIRTIO_NET_HDR_GSO_* type"},
+    {"hdr_len", "length of the headers to copy in each segment"},
+    {"gso_size", "size of the payload of each segment"},
+    {"csum_start", "offset at which to start checksumming"},
+    {"csum_offset", "offset after csum_start where to store the checksum"},
+    {NULL, NULL}
+};
+
+static PyStructSequence_Desc pytun_vnet_hdr_desc =
+{
+    "pytun.VnetHeader",
+    "Virtio net header preceding packets on a device created with IFF_VNET_HDR.",
+    pytun_vnet_hdr_fields,
+    6
+};
+
+/* Return hdr as a VnetHeader, type being the VnetHeader type of the module */
+static PyObject* pytun_vnet_hdr_to_object(PyTypeObject* type, const struct virtio_net_hdr* hdr)
+{
+    PyObject* res;
+    PyObject* field;
+    long values[6];
+    int i;
+
+    res = PyStructSequence_New(type);
+    if (res == NULL)
+    {
+        return NULL;
+    }
+    values[0] = hdr->flags;
+    values[1] = hdr->gso_type;
+    values[2] = hdr->hdr_len;
+    values[3] = hdr->gso_size;
+    values[4] = hdr->csum_start;
+    values[5] = hdr->csum_offset;
+    for (i = 0; i < 6; i++)
+    {
+#if PY_MAJOR_VERSION >= 3
+        field = PyLong_FromLong(values[i]);
+#else
+        field = PyInt_FromLong(values[i]);
+#endif
+        if (field == NULL)
+        {
+            Py_DECREF(res);
+            return NULL;
+        }
+        PyStructSequence_SET_ITEM(res, i, field);
+    }
+
+    return res;
+}
+
+static int pytun_vnet_hdr_from_object(PyObject* obj, struct virtio_net_hdr* hdr)
+{
+    PyObject* tuple;
+    int ret;
+
+    memset(hdr, 0, sizeof(*hdr));
+    if (obj == Py_None)
+    {
+        return 0;
+    }
+    tuple = PySequence_Tuple(obj);
+    if (tuple == NULL)
+    {
+        return -1;
+    }
+    ret = PyArg_ParseTuple(tuple, "bbHHHH;vnet header must be a sequence of 6 integers",
+                           &hdr->flags, &hdr->gso_type, &hdr->hdr_len,
+                           &hdr->gso_size, &hdr->csum_start, &hdr->csum_offset);
+    Py_DECREF(tuple);
+
+    return ret ? 0 : -1;
+}
+
+static PyObject* pytun_tuntap_read_vnet(PyObject* self, PyObject* args)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    unsigned int rdlen = 65536;
+    unsigned int pilen;
+    char hdrbuf[PYTUN_VNET_HDR_MAX];
+    struct iovec iov[3];
+    int iovcnt = 0;
+    ssize_t outlen = -1;
+    PyObject* buf;
+    PyObject* hdr;
+    int fd;
+    char* data;
+
+    if (!PyArg_ParseTuple(args, "|I:read_vnet", &rdlen))
+    {
+        return NULL;
+    }
+    if (!(tuntap->flags & IFF_VNET_HDR))
+    {
+        raise_error(pytun_state_of(self), "The device has not been created with IFF_VNET_HDR");
+        return NULL;
+    }
+    pilen = (tuntap->flags & IFF_NO_PI) ? 0 : sizeof(struct tun_pi);
+    if (rdlen < pilen)
+    {
+        raise_error(pytun_state_of(self), "Bad size, too small to hold the packet information");
+        return NULL;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    buf = PyBytes_FromStringAndSize(NULL, rdlen);
+#else
+    buf = PyString_FromStringAndSize(NULL, rdlen);
+#endif
+    if (buf == NULL)
+    {
+        return NULL;
+    }
+#if PY_MAJOR_VERSION >= 3
+    data = PyBytes_AS_STRING(buf);
+#else
+    data = PyString_AS_STRING(buf);
+#endif
+
+    /* The packet information, if any, comes before the vnet header: keep it
+       at the beginning of the packet like read() does */
+    if (pilen != 0)
+    {
+        iov[iovcnt].iov_base = data;
+        iov[iovcnt].iov_len = pilen;
+        iovcnt++;
+    }
+    iov[iovcnt].iov_base = hdrbuf;
+    iov[iovcnt].iov_len = tuntap->vnet_hdr_sz;
+    iovcnt++;
+    iov[iovcnt].iov_base = data + pilen;
+    iov[iovcnt].iov_len = rdlen - pilen;
+    iovcnt++;
+
+    PYTUN_BEGIN_ALLOW_THREADS(&tuntap->stats)
+    if ((fd = pytun_tuntap_get_fd(tuntap)) >= 0)
+    {
+        outlen = readv(fd, iov, iovcnt);
+        pytun_tuntap_put_fd(tuntap);
+    }
+    pytun_stats_read(&tuntap->stats, outlen, tuntap->vnet_hdr_sz + rdlen);
+    PYTUN_END_ALLOW_THREADS(&tuntap->stats)
+    if (outlen < 0)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        Py_DECREF(buf);
+        return NULL;
+    }
+    if ((size_t)outlen < pilen + tuntap->vnet_hdr_sz)
+    {
+        raise_error(pytun_state_of(self), "Short read, missing vnet header");
+        Py_DECREF(buf);
+        return NULL;
+    }
+    outlen -= tuntap->vnet_hdr_sz;
+    pytun_capture_payload(&tuntap->capture, PYTUN_CAPTURE_OUT, data + pilen, outlen - pilen);
+    if (outlen < rdlen)
+    {
+#if PY_MAJOR_VERSION >= 3
+        if (_PyBytes_Resize(&buf, outlen) < 0)
+#else
+        if (_PyString_Resize(&buf, outlen) < 0)
+#endif
+        {
+            return NULL;
+        }
+    }
+
+    hdr = pytun_vnet_hdr_to_object(pytun_state_of(self)->vnet_hdr_type, (struct virtio_net_hdr*)hdrbuf);
+    if (hdr == NULL)
+    {
+        Py_DECREF(buf);
+        return NULL;
+    }
+
+    return Py_BuildValue("(NN)", hdr, buf);
+}
+
+PyDoc_STRVAR(pytun_tuntap_read_vnet_doc,
+"read_vnet(size=65536) -> (VnetHeader, string).\n\
+Read a packet of at most size bytes from a device created with IFF_VNET_HDR\n\
+and return its parsed vnet header along with the packet itself.");
+
+static PyObject* pytun_tuntap_write_vnet(PyObject* self, PyObject* args)
+{
+    pytun_tuntap_t* tuntap = (pytun_tuntap_t*)self;
+    PyObject* hdrobj;
+    Py_buffer buf;
+    char hdrbuf[PYTUN_VNET_HDR_MAX];
+    size_t pilen;
+    struct iovec iov[3];
+    int iovcnt = 0;
+    pytun_tb_t* tb;
+    ssize_t written = -1;
+    int admit;
+    int fd;
+
+#if PY_MAJOR_VERSION >= 3
+    if (!PyArg_ParseTuple(args, "Oy*:write_vnet", &hdrobj, &buf))
+#else
+    if (!PyArg_ParseTuple(args, "Os*:write_vnet", &hdrobj, &buf))
+#endif
+    {
+        return NULL;
+    }
+    if (!(tuntap->flags & IFF_VNET_HDR))
+    {
+        PyBuffer_Release(&buf);
+        raise_error(pytun_state_of(self), "The device has not been created with IFF_VNET_HDR");
+        return NULL;
+    }
+    memset(hdrbuf, 0, sizeof(hdrbuf));
+    if (pytun_vnet_hdr_from_object(hdrobj, (struct virtio_net_hdr*)hdrbuf) < 0)
+    {
+        PyBuffer_Release(&buf);
+        return NULL;
+    }
+    pilen = (tuntap->flags & IFF_NO_PI) ? 0 : sizeof(struct tun_pi);
+    if ((size_t)buf.len < pilen)
+    {
+        PyBuffer_Release(&buf);
+        raise_error(pytun_state_of(self), "Packet too short to hold the packet information");
+        return NULL;
+    }
+
+    if (pilen != 0)
+    {
+        iov[iovcnt].iov_base = buf.buf;
+        iov[iovcnt].iov_len = pilen;
+        iovcnt++;
+    }
+    iov[iovcnt].iov_base = hdrbuf;
+    iov[iovcnt].iov_len = tuntap->vnet_hdr_sz;
+    iovcnt++;
+    iov[iovcnt].iov_base = (char*)buf.buf + pilen;
+    iov[iovcnt].iov_len = buf.len - pilen;
+    iovcnt++;
+
+    tb = pytun_tuntap_shaper(tuntap);
+    PYTUN_BEGIN_ALLOW_THREADS(&tuntap->stats)
+    if ((fd = pytun_tuntap_get_fd(tuntap)) >= 0)
+    {
+        admit = tb != NULL ? pytun_tb_admit(tb, tuntap->vnet_hdr_sz + buf.len, 0) : 1;
+        if (admit > 0)
+        {
+            written = writev(fd, iov, iovcnt);
+            pytun_stats_write(&tuntap->stats, written, tuntap->vnet_hdr_sz + buf.len);
+            if (written >= 0)
+            {
+                pytun_capture_payload(&tuntap->capture, PYTUN_CAPTURE_IN, (char*)buf.buf + pilen, buf.len - pilen);
+            }
+            else if (tb != NULL)
+            {
+                pytun_tb_refund(tb, tuntap->vnet_hdr_sz + buf.len);
+            }
+        }
+        else
+        {
+            pytun_stats_shaped(&tuntap->stats, admit);
+        }
+        pytun_tuntap_put_fd(tuntap);
+    }
+    PYTUN_END_ALLOW_THREADS(&tuntap->stats)
+    pytun_tb_decref(tb);
+    PyBuffer_Release(&buf);
+    if (written < 0)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        return NULL;
+    }
+    if (written >= tuntap->vnet_hdr_sz)
+    {
+        written -= tuntap->vnet_hdr_sz;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    return PyLong_FromSsize_t(written);
+#else
+    return PyInt_FromSsize_t(written);
+#endif
+}
+
+PyDoc_STRVAR(pytun_tuntap_write_vnet_doc,
+"write_vnet(hdr, str) -> number of bytes of str written.\n\
+Write str to a device created with IFF_VNET_HDR, preceded by the vnet header\n\
+hdr (a VnetHeader or any sequence of 6 integers, None for an all-zero\n\
+header). Packets dropped by the shaper of the device are reported as by\n\
+write().");
+
+static PyMethodDef pytun_tuntap_meth[] =
+{
+    {
+     "close",
+     (PyCFunction)pytun_tuntap_close,
+     METH_NOARGS,
+     pytun_tuntap_close_doc
+    },
+    {
+     "up",
+     (PyCFunction)pytun_tuntap_up,
+     METH_NOARGS,
+     pytun_tuntap_up_doc
+    },
+    {
+     "down",
+     (PyCFunction)pytun_tuntap_down,
+     METH_NOARGS,
+     pytun_tuntap_down_doc
+    },
+    {
+     "configure",
+     (PyCFunction)pytun_tuntap_configure,
+     METH_VARARGS | METH_KEYWORDS,
+     pytun_tuntap_configure_doc
+    },
+    {
+     "add_addr",
+     (PyCFunction)pytun_tuntap_add_addr,
+     METH_VARARGS,
+     pytun_tuntap_add_addr_doc
+    },
+    {
+     "del_addr",
+     (PyCFunction)pytun_tuntap_del_addr,
+     METH_VARARGS,
+     pytun_tuntap_del_addr_doc
+    },
+    {
+     "read",
+     (PyCFunction)PYTUN_FASTCALL_FUNC(pytun_tuntap_read),
+     PYTUN_METH_FASTCALL,
+     pytun_tuntap_read_doc
+    },
+    {
+     "try_read",
+     (PyCFunction)PYTUN_FASTCALL_FUNC(pytun_tuntap_try_read),
+     PYTUN_METH_FASTCALL,
+     pytun_tuntap_try_read_doc
+    },
+    {
+     "read_into",
+     (PyCFunction)pytun_tuntap_read_into,
+     METH_VARARGS | METH_KEYWORDS,
+     pytun_tuntap_read_into_doc
+    },
+    {
+     "read_many",
+     (PyCFunction)pytun_tuntap_read_many,
+     METH_VARARGS,
+     pytun_tuntap_read_many_doc
+    },
+    {
+     "read_many_into",
+     (PyCFunction)pytun_tuntap_read_many_into,
+     METH_VARARGS | METH_KEYWORDS,
+     pytun_tuntap_read_many_into_doc
+    },
+    {
+     "write",
+     (PyCFunction)PYTUN_FASTCALL_FUNC(pytun_tuntap_write),
+     PYTUN_METH_FASTCALL,
+     pytun_tuntap_write_doc
+    },
+    {
+     "try_write",
+     (PyCFunction)PYTUN_FASTCALL_FUNC(pytun_tuntap_try_write),
+     PYTUN_METH_FASTCALL,
+     pytun_tuntap_try_write_doc
+    },
+    {
+     "write_many",
+     (PyCFunction)pytun_tuntap_write_many,
+     METH_VARARGS,
+     pytun_tuntap_write_many_doc
+    },
+    {
+     "fileno",
+     (PyCFunction)pytun_tuntap_fileno,
+     METH_NOARGS,
+     pytun_tuntap_fileno_doc
+    },
+    {
+     "persist",
+     (PyCFunction)pytun_tuntap_persist,
+     METH_VARARGS,
+     pytun_tuntap_persist_doc
+    },
+    {
+     "set_offload",
+     (PyCFunction)pytun_tuntap_set_offload,
+     METH_VARARGS,
+     pytun_tuntap_set_offload_doc
+    },
+    {
+     "stats",
+     (PyCFunction)pytun_tuntap_stats,
+     METH_NOARGS,
+     pytun_tuntap_stats_doc
+    },
+    {
+     "reset_stats",
+     (PyCFunction)pytun_tuntap_reset_stats,
+     METH_NOARGS,
+     pytun_tuntap_reset_stats_doc
+    },
+    {
+     "kernel_stats",
+     (PyCFunction)pytun_tuntap_kernel_stats,
+     METH_NOARGS,
+     pytun_tuntap_kernel_stats_doc
+    },
+    {
+     "start_capture",
+     (PyCFunction)pytun_tuntap_start_capture,
+     METH_VARARGS | METH_KEYWORDS,
+     pytun_tuntap_start_capture_doc
+    },
+    {
+     "stop_capture",
+     (PyCFunction)pytun_tuntap_stop_capture,
+     METH_NOARGS,
+     pytun_tuntap_stop_capture_doc
+    },
+    {
+     "capture_stats",
+     (PyCFunction)pytun_tuntap_capture_stats,
+     METH_NOARGS,
+     pytun_tuntap_capture_stats_doc
+    },
+    {
+     "attach_filter",
+     (PyCFunction)pytun_tuntap_attach_filter,
+     METH_VARARGS,
+     pytun_tuntap_attach_filter_doc
+    },
+    {
+     "detach_filter",
+     (PyCFunction)pytun_tuntap_detach_filter,
+     METH_NOARGS,
+     pytun_tuntap_detach_filter_doc
+    },
+#ifdef TUNSETFILTEREBPF
+    {
+     "set_filter_ebpf",
+     (PyCFunction)pytun_tuntap_set_filter_ebpf,
+     METH_VARARGS,
+     pytun_tuntap_set_filter_ebpf_doc
+    },
+#endif
+#ifdef TUNSETSTEERINGEBPF
+    {
+     "set_steering_ebpf",
+     (PyCFunction)pytun_tuntap_set_steering_ebpf,
+     METH_VARARGS,
+     pytun_tuntap_set_steering_ebpf_doc
+    },
+#endif
+    {
+     "read_vnet",
+     (PyCFunction)pytun_tuntap_read_vnet,
+     METH_VARARGS,
+     pytun_tuntap_read_vnet_doc
+    },
+    {
+     "write_vnet",
+     (PyCFunction)pytun_tuntap_write_vnet,
+     METH_VARARGS,
+     pytun_tuntap_write_vnet_doc
+    },
+#ifdef IFF_MULTI_QUEUE
+    {
+     "mq_attach",
+     (PyCFunction)pytun_tuntap_mq_attach,
+     METH_VARARGS,
+     pytun_tuntap_mq_attach_doc
+    },
+#endif
+    {NULL, NULL, 0, NULL}
+};
+
+PyDoc_STRVAR(pytun_tuntap_doc,
+"TunTapDevice(name='', flags=IFF_TUN, dev='/dev/net/tun', nonblocking=False) -> TUN/TAP device object.\n\
+\n\
+dev is the path of the clone device or an open file descriptor (or an\n\
+object with a fileno() method), which is duplicated. A descriptor which is\n\
+not a TUN/TAP device, e.g one end of a socketpair, is used as is. The\n\
+duplicate shares the file status flags of the original descriptor:\n\
+nonblocking=True, or setting the nonblocking attribute, also makes the\n\
+caller's descriptor non-blocking.");
+
+static PyType_Slot pytun_tuntap_slots[] =
+{
+    {Py_tp_dealloc, pytun_tuntap_dealloc},
+    {Py_tp_doc, (void*)pytun_tuntap_doc},
+    {Py_tp_methods, pytun_tuntap_meth},
+    {Py_tp_getset, pytun_tuntap_prop},
+    {Py_tp_new, pytun_tuntap_new},
+    {0, NULL}
+};
+
+static PyType_Spec pytun_tuntap_spec =
+{
+    .name = "pytun.TunTapDevice",
+    .basicsize = sizeof(pytun_tuntap_t),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = pytun_tuntap_slots
+};
+
+#ifndef Py_TPFLAGS_HAVE_NEWBUFFER
+#define Py_TPFLAGS_HAVE_NEWBUFFER 0
+#endif
+
+#define PYTUN_SLOT_FREE 0
+#define PYTUN_SLOT_FILLED 1
+#define PYTUN_SLOT_BUSY 2
+
+struct pytun_packet_ring;
+
+struct pytun_packet_slot
+{
+    PyObject_HEAD
+    struct pytun_packet_ring* ring;
+    unsigned int index;
+    int state;
+    Py_ssize_t len;
+    Py_ssize_t exports;
+};
+typedef struct pytun_packet_slot pytun_packet_slot_t;
+
+struct pytun_packet_ring
+{
+    PyObject_HEAD
+    PyObject* device;
+    unsigned int nslots;
+    size_t slot_size;
+    char* slab;
+    size_t slab_size;
+    pytun_packet_slot_t** slots;
+    /* Stack of free slots */
+    unsigned int* free;
+    unsigned int nfree;
+    /* FIFO of filled slots waiting to be consumed */
+    unsigned int* fifo;
+    unsigned int head;
+    unsigned int npending;
+    /* Scratch space used by fill() */
+    unsigned int* fill_idx;
+    Py_ssize_t* fill_len;
+    int filling;
+    /* Counters */
+    unsigned PY_LONG_LONG filled;
+    unsigned PY_LONG_LONG consumed;
+    unsigned PY_LONG_LONG released;
+    unsigned PY_LONG_LONG overruns;
+};
+typedef struct pytun_packet_ring pytun_packet_ring_t;
+
+static int pytun_packet_slot_traverse(PyObject* self, visitproc visit, void* arg)
+{
+    PYTUN_VISIT_TYPE(self);
+    Py_VISIT((PyObject*)((pytun_packet_slot_t*)self)->ring);
+    return 0;
+}
+
+static int pytun_packet_slot_clear(PyObject* self)
+{
+    Py_CLEAR(((pytun_packet_slot_t*)self)->ring);
+    return 0;
+}
+
+static void pytun_packet_slot_dealloc(PyObject* self)
+{
+    PyTypeObject* type = Py_TYPE(self);
+
+    PyObject_GC_UnTrack(self);
+    pytun_packet_slot_clear(self);
+    PyObject_GC_Del(self);
+    PYTUN_TYPE_DECREF(type);
+}
+
+static int pytun_packet_slot_getbuffer(PyObject* self, Py_buffer* view, int flags)
+{
+    pytun_packet_slot_t* slot = (pytun_packet_slot_t*)self;
+    pytun_packet_ring_t* ring = slot->ring;
+    int ret = -1;
+
+    if (ring == NULL)
+    {
+        PyErr_SetString(PyExc_BufferError, "slot is not in use");
+        view->obj = NULL;
+        return -1;
+    }
+    Py_BEGIN_CRITICAL_SECTION2(self, (PyObject*)ring);
+    if (slot->state != PYTUN_SLOT_BUSY)
+    {
+        PyErr_SetString(PyExc_BufferError, "slot is not in use");
+        view->obj = NULL;
+    }
+    else if (PyBuffer_FillInfo(view, self, ring->slab + slot->index * ring->slot_size, slot->len, 0, flags) == 0)
+    {
+        slot->exports++;
+        ret = 0;
+    }
+    Py_END_CRITICAL_SECTION2();
+
+    return ret;
+}
+
+static void pytun_packet_slot_releasebuffer(PyObject* self, Py_buffer* view)
+{
+    Py_BEGIN_CRITICAL_SECTION(self);
+    ((pytun_packet_slot_t*)self)->exports--;
+    Py_END_CRITICAL_SECTION();
+}
+
+static Py_ssize_t pytun_packet_slot_length(PyObject* self)
+{
+    return ((pytun_packet_slot_t*)self)->len;
+}
+
+static PyObject* pytun_packet_slot_release(PyObject* self)
+{
+    pytun_packet_slot_t* slot = (pytun_packet_slot_t*)self;
+    pytun_packet_ring_t* ring = slot->ring;
+    int ret = -1;
+
+    if (ring == NULL)
+    {
+        raise_error(pytun_state_of(self), "Slot is not in use");
+        return NULL;
+    }
+    Py_BEGIN_CRITICAL_SECTION2(self, (PyObject*)ring);
+    if (slot->state != PYTUN_SLOT_BUSY)
+    {
+        raise_error(pytun_state_of(self), "Slot is not in use");
+    }
+    else if (slot->exports > 0)
+    {
+        PyErr_SetString(PyExc_BufferError, "Existing exports of the slot, release them first");
+    }
+    else
+    {
+        slot->state = PYTUN_SLOT_FREE;
+        slot->len = 0;
+        ring->free[ring->nfree++] = slot->index;
+        ring->released++;
+        ret = 0;
+    }
+    Py_END_CRITICAL_SECTION2();
+    if (ret < 0)
+    {
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pytun_packet_slot_release_doc,
+"release() -> None.\n\
+Give the slot back to its ring so that it can be filled again. All the\n\
+memoryviews of the slot must have been released.");
+
+static PyObject* pytun_packet_slot_enter(PyObject* self)
+{
+    Py_INCREF(self);
+    return self;
+}
+
+static PyObject* pytun_packet_slot_exit(PyObject* self, PyObject* args)
+{
+    if (((pytun_packet_slot_t*)self)->state != PYTUN_SLOT_BUSY)
+    {
+        Py_RETURN_NONE;
+    }
+    return pytun_packet_slot_release(self);
+}
+
+static PyObject* pytun_packet_slot_get_index(PyObject* self, void* d)
+{
+#if PY_MAJOR_VERSION >= 3
+    return PyLong_FromUnsignedLong(((pytun_packet_slot_t*)self)->index);
+#else
+    return PyInt_FromLong(((pytun_packet_slot_t*)self)->index);
+#endif
+}
+
+static PyGetSetDef pytun_packet_slot_prop[] =
+{
+    {
+     "index",
+     pytun_packet_slot_get_index,
+     NULL,
+     NULL,
+     NULL
+    },
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyMethodDef pytun_packet_slot_meth[] =
+{
+    {
+     "release",
+     (PyCFunction)pytun_packet_slot_release,
+     METH_NOARGS,
+     pytun_packet_slot_release_doc
+    },
+    {
+     "__enter__",
+     (PyCFunction)pytun_packet_slot_enter,
+     METH_NOARGS,
+     NULL
+    },
+    {
+     "__exit__",
+     (PyCFunction)pytun_packet_slot_exit,
+     METH_VARARGS,
+     NULL
+    },
+    {NULL, NULL, 0, NULL}
+};
+
+PyDoc_STRVAR(pytun_packet_slot_doc,
+"Slot of a PacketRing holding one packet. It supports the buffer protocol,\n\
+so it can be wrapped in a memoryview or passed to any function accepting a\n\
+bytes-like object without copying.");
+
+static PyType_Slot pytun_packet_slot_slots[] =
+{
+    {Py_tp_dealloc, pytun_packet_slot_dealloc},
+    {Py_sq_length, pytun_packet_slot_length},
+    {Py_bf_getbuffer, pytun_packet_slot_getbuffer},
+    {Py_bf_releasebuffer, pytun_packet_slot_releasebuffer},
+    {Py_tp_doc, (void*)pytun_packet_slot_doc},
+    {Py_tp_traverse, pytun_packet_slot_traverse},
+    {Py_tp_clear, pytun_packet_slot_clear},
+    {Py_tp_methods, pytun_packet_slot_meth},
+    {Py_tp_getset, pytun_packet_slot_prop},
+    {0, NULL}
+};
+
+static PyType_Spec pytun_packet_slot_spec =
+{
+    .name = "pytun.PacketSlot",
+    .basicsize = sizeof(pytun_packet_slot_t),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_HAVE_NEWBUFFER |
+             Py_TPFLAGS_DISALLOW_INSTANTIATION,
+    .slots = pytun_packet_slot_slots
+};
+
+static int pytun_packet_ring_traverse(PyObject* self, visitproc visit, void* arg)
+{
+    pytun_packet_ring_t* ring = (pytun_packet_ring_t*)self;
+    unsigned int i;
+
+    PYTUN_VISIT_TYPE(self);
+    Py_VISIT(ring->device);
+    if (ring->slots != NULL)
+    {
+        for (i = 0; i < ring->nslots; i++)
+        {
+            Py_VISIT((PyObject*)ring->slots[i]);
+        }
+    }
+
+    return 0;
+}
+
+static int pytun_packet_ring_clear(PyObject* self)
+{
+    pytun_packet_ring_t* ring = (pytun_packet_ring_t*)self;
+    pytun_packet_slot_t* slot;
+    unsigned int i;
+
+    Py_CLEAR(ring->device);
+    if (ring->slots != NULL)
+    {
+        for (i = 0; i < ring->nslots; i++)
+        {
+            slot = ring->slots[i];
+            ring->slots[i] = NULL;
+            Py_XDECREF((PyObject*)slot);
+        }
+    }
+
+    return 0;
+}
+
+static void pytun_packet_ring_dealloc(PyObject* self)
+{
+    PyTypeObject* type = Py_TYPE(self);
+    pytun_packet_ring_t* ring = (pytun_packet_ring_t*)self;
+
+    PyObject_GC_UnTrack(self);
+    pytun_packet_ring_clear(self);
+    if (ring->slab != NULL)
+    {
+        munmap(ring->slab, ring->slab_size);
+    }
+    PyMem_Free(ring->slots);
+    PyMem_Free(ring->free);
+    PyMem_Free(ring->fifo);
+    PyMem_Free(ring->fill_idx);
+    PyMem_Free(ring->fill_len);
+    PyObject_GC_Del(self);
+    PYTUN_TYPE_DECREF(type);
+}
+
+static PyObject* pytun_packet_ring_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+    pytun_packet_ring_t* ring;
+    PyObject* device;
+    unsigned int nslots;
+    Py_ssize_t slot_size;
+    char* kwlist[] = {"device", "slots", "slot_size", NULL};
+    long page_size;
+    unsigned int i;
+    void* slab;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!In:PacketRing", kwlist,
+                                     pytun_state_of_type(type)->tuntap_type, &device, &nslots, &slot_size))
+    {
+        return NULL;
+    }
+    if (nslots == 0 || slot_size <= 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "slots and slot_size must be > 0");
+        return NULL;
+    }
+    if ((size_t)slot_size > PY_SSIZE_T_MAX / nslots)
+    {
+        return PyErr_NoMemory();
+    }
+
+    ring = (pytun_packet_ring_t*)type->tp_alloc(type, 0);
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+    Py_INCREF(device);
+    ring->device = device;
+    ring->nslots = nslots;
+    ring->slot_size = slot_size;
+
+    /* Allocate all the slots in a single page-aligned slab */
+    page_size = sysconf(_SC_PAGESIZE);
+    ring->slab_size = (nslots * slot_size + page_size - 1) / page_size * page_size;
+    slab = mmap(NULL, ring->slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED)
+    {
+        raise_error_from_errno(pytun_state_of_type(type));
+        goto error;
+    }
+    ring->slab = slab;
+
+    ring->slots = PyMem_New(pytun_packet_slot_t*, nslots);
+    ring->free = PyMem_New(unsigned int, nslots);
+    ring->fifo = PyMem_New(unsigned int, nslots);
+    ring->fill_idx = PyMem_New(unsigned int, nslots);
+    ring->fill_len = PyMem_New(Py_ssize_t, nslots);
+    if (ring->slots == NULL || ring->free == NULL || ring->fifo == NULL ||
+        ring->fill_idx == NULL || ring->fill_len == NULL)
+    {
+        PyErr_NoMemory();
+        goto error;
+    }
+    memset(ring->slots, 0, nslots * sizeof(*ring->slots));
+    for (i = 0; i < nslots; i++)
+    {
+        ring->slots[i] = PyObject_GC_New(pytun_packet_slot_t, pytun_state_of_type(type)->packet_slot_type);
+        if (ring->slots[i] == NULL)
+        {
+            goto error;
+        }
+        Py_INCREF(ring);
+        ring->slots[i]->ring = ring;
+        ring->slots[i]->index = i;
+        ring->slots[i]->state = PYTUN_SLOT_FREE;
+        ring->slots[i]->len = 0;
+        ring->slots[i]->exports = 0;
+        PyObject_GC_Track((PyObject*)ring->slots[i]);
+        /* Hand out the slots in increasing order */
+        ring->free[i] = nslots - 1 - i;
+    }
+    ring->nfree = nslots;
+
+    return (PyObject*)ring;
+
+error:
+    Py_DECREF(ring);
+
+    return NULL;
+}
+
+static PyObject* pytun_packet_ring_fill(PyObject* self, PyObject* args)
+{
+    pytun_packet_ring_t* ring = (pytun_packet_ring_t*)self;
+    unsigned int max_packets = 0;
+    unsigned int n;
+    unsigned int nread = 0;
+    unsigned int i;
+    ssize_t outlen = 0;
+    pytun_tuntap_t* tuntap;
+    int fd;
+    char* slab;
+    size_t slot_size;
+    unsigned int* idx;
+    Py_ssize_t* len;
+    int nonblocking = 0;
+    int err = 0;
+
+    if (!PyArg_ParseTuple(args, "|I:fill", &max_packets))
+    {
+        return NULL;
+    }
+    if (ring->device == NULL)
+    {
+        raise_error(pytun_state_of(self), "Ring has been cleared");
+        return NULL;
+    }
+    /* Slots may be consumed and released by other threads while the ring
+       is being filled, but only one thread may fill it */
+    if (pytun_busy_enter(pytun_state_of(self), &ring->filling) < 0)
+    {
+        return NULL;
+    }
+
+    /* Take the slots to fill from the free list */
+    Py_BEGIN_CRITICAL_SECTION(self);
+    n = ring->nfree;
+    if (n == 0)
+    {
+        ring->overruns++;
+    }
+    if (max_packets != 0 && max_packets < n)
+    {
+        n = max_packets;
+    }
+    for (i = 0; i < n; i++)
+    {
+        ring->fill_idx[i] = ring->free[--ring->nfree];
+    }
+    Py_END_CRITICAL_SECTION();
+    if (n == 0)
+    {
+        goto out;
+    }
+
+    /* Keep the device alive while the GIL is released */
+    tuntap = (pytun_tuntap_t*)ring->device;
+    Py_INCREF(tuntap);
+    slab = ring->slab;
+    slot_size = ring->slot_size;
+    idx = ring->fill_idx;
+    len = ring->fill_len;
+    PYTUN_BEGIN_ALLOW_THREADS(&tuntap->stats)
+    fd = pytun_tuntap_get_fd(tuntap);
+    outlen = -1;
+    for (nread = 0; fd >= 0 && nread < n; nread++)
+    {
+        /* Same as pytun_read_batch() */
+        if (nread == 1)
+        {
+            nonblocking = pytun_fd_nonblocking(fd);
+        }
+        if (nread > 0 && !nonblocking && !pytun_fd_readable(fd))
+        {
+            break;
+        }
+        outlen = read(fd, slab + idx[nread] * slot_size, slot_size);
+        pytun_stats_read(&tuntap->stats, outlen, slot_size);
+        pytun_capture_packet(&tuntap->capture, PYTUN_CAPTURE_OUT, slab + idx[nread] * slot_size, outlen);
+        if (outlen < 0)
+        {
+            break;
+        }
+        len[nread] = outlen;
+    }
+    if (nread == 0 && outlen < 0)
+    {
+        err = errno;
+    }
+    if (fd >= 0)
+    {
+        pytun_tuntap_put_fd(tuntap);
+    }
+    PYTUN_END_ALLOW_THREADS(&tuntap->stats)
+    Py_DECREF(tuntap);
+
+    /* Queue the filled slots and give back the others */
+    Py_BEGIN_CRITICAL_SECTION(self);
+    for (i = 0; i < nread; i++)
+    {
+        ring->slots[idx[i]]->state = PYTUN_SLOT_FILLED;
+        ring->slots[idx[i]]->len = len[i];
+        ring->fifo[(ring->head + ring->npending++) % ring->nslots] = idx[i];
+    }
+    for (i = n; i > nread; i--)
+    {
+        ring->free[ring->nfree++] = idx[i - 1];
+    }
+    ring->filled += nread;
+    Py_END_CRITICAL_SECTION();
+    if (err != 0 && err != EAGAIN)
+    {
+        pytun_busy_leave(&ring->filling);
+        errno = err;
+        raise_error_from_errno(pytun_state_of(self));
+        return NULL;
+    }
+
+out:
+    pytun_busy_leave(&ring->filling);
+#if PY_MAJOR_VERSION >= 3
+    return PyLong_FromUnsignedLong(nread);
+#else
+    return PyInt_FromLong(nread);
+#endif
+}
+
+PyDoc_STRVAR(pytun_packet_ring_fill_doc,
+"fill(max_packets=0) -> number of packets read.\n\
+Read packets from the device into the free slots of the ring, at most\n\
+max_packets if it is not 0. Only the first read may block, filling stops as\n\
+soon as the device has no more packets pending.");
+
+static PyObject* pytun_packet_ring_iternext(PyObject* self)
+{
+    pytun_packet_ring_t* ring = (pytun_packet_ring_t*)self;
+    pytun_packet_slot_t* slot = NULL;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (ring->npending != 0)
+    {
+        slot = ring->slots[ring->fifo[ring->head]];
+        ring->head = (ring->head + 1) % ring->nslots;
+        ring->npending--;
+        slot->state = PYTUN_SLOT_BUSY;
+        ring->consumed++;
+        Py_INCREF(slot);
+    }
+    Py_END_CRITICAL_SECTION();
+
+    return (PyObject*)slot;
+}
+
+static PyObject* pytun_packet_ring_get(PyObject* self)
+{
+    PyObject* slot;
+
+    slot = pytun_packet_ring_iternext(self);
+    if (slot == NULL)
+    {
+        Py_RETURN_NONE;
+    }
+
+    return slot;
+}
+
+PyDoc_STRVAR(pytun_packet_ring_get_doc,
+"get() -> PacketSlot or None.\n\
+Return the oldest filled slot, or None if there is none. The slot must be\n\
+given back to the ring with its release() method once the packet has been\n\
+processed.");
+
+static Py_ssize_t pytun_packet_ring_length(PyObject* self)
+{
+    return ((pytun_packet_ring_t*)self)->npending;
+}
+
+static PyObject* pytun_packet_ring_get_free(PyObject* self, void* d)
+{
+#if PY_MAJOR_VERSION >= 3
+    return PyLong_FromUnsignedLong(((pytun_packet_ring_t*)self)->nfree);
+#else
+    return PyInt_FromLong(((pytun_packet_ring_t*)self)->nfree);
+#endif
+}
+
+static PyObject* pytun_packet_ring_get_slots(PyObject* self, void* d)
+{
+#if PY_MAJOR_VERSION >= 3
+    return PyLong_FromUnsignedLong(((pytun_packet_ring_t*)self)->nslots);
+#else
+    return PyInt_FromLong(((pytun_packet_ring_t*)self)->nslots);
+#endif
+}
+
+static PyObject* pytun_packet_ring_get_slot_size(PyObject* self, void* d)
+{
+#if PY_MAJOR_VERSION >= 3
+    return PyLong_FromSize_t(((pytun_packet_ring_t*)self)->slot_size);
+#else
+    return PyInt_FromSize_t(((pytun_packet_ring_t*)self)->slot_size);
+#endif
+}
+
+static PyGetSetDef pytun_packet_ring_prop[] =
+{
+    {
+     "free",
+     pytun_packet_ring_get_free,
+     NULL,
+     "number of slots that can be filled",
+     NULL
+    },
+    {
+     "slots",
+     pytun_packet_ring_get_slots,
+     NULL,
+     "total number of slots",
+     NULL
+    },
+    {
+     "slot_size",
+     pytun_packet_ring_get_slot_size,
+     NULL,
+     "size of each slot",
+     NULL
+    },
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyMemberDef pytun_packet_ring_members[] =
+{
+    {
+     "filled",
+     T_ULONGLONG,
+     offsetof(pytun_packet_ring_t, filled),
+     READONLY,
+     "number of packets read into the ring"
+    },
+    {
+     "consumed",
+     T_ULONGLONG,
+     offsetof(pytun_packet_ring_t, consumed),
+     READONLY,
+     "number of slots handed out"
+    },
+    {
+     "released",
+     T_ULONGLONG,
+     offsetof(pytun_packet_ring_t, released),
+     READONLY,
+     "number of slots given back to the ring"
+    },
+    {
+     "overruns",
+     T_ULONGLONG,
+     offsetof(pytun_packet_ring_t, overruns),
+     READONLY,
+     "number of calls to fill() made while no slot was free"
+    },
+    {NULL, 0, 0, 0, NULL}
+};
+
+static PyMethodDef pytun_packet_ring_meth[] =
+{
+    {
+     "fill",
+     (PyCFunction)pytun_packet_ring_fill,
+     METH_VARARGS,
+     pytun_packet_ring_fill_doc
+    },
+    {
+     "get",
+     (PyCFunction)pytun_packet_ring_get,
+     METH_NOARGS,
+     pytun_packet_ring_get_doc
+    },
+    {NULL, NULL, 0, NULL}
+};
+
+PyDoc_STRVAR(pytun_packet_ring_doc,
+"PacketRing(device, slots, slot_size) -> ring of preallocated packet slots.\n\
+The slots live in a single page-aligned memory area and are filled from the\n\
+device by fill(). Iterating over the ring (or calling get()) hands out the\n\
+filled slots in order, len(ring) is the number of filled slots waiting to be\n\
+handed out.");
+
+static PyType_Slot pytun_packet_ring_slots[] =
+{
+    {Py_tp_dealloc, pytun_packet_ring_dealloc},
+    {Py_sq_length, pytun_packet_ring_length},
+    {Py_tp_doc, (void*)pytun_packet_ring_doc},
+    {Py_tp_traverse, pytun_packet_ring_traverse},
+    {Py_tp_clear, pytun_packet_ring_clear},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, pytun_packet_ring_iternext},
+    {Py_tp_methods, pytun_packet_ring_meth},
+    {Py_tp_members, pytun_packet_ring_members},
+    {Py_tp_getset, pytun_packet_ring_prop},
+    {Py_tp_new, pytun_packet_ring_new},
+    {0, NULL}
+};
+
+static PyType_Spec pytun_packet_ring_spec =
+{
+    .name = "pytun.PacketRing",
+    .basicsize = sizeof(pytun_packet_ring_t),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_HAVE_GC,
+    .slots = pytun_packet_ring_slots
+};
+
+/* Register (or unregister if reg is 0) func to be called at interpreter exit,
+   so that native threads calling into Python are stopped before the
+   interpreter is finalized */
+static int pytun_atexit(PyObject* func, int reg)
+{
+    PyObject* atexit;
+    PyObject* res;
+
+    atexit = PyImport_ImportModule("atexit");
+    if (atexit == NULL)
+    {
+        return -1;
+    }
+#if PY_MAJOR_VERSION >= 3
+    res = PyObject_CallMethod(atexit, reg ? "register" : "unregister", "O", func);
+#else
+    res = reg ? PyObject_CallMethod(atexit, "register", "O", func) : (Py_INCREF(Py_None), Py_None);
+#endif
+    Py_DECREF(atexit);
+    if (res == NULL)
+    {
+        return -1;
+    }
+    Py_DECREF(res);
+
+    return 0;
+}
+
+/* Native threads calling back into Python create a thread state of the
+   interpreter which started them, PyGILState_Ensure() would attach them to
+   the main interpreter */
+static PyInterpreterState* pytun_current_interp(void)
+{
+#if PY_MAJOR_VERSION >= 3 && PY_MINOR_VERSION >= 9
+    return PyInterpreterState_Get();
+#else
+    return PyThreadState_Get()->interp;
+#endif
+}
+
+/* Delete the thread state of the calling native thread, which must hold
+   the GIL with it */
+static void pytun_thread_state_delete(PyThreadState* tstate)
+{
+    PyThreadState_Clear(tstate);
+    PyThreadState_DeleteCurrent();
+}
+
+/* Lock the mutex serializing start() and stop() of the objects running
+   native threads. Its holder releases the GIL while joining the threads,
+   so the GIL is released while waiting for it. */
+static void pytun_start_lock(pthread_mutex_t* lock)
+{
+    if (pthread_mutex_trylock(lock) != 0)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(lock);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+#ifdef IFF_MULTI_QUEUE
+struct pytun_mq;
+
+/* State of one queue of a MultiQueueDevice */
+struct pytun_mq_queue
+{
+    struct pytun_mq* mq;
+    unsigned int index;
+    int fd;
+    pytun_stats_t* stats;
+    pytun_capture_t* capture;
+    int cpu;
+    int running;
+    pthread_t thread;
+    int err;
+    unsigned PY_LONG_LONG packets;
+    unsigned PY_LONG_LONG bytes;
+    unsigned PY_LONG_LONG batches;
+    unsigned PY_LONG_LONG errors;
+};
+typedef struct pytun_mq_queue pytun_mq_queue_t;
+
+struct pytun_mq
+{
+    PyObject_HEAD
+    PyObject* queues;
+    PyObject* callback;
+    PyObject* stop_meth;
+    PyInterpreterState* interp;
+    unsigned int nqueues;
+    pytun_mq_queue_t* state;
+    unsigned int batch;
+    unsigned int size;
+    int stop_pipe[2];
+    int started;
+    int stopping;
+    pthread_mutex_t lock;
+};
+typedef struct pytun_mq pytun_mq_t;
+
+/* MultiQueueDevice whose callback the calling thread runs, if any */
+static __thread pytun_mq_t* pytun_mq_current;
+
+static void* pytun_mq_worker(void* arg)
+{
+    pytun_mq_queue_t* q = (pytun_mq_queue_t*)arg;
+    pytun_mq_t* mq = q->mq;
+    size_t arena_size = (size_t)mq->batch * mq->size;
+    char* arena;
+    Py_ssize_t* offsets;
+    Py_ssize_t n;
+    Py_ssize_t i;
+    struct pollfd pfd[2];
+    PyThreadState* tstate = NULL;
+    PyObject* pkts;
+    PyObject* pkt;
+    PyObject* callback;
+    PyObject* res;
+#ifdef CPU_SET
+    cpu_set_t cpus;
+#endif
+
+    pytun_mq_current = mq;
+#ifdef CPU_SET
+    if (q->cpu >= 0)
+    {
+        CPU_ZERO(&cpus);
+        CPU_SET(q->cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+#endif
+
+    arena = malloc(arena_size);
+    offsets = malloc((mq->batch + 1) * sizeof(*offsets));
+    if (arena == NULL || offsets == NULL)
+    {
+        q->err = ENOMEM;
+        PYTUN_STAT_ADD(q, errors, 1);
+        goto out;
+    }
+
+    for (;;)
+    {
+        pfd[0].fd = q->fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = mq->stop_pipe[0];
+        pfd[1].events = POLLIN;
+        if (poll(pfd, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            q->err = errno;
+            PYTUN_STAT_ADD(q, errors, 1);
+            break;
+        }
+        if (pfd[1].revents)
+        {
+            break;
+        }
+        if (!(pfd[0].revents & POLLIN))
+        {
+            q->err = EIO;
+            PYTUN_STAT_ADD(q, errors, 1);
+            break;
+        }
+        n = pytun_read_batch(q->fd, arena, arena_size, mq->size, mq->batch, offsets, q->stats, q->capture);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+            {
+                continue;
+            }
+            q->err = errno;
+            PYTUN_STAT_ADD(q, errors, 1);
+            break;
+        }
+        if (n == 0)
+        {
+            continue;
+        }
+        PYTUN_STAT_ADD(q, packets, n);
+        PYTUN_STAT_ADD(q, bytes, offsets[n]);
+        PYTUN_STAT_ADD(q, batches, 1);
+
+        /* Hand the batch over to Python */
+        if (tstate == NULL)
+        {
+            tstate = PyThreadState_New(mq->interp);
+            if (tstate == NULL)
+            {
+                PYTUN_STAT_ADD(q, errors, 1);
+                continue;
+            }
+        }
+        PyEval_RestoreThread(tstate);
+        callback = mq->callback;
+        Py_XINCREF(callback);
+        pkts = callback != NULL ? PyList_New(n) : NULL;
+        for (i = 0; pkts != NULL && i < n; i++)
+        {
+            pkt = pytun_new_string(arena + offsets[i], offsets[i + 1] - offsets[i]);
+            if (pkt == NULL)
+            {
+                Py_CLEAR(pkts);
+                break;
+            }
+            PyList_SET_ITEM(pkts, i, pkt);
+        }
+        if (pkts != NULL)
+        {
+            res = PyObject_CallFunction(callback, "IN", q->index, pkts);
+            Py_XDECREF(res);
+        }
+        if (PyErr_Occurred())
+        {
+            PyErr_WriteUnraisable(callback != NULL ? callback : Py_None);
+        }
+        Py_XDECREF(callback);
+        PyEval_SaveThread();
+    }
+
+out:
+    if (tstate != NULL)
+    {
+        PyEval_RestoreThread(tstate);
+        pytun_thread_state_delete(tstate);
+    }
+    free(arena);
+    free(offsets);
+
+    return NULL;
+}
+
+static int pytun_mq_traverse(PyObject* self, visitproc visit, void* arg)
+{
+    pytun_mq_t* mq = (pytun_mq_t*)self;
+
+    PYTUN_VISIT_TYPE(self);
+    Py_VISIT(mq->queues);
+    Py_VISIT(mq->callback);
+    Py_VISIT(mq->stop_meth);
+
+    return 0;
+}
+
+static int pytun_mq_clear(PyObject* self)
+{
+    pytun_mq_t* mq = (pytun_mq_t*)self;
+
+    Py_CLEAR(mq->queues);
+    Py_CLEAR(mq->callback);
+    Py_CLEAR(mq->stop_meth);
+
+    return 0;
+}
+
+/* Stop and join the reader threads. A reader thread stopping them from its
+   callback cannot join itself: it only tells them to exit and they are
+   joined by the next start() or stop(), or by the deallocation. */
+static void pytun_mq_join(pytun_mq_t* mq)
+{
+    unsigned int i;
+    char c = 0;
+    ssize_t ret;
+
+    if (!mq->started)
+    {
+        return;
+    }
+    if (pytun_mq_current == mq)
+    {
+        __atomic_store_n(&mq->stopping, 1, __ATOMIC_RELAXED);
+        ret = write(mq->stop_pipe[1], &c, 1);
+        (void)ret;
+        return;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    ret = write(mq->stop_pipe[1], &c, 1);
+    (void)ret;
+    for (i = 0; i < mq->nqueues; i++)
+    {
+        if (mq->state[i].running)
+        {
+            pthread_join(mq->state[i].thread, NULL);
+            mq->state[i].running = 0;
+        }
+    }
+    Py_END_ALLOW_THREADS
+    for (i = 0; mq->queues != NULL && i < mq->nqueues; i++)
+    {
+        pytun_tuntap_put_fd((pytun_tuntap_t*)PyTuple_GET_ITEM(mq->queues, i));
+    }
+    close(mq->stop_pipe[0]);
+    close(mq->stop_pipe[1]);
+    mq->stop_pipe[0] = mq->stop_pipe[1] = -1;
+    __atomic_store_n(&mq->stopping, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&mq->started, 0, __ATOMIC_RELAXED);
+}
+
+static void pytun_mq_dealloc(PyObject* self)
+{
+    PyTypeObject* type = Py_TYPE(self);
+    pytun_mq_t* mq = (pytun_mq_t*)self;
+
+    PyObject_GC_UnTrack(self);
+    pytun_mq_join(mq);
+    pytun_mq_clear(self);
+    PyMem_Free(mq->state);
+    pthread_mutex_destroy(&mq->lock);
+    type->tp_free(self);
+    PYTUN_TYPE_DECREF(type);
+}
+
+static PyObject* pytun_mq_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+    pytun_mq_t* mq;
+    const char* name = "";
+    unsigned int nqueues = 2;
+    int flags = IFF_TUN;
+    const char* dev = "/dev/net/tun";
+    char* kwlist[] = {"name", "queues", "flags", "dev", NULL};
+    PyObject* queue;
+    PyObject* qargs;
+    unsigned int i;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|sIis:MultiQueueDevice", kwlist, &name, &nqueues, &flags, &dev))
+    {
+        return NULL;
+    }
+    if (nqueues == 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "queues must be > 0");
+        return NULL;
+    }
+
+    mq = (pytun_mq_t*)type->tp_alloc(type, 0);
+    if (mq == NULL)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&mq->lock, NULL);
+    mq->stop_pipe[0] = mq->stop_pipe[1] = -1;
+    mq->state = PyMem_New(pytun_mq_queue_t, nqueues);
+    mq->queues = PyTuple_New(nqueues);
+    if (mq->state == NULL || mq->queues == NULL)
+    {
+        if (mq->state == NULL)
+        {
+            PyErr_NoMemory();
+        }
+        goto error;
+    }
+    memset(mq->state, 0, nqueues * sizeof(*mq->state));
+    mq->nqueues = nqueues;
+
+    /* Open all the queues, the first one creates the interface if needed.
+       If any of them fails, the already opened ones are closed when the
+       tuple holding them is released. */
+    for (i = 0; i < nqueues; i++)
+    {
+        qargs = Py_BuildValue("(sis)", name, flags | IFF_MULTI_QUEUE, dev);
+        if (qargs == NULL)
+        {
+            goto error;
+        }
+        queue = PyObject_Call((PyObject*)pytun_state_of_type(type)->tuntap_type, qargs, NULL);
+        Py_DECREF(qargs);
+        if (queue == NULL)
+        {
+            goto error;
+        }
+        PyTuple_SET_ITEM(mq->queues, i, queue);
+        name = ((pytun_tuntap_t*)queue)->name;
+        mq->state[i].mq = mq;
+        mq->state[i].index = i;
+        mq->state[i].fd = ((pytun_tuntap_t*)queue)->fd;
+        mq->state[i].stats = &((pytun_tuntap_t*)queue)->stats;
+        mq->state[i].capture = &((pytun_tuntap_t*)queue)->capture;
+        mq->state[i].cpu = -1;
+    }
+
+    return (PyObject*)mq;
+
+error:
+    Py_DECREF(mq);
+
+    return NULL;
+}
+
+static PyObject* pytun_mq_start(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    pytun_mq_t* mq = (pytun_mq_t*)self;
+    PyObject* callback;
+    PyObject* cpus = Py_None;
+    unsigned int batch = 64;
+    unsigned int size = 65536;
+    char* kwlist[] = {"callback", "cpus", "batch", "size", NULL};
+    PyObject* fast = NULL;
+    PyObject* old_callback = NULL;
+    PyObject* res = NULL;
+    Py_ssize_t ncpus = 0;
+    int* cpu = NULL;
+    unsigned int i;
+    int ret;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OII:start", kwlist, &callback, &cpus, &batch, &size))
+    {
+        return NULL;
+    }
+    if (pytun_mq_current == mq)
+    {
+        raise_error(pytun_state_of(self), "Reader threads already started");
+        return NULL;
+    }
+    if (!PyCallable_Check(callback))
+    {
+        PyErr_SetString(PyExc_TypeError, "callback must be callable");
+        return NULL;
+    }
+    if (batch == 0 || size == 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "batch and size must be > 0");
+        return NULL;
+    }
+    /* Convert the CPU numbers before locking, it may run Python code */
+    cpu = PyMem_New(int, mq->nqueues);
+    if (cpu == NULL)
+    {
+        return PyErr_NoMemory();
+    }
+    if (cpus != Py_None)
+    {
+        fast = PySequence_Fast(cpus, "cpus must be a sequence");
+        if (fast == NULL)
+        {
+            PyMem_Free(cpu);
+            return NULL;
+        }
+        ncpus = PySequence_Fast_GET_SIZE(fast);
+    }
+    for (i = 0; i < mq->nqueues; i++)
+    {
+        cpu[i] = -1;
+        if (ncpus > 0)
+        {
+            cpu[i] = (int)PyLong_AsLong(PySequence_Fast_GET_ITEM(fast, i % ncpus));
+            if (cpu[i] == -1 && PyErr_Occurred())
+            {
+                Py_DECREF(fast);
+                PyMem_Free(cpu);
+                return NULL;
+            }
+        }
+    }
+    Py_XDECREF(fast);
+
+    pytun_start_lock(&mq->lock);
+    if (mq->started && mq->stopping)
+    {
+        pytun_mq_join(mq);
+        if (pytun_atexit(mq->stop_meth, 0) < 0)
+        {
+            goto out;
+        }
+    }
+    if (mq->started)
+    {
+        raise_error(pytun_state_of(self), "Reader threads already started");
+        goto out;
+    }
+    if (pipe(mq->stop_pipe) < 0)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        goto out;
+    }
+    if (mq->stop_meth == NULL)
+    {
+        mq->stop_meth = PyObject_GetAttrString(self, "stop");
+        if (mq->stop_meth == NULL)
+        {
+            goto error;
+        }
+    }
+    if (pytun_atexit(mq->stop_meth, 1) < 0)
+    {
+        goto error;
+    }
+    /* Keep the queues open while the threads read them */
+    for (i = 0; i < mq->nqueues; i++)
+    {
+        if (pytun_tuntap_get_fd((pytun_tuntap_t*)PyTuple_GET_ITEM(mq->queues, i)) < 0)
+        {
+            raise_error_from_errno(pytun_state_of(self));
+            while (i-- > 0)
+            {
+                pytun_tuntap_put_fd((pytun_tuntap_t*)PyTuple_GET_ITEM(mq->queues, i));
+            }
+            goto error;
+        }
+    }
+#if PY_MAJOR_VERSION < 3 || PY_MINOR_VERSION < 7
+    PyEval_InitThreads();
+#endif
+    /* The previous callback is released once unlocked, it may run Python
+       code too */
+    old_callback = mq->callback;
+    Py_INCREF(callback);
+    mq->callback = callback;
+    mq->interp = pytun_current_interp();
+    mq->batch = batch;
+    mq->size = size;
+    __atomic_store_n(&mq->started, 1, __ATOMIC_RELAXED);
+
+    for (i = 0; i < mq->nqueues; i++)
+    {
+        mq->state[i].cpu = cpu[i];
+        mq->state[i].err = 0;
+        ret = pthread_create(&mq->state[i].thread, NULL, pytun_mq_worker, &mq->state[i]);
+        if (ret != 0)
+        {
+            errno = ret;
+            raise_error_from_errno(pytun_state_of(self));
+            pytun_mq_join(mq);
+            goto out;
+        }
+        mq->state[i].running = 1;
+    }
+    Py_INCREF(Py_None);
+    res = Py_None;
+    goto out;
+
+error:
+    close(mq->stop_pipe[0]);
+    close(mq->stop_pipe[1]);
+    mq->stop_pipe[0] = mq->stop_pipe[1] = -1;
+out:
+    pthread_mutex_unlock(&mq->lock);
+    Py_XDECREF(old_callback);
+    PyMem_Free(cpu);
+
+    return res;
+}
+
+PyDoc_STRVAR(pytun_mq_start_doc,
+"start(callback, cpus=None, batch=64, size=65536) -> None.\n\
+Start one native reader thread per queue. Each thread reads batches of at\n\
+most batch packets of at most size bytes from its queue, with the GIL\n\
+released, and calls callback(queue_index, packets) for each batch. If cpus\n\
+is a sequence of CPU numbers, the thread of queue i is pinned to CPU\n\
+cpus[i % len(cpus)].");
+
+static PyObject* pytun_mq_stop(PyObject* self)
+{
+    pytun_mq_t* mq = (pytun_mq_t*)self;
+    int ret = 0;
+
+    if (pytun_mq_current == mq)
+    {
+        /* Called by a callback, the threads are only told to exit */
+        pytun_mq_join(mq);
+        Py_RETURN_NONE;
+    }
+    pytun_start_lock(&mq->lock);
+    if (mq->started)
+    {
+        pytun_mq_join(mq);
+        if (mq->stop_meth != NULL)
+        {
+            ret = pytun_atexit(mq->stop_meth, 0);
+        }
+    }
+    pthread_mutex_unlock(&mq->lock);
+    if (ret < 0)
+    {
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pytun_mq_stop_doc,
+"stop() -> None.\n\
+Stop the reader threads and wait for them to exit. Called from the\n\
+callback, it returns at once and the threads exit after their current\n\
+batch.");
+
+static PyObject* pytun_mq_stats(PyObject* self)
+{
+    pytun_mq_t* mq = (pytun_mq_t*)self;
+    PyObject* res;
+    PyObject* item;
+    pytun_mq_queue_t* q;
+    unsigned int i;
+    int running = PYTUN_STAT_LOAD(mq->started) && !PYTUN_STAT_LOAD(mq->stopping);
+
+    res = PyList_New(mq->nqueues);
+    if (res == NULL)
+    {
+        return NULL;
+    }
+    for (i = 0; i < mq->nqueues; i++)
+    {
+        q = &mq->state[i];
+        item = Py_BuildValue("{sKsKsKsKsisO}",
+                             "packets", PYTUN_STAT_LOAD(q->packets),
+                             "bytes", PYTUN_STAT_LOAD(q->bytes),
+                             "batches", PYTUN_STAT_LOAD(q->batches),
+                             "errors", PYTUN_STAT_LOAD(q->errors),
+                             "errno", q->err,
+                             "running", q->running && running ? Py_True : Py_False);
+        if (item == NULL)
+        {
+            Py_DECREF(res);
+            return NULL;
+        }
+        PyList_SET_ITEM(res, i, item);
+    }
+
+    return res;
+}
+
+PyDoc_STRVAR(pytun_mq_stats_doc,
+"stats() -> list of dicts.\n\
+Return the counters of the reader thread of each queue: packets, bytes,\n\
+batches, errors, the errno of the last error and whether it is running.");
+
+static PyObject* pytun_mq_close(PyObject* self)
+{
+    pytun_mq_t* mq = (pytun_mq_t*)self;
+    PyObject* res;
+    unsigned int i;
+
+    res = pytun_mq_stop(self);
+    if (res == NULL)
+    {
+        return NULL;
+    }
+    Py_DECREF(res);
+    for (i = 0; mq->queues != NULL && i < mq->nqueues; i++)
+    {
+        res = pytun_tuntap_close(PyTuple_GET_ITEM(mq->queues, i));
+        Py_XDECREF(res);
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pytun_mq_close_doc,
+"close() -> None.\n\
+Stop the reader threads and close all the queues.");
+
+static PyObject* pytun_mq_get_queues(PyObject* self, void* d)
+{
+    pytun_mq_t* mq = (pytun_mq_t*)self;
+
+    if (mq->queues == NULL)
+    {
+        raise_error(pytun_state_of(self), "Device has been cleared");
+        return NULL;
+    }
+    Py_INCREF(mq->queues);
+
+    return mq->queues;
+}
+
+static PyObject* pytun_mq_get_name(PyObject* self, void* d)
+{
+    pytun_mq_t* mq = (pytun_mq_t*)self;
+
+    if (mq->queues == NULL)
+    {
+        raise_error(pytun_state_of(self), "Device has been cleared");
+        return NULL;
+    }
+
+    return pytun_tuntap_get_name(PyTuple_GET_ITEM(mq->queues, 0), NULL);
+}
+
+static PyGetSetDef pytun_mq_prop[] =
+{
+    {
+     "queues",
+     pytun_mq_get_queues,
+     NULL,
+     "tuple of the TunTapDevice of each queue",
+     NULL
+    },
+    {
+     "name",
+     pytun_mq_get_name,
+     NULL,
+     NULL,
+     NULL
+    },
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyMethodDef pytun_mq_meth[] =
+{
+    {
+     "start",
+     (PyCFunction)pytun_mq_start,
+     METH_VARARGS | METH_KEYWORDS,
+     pytun_mq_start_doc
+    },
+    {
+     "stop",
+     (PyCFunction)pytun_mq_stop,
+     METH_NOARGS,
+     pytun_mq_stop_doc
+    },
+    {
+     "stats",
+     (PyCFunction)pytun_mq_stats,
+     METH_NOARGS,
+     pytun_mq_stats_doc
+    },
+    {
+     "close",
+     (PyCFunction)pytun_mq_close,
+     METH_NOARGS,
+     pytun_mq_close_doc
+    },
+    {NULL, NULL, 0, NULL}
+};
+
+PyDoc_STRVAR(pytun_mq_doc,
+"MultiQueueDevice(name='', queues=2, flags=IFF_TUN, dev='/dev/net/tun') -> multi-queue device object.\n\
+Open all the queues of a TUN/TAP device created with IFF_MULTI_QUEUE. Either\n\
+all the queues are opened or none is.");
+
+static PyType_Slot pytun_mq_slots[] =
+{
+    {Py_tp_dealloc, pytun_mq_dealloc},
+    {Py_tp_doc, (void*)pytun_mq_doc},
+    {Py_tp_traverse, pytun_mq_traverse},
+    {Py_tp_clear, pytun_mq_clear},
+    {Py_tp_methods, pytun_mq_meth},
+    {Py_tp_getset, pytun_mq_prop},
+    {Py_tp_new, pytun_mq_new},
+    {0, NULL}
+};
+
+static PyType_Spec pytun_mq_spec =
+{
+    .name = "pytun.MultiQueueDevice",
+    .basicsize = sizeof(pytun_mq_t),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_HAVE_GC,
+    .slots = pytun_mq_slots
+};
+#endif
+
+/* Parse a (host, port) pair with a numeric IPv4 or IPv6 host */
+static int pytun_parse_sockaddr(pytun_state_t* state, PyObject* obj, struct sockaddr_storage* ss, socklen_t* sslen)
+{
+    const char* host;
+    unsigned short port;
+    struct sockaddr_in* sin = (struct sockaddr_in*)ss;
+    struct sockaddr_in6* sin6 = (struct sockaddr_in6*)ss;
+    unsigned int flowinfo = 0;
+    unsigned int scope_id = 0;
+
+    if (!PyTuple_Check(obj))
+    {
+        PyErr_SetString(PyExc_TypeError, "address must be a (host, port) tuple");
+        return -1;
+    }
+    if (!PyArg_ParseTuple(obj, "sH|II;address must be a (host, port) tuple", &host, &port, &flowinfo, &scope_id))
+    {
+        return -1;
+    }
+    memset(ss, 0, sizeof(*ss));
+    if (inet_pton(AF_INET, host, &sin->sin_addr) == 1)
+    {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        *sslen = sizeof(*sin);
+        return 0;
+    }
+    if (inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1)
+    {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        sin6->sin6_flowinfo = htonl(flowinfo);
+        sin6->sin6_scope_id = scope_id;
+        *sslen = sizeof(*sin6);
+        return 0;
+    }
+    raise_error(state, "Bad IP address");
+
+    return -1;
+}
+
+/* Get the IPv4 address of ss, which may be mapped to IPv6 (::ffff:a.b.c.d)
+   as dual-stack sockets receive them. Return 0 if it is not an IPv4 one. */
+static int pytun_sockaddr_in(const struct sockaddr_storage* ss, struct sockaddr_in* sin)
+{
+    const struct sockaddr_in6* sin6 = (const struct sockaddr_in6*)ss;
+
+    if (ss->ss_family == AF_INET)
+    {
+        memcpy(sin, ss, sizeof(*sin));
+        return 1;
+    }
+    if (ss->ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+    {
+        memset(sin, 0, sizeof(*sin));
+        sin->sin_family = AF_INET;
+        sin->sin_port = sin6->sin6_port;
+        memcpy(&sin->sin_addr, &sin6->sin6_addr.s6_addr[12], sizeof(sin->sin_addr));
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Return 1 if a and b hold the same address and port, an IPv4 address
+   being equal to its mapped IPv6 form */
+static int pytun_same_sockaddr(const struct sockaddr_storage* a, const struct sockaddr_storage* b)
+{
+    struct sockaddr_in a4;
+    struct sockaddr_in b4;
+    const struct sockaddr_in6* a6 = (const struct sockaddr_in6*)a;
+    const struct sockaddr_in6* b6 = (const struct sockaddr_in6*)b;
+
+    if (pytun_sockaddr_in(a, &a4) && pytun_sockaddr_in(b, &b4))
+    {
+        return a4.sin_port == b4.sin_port && a4.sin_addr.s_addr == b4.sin_addr.s_addr;
+    }
+    if (a->ss_family == AF_INET6 && b->ss_family == AF_INET6)
+    {
+        return a6->sin6_port == b6->sin6_port &&
+               memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0;
+    }
+
+    return 0;
+}
+
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 14)
+/* sendmmsg() appeared in glibc 2.14 */
+static int pytun_sendmmsg(int fd, struct mmsghdr* msgvec, unsigned int vlen, int flags)
+{
+    return syscall(SYS_sendmmsg, fd, msgvec, vlen, flags);
+}
+#else
+#define pytun_sendmmsg sendmmsg
+#endif
+
+struct pytun_relay
+{
+    PyObject_HEAD
+    PyObject* device;
+    PyObject* sock;
+    PyObject* on_event;
+    PyObject* stop_meth;
+    PyInterpreterState* interp;
+    int dev_fd;
+    pytun_stats_t* dev_stats;
+    pytun_capture_t* dev_capture;
+    int sock_fd;
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+    unsigned int batch;
+    unsigned int size;
+    int stop_pipe[2];
+    int started;
+    int running;
+    int err;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    /* Device to socket */
+    unsigned PY_LONG_LONG dev_rx_packets;
+    unsigned PY_LONG_LONG dev_rx_bytes;
+    unsigned PY_LONG_LONG sock_tx_packets;
+    unsigned PY_LONG_LONG sock_tx_errors;
+    /* Socket to device */
+    unsigned PY_LONG_LONG sock_rx_packets;
+    unsigned PY_LONG_LONG sock_rx_bytes;
+    unsigned PY_LONG_LONG dev_tx_packets;
+    unsigned PY_LONG_LONG dev_tx_errors;
+    unsigned PY_LONG_LONG dev_tx_shaped;
+    unsigned PY_LONG_LONG foreign_drops;
+};
+typedef struct pytun_relay pytun_relay_t;
+
+/* Relay whose thread is the calling one, if any */
+static __thread pytun_relay_t* pytun_relay_current;
+
+/* Call the event callback of the relay, must be called without the GIL */
+static void pytun_relay_event(pytun_relay_t* relay, const char* event, int err)
+{
+    PyThreadState* tstate;
+    PyObject* callback;
+    PyObject* res;
+
+    tstate = PyThreadState_New(relay->interp);
+    if (tstate == NULL)
+    {
+        return;
+    }
+    PyEval_RestoreThread(tstate);
+    callback = relay->on_event;
+    if (callback != NULL)
+    {
+        Py_INCREF(callback);
+        res = PyObject_CallFunction(callback, "si", event, err);
+        if (res == NULL)
+        {
+            PyErr_WriteUnraisable(callback);
+        }
+        Py_XDECREF(res);
+        Py_DECREF(callback);
+    }
+    pytun_thread_state_delete(tstate);
+}
+
+static void* pytun_relay_worker(void* arg)
+{
+    pytun_relay_t* relay = (pytun_relay_t*)arg;
+    unsigned int batch = relay->batch;
+    size_t size = relay->size;
+    char* tx_arena = NULL;
+    char* rx_arena = NULL;
+    Py_ssize_t* offsets = NULL;
+    struct mmsghdr* tx_msgs = NULL;
+    struct mmsghdr* rx_msgs = NULL;
+    struct iovec* tx_iov = NULL;
+    struct iovec* rx_iov = NULL;
+    struct sockaddr_storage* rx_addrs = NULL;
+    struct pollfd pfd[3];
+    Py_ssize_t n;
+    Py_ssize_t i;
+    Py_ssize_t kept;
+    Py_ssize_t dropped;
+    pytun_tb_t* tb;
+    int sent;
+    int ret;
+    int err = 0;
+
+    pytun_relay_current = relay;
+    tx_arena = malloc(batch * size);
+    rx_arena = malloc(batch * size);
+    offsets = malloc((batch + 1) * sizeof(*offsets));
+    tx_msgs = calloc(batch, sizeof(*tx_msgs));
+    rx_msgs = calloc(batch, sizeof(*rx_msgs));
+    tx_iov = calloc(batch, sizeof(*tx_iov));
+    rx_iov = calloc(batch, sizeof(*rx_iov));
+    rx_addrs = calloc(batch, sizeof(*rx_addrs));
+    if (tx_arena == NULL || rx_arena == NULL || offsets == NULL || tx_msgs == NULL ||
+        rx_msgs == NULL || tx_iov == NULL || rx_iov == NULL || rx_addrs == NULL)
+    {
+        err = ENOMEM;
+        goto out;
+    }
+    for (i = 0; i < (Py_ssize_t)batch; i++)
+    {
+        tx_msgs[i].msg_hdr.msg_name = &relay->peer;
+        tx_msgs[i].msg_hdr.msg_namelen = relay->peer_len;
+        tx_msgs[i].msg_hdr.msg_iov = &tx_iov[i];
+        tx_msgs[i].msg_hdr.msg_iovlen = 1;
+        rx_iov[i].iov_base = rx_arena + i * size;
+        rx_iov[i].iov_len = size;
+    }
+
+    pfd[0].fd = relay->dev_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = relay->sock_fd;
+    pfd[1].events = POLLIN;
+    pfd[2].fd = relay->stop_pipe[0];
+    pfd[2].events = POLLIN;
+    for (;;)
+    {
+        if (poll(pfd, 3, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            err = errno;
+            break;
+        }
+        if (pfd[2].revents)
+        {
+            break;
+        }
+        if (pfd[0].revents & (POLLERR | POLLHUP | POLLNVAL) ||
+            pfd[1].revents & (POLLERR | POLLHUP | POLLNVAL))
+        {
+            err = EIO;
+            break;
+        }
+
+        /* Device to socket */
+        if (pfd[0].revents & POLLIN)
+        {
+            n = pytun_read_batch(relay->dev_fd, tx_arena, batch * size, size, batch, offsets,
+                                 relay->dev_stats, relay->dev_capture);
+            if (n < 0 && errno != EAGAIN && errno != EINTR)
+            {
+                err = errno;
+                break;
+            }
+            for (i = 0; i < n; i++)
+            {
+                tx_iov[i].iov_base = tx_arena + offsets[i];
+                tx_iov[i].iov_len = offsets[i + 1] - offsets[i];
+            }
+            if (n > 0)
+            {
+                PYTUN_STAT_ADD(relay, dev_rx_packets, n);
+                PYTUN_STAT_ADD(relay, dev_rx_bytes, offsets[n]);
+            }
+            for (sent = 0; sent < n; )
+            {
+                ret = pytun_sendmmsg(relay->sock_fd, tx_msgs + sent, n - sent, 0);
+                if (ret < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    /* Drop the packet which could not be sent */
+                    PYTUN_STAT_ADD(relay, sock_tx_errors, 1);
+                    ret = 1;
+                }
+                else
+                {
+                    PYTUN_STAT_ADD(relay, sock_tx_packets, ret);
+                }
+                sent += ret;
+            }
+        }
+
+        /* Socket to device */
+        if (pfd[1].revents & POLLIN)
+        {
+            for (i = 0; i < (Py_ssize_t)batch; i++)
+            {
+                rx_msgs[i].msg_hdr.msg_name = &rx_addrs[i];
+                rx_msgs[i].msg_hdr.msg_namelen = sizeof(rx_addrs[i]);
+                rx_msgs[i].msg_hdr.msg_iov = &rx_iov[i];
+                rx_msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            ret = recvmmsg(relay->sock_fd, rx_msgs, batch, MSG_DONTWAIT, NULL);
+            if (ret < 0 && errno != EAGAIN && errno != EINTR)
+            {
+                err = errno;
+                break;
+            }
+            /* Only keep the datagrams coming from the peer */
+            kept = 0;
+            for (i = 0; i < ret; i++)
+            {
+                PYTUN_STAT_ADD(relay, sock_rx_packets, 1);
+                PYTUN_STAT_ADD(relay, sock_rx_bytes, rx_msgs[i].msg_len);
+                if (!pytun_same_sockaddr(&rx_addrs[i], &relay->peer))
+                {
+                    PYTUN_STAT_ADD(relay, foreign_drops, 1);
+                    continue;
+                }
+                tx_iov[kept].iov_base = rx_iov[i].iov_base;
+                tx_iov[kept].iov_len = rx_msgs[i].msg_len;
+                kept++;
+            }
+            tb = pytun_tuntap_shaper((pytun_tuntap_t*)relay->device);
+            for (i = 0; i < kept; )
+            {
+                dropped = 0;
+                n = pytun_write_batch(relay->dev_fd, tx_iov + i, kept - i, relay->dev_stats,
+                                      relay->dev_capture, tb, &dropped);
+                if (n < 0)
+                {
+                    /* Skip the dropped packets and the one which failed */
+                    PYTUN_STAT_ADD(relay, dev_tx_errors, 1);
+                    PYTUN_STAT_ADD(relay, dev_tx_shaped, dropped);
+                    n = dropped + 1;
+                }
+                else
+                {
+                    PYTUN_STAT_ADD(relay, dev_tx_packets, n - dropped);
+                    PYTUN_STAT_ADD(relay, dev_tx_shaped, dropped);
+                }
+                i += n;
+            }
+            pytun_tb_decref(tb);
+        }
+    }
+
+out:
+    free(tx_arena);
+    free(rx_arena);
+    free(offsets);
+    free(tx_msgs);
+    free(rx_msgs);
+    free(tx_iov);
+    free(rx_iov);
+    free(rx_addrs);
+    relay->err = err;
+    __atomic_store_n(&relay->running, 0, __ATOMIC_RELAXED);
+    pytun_relay_event(relay, err != 0 ? "error" : "stopped", err);
+
+    return NULL;
+}
+
+static int pytun_relay_traverse(PyObject* self, visitproc visit, void* arg)
+{
+    pytun_relay_t* relay = (pytun_relay_t*)self;
+
+    PYTUN_VISIT_TYPE(self);
+    Py_VISIT(relay->device);
+    Py_VISIT(relay->sock);
+    Py_VISIT(relay->on_event);
+    Py_VISIT(relay->stop_meth);
+
+    return 0;
+}
+
+static int pytun_relay_clear(PyObject* self)
+{
+    pytun_relay_t* relay = (pytun_relay_t*)self;
+
+    Py_CLEAR(relay->device);
+    Py_CLEAR(relay->sock);
+    Py_CLEAR(relay->on_event);
+    Py_CLEAR(relay->stop_meth);
+
+    return 0;
+}
+
+/* Stop and join the relay thread. Called from on_event, the thread is
+   already exiting and cannot join itself: it is joined by the next start()
+   or stop(), or by the deallocation. */
+static void pytun_relay_join(pytun_relay_t* relay)
+{
+    char c = 0;
+    ssize_t ret;
+
+    if (!relay->started || pytun_relay_current == relay)
+    {
+        return;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    ret = write(relay->stop_pipe[1], &c, 1);
+    (void)ret;
+    pthread_join(relay->thread, NULL);
+    Py_END_ALLOW_THREADS
+    if (relay->device != NULL)
+    {
+        pytun_tuntap_put_fd((pytun_tuntap_t*)relay->device);
+    }
+    close(relay->sock_fd);
+    relay->sock_fd = -1;
+    close(relay->stop_pipe[0]);
+    close(relay->stop_pipe[1]);
+    relay->stop_pipe[0] = relay->stop_pipe[1] = -1;
+    relay->started = 0;
+}
+
+static void pytun_relay_dealloc(PyObject* self)
+{
+    PyTypeObject* type = Py_TYPE(self);
+
+    PyObject_GC_UnTrack(self);
+    pytun_relay_join((pytun_relay_t*)self);
+    pytun_relay_clear(self);
+    pthread_mutex_destroy(&((pytun_relay_t*)self)->lock);
+    type->tp_free(self);
+    PYTUN_TYPE_DECREF(type);
+}
+
+static PyObject* pytun_relay_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+    pytun_relay_t* relay;
+    PyObject* device;
+    PyObject* sock;
+    PyObject* peer;
+    unsigned int batch = 64;
+    unsigned int size = 65536;
+    char* kwlist[] = {"device", "sock", "peer", "batch", "size", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!OO|II:Relay", kwlist, pytun_state_of_type(type)->tuntap_type, &device,
+                                     &sock, &peer, &batch, &size))
+    {
+        return NULL;
+    }
+    if (batch == 0 || size == 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "batch and size must be > 0");
+        return NULL;
+    }
+
+    relay = (pytun_relay_t*)type->tp_alloc(type, 0);
+    if (relay == NULL)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&relay->lock, NULL);
+    relay->sock_fd = -1;
+    relay->stop_pipe[0] = relay->stop_pipe[1] = -1;
+    Py_INCREF(device);
+    relay->device = device;
+    Py_INCREF(sock);
+    relay->sock = sock;
+    relay->dev_fd = ((pytun_tuntap_t*)device)->fd;
+    relay->dev_stats = &((pytun_tuntap_t*)device)->stats;
+    relay->dev_capture = &((pytun_tuntap_t*)device)->capture;
+    relay->batch = batch;
+    relay->size = size;
+
+    /* The descriptor is only duplicated by start() */
+    if (PyObject_AsFileDescriptor(sock) < 0)
+    {
+        goto error;
+    }
+    if (pytun_parse_sockaddr(pytun_state_of_type(type), peer, &relay->peer, &relay->peer_len) < 0)
+    {
+        goto error;
+    }
+
+    return (PyObject*)relay;
+
+error:
+    Py_DECREF(relay);
+
+    return NULL;
+}
+
+static PyObject* pytun_relay_start(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    pytun_relay_t* relay = (pytun_relay_t*)self;
+    PyObject* on_event = Py_None;
+    PyObject* old_on_event = NULL;
+    PyObject* res = NULL;
+    char* kwlist[] = {"on_event", NULL};
+    int sock_fd;
+    int ret;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:start", kwlist, &on_event))
+    {
+        return NULL;
+    }
+    if (pytun_relay_current == relay)
+    {
+        raise_error(pytun_state_of(self), "Relay already started");
+        return NULL;
+    }
+    if (on_event != Py_None && !PyCallable_Check(on_event))
+    {
+        PyErr_SetString(PyExc_TypeError, "on_event must be callable");
+        return NULL;
+    }
+    sock_fd = PyObject_AsFileDescriptor(relay->sock);
+    if (sock_fd < 0)
+    {
+        return NULL;
+    }
+
+    pytun_start_lock(&relay->lock);
+    /* Join a thread which exited by itself */
+    if (relay->started && !PYTUN_STAT_LOAD(relay->running))
+    {
+        pytun_relay_join(relay);
+        if (pytun_atexit(relay->stop_meth, 0) < 0)
+        {
+            goto out;
+        }
+    }
+    if (relay->started)
+    {
+        raise_error(pytun_state_of(self), "Relay already started");
+        goto out;
+    }
+    if (pipe(relay->stop_pipe) < 0)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        goto out;
+    }
+    /* The thread uses its own descriptor of the socket, which stays valid
+       (and isn't reused) whatever is done with the socket object */
+    relay->sock_fd = fcntl(sock_fd, F_DUPFD_CLOEXEC, 0);
+    if (relay->sock_fd < 0)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        goto error;
+    }
+    if (relay->stop_meth == NULL)
+    {
+        relay->stop_meth = PyObject_GetAttrString(self, "stop");
+        if (relay->stop_meth == NULL)
+        {
+            goto error;
+        }
+    }
+    if (pytun_atexit(relay->stop_meth, 1) < 0)
+    {
+        goto error;
+    }
+#if PY_MAJOR_VERSION < 3 || PY_MINOR_VERSION < 7
+    PyEval_InitThreads();
+#endif
+    /* The previous callback is released once unlocked, it may run Python
+       code */
+    old_on_event = relay->on_event;
+    relay->on_event = NULL;
+    if (on_event != Py_None)
+    {
+        Py_INCREF(on_event);
+        relay->on_event = on_event;
+    }
+
+    /* Keep the device open while the thread relays it */
+    if (pytun_tuntap_get_fd((pytun_tuntap_t*)relay->device) < 0)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        goto error;
+    }
+    relay->interp = pytun_current_interp();
+    relay->err = 0;
+    __atomic_store_n(&relay->running, 1, __ATOMIC_RELAXED);
+    ret = pthread_create(&relay->thread, NULL, pytun_relay_worker, relay);
+    if (ret != 0)
+    {
+        __atomic_store_n(&relay->running, 0, __ATOMIC_RELAXED);
+        pytun_tuntap_put_fd((pytun_tuntap_t*)relay->device);
+        errno = ret;
+        raise_error_from_errno(pytun_state_of(self));
+        goto error;
+    }
+    relay->started = 1;
+    Py_INCREF(Py_None);
+    res = Py_None;
+    goto out;
+
+error:
+    if (relay->sock_fd >= 0)
+    {
+        close(relay->sock_fd);
+        relay->sock_fd = -1;
+    }
+    close(relay->stop_pipe[0]);
+    close(relay->stop_pipe[1]);
+    relay->stop_pipe[0] = relay->stop_pipe[1] = -1;
+out:
+    pthread_mutex_unlock(&relay->lock);
+    Py_XDECREF(old_on_event);
+
+    return res;
+}
+
+PyDoc_STRVAR(pytun_relay_start_doc,
+"start(on_event=None) -> None.\n\
+Start relaying packets in a native thread. When the thread exits,\n\
+on_event('stopped', 0) or on_event('error', errno) is called. A relay\n\
+whose thread exited on an error can be started again without stop().");
+
+static PyObject* pytun_relay_stop(PyObject* self)
+{
+    pytun_relay_t* relay = (pytun_relay_t*)self;
+    int ret = 0;
+
+    if (pytun_relay_current == relay)
+    {
+        /* Called by on_event, the thread is already exiting */
+        Py_RETURN_NONE;
+    }
+    pytun_start_lock(&relay->lock);
+    if (relay->started)
+    {
+        pytun_relay_join(relay);
+        if (relay->stop_meth != NULL)
+        {
+            ret = pytun_atexit(relay->stop_meth, 0);
+        }
+    }
+    pthread_mutex_unlock(&relay->lock);
+    if (ret < 0)
+    {
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pytun_relay_stop_doc,
+"stop() -> None.\n\
+Stop relaying packets and wait for the thread to exit. Called from\n\
+on_event, it returns at once.");
+
+static PyObject* pytun_relay_stats(PyObject* self)
+{
+    pytun_relay_t* relay = (pytun_relay_t*)self;
+
+    return Py_BuildValue("{sKsKsKsKsKsKsKsKsKsKsisO}",
+                         "dev_rx_packets", PYTUN_STAT_LOAD(relay->dev_rx_packets),
+                         "dev_rx_bytes", PYTUN_STAT_LOAD(relay->dev_rx_bytes),
+                         "sock_tx_packets", PYTUN_STAT_LOAD(relay->sock_tx_packets),
+                         "sock_tx_errors", PYTUN_STAT_LOAD(relay->sock_tx_errors),
+                         "sock_rx_packets", PYTUN_STAT_LOAD(relay->sock_rx_packets),
+                         "sock_rx_bytes", PYTUN_STAT_LOAD(relay->sock_rx_bytes),
+                         "dev_tx_packets", PYTUN_STAT_LOAD(relay->dev_tx_packets),
+                         "dev_tx_errors", PYTUN_STAT_LOAD(relay->dev_tx_errors),
+                         "dev_tx_shaped", PYTUN_STAT_LOAD(relay->dev_tx_shaped),
+                         "foreign_drops", PYTUN_STAT_LOAD(relay->foreign_drops),
+                         "errno", relay->err,
+                         "running", PYTUN_STAT_LOAD(relay->running) ? Py_True : Py_False);
+}
+
+PyDoc_STRVAR(pytun_relay_stats_doc,
+"stats() -> dict.\n\
+Return the counters of the relay. Datagrams received from another address\n\
+than the peer are counted in foreign_drops, those dropped by the shaper of\n\
+the device in dev_tx_shaped.");
+
+static PyMethodDef pytun_relay_meth[] =
+{
+    {
+     "start",
+     (PyCFunction)pytun_relay_start,
+     METH_VARARGS | METH_KEYWORDS,
+     pytun_relay_start_doc
+    },
+    {
+     "stop",
+     (PyCFunction)pytun_relay_stop,
+     METH_NOARGS,
+     pytun_relay_stop_doc
+    },
+    {
+     "stats",
+     (PyCFunction)pytun_relay_stats,
+     METH_NOARGS,
+     pytun_relay_stats_doc
+    },
+    {NULL, NULL, 0, NULL}
+};
+
+PyDoc_STRVAR(pytun_relay_doc,
+"Relay(device, sock, peer, batch=64, size=65536) -> relay object.\n\
+Forward packets between device and the UDP socket sock in a native thread,\n\
+with the GIL released. Packets read from the device are sent to peer, a\n\
+(host, port) pair, and datagrams received from peer are written to the\n\
+device. Batches of at most batch packets of at most size bytes are moved\n\
+with recvmmsg()/sendmmsg() on the socket side. The thread uses a duplicate\n\
+of the descriptor of sock, closing sock doesn't stop it.");
+
+static PyType_Slot pytun_relay_slots[] =
+{
+    {Py_tp_dealloc, pytun_relay_dealloc},
+    {Py_tp_doc, (void*)pytun_relay_doc},
+    {Py_tp_traverse, pytun_relay_traverse},
+    {Py_tp_clear, pytun_relay_clear},
+    {Py_tp_methods, pytun_relay_meth},
+    {Py_tp_new, pytun_relay_new},
+    {0, NULL}
+};
+
+static PyType_Spec pytun_relay_spec =
+{
+    .name = "pytun.Relay",
+    .basicsize = sizeof(pytun_relay_t),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_HAVE_GC,
+    .slots = pytun_relay_slots
+};
+
+#ifdef PYTUN_HAVE_IO_URING
+#define PYTUN_URING_WRITE (1ULL << 32)
+
+/* Submission and completion queues of an io_uring instance */
+struct pytun_uring_queues
+{
+    int fd;
+    void* sq_ptr;
+    size_t sq_sz;
+    void* cq_ptr;
+    size_t cq_sz;
+    struct io_uring_sqe* sqes;
+    size_t sqes_sz;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned to_submit;
+};
+typedef struct pytun_uring_queues pytun_uring_queues_t;
+
+static void pytun_uring_queues_close(pytun_uring_queues_t* q)
+{
+    if (q->sqes != NULL)
+    {
+        munmap(q->sqes, q->sqes_sz);
+    }
+    if (q->cq_ptr != NULL && q->cq_ptr != q->sq_ptr)
+    {
+        munmap(q->cq_ptr, q->cq_sz);
+    }
+    if (q->sq_ptr != NULL)
+    {
+        munmap(q->sq_ptr, q->sq_sz);
+    }
+    if (q->fd >= 0)
+    {
+        close(q->fd);
+    }
+    memset(q, 0, sizeof(*q));
+    q->fd = -1;
+}
+
+/* Create an io_uring instance with the raw system calls. Returns -1 with
+   errno set on failure. */
+static int pytun_uring_queues_open(pytun_uring_queues_t* q, unsigned entries)
+{
+    struct io_uring_params p;
+    void* ptr;
+
+    memset(q, 0, sizeof(*q));
+    memset(&p, 0, sizeof(p));
+    q->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (q->fd < 0)
+    {
+        q->fd = -1;
+        return -1;
+    }
+
+    q->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    q->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+#ifdef IORING_FEAT_SINGLE_MMAP
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (q->cq_sz > q->sq_sz)
+        {
+            q->sq_sz = q->cq_sz;
+        }
+        q->cq_sz = q->sq_sz;
+    }
+#endif
+    ptr = mmap(NULL, q->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQ_RING);
+    if (ptr == MAP_FAILED)
+    {
+        goto error;
+    }
+    q->sq_ptr = ptr;
+#ifdef IORING_FEAT_SINGLE_MMAP
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        q->cq_ptr = q->sq_ptr;
+    }
+    else
+#endif
+    {
+        ptr = mmap(NULL, q->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_CQ_RING);
+        if (ptr == MAP_FAILED)
+        {
+            goto error;
+        }
+        q->cq_ptr = ptr;
+    }
+    q->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    ptr = mmap(NULL, q->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQES);
+    if (ptr == MAP_FAILED)
+    {
+        goto error;
+    }
+    q->sqes = ptr;
+
+    q->sq_head = (unsigned*)((char*)q->sq_ptr + p.sq_off.head);
+    q->sq_tail = (unsigned*)((char*)q->sq_ptr + p.sq_off.tail);
+    q->sq_array = (unsigned*)((char*)q->sq_ptr + p.sq_off.array);
+    q->sq_mask = *(unsigned*)((char*)q->sq_ptr + p.sq_off.ring_mask);
+    q->sq_entries = p.sq_entries;
+    q->cq_head = (unsigned*)((char*)q->cq_ptr + p.cq_off.head);
+    q->cq_tail = (unsigned*)((char*)q->cq_ptr + p.cq_off.tail);
+    q->cq_mask = *(unsigned*)((char*)q->cq_ptr + p.cq_off.ring_mask);
+    q->cqes = (struct io_uring_cqe*)((char*)q->cq_ptr + p.cq_off.cqes);
+
+    return 0;
+
+error:
+    pytun_uring_queues_close(q);
+
+    return -1;
+}
+
+/* Submit the queued entries and wait for at least min_complete completions */
+static int pytun_uring_enter(pytun_uring_queues_t* q, unsigned min_complete)
+{
+    int ret;
+
+    ret = syscall(__NR_io_uring_enter, q->fd, q->to_submit, min_complete,
+                  min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret < 0)
+    {
+        return -1;
+    }
+    q->to_submit -= ret;
+
+    return ret;
+}
+
+/* Queue a fixed-buffer read or write. The submission queue is sized so that
+   it never overflows. */
+static void pytun_uring_queue(pytun_uring_queues_t* q, int opcode, int fd, void* buf,
+                              unsigned len, unsigned buf_index, unsigned long long user_data)
+{
+    unsigned tail = *q->sq_tail;
+    unsigned idx = tail & q->sq_mask;
+    struct io_uring_sqe* sqe = &q->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->buf_index = buf_index;
+    sqe->user_data = user_data;
+    q->sq_array[idx] = idx;
+    __atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    q->to_submit++;
+}
+
+struct pytun_uring
+{
+    PyObject_HEAD
+    PyObject* device;
+    /* Descriptor of the device, a use of which is held by each call */
+    int fd;
+    pytun_stats_t* stats;
+    pytun_capture_t* capture;
+    int busy;
+    unsigned int depth;
+    size_t size;
+    char* slab;
+    size_t slab_size;
+    pytun_uring_queues_t q;
+    /* Completed reads not handed out yet */
+    unsigned int* ready_idx;
+    int* ready_res;
+    unsigned int ready_head;
+    unsigned int nready;
+    /* Write buffers not in use */
+    unsigned int* free_wr;
+    unsigned int nfree_wr;
+    /* Length of the packet submitted in each write buffer */
+    unsigned int* wr_len;
+    /* Counters */
+    unsigned PY_LONG_LONG enters;
+    unsigned PY_LONG_LONG submitted;
+    unsigned PY_LONG_LONG completions;
+    unsigned PY_LONG_LONG reads;
+    unsigned PY_LONG_LONG writes;
+    unsigned PY_LONG_LONG read_errors;
+    unsigned PY_LONG_LONG write_errors;
+};
+typedef struct pytun_uring pytun_uring_t;
+
+/* Harvest all the available completions. Returns the number of writes
+   completed, the errno of the first failed one is stored in write_err. */
+static unsigned int pytun_uring_reap(pytun_uring_t* u, int* write_err)
+{
+    pytun_uring_queues_t* q = &u->q;
+    unsigned head = *q->cq_head;
+    unsigned tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+    struct io_uring_cqe* cqe;
+    unsigned int writes = 0;
+    unsigned int idx;
+
+    for (; head != tail; head++)
+    {
+        cqe = &q->cqes[head & q->cq_mask];
+        idx = cqe->user_data & 0xffffffff;
+        errno = cqe->res < 0 ? -cqe->res : 0;
+        if (cqe->user_data & PYTUN_URING_WRITE)
+        {
+            pytun_stats_write(u->stats, cqe->res, u->wr_len[idx - u->depth]);
+            pytun_capture_packet(u->capture, PYTUN_CAPTURE_IN, u->slab + idx * u->size, cqe->res);
+            u->free_wr[u->nfree_wr++] = idx;
+            writes++;
+            if (cqe->res < 0)
+            {
+                PYTUN_STAT_ADD(u, write_errors, 1);
+                if (*write_err == 0)
+                {
+                    *write_err = -cqe->res;
+                }
+            }
+            else
+            {
+                PYTUN_STAT_ADD(u, writes, 1);
+            }
+        }
+        else
+        {
+            pytun_stats_read(u->stats, cqe->res, u->size);
+            pytun_capture_packet(u->capture, PYTUN_CAPTURE_OUT, u->slab + idx * u->size, cqe->res);
+            u->ready_idx[(u->ready_head + u->nready) % u->depth] = idx;
+            u->ready_res[(u->ready_head + u->nready) % u->depth] = cqe->res;
+            u->nready++;
+        }
+        PYTUN_STAT_ADD(u, completions, 1);
+    }
+    __atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+
+    return writes;
+}
+
+static int pytun_uring_submit_and_wait(pytun_uring_t* u, unsigned min_complete)
+{
+    unsigned to_submit = u->q.to_submit;
+    int ret;
+
+    do
+    {
+        ret = pytun_uring_enter(&u->q, min_complete);
+    } while (ret < 0 && errno == EINTR);
+    PYTUN_STAT_ADD(u, enters, 1);
+    if (ret >= 0)
+    {
+        PYTUN_STAT_ADD(u, submitted, to_submit - u->q.to_submit);
+    }
+
+    return ret;
+}
+
+static void pytun_uring_post_read(pytun_uring_t* u, unsigned int idx)
+{
+    pytun_uring_queue(&u->q, IORING_OP_READ_FIXED, u->fd, u->slab + idx * u->size,
+                      u->size, 0, idx);
+}
+
+static void pytun_uring_dealloc(PyObject* self)
+{
+    PyTypeObject* type = Py_TYPE(self);
+    pytun_uring_t* u = (pytun_uring_t*)self;
+
+    if (u->q.fd >= 0)
+    {
+        pytun_uring_queues_close(&u->q);
+    }
+    if (u->slab != NULL)
+    {
+        munmap(u->slab, u->slab_size);
+    }
+    PyMem_Free(u->ready_idx);
+    PyMem_Free(u->ready_res);
+    PyMem_Free(u->free_wr);
+    PyMem_Free(u->wr_len);
+    Py_XDECREF(u->device);
+    type->tp_free(self);
+    PYTUN_TYPE_DECREF(type);
+}
+
+static PyObject* pytun_uring_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+    pytun_uring_t* u;
+    PyObject* device;
+    unsigned int depth = 64;
+    unsigned int size = 2048;
+    char* kwlist[] = {"device", "depth", "size", NULL};
+    struct iovec reg;
+    unsigned int i;
+    long page_size;
+    void* slab;
+    int ret;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|II:Uring", kwlist, pytun_state_of_type(type)->tuntap_type, &device, &depth, &size))
+    {
+        return NULL;
+    }
+    if (depth == 0 || depth > 4096 || size == 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "depth must be in [1, 4096] and size > 0");
+        return NULL;
+    }
+
+    u = (pytun_uring_t*)type->tp_alloc(type, 0);
+    if (u == NULL)
+    {
+        return NULL;
+    }
+    u->q.fd = -1;
+    Py_INCREF(device);
+    u->device = device;
+    u->fd = pytun_tuntap_get_fd((pytun_tuntap_t*)device);
+    if (u->fd < 0)
+    {
+        raise_error_from_errno(pytun_state_of_type(type));
+        goto error;
+    }
+    u->stats = &((pytun_tuntap_t*)device)->stats;
+    u->capture = &((pytun_tuntap_t*)device)->capture;
+    u->depth = depth;
+    u->size = size;
+
+    /* depth read buffers followed by depth write buffers */
+    page_size = sysconf(_SC_PAGESIZE);
+    u->slab_size = ((size_t)2 * depth * size + page_size - 1) / page_size * page_size;
+    slab = mmap(NULL, u->slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED)
+    {
+        raise_error_from_errno(pytun_state_of_type(type));
+        goto error;
+    }
+    u->slab = slab;
+    u->ready_idx = PyMem_New(unsigned int, depth);
+    u->ready_res = PyMem_New(int, depth);
+    u->free_wr = PyMem_New(unsigned int, depth);
+    u->wr_len = PyMem_New(unsigned int, depth);
+    if (u->ready_idx == NULL || u->ready_res == NULL || u->free_wr == NULL || u->wr_len == NULL)
+    {
+        PyErr_NoMemory();
+        goto error;
+    }
+    for (i = 0; i < depth; i++)
+    {
+        u->free_wr[i] = depth + i;
+    }
+    u->nfree_wr = depth;
+
+    /* Fall back to plain read()/write() if io_uring is not usable */
+    Py_BEGIN_ALLOW_THREADS
+    ret = pytun_uring_queues_open(&u->q, 2 * depth);
+    if (ret == 0)
+    {
+        reg.iov_base = u->slab;
+        reg.iov_len = (size_t)2 * depth * size;
+        ret = syscall(__NR_io_uring_register, u->q.fd, IORING_REGISTER_BUFFERS, &reg, 1);
+        if (ret < 0)
+        {
+            pytun_uring_queues_close(&u->q);
+        }
+    }
+    if (ret == 0)
+    {
+        for (i = 0; i < depth; i++)
+        {
+            pytun_uring_post_read(u, i);
+        }
+        ret = pytun_uring_submit_and_wait(u, 0);
+        if (ret < 0)
+        {
+            pytun_uring_queues_close(&u->q);
+        }
+    }
+    Py_END_ALLOW_THREADS
+    pytun_tuntap_put_fd((pytun_tuntap_t*)device);
+
+    return (PyObject*)u;
+
+error:
+    if (u->fd >= 0)
+    {
+        pytun_tuntap_put_fd((pytun_tuntap_t*)device);
+    }
+    Py_DECREF(u);
+
+    return NULL;
+}
+
+static PyObject* pytun_uring_do_read_many(PyObject* self, PyObject* args)
+{
+    pytun_uring_t* u = (pytun_uring_t*)self;
+    unsigned int max_packets = 0;
+    Py_ssize_t* offsets;
+    PyObject* pkts;
+    PyObject* pkt;
+    Py_ssize_t n = 0;
+    Py_ssize_t i;
+    int write_err = 0;
+    int ret = 0;
+    unsigned int idx;
+    int res;
+
+    if (!PyArg_ParseTuple(args, "|I:read_many", &max_packets))
+    {
+        return NULL;
+    }
+    if (max_packets == 0 || max_packets > u->depth)
+    {
+        max_packets = u->depth;
+    }
+
+    if (u->q.fd < 0)
+    {
+        /* Plain read() fallback */
+        offsets = PyMem_New(Py_ssize_t, max_packets + 1);
+        if (offsets == NULL)
+        {
+            return PyErr_NoMemory();
+        }
+        PYTUN_BEGIN_ALLOW_THREADS(u->stats)
+        n = pytun_read_batch(u->fd, u->slab, (size_t)max_packets * u->size, u->size, max_packets, offsets,
+                             u->stats, u->capture);
+        PYTUN_END_ALLOW_THREADS(u->stats)
+        if (n < 0)
+        {
+            PyMem_Free(offsets);
+            PYTUN_STAT_ADD(u, read_errors, 1);
+            raise_error_from_errno(pytun_state_of(self));
+            return NULL;
+        }
+        PYTUN_STAT_ADD(u, reads, n);
+        pkts = PyList_New(n);
+        for (i = 0; pkts != NULL && i < n; i++)
+        {
+            pkt = pytun_new_string(u->slab + offsets[i], offsets[i + 1] - offsets[i]);
+            if (pkt == NULL)
+            {
+                Py_CLEAR(pkts);
+                break;
+            }
+            PyList_SET_ITEM(pkts, i, pkt);
+        }
+        PyMem_Free(offsets);
+        return pkts;
+    }
+
+    /* Wait for at least one completed read, resubmitting the buffers of the
+       packets handed out previously in the same system call */
+    Py_BEGIN_ALLOW_THREADS
+    pytun_uring_reap(u, &write_err);
+    while (u->nready == 0)
+    {
+        ret = pytun_uring_submit_and_wait(u, 1);
+        if (ret < 0)
+        {
+            break;
+        }
+        pytun_uring_reap(u, &write_err);
+    }
+    Py_END_ALLOW_THREADS
+    if (ret < 0)
+    {
+        raise_error_from_errno(pytun_state_of(self));
+        return NULL;
+    }
+
+    pkts = PyList_New(0);
+    if (pkts == NULL)
+    {
+        return NULL;
+    }
+    while (u->nready > 0 && n < max_packets)
+    {
+        idx = u->ready_idx[u->ready_head];
+        res = u->ready_res[u->ready_head];
+        if (res < 0 && n > 0)
+        {
+            /* Report the error with the next call */
+            break;
+        }
+        u->ready_head = (u->ready_head + 1) % u->depth;
+        u->nready--;
+        if (res < 0)
+        {
+            PYTUN_STAT_ADD(u, read_errors, 1);
+            pytun_uring_post_read(u, idx);
+            Py_DECREF(pkts);
+            errno = -res;
+            raise_error_from_errno(pytun_state_of(self));
+            return NULL;
+        }
+        pkt = pytun_new_string(u->slab + idx * u->size, res);
+        pytun_uring_post_read(u, idx);
+        if (pkt == NULL || PyList_Append(pkts, pkt) < 0)
+        {
+            Py_XDECREF(pkt);
+            Py_DECREF(pkts);
+            return NULL;
+        }
+        Py_DECREF(pkt);
+        PYTUN_STAT_ADD(u, reads, 1);
+        n++;
+    }
+
+    return pkts;
+}
+
+/* Call a method of the Uring: its rings can't be used by several threads at
+   once, and it stops working once its device has been closed */
+static PyObject* pytun_uring_call(PyObject* self, PyObject* args, PyObject* (*meth)(PyObject*, PyObject*))
+{
+    pytun_uring_t* u = (pytun_uring_t*)self;
+    PyObject* res = NULL;
+    int fd;
+
+    if (pytun_busy_enter(pytun_state_of(self), &u->busy) < 0)
+    {
+        return NULL;
+    }
+    fd = pytun_tuntap_get_fd((pytun_tuntap_t*)u->device);
+    if (fd < 0)
+    {
+        /* The posted reads hold the device open in the kernel, release
+           them with the ring */
+        if (u->q.fd >= 0)
+        {
+            pytun_uring_queues_close(&u->q);
+        }
+        raise_error_from_errno(pytun_state_of(self));
+    }
+    else
+    {
+        u->fd = fd;
+        res = meth(self, args);
+        pytun_tuntap_put_fd((pytun_tuntap_t*)u->device);
+    }
+    pytun_busy_leave(&u->busy);
+
+    return res;
+}
+
+static PyObject* pytun_uring_read_many(PyObject* self, PyObject* args)
+{
+    return pytun_uring_call(self, args, pytun_uring_do_read_many);
+}
+
+PyDoc_STRVAR(pytun_uring_read_many_doc,
+"read_many(max_packets=0) -> list of strings.\n\
+Return the packets whose reads have completed, waiting for at least one.\n\
+At most max_packets packets are returned if it is not 0 (and never more\n\
+than depth). The buffers of the returned packets are posted again for\n\
+reading.");
+
+static PyObject* pytun_uring_do_write_many(PyObject* self, PyObject* args)
+{
+    pytun_uring_t* u = (pytun_uring_t*)self;
+    PyObject* packets;
+    PyObject* fast;
+    Py_buffer* bufs = NULL;
+    struct iovec* iov = NULL;
+    Py_ssize_t nbufs = 0;
+    Py_ssize_t n;
+    Py_ssize_t i;
+    Py_ssize_t written = 0;
+    Py_ssize_t done = 0;
+    Py_ssize_t dropped = 0;
+    pytun_tb_t* tb;
+    unsigned PY_LONG_LONG before;
+    unsigned int pending;
+    unsigned int idx;
+    int write_err = 0;
+    int ret = 0;
+    PyObject* res = NULL;
+
+    if (!PyArg_ParseTuple(args, "O:write_many", &packets))
+    {
+        return NULL;
+    }
+    fast = PySequence_Fast(packets, "packets must be an iterable");
+    if (fast == NULL)
+    {
+        return NULL;
+    }
+    n = PySequence_Fast_GET_SIZE(fast);
+    /* The writes of a shaped device are paced one by one with write() */
+    tb = pytun_tuntap_shaper((pytun_tuntap_t*)u->device);
+    bufs = PyMem_New(Py_buffer, n > 0 ? n : 1);
+    iov = PyMem_New(struct iovec, n > 0 ? n : 1);
+    if (bufs == NULL || iov == NULL)
+    {
+        PyErr_NoMemory();
+        goto out;
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(fast, i), &bufs[i], PyBUF_SIMPLE) < 0)
+        {
+            goto out;
+        }
+        nbufs++;
+        if (u->q.fd >= 0 && tb == NULL && (size_t)bufs[i].len > u->size)
+        {
+            PyErr_SetString(PyExc_ValueError, "packet larger than the buffer size");
+            goto out;
+        }
+        iov[i].iov_base = bufs[i].buf;
+        iov[i].iov_len = bufs[i].len;
+    }
+
+    if (u->q.fd < 0 || tb != NULL)
+    {
+        /* Plain write() fallback */
+        if (n > 0)
+        {
+            PYTUN_BEGIN_ALLOW_THREADS(u->stats)
+            written = pytun_write_batch(u->fd, iov, n, u->stats, u->capture, tb, &dropped);
+            PYTUN_END_ALLOW_THREADS(u->stats)
+            if (written < 0)
+            {
+                PYTUN_STAT_ADD(u, write_errors, 1);
+                raise_error_from_errno(pytun_state_of(self));
+                goto out;
+            }
+            written -= dropped;
+            PYTUN_STAT_ADD(u, writes, written);
+        }
+    }
+    else
+    {
+        /* Copy the packets to the registered write buffers and submit them
+           by chunks of at most depth writes */
+        before = u->writes;
+        Py_BEGIN_ALLOW_THREADS
+        while (done < n && write_err == 0)
+        {
+            for (pending = 0; done + pending < n && u->nfree_wr > 0; pending++)
+            {
+                idx = u->free_wr[--u->nfree_wr];
+                u->wr_len[idx - u->depth] = iov[done + pending].iov_len;
+                memcpy(u->slab + idx * u->size, iov[done + pending].iov_base, iov[done + pending].iov_len);
+                pytun_uring_queue(&u->q, IORING_OP_WRITE_FIXED, u->fd, u->slab + idx * u->size,
+                                  iov[done + pending].iov_len, 0, PYTUN_URING_WRITE | idx);
+            }
+            done += pending;
+            /* Completed reads are queued while waiting for the writes */
+            while (pending > 0)
+            {
+                ret = pytun_uring_submit_and_wait(u, 1);
+                if (ret < 0)
+                {
+                    break;
+                }
+                pending -= pytun_uring_reap(u, &write_err);
+            }
+            if (ret < 0)
+            {
+                break;
+            }
+        }
+        Py_END_ALLOW_THREADS
+        written = u->writes - before;
+        if (ret < 0 || (written == 0 && write_err != 0))
+        {
+            if (ret >= 0)
+            {
+                errno = write_err;
+            }
+            raise_error_from_errno(pytun_state_of(self));
+            goto out;
+        }
+    }
+    res = PyLong_FromSsize_t(written);
+
+out:
+    for (i = 0; i < nbufs; i++)
+    {
+        PyBuffer_Release(&bufs[i]);
+    }
+    PyMem_Free(bufs);
+    PyMem_Free(iov);
+    pytun_tb_decref(tb);
+    Py_DECREF(fast);
+
+    return res;
+}
+
+static PyObject* pytun_uring_write_many(PyObject* self, PyObject* args)
+{
+    return pytun_uring_call(self, args, pytun_uring_do_write_many);
+}
+
+PyDoc_STRVAR(pytun_uring_write_many_doc,
+"write_many(packets) -> number of packets written.\n\
+Write an iterable of buffers to the device. The packets are copied to the\n\
+registered write buffers and submitted in batches of at most depth writes.\n\
+The call returns once all the writes have completed. If the device has a\n\
+shaper, the packets are paced and written with write() instead, and those\n\
+dropped by the shaper are not counted.");
+
+static PyObject* pytun_uring_stats(PyObject* self)
+{
+    pytun_uring_t* u = (pytun_uring_t*)self;
+
+    return Py_BuildValue("{sKsKsKsKsKsKsK}",
+                         "enters", PYTUN_STAT_LOAD(u->enters),
+                         "submitted", PYTUN_STAT_LOAD(u->submitted),
+                         "completions", PYTUN_STAT_LOAD(u->completions),
+                         "reads", PYTUN_STAT_LOAD(u->reads),
+                         "writes", PYTUN_STAT_LOAD(u->writes),
+                         "read_errors", PYTUN_STAT_LOAD(u->read_errors),
+                         "write_errors", PYTUN_STAT_LOAD(u->write_errors));
+}
+
+PyDoc_STRVAR(pytun_uring_stats_doc,
+"stats() -> dict.\n\
+Return the counters of the ring. enters is the number of io_uring_enter()\n\
+calls, to be compared with the number of packets read and written.");
+
+static PyObject* pytun_uring_get_backend(PyObject* self, void* d)
+{
+    pytun_uring_t* u = (pytun_uring_t*)self;
+    const char* backend = u->q.fd >= 0 ? "io_uring" : "syscall";
+
+#if PY_MAJOR_VERSION >= 3
+    return PyUnicode_FromString(backend);
+#else
+    return PyString_FromString(backend);
+#endif
+}
+
+static PyObject* pytun_uring_get_depth(PyObject* self, void* d)
+{
+    return PyLong_FromUnsignedLong(((pytun_uring_t*)self)->depth);
+}
+
+static PyObject* pytun_uring_get_size(PyObject* self, void* d)
+{
+    return PyLong_FromSize_t(((pytun_uring_t*)self)->size);
+}
+
+static PyMethodDef pytun_uring_meth[] =
+{
+    {
+     "read_many",
+     (PyCFunction)pytun_uring_read_many,
+     METH_VARARGS,
+     pytun_uring_read_many_doc
+    },
+    {
+     "write_many",
+     (PyCFunction)pytun_uring_write_many,
+     METH_VARARGS,
+     pytun_uring_write_many_doc
+    },
+    {
+     "stats",
+     (PyCFunction)pytun_uring_stats,
+     METH_NOARGS,
+     pytun_uring_stats_doc
+    },
+    {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef pytun_uring_prop[] =
+{
+    {"backend", pytun_uring_get_backend, NULL, NULL, NULL},
+    {"depth", pytun_uring_get_depth, NULL, NULL, NULL},
+    {"size", pytun_uring_get_size, NULL, NULL, NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+PyDoc_STRVAR(pytun_uring_doc,
+"Uring(device, depth=64, size=2048) -> uring object.\n\
+Read and write packets of device through io_uring. depth reads of at most\n\
+size bytes are kept posted on registered buffers, their completions are\n\
+harvested in bulk and writes are submitted in batches. If io_uring is not\n\
+available, the backend attribute is 'syscall' and plain read()/write()\n\
+calls are used instead. A Uring can't be used by several threads at once.\n\
+Closing the device closes its descriptor, the Uring then raises an error.\n\
+The reads posted in the ring keep the interface open in the kernel until\n\
+that error is raised or the Uring is released.");
+
+static PyType_Slot pytun_uring_slots[] =
+{
+    {Py_tp_dealloc, pytun_uring_dealloc},
+    {Py_tp_doc, (void*)pytun_uring_doc},
+    {Py_tp_methods, pytun_uring_meth},
+    {Py_tp_getset, pytun_uring_prop},
+    {Py_tp_new, pytun_uring_new},
+    {0, NULL}
+};
+
+static PyType_Spec pytun_uring_spec =
+{
+    .name = "pytun.Uring",
+    .basicsize = sizeof(pytun_uring_t),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = pytun_uring_slots
+};
+#endif
+
+struct pytun_poller
+{
+    PyObject_HEAD
+    int epfd;
+    unsigned int budget;
+    size_t size;
+    unsigned int max_events;
+    struct epoll_event* events;
+    /* Registered devices indexed by file descriptor */
+    PyObject* devices;
+    char* arena;
+    size_t arena_size;
+    Py_ssize_t* offsets;
+    unsigned int offsets_len;
+    int busy;
+};
+typedef struct pytun_poller pytun_poller_t;
+
+static int pytun_poller_traverse(PyObject* self, visitproc visit, void* arg)
+{
+    PYTUN_VISIT_TYPE(self);
+    Py_VISIT(((pytun_poller_t*)self)->devices);
+
+    return 0;
+}
+
+static int pytun_poller_clear(PyObject* self)
+{
+    pytun_poller_t* poller = (pytun_poller_t*)self;
+    PyObject* key;
+    PyObject* value;
+    Py_ssize_t pos = 0;
+
+    /* Drop the uses of the descriptors held by the registrations */
+    while (poller->devices != NULL && PyDict_Next(poller->devices, &pos, &key, &value))
+    {
+        pytun_tuntap_put_fd((pytun_tuntap_t*)value);
+    }
+    Py_CLEAR(poller->devices);
+
+    return 0;
+}
+
+static void pytun_poller_dealloc(PyObject* self)
+{
+    PyTypeObject* type = Py_TYPE(self);
+    pytun_poller_t* poller = (pytun_poller_t*)self;
+
+    PyObject_GC_UnTrack(self);
+    if (poller->epfd >= 0)
+    {
+        close(poller->epfd);
+    }
+    PyMem_Free(poller->events);
+    PyMem_Free(poller->arena);
+    PyMem_Free(poller->offsets);
+    pytun_poller_clear(self);
+    type->tp_free(self);
+    PYTUN_TYPE_DECREF(type);
+}
+
+static PyObject* pytun_poller_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+    pytun_poller_t* poller;
+    unsigned int budget = 64;
+    unsigned int size = 65536;
+    unsigned int max_events = 256;
+    char* kwlist[] = {"budget", "size", "max_events", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|III:Poller", kwlist, &budget, &size, &max_events))
+    {
+        return NULL;
+    }
+    if (budget == 0 || size == 0 || max_events == 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "budget, size and max_events must be > 0");
+        return NULL;
+    }
+
+    poller = (pytun_poller_t*)type->tp_alloc(type, 0);
+    if (poller == NULL)
+    {
+        return NULL;
+    }
+    poller->budget = budget;
+    poller->size = size;
+    poller->max_events = max_events;
+    poller->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (poller->epfd < 0)
+    {
+        raise_error_from_errno(pytun_state_of_type(type));
+        goto error;
+    }
+    poller->events = PyMem_New(struct epoll_event, max_events);
+    if (poller->events == NULL)
+    {
+        PyErr_NoMemory();
+        goto error;
+    }
+    poller->devices = PyDict_New();
+    if (poller->devices == NULL)
+    {
+        goto error;
+    }
+
+    return (PyObject*)poller;
+
+error:
+    Py_DECREF(poller);
+
+    return NULL;
+}
+
+static PyObject* pytun_poller_ctl(pytun_poller_t* poller, PyObject* args, PyObject* kwds, int op)
+{
+    PyObject* device;
+    unsigned int budget = 0;
+    char* kwlist[] = {"device", "budget", NULL};
+    struct epoll_event ev;
+    PyObject* key;
+    int fd;
+    int ret;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, op == EPOLL_CTL_ADD ? "O!|I:register" : "O!|I:modify",
+                                     kwlist, pytun_state_of(poller)->tuntap_type, &device, &budget))
+    {
+        return NULL;
+    }
+    /* A registered device holds a use of its descriptor until it is
+       unregistered */
+    fd = pytun_tuntap_get_fd((pytun_tuntap_t*)device);
+    if (fd < 0)
+    {
+        raise_error(pytun_state_of(poller), "Device is closed");
+        return NULL;
+    }
+
+    /* The budget of the device is kept along with its fd in the event */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint64_t)(budget != 0 ? budget : poller->budget) << 32 | (uint32_t)fd;
+    ret = epoll_ctl(poller->epfd, op, fd, &ev);
+    if (ret < 0 || op == EPOLL_CTL_MOD)
+    {
+        if (ret < 0)
+        {
+            raise_error_from_errno(pytun_state_of(poller));
+        }
+        pytun_tuntap_put_fd((pytun_tuntap_t*)device);
+        if (ret < 0)
+        {
+            return NULL;
+        }
+        Py_RETURN_NONE;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    key = PyLong_FromLong(fd);
+#else
+    key = PyInt_FromLong(fd);
+#endif
+    if (key == NULL || PyDict_SetItem(poller->devices, key, device) < 0)
+    {
+        Py_XDECREF(key);
+        epoll_ctl(poller->epfd, EPOLL_CTL_DEL, fd, &ev);
+        pytun_tuntap_put_fd((pytun_tuntap_t*)device);
+        return NULL;
+    }
+    Py_DECREF(key);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject* pytun_poller_register(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    return pytun_poller_ctl((pytun_poller_t*)self, args, kwds, EPOLL_CTL_ADD);
+}
+
+PyDoc_STRVAR(pytun_poller_register_doc,
+"register(device, budget=0) -> None.\n\
+Register device with the poller. At most budget packets are read from the\n\
+device on each call to poll(), if 0 the default budget of the poller is\n\
+used.");
+
+static PyObject* pytun_poller_modify(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    return pytun_poller_ctl((pytun_poller_t*)self, args, kwds, EPOLL_CTL_MOD);
+}
+
+PyDoc_STRVAR(pytun_poller_modify_doc,
+"modify(device, budget=0) -> None.\n\
+Change the budget of a registered device.");
+
+static PyObject* pytun_poller_unregister(PyObject* self, PyObject* args)
+{
+    pytun_poller_t* poller = (pytun_poller_t*)self;
+    PyObject* device;
+    PyObject* key;
+    PyObject* value;
+    Py_ssize_t pos = 0;
+    struct epoll_event ev;
+
+    if (!PyArg_ParseTuple(args, "O!:unregister", pytun_state_of(self)->tuntap_type, &device))
+    {
+        return NULL;
+    }
+
+    /* Look the device up by identity as it may have been closed since it
+       was registered */
+    while (PyDict_Next(poller->devices, &pos, &key, &value))
+    {
+        if (value == device)
+        {
+            memset(&ev, 0, sizeof(ev));
+            epoll_ctl(poller->epfd, EPOLL_CTL_DEL, (int)PyLong_AsLong(key), &ev);
+            if (PyDict_DelItem(poller->devices, key) < 0)
+            {
+                return NULL;
+            }
+            pytun_tuntap_put_fd((pytun_tuntap_t*)device);
+            Py_RETURN_NONE;
+        }
+    }
+    PyErr_SetString(PyExc_KeyError, "device is not registered");
+
+    return NULL;
+}
+
+PyDoc_STRVAR(pytun_poller_unregister_doc,
+"unregister(device) -> None.\n\
+Remove device from the poller. The descriptor of a device closed while it\n\
+is registered is only closed once it is unregistered.");
+
+static PyObject* pytun_poller_do_poll(PyObject* self, PyObject* args)
+{
+    pytun_poller_t* poller = (pytun_poller_t*)self;
+    double timeout = -1.0;
+    int ms;
+    int nevents;
+    int i;
+    Py_ssize_t j;
+    Py_ssize_t n;
+    unsigned int budget;
+    size_t need;
+    int fd;
+    PyObject* res;
+    PyObject* key;
+    PyObject* device;
+    pytun_tuntap_t* tuntap;
+    PyObject* pkts;
+    PyObject* pkt;
+    PyObject* item;
+    int ret;
+
+    if (!PyArg_ParseTuple(args, "|d:poll", &timeout))
+    {
+        return NULL;
+    }
+    if (timeout != timeout)
+    {
+        PyErr_SetString(PyExc_ValueError, "Invalid value NaN (not a number)");
+        return NULL;
+    }
+    /* Like select.epoll.poll(): round up to the next millisecond so that a
+       short timeout doesn't become a busy poll, and clamp large ones */
+    if (timeout < 0)
+    {
+        ms = -1;
+    }
+    else if (timeout * 1000 >= INT_MAX)
+    {
+        ms = INT_MAX;
+    }
+    else
+    {
+        ms = (int)(timeout * 1000);
+        if (ms < timeout * 1000)
+        {
+            ms++;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    nevents = epoll_wait(poller->epfd, poller->events, poller->max_events, ms);
+    Py_END_ALLOW_THREADS
+    if (nevents < 0)
+    {
+        if (errno == EINTR)
+        {
+            if (PyErr_CheckSignals() < 0)
+            {
+                return NULL;
+            }
+            return PyList_New(0);
+        }
+        raise_error_from_errno(pytun_state_of(self));
+        return NULL;
+    }
+
+    res = PyList_New(0);
+    if (res == NULL)
+    {
+        return NULL;
+    }
+    for (i = 0; i < nevents; i++)
+    {
+        fd = (int)(poller->events[i].data.u64 & 0xffffffff);
+        budget = (unsigned int)(poller->events[i].data.u64 >> 32);
+
+        /* The arena is sized for the largest budget seen so far */
+        need = (size_t)budget * poller->size;
+        if (need > poller->arena_size)
+        {
+            PyMem_Free(poller->arena);
+            poller->arena = PyMem_Malloc(need);
+            poller->arena_size = poller->arena != NULL ? need : 0;
+        }
+        if (budget + 1 > poller->offsets_len)
+        {
+            PyMem_Free(poller->offsets);
+            poller->offsets = PyMem_New(Py_ssize_t, budget + 1);
+            poller->offsets_len = poller->offsets != NULL ? budget + 1 : 0;
+        }
+        if (poller->arena == NULL || poller->offsets == NULL)
+        {
+            PyErr_NoMemory();
+            goto error;
+        }
+
+#if PY_MAJOR_VERSION >= 3
+        key = PyLong_FromLong(fd);
+#else
+        key = PyInt_FromLong(fd);
+#endif
+        if (key == NULL)
+        {
+            goto error;
+        }
+        /* The device is kept alive while the GIL is released */
+#if PY_MAJOR_VERSION >= 3 && PY_MINOR_VERSION >= 13
+        ret = PyDict_GetItemRef(poller->devices, key, &device);
+#else
+        device = PyDict_GetItem(poller->devices, key);
+        Py_XINCREF(device);
+        ret = device != NULL;
+#endif
+        Py_DECREF(key);
+        if (ret <= 0)
+        {
+            if (ret < 0)
+            {
+                goto error;
+            }
+            continue;
+        }
+        tuntap = (pytun_tuntap_t*)device;
+        /* The use held by the registration can be dropped by another
+           thread unregistering the device while the GIL is released */
+        if (pytun_tuntap_get_fd(tuntap) < 0)
+        {
+            /* Stop watching a closed device, its descriptor is released
+               when it is unregistered */
+            epoll_ctl(poller->epfd, EPOLL_CTL_DEL, fd, &poller->events[i]);
+            Py_DECREF(tuntap);
+            continue;
+        }
+
+        /* Level-triggered: a device with more than budget packets pending
+           is reported again by the next call, after the other ready
+           devices. */
+        PYTUN_BEGIN_ALLOW_THREADS(&tuntap->stats)
+        n = pytun_read_batch(fd, poller->arena, need, poller->size, budget, poller->offsets,
+                             &tuntap->stats, &tuntap->capture);
+        pytun_tuntap_put_fd(tuntap);
+        PYTUN_END_ALLOW_THREADS(&tuntap->stats)
+        if (n < 0)
+        {
+            if (PyList_GET_SIZE(res) == 0)
+            {
+                raise_error_from_errno(pytun_state_of(self));
+                Py_DECREF(tuntap);
+                goto error;
+            }
+            /* Report the packets already read, the error (other than
+               EAGAIN) will be reported by the next call */
+            Py_DECREF(tuntap);
+            break;
+        }
+        if (n == 0)
+        {
+            Py_DECREF(tuntap);
+            continue;
+        }
+
+        pkts = PyList_New(n);
+        if (pkts == NULL)
+        {
+            Py_DECREF(tuntap);
+            goto error;
+        }
+        for (j = 0; j < n; j++)
+        {
+            pkt = pytun_new_string(poller->arena + poller->offsets[j], poller->offsets[j + 1] - poller->offsets[j]);
+            if (pkt == NULL)
+            {
+                Py_DECREF(pkts);
+                Py_DECREF(tuntap);
+                goto error;
+            }
+            PyList_SET_ITEM(pkts, j, pkt);
+        }
+        item = Py_BuildValue("(ON)", device, pkts);
+        Py_DECREF(tuntap);
+        if (item == NULL || PyList_Append(res, item) < 0)
+        {
+            Py_XDECREF(item);
+            goto error;
+        }
+        Py_DECREF(item);
+    }
+
+    return res;
+
+error:
+    Py_DECREF(res);
+
+    return NULL;
+}
+
+static PyObject* pytun_poller_poll(PyObject* self, PyObject* args)
+{
+    pytun_poller_t* poller = (pytun_poller_t*)self;
+    PyObject* res;
+
+    /* The events and the arena are shared by all the calls */
+    if (pytun_busy_enter(pytun_state_of(self), &poller->busy) < 0)
+    {
+        return NULL;
+    }
+    res = pytun_poller_do_poll(self, args);
+    pytun_busy_leave(&poller->busy);
+
+    return res;
+}
+
+PyDoc_STRVAR(pytun_poller_poll_doc,
+"poll(timeout=-1) -> list of (device, packets) pairs.\n\
+Wait at most timeout seconds (forever if negative, rounded up to the\n\
+millisecond) for registered devices to become readable, then read a batch\n\
+of at most budget packets from each ready device. Devices with more packets\n\
+pending are reported again by the next call, so that a busy device can't\n\
+starve the others. Only one thread may poll at a time.");
+
+static Py_ssize_t pytun_poller_len(PyObject* self)
+{
+    return PyDict_Size(((pytun_poller_t*)self)->devices);
+}
+
+static PyObject* pytun_poller_fileno(PyObject* self)
+{
+#if PY_MAJOR_VERSION >= 3
+    return PyLong_FromLong(((pytun_poller_t*)self)->epfd);
+#else
+    return PyInt_FromLong(((pytun_poller_t*)self)->epfd);
+#endif
+}
+
+PyDoc_STRVAR(pytun_poller_fileno_doc,
+"fileno() -> integer \"file descriptor\".\n\
+Return the epoll file descriptor of the poller.");
+
+static PyMethodDef pytun_poller_meth[] =
+{
+    {
+     "register",
+     (PyCFunction)pytun_poller_register,
+     METH_VARARGS | METH_KEYWORDS,
+     pytun_poller_register_doc
+    },
+    {
+     "modify",
+     (PyCFunction)pytun_poller_modify,
+     METH_VARARGS | METH_KEYWORDS,
+     pytun_poller_modify_doc
+    },
+    {
+     "unregister",
+     (PyCFunction)pytun_poller_unregister,
+     METH_VARARGS,
+     pytun_poller_unregister_doc
+    },
+    {
+     "poll",
+     (PyCFunction)pytun_poller_poll,
+     METH_VARARGS,
+     pytun_poller_poll_doc
+    },
+    {
+     "fileno",
+     (PyCFunction)pytun_poller_fileno,
+     METH_NOARGS,
+     pytun_poller_fileno_doc
+    },
+    {NULL, NULL, 0, NULL}
+};
+
+PyDoc_STRVAR(pytun_poller_doc,
+"Poller(budget=64, size=65536, max_events=256) -> poller object.\n\
+Wait for many devices at once with epoll. On each call to poll(), at most\n\
+max_events ready devices are served and at most budget packets of at most\n\
+size bytes are read from each of them, with the GIL released.");
+
+static PyType_Slot pytun_poller_slots[] =
+{
+    {Py_tp_dealloc, pytun_poller_dealloc},
+    {Py_sq_length, pytun_poller_len},
+    {Py_tp_doc, (void*)pytun_poller_doc},
+    {Py_tp_traverse, pytun_poller_traverse},
+    {Py_tp_clear, pytun_poller_clear},
+    {Py_tp_methods, pytun_poller_meth},
+    {Py_tp_new, pytun_poller_new},
+    {0, NULL}
+};
+
+static PyType_Spec pytun_poller_spec =
+{
+    .name = "pytun.Poller",
+    .basicsize = sizeof(pytun_poller_t),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_HAVE_GC,
+    .slots = pytun_poller_slots
+};
+
+#define PYTUN_TCP_FIN 0x01
+#define PYTUN_TCP_SYN 0x02
+#define PYTUN_TCP_RST 0x04
+#define PYTUN_TCP_PSH 0x08
+#define PYTUN_TCP_ACK 0x10
+#define PYTUN_TCP_URG 0x20
+#define PYTUN_TCP_CWR 0x80
+
+static unsigned int pytun_get16(const unsigned char* p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static void pytun_put16(unsigned char* p, unsigned int v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static uint32_t pytun_get32(const unsigned char* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void pytun_put32(unsigned char* p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* Checksum kernels. They return the sum of the 16-bit words of data in host
+   byte order, to be folded. The sums of 32-bit words are accumulated in 64
+   bits, which doesn't change the folded result. */
+static uint64_t pytun_csum_portable(const unsigned char* data, size_t len)
+{
+    uint64_t s0 = 0;
+    uint64_t s1 = 0;
+    uint64_t v;
+    uint32_t w;
+    uint16_t h;
+    unsigned char last[2];
+
+    while (len >= 16)
+    {
+        memcpy(&v, data, 8);
+        s0 += (v & 0xffffffff) + (v >> 32);
+        memcpy(&v, data + 8, 8);
+        s1 += (v & 0xffffffff) + (v >> 32);
+        data += 16;
+        len -= 16;
+    }
+    if (len >= 8)
+    {
+        memcpy(&v, data, 8);
+        s0 += (v & 0xffffffff) + (v >> 32);
+        data += 8;
+        len -= 8;
+    }
+    if (len >= 4)
+    {
+        memcpy(&w, data, 4);
+        s1 += w;
+        data += 4;
+        len -= 4;
+    }
+    if (len >= 2)
+    {
+        memcpy(&h, data, 2);
+        s0 += h;
+        data += 2;
+        len -= 2;
+    }
+    if (len)
+    {
+        /* The odd byte is padded with a zero byte */
+        last[0] = data[0];
+        last[1] = 0;
+        memcpy(&h, last, 2);
+        s1 += h;
+    }
+
+    return s0 + s1;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PYTUN_HAVE_CSUM_X86
+
+__attribute__((target("sse2")))
+static uint64_t pytun_csum_sse2(const unsigned char* data, size_t len)
+{
+    const __m128i mask = _mm_set_epi32(0, -1, 0, -1);
+    __m128i lo = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+    __m128i v;
+    uint64_t lanes[2];
+
+    while (len >= 32)
+    {
+        v = _mm_loadu_si128((const __m128i*)data);
+        lo = _mm_add_epi64(lo, _mm_and_si128(v, mask));
+        hi = _mm_add_epi64(hi, _mm_srli_epi64(v, 32));
+        v = _mm_loadu_si128((const __m128i*)(data + 16));
+        lo = _mm_add_epi64(lo, _mm_and_si128(v, mask));
+        hi = _mm_add_epi64(hi, _mm_srli_epi64(v, 32));
+        data += 32;
+        len -= 32;
+    }
+    _mm_storeu_si128((__m128i*)lanes, _mm_add_epi64(lo, hi));
+
+    return lanes[0] + lanes[1] + pytun_csum_portable(data, len);
+}
+
+__attribute__((target("avx2")))
+static uint64_t pytun_csum_avx2(const unsigned char* data, size_t len)
+{
+    const __m256i mask = _mm256_set1_epi64x(0xffffffff);
+    __m256i lo = _mm256_setzero_si256();
+    __m256i hi = _mm256_setzero_si256();
+    __m256i v;
+    uint64_t lanes[4];
+
+    while (len >= 64)
+    {
+        v = _mm256_loadu_si256((const __m256i*)data);
+        lo = _mm256_add_epi64(lo, _mm256_and_si256(v, mask));
+        hi = _mm256_add_epi64(hi, _mm256_srli_epi64(v, 32));
+        v = _mm256_loadu_si256((const __m256i*)(data + 32));
+        lo = _mm256_add_epi64(lo, _mm256_and_si256(v, mask));
+        hi = _mm256_add_epi64(hi, _mm256_srli_epi64(v, 32));
+        data += 64;
+        len -= 64;
+    }
+    _mm256_storeu_si256((__m256i*)lanes, _mm256_add_epi64(lo, hi));
+
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + pytun_csum_portable(data, len);
+}
+#endif
+
+struct pytun_csum_impl
+{
+    const char* name;
+    uint64_t (*sum)(const unsigned char* data, size_t len);
+};
+typedef struct pytun_csum_impl pytun_csum_impl_t;
+
+/* Checksum kernels, from the fastest to the slowest */
+static const pytun_csum_impl_t pytun_csum_impls[] =
+{
+#ifdef PYTUN_HAVE_CSUM_X86
+    {"avx2", pytun_csum_avx2},
+    {"sse2", pytun_csum_sse2},
+#endif
+    {"portable", pytun_csum_portable}
+};
+#define PYTUN_CSUM_NIMPLS (sizeof(pytun_csum_impls) / sizeof(pytun_csum_impls[0]))
+
+/* Kernel used by pytun_csum_add(), selected when the module is loaded */
+static const pytun_csum_impl_t* pytun_csum_impl = &pytun_csum_impls[PYTUN_CSUM_NIMPLS - 1];
+
+static int pytun_csum_supported(const pytun_csum_impl_t* impl)
+{
+#ifdef PYTUN_HAVE_CSUM_X86
+    __builtin_cpu_init();
+    if (impl->sum == pytun_csum_avx2)
+    {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (impl->sum == pytun_csum_sse2)
+    {
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+
+    return 1;
+}
+
+static void pytun_csum_select(void)
+{
+    size_t i;
+
+    for (i = 0; i < PYTUN_CSUM_NIMPLS; i++)
+    {
+        if (pytun_csum_supported(&pytun_csum_impls[i]))
+        {
+            __atomic_store_n(&pytun_csum_impl, &pytun_csum_impls[i], __ATOMIC_RELAXED);
+            break;
+        }
+    }
+}
+
+/* Return the names of the supported checksum kernels, from the fastest to
+   the slowest */
+static PyObject* pytun_csum_kernels(void)
+{
+    PyObject* names;
+    PyObject* name;
+    size_t i;
+
+    names = PyList_New(0);
+    if (names == NULL)
+    {
+        return NULL;
+    }
+    for (i = 0; i < PYTUN_CSUM_NIMPLS; i++)
+    {
+        if (!pytun_csum_supported(&pytun_csum_impls[i]))
+        {
+            continue;
+        }
+#if PY_MAJOR_VERSION >= 3
+        name = PyUnicode_FromString(pytun_csum_impls[i].name);
+#else
+        name = PyString_FromString(pytun_csum_impls[i].name);
+#endif
+        if (name == NULL || PyList_Append(names, name) < 0)
+        {
+            Py_XDECREF(name);
+            Py_DECREF(names);
+            return NULL;
+        }
+        Py_DECREF(name);
+    }
+    name = PyList_AsTuple(names);
+    Py_DECREF(names);
+
+    return name;
+}
+
+static unsigned int pytun_csum_fold(uint64_t sum)
+{
+    while (sum >> 16)
+    {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return sum;
+}
+
+/* Add the len bytes at data to the one's complement sum. Only the last chunk
+   of the checksummed data may have an odd length. */
+static uint64_t pytun_csum_add(uint64_t sum, const unsigned char* data, size_t len)
+{
+    return sum + ntohs(pytun_csum_fold(__atomic_load_n(&pytun_csum_impl, __ATOMIC_RELAXED)->sum(data, len)));
+}
+
+/* Sum of the pseudo-header of the IP packet ip for an upper-layer protocol
+   proto carrying l4len bytes */
+static uint64_t pytun_csum_pseudo(const unsigned char* ip, int version, unsigned int proto, size_t l4len)
+{
+    uint64_t sum;
+
+    if (version == 4)
+    {
+        sum = pytun_csum_add(0, ip + 12, 8);
+    }
+    else
+    {
+        sum = pytun_csum_add(0, ip + 8, 32);
+    }
+
+    return sum + proto + (l4len & 0xffff) + (l4len >> 16);
+}
+
+/* Layout of an IP packet */
+struct pytun_l3
+{
+    int version;
+    unsigned int proto;
+    size_t l4_off;
+    size_t len;
+    int fragment;
+};
+typedef struct pytun_l3 pytun_l3_t;
+
+/* Parse the IPv4 or IPv6 header at p. IPv6 extension headers are skipped to
+   find the upper-layer protocol. Returns -1 if the packet is malformed. */
+static int pytun_parse_l3(const unsigned char* p, size_t len, pytun_l3_t* l3)
+{
+    size_t off;
+    unsigned int nh;
+
+    if (len < 1)
+    {
+        return -1;
+    }
+    l3->version = p[0] >> 4;
+    l3->fragment = 0;
+    if (l3->version == 4)
+    {
+        if (len < 20)
+        {
+            return -1;
+        }
+        l3->l4_off = (p[0] & 0x0f) * 4;
+        l3->len = pytun_get16(p + 2);
+        if (l3->l4_off < 20 || l3->len < l3->l4_off || l3->len > len)
+        {
+            return -1;
+        }
+        l3->proto = p[9];
+        l3->fragment = (pytun_get16(p + 6) & 0x3fff) != 0;
+        return 0;
+    }
+    if (l3->version == 6)
+    {
+        if (len < 40)
+        {
+            return -1;
+        }
+        l3->len = 40 + pytun_get16(p + 4);
+        if (l3->len > len)
+        {
+            return -1;
+        }
+        nh = p[6];
+        off = 40;
+        for (;;)
+        {
+            if (nh == IPPROTO_HOPOPTS || nh == IPPROTO_ROUTING || nh == IPPROTO_DSTOPTS)
+            {
+                if (off + 8 > l3->len)
+                {
+                    return -1;
+                }
+                nh = p[off];
+                off += (p[off + 1] + 1) * 8;
+            }
+            else if (nh == IPPROTO_FRAGMENT)
+            {
+                if (off + 8 > l3->len)
+                {
+                    return -1;
+                }
+                l3->fragment = 1;
+                nh = p[off];
+                off += 8;
+            }
+            else
+            {
+                break;
+            }
+        }
+        if (off > l3->len)
+        {
+            return -1;
+        }
+        l3->proto = nh;
+        l3->l4_off = off;
+        return 0;
+    }
+
+    return -1;
+}
+
+/* Append to list the packet pkt with its partial checksum completed */
+static int pytun_gso_complete_csum(pytun_state_t* state, const struct virtio_net_hdr* hdr, const unsigned char* pkt,
+                                   size_t len, PyObject* list)
+{
+    PyObject* seg;
+    unsigned char* q;
+    unsigned int csum;
+    int ret;
+
+    seg = pytun_new_string(pkt, len);
+    if (seg == NULL)
+    {
+        return -1;
+    }
+    if (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+    {
+        if ((size_t)hdr->csum_start + hdr->csum_offset + 2 > len)
+        {
+            Py_DECREF(seg);
+            raise_error(state, "Bad vnet header, checksum out of the packet");
+            return -1;
+        }
+        q = pytun_string_data(seg);
+        csum = ~pytun_csum_fold(pytun_csum_add(0, q + hdr->csum_start, len - hdr->csum_start)) & 0xffff;
+        pytun_put16(q + hdr->csum_start + hdr->csum_offset, csum ? csum : 0xffff);
+    }
+    ret = PyList_Append(list, seg);
+    Py_DECREF(seg);
+
+    return ret;
+}
+
+/* Split the GSO packet pkt described by hdr in segments of at most
+   hdr->gso_size bytes of payload, and append them to list */
+static int pytun_gso_segment_one(pytun_state_t* state, const struct virtio_net_hdr* hdr, const unsigned char* pkt,
+                                 size_t len, PyObject* list)
+{
+    pytun_l3_t l3;
+    unsigned int gso_type;
+    unsigned int mss;
+    size_t l4_off;
+    size_t hlen;
+    size_t payload_len;
+    size_t seg_payload;
+    size_t seglen;
+    size_t nsegs;
+    size_t i;
+    unsigned int ip_id = 0;
+    uint32_t seq = 0;
+    unsigned int tcp_flags = 0;
+    unsigned int csum_off;
+    unsigned int csum;
+    unsigned char* q;
+    PyObject* seg;
+    int ret;
+
+    gso_type = hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+    if (gso_type == VIRTIO_NET_HDR_GSO_NONE)
+    {
+        return pytun_gso_complete_csum(state, hdr, pkt, len, list);
+    }
+    if (pytun_parse_l3(pkt, len, &l3) < 0)
+    {
+        raise_error(state, "Malformed IP packet");
+        return -1;
+    }
+    if ((gso_type == VIRTIO_NET_HDR_GSO_TCPV4 && (l3.version != 4 || l3.proto != IPPROTO_TCP)) ||
+        (gso_type == VIRTIO_NET_HDR_GSO_TCPV6 && (l3.version != 6 || l3.proto != IPPROTO_TCP)) ||
+        (gso_type == PYTUN_GSO_UDP_L4 && l3.proto != IPPROTO_UDP) ||
+        (gso_type != VIRTIO_NET_HDR_GSO_TCPV4 && gso_type != VIRTIO_NET_HDR_GSO_TCPV6 &&
+         gso_type != PYTUN_GSO_UDP_L4))
+    {
+        raise_error(state, "Unsupported GSO type");
+        return -1;
+    }
+    mss = hdr->gso_size;
+    if (mss == 0)
+    {
+        raise_error(state, "Bad vnet header, null gso_size");
+        return -1;
+    }
+
+    l4_off = l3.l4_off;
+    if (l3.proto == IPPROTO_TCP)
+    {
+        if (l4_off + 20 > l3.len)
+        {
+            raise_error(state, "Malformed TCP segment");
+            return -1;
+        }
+        hlen = l4_off + (pkt[l4_off + 12] >> 4) * 4;
+        if (hlen < l4_off + 20 || hlen > l3.len)
+        {
+            raise_error(state, "Malformed TCP segment");
+            return -1;
+        }
+        seq = pytun_get32(pkt + l4_off + 4);
+        tcp_flags = pkt[l4_off + 13];
+        csum_off = 16;
+    }
+    else
+    {
+        hlen = l4_off + 8;
+        if (hlen > l3.len)
+        {
+            raise_error(state, "Malformed UDP datagram");
+            return -1;
+        }
+        csum_off = 6;
+    }
+    if (l3.version == 4)
+    {
+        ip_id = pytun_get16(pkt + 4);
+    }
+
+    payload_len = l3.len - hlen;
+    nsegs = payload_len == 0 ? 1 : (payload_len + mss - 1) / mss;
+    for (i = 0; i < nsegs; i++)
+    {
+        seg_payload = payload_len - i * mss;
+        if (seg_payload > mss)
+        {
+            seg_payload = mss;
+        }
+        seglen = hlen + seg_payload;
+        seg = pytun_new_string(NULL, seglen);
+        if (seg == NULL)
+        {
+            return -1;
+        }
+        q = pytun_string_data(seg);
+        memcpy(q, pkt, hlen);
+        memcpy(q + hlen, pkt + hlen + i * mss, seg_payload);
+
+        /* Fix the IP header */
+        if (l3.version == 4)
+        {
+            pytun_put16(q + 2, seglen);
+            pytun_put16(q + 4, (ip_id + i) & 0xffff);
+            pytun_put16(q + 10, 0);
+            pytun_put16(q + 10, ~pytun_csum_fold(pytun_csum_add(0, q, l4_off)) & 0xffff);
+        }
+        else
+        {
+            pytun_put16(q + 4, seglen - 40);
+        }
+
+        /* Fix the transport header */
+        if (l3.proto == IPPROTO_TCP)
+        {
+            pytun_put32(q + l4_off + 4, seq + i * mss);
+            q[l4_off + 13] = tcp_flags;
+            if (i != nsegs - 1)
+            {
+                q[l4_off + 13] &= ~(PYTUN_TCP_FIN | PYTUN_TCP_PSH);
+            }
+            if (i != 0)
+            {
+                q[l4_off + 13] &= ~PYTUN_TCP_CWR;
+            }
+        }
+        else
+        {
+            pytun_put16(q + l4_off + 4, seglen - l4_off);
+        }
+        pytun_put16(q + l4_off + csum_off, 0);
+        csum = ~pytun_csum_fold(pytun_csum_pseudo(q, l3.version, l3.proto, seglen - l4_off) +
+                                pytun_csum_add(0, q + l4_off, seglen - l4_off)) & 0xffff;
+        if (csum == 0 && l3.proto == IPPROTO_UDP)
+        {
+            csum = 0xffff;
+        }
+        pytun_put16(q + l4_off + csum_off, csum);
+
+        ret = PyList_Append(list, seg);
+        Py_DECREF(seg);
+        if (ret < 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static PyObject* pytun_gso_segment(PyObject* self, PyObject* args)
+{
+    PyObject* packets;
+    PyObject* fast;
+    PyObject* item;
+    PyObject* hdrobj;
+    PyObject* pktobj;
+    PyObject* list;
+    struct virtio_net_hdr hdr;
+    Py_buffer buf;
+    Py_ssize_t n;
+    Py_ssize_t i;
+    int ret;
+
+    if (!PyArg_ParseTuple(args, "O:gso_segment", &packets))
+    {
+        return NULL;
+    }
+    fast = PySequence_Fast(packets, "packets must be an iterable");
+    if (fast == NULL)
+    {
+        return NULL;
+    }
+    list = PyList_New(0);
+    if (list == NULL)
+    {
+        Py_DECREF(fast);
+        return NULL;
+    }
+
+    n = PySequence_Fast_GET_SIZE(fast);
+    for (i = 0; i < n; i++)
+    {
+        item = PySequence_Fast_GET_ITEM(fast, i);
+        if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2)
+        {
+            PyErr_SetString(PyExc_TypeError, "packets must be (vnet header, packet) pairs");
+            goto error;
+        }
+        hdrobj = PyTuple_GET_ITEM(item, 0);
+        pktobj = PyTuple_GET_ITEM(item, 1);
+        if (pytun_vnet_hdr_from_object(hdrobj, &hdr) < 0)
+        {
+            goto error;
+        }
+        if (PyObject_GetBuffer(pktobj, &buf, PyBUF_SIMPLE) < 0)
+        {
+            goto error;
+        }
+        ret = pytun_gso_segment_one(pytun_module_state(self), &hdr, buf.buf, buf.len, list);
+        PyBuffer_Release(&buf);
+        if (ret < 0)
+        {
+            goto error;
+        }
+    }
+    Py_DECREF(fast);
+
+    return list;
+
+error:
+    Py_DECREF(fast);
+    Py_DECREF(list);
+
+    return NULL;
+}
+
+PyDoc_STRVAR(pytun_gso_segment_doc,
+"gso_segment(packets) -> list of strings.\n\
+Split the GSO packets read from a device created with IFF_VNET_HDR in\n\
+segments of at most gso_size bytes of payload. packets is an iterable of\n\
+(vnet header, packet) pairs as returned by read_vnet(), each packet being an\n\
+IPv4 or IPv6 packet without packet information. TCP (TSO) and UDP (USO)\n\
+packets are supported: lengths, IPv4 IDs, TCP sequence numbers and flags\n\
+and checksums of each segment are filled in. Non-GSO packets are returned\n\
+as is, with their checksum completed if the header requests it.");
+
+/* State of a TCP flow being coalesced */
+struct pytun_gro_flow
+{
+    Py_ssize_t head;
+    Py_ssize_t tail;
+    Py_ssize_t count;
+    pytun_l3_t l3;
+    size_t hlen;
+    size_t mss;
+    size_t total;
+    size_t last_len;
+    uint32_t next_seq;
+};
+typedef struct pytun_gro_flow pytun_gro_flow_t;
+
+#define PYTUN_GRO_FLOWS 8
+
+/* Return 1 if the TCP segment q can be appended to flow f whose first
+   segment is p, 0 otherwise */
+static int pytun_gro_can_append(const pytun_gro_flow_t* f, const unsigned char* p,
+                                const unsigned char* q, const pytun_l3_t* l3,
+                                size_t hlen, size_t max_size)
+{
+    const unsigned char* pt = p + f->l3.l4_off;
+    const unsigned char* qt = q + l3->l4_off;
+    size_t payload = l3->len - hlen;
+
+    if (l3->version != f->l3.version || l3->l4_off != f->l3.l4_off || hlen != f->hlen)
+    {
+        return 0;
+    }
+    if (l3->version == 4)
+    {
+        /* Same TOS, flags, TTL and options */
+        if (p[1] != q[1] || pytun_get16(p + 6) != pytun_get16(q + 6) || p[8] != q[8] ||
+            memcmp(p + 20, q + 20, l3->l4_off - 20) != 0)
+        {
+            return 0;
+        }
+    }
+    else
+    {
+        /* Same traffic class, flow label and hop limit, no extension headers */
+        if (memcmp(p, q, 4) != 0 || p[7] != q[7] || l3->l4_off != 40)
+        {
+            return 0;
+        }
+    }
+    /* Same ACK and options, only ACK and PSH flags */
+    if (pytun_get32(pt + 8) != pytun_get32(qt + 8) ||
+        (qt[13] & ~PYTUN_TCP_PSH) != PYTUN_TCP_ACK ||
+        memcmp(pt + 20, qt + 20, hlen - l3->l4_off - 20) != 0)
+    {
+        return 0;
+    }
+    /* In order, and all the segments but the last one have the same size */
+    if (pytun_get32(qt + 4) != f->next_seq || payload == 0 || payload > f->mss ||
+        f->last_len != f->mss || f->hlen + f->total + payload > max_size)
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Append a (vnet header, packet) pair to list, hdr_type being the
+   VnetHeader type */
+static int pytun_gro_emit(PyTypeObject* hdr_type, PyObject* list, const struct virtio_net_hdr* hdr, PyObject* pkt)
+{
+    PyObject* hdrobj;
+    PyObject* pair;
+    int ret;
+
+    hdrobj = pytun_vnet_hdr_to_object(hdr_type, hdr);
+    if (hdrobj == NULL)
+    {
+        Py_DECREF(pkt);
+        return -1;
+    }
+    pair = Py_BuildValue("(NN)", hdrobj, pkt);
+    if (pair == NULL)
+    {
+        return -1;
+    }
+    ret = PyList_Append(list, pair);
+    Py_DECREF(pair);
+
+    return ret;
+}
+
+/* Append packet i unchanged to list */
+static int pytun_gro_emit_one(PyTypeObject* hdr_type, PyObject* list, PyObject* fast, Py_buffer* bufs, Py_ssize_t i)
+{
+    struct virtio_net_hdr hdr;
+    PyObject* pkt;
+
+    memset(&hdr, 0, sizeof(hdr));
+    pkt = PySequence_Fast_GET_ITEM(fast, i);
+#if PY_MAJOR_VERSION >= 3
+    if (PyBytes_CheckExact(pkt))
+#else
+    if (PyString_CheckExact(pkt))
+#endif
+    {
+        Py_INCREF(pkt);
+    }
+    else
+    {
+        pkt = pytun_new_string(bufs[i].buf, bufs[i].len);
+        if (pkt == NULL)
+        {
+            return -1;
+        }
+    }
+
+    return pytun_gro_emit(hdr_type, list, &hdr, pkt);
+}
+
+/* Append the coalesced segments of flow f to list */
+static int pytun_gro_flush(PyTypeObject* hdr_type, PyObject* list, PyObject* fast, Py_buffer* bufs,
+                           const Py_ssize_t* links, pytun_gro_flow_t* f)
+{
+    struct virtio_net_hdr hdr;
+    const unsigned char* p;
+    const unsigned char* last;
+    unsigned char* q;
+    size_t outlen;
+    size_t pos;
+    size_t l4_off = f->l3.l4_off;
+    Py_ssize_t i;
+    PyObject* pkt;
+
+    if (f->count == 1)
+    {
+        f->count = 0;
+        return pytun_gro_emit_one(hdr_type, list, fast, bufs, f->head);
+    }
+
+    outlen = f->hlen + f->total;
+    pkt = pytun_new_string(NULL, outlen);
+    if (pkt == NULL)
+    {
+        return -1;
+    }
+    q = pytun_string_data(pkt);
+    p = bufs[f->head].buf;
+    last = bufs[f->tail].buf;
+    memcpy(q, p, f->hlen);
+    pos = f->hlen;
+    for (i = f->head; i >= 0; i = links[i])
+    {
+        memcpy(q + pos, (const unsigned char*)bufs[i].buf + f->hlen, bufs[i].len - f->hlen);
+        pos += bufs[i].len - f->hlen;
+    }
+
+    if (f->l3.version == 4)
+    {
+        pytun_put16(q + 2, outlen);
+        pytun_put16(q + 10, 0);
+        pytun_put16(q + 10, ~pytun_csum_fold(pytun_csum_add(0, q, l4_off)) & 0xffff);
+    }
+    else
+    {
+        pytun_put16(q + 4, outlen - 40);
+    }
+    /* Window and PSH flag of the last segment, checksum left for the kernel
+       to complete */
+    memcpy(q + l4_off + 14, last + l4_off + 14, 2);
+    q[l4_off + 13] |= last[l4_off + 13] & PYTUN_TCP_PSH;
+    pytun_put16(q + l4_off + 16, pytun_csum_fold(pytun_csum_pseudo(q, f->l3.version, IPPROTO_TCP, outlen - l4_off)));
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr.gso_type = f->l3.version == 4 ? VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_TCPV6;
+    hdr.hdr_len = f->hlen;
+    hdr.gso_size = f->mss;
+    hdr.csum_start = l4_off;
+    hdr.csum_offset = 16;
+    f->count = 0;
+
+    return pytun_gro_emit(hdr_type, list, &hdr, pkt);
+}
+
+static PyObject* pytun_gro_coalesce(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    PyObject* packets;
+    Py_ssize_t max_size = 65535;
+    char* kwlist[] = {"packets", "max_size", NULL};
+    PyTypeObject* hdr_type = pytun_module_state(self)->vnet_hdr_type;
+    PyObject* fast;
+    PyObject* list = NULL;
+    Py_buffer* bufs = NULL;
+    Py_ssize_t* links = NULL;
+    Py_ssize_t nbufs = 0;
+    Py_ssize_t n;
+    Py_ssize_t i;
+    pytun_gro_flow_t flows[PYTUN_GRO_FLOWS];
+    pytun_gro_flow_t* f;
+    pytun_l3_t l3;
+    const unsigned char* p;
+    const unsigned char* q;
+    const unsigned char* th;
+    size_t hlen;
+    size_t payload;
+    int nflows = 0;
+    int j;
+    int k;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|n:gro_coalesce", kwlist, &packets, &max_size))
+    {
+        return NULL;
+    }
+    if (max_size > 65535)
+    {
+        max_size = 65535;
+    }
+    fast = PySequence_Fast(packets, "packets must be an iterable");
+    if (fast == NULL)
+    {
+        return NULL;
+    }
+    n = PySequence_Fast_GET_SIZE(fast);
+    bufs = PyMem_New(Py_buffer, n > 0 ? n : 1);
+    links = PyMem_New(Py_ssize_t, n > 0 ? n : 1);
+    if (bufs == NULL || links == NULL)
+    {
+        PyErr_NoMemory();
+        goto error;
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(fast, i), &bufs[i], PyBUF_SIMPLE) < 0)
+        {
+            goto error;
+        }
+        nbufs++;
+    }
+    list = PyList_New(0);
+    if (list == NULL)
+    {
+        goto error;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        q = bufs[i].buf;
+        links[i] = -1;
+        if (pytun_parse_l3(q, bufs[i].len, &l3) < 0 || l3.proto != IPPROTO_TCP || l3.fragment ||
+            l3.len != (size_t)bufs[i].len || l3.l4_off + 20 > l3.len)
+        {
+            if (pytun_gro_emit_one(hdr_type, list, fast, bufs, i) < 0)
+            {
+                goto error;
+            }
+            continue;
+        }
+        th = q + l3.l4_off;
+        hlen = l3.l4_off + (th[12] >> 4) * 4;
+        if (hlen < l3.l4_off + 20 || hlen > l3.len)
+        {
+            if (pytun_gro_emit_one(hdr_type, list, fast, bufs, i) < 0)
+            {
+                goto error;
+            }
+            continue;
+        }
+        payload = l3.len - hlen;
+
+        /* Look for the flow of the segment */
+        f = NULL;
+        for (j = 0; j < nflows; j++)
+        {
+            p = bufs[flows[j].head].buf;
+            if (flows[j].l3.version == l3.version &&
+                memcmp(p + (l3.version == 4 ? 12 : 8), q + (l3.version == 4 ? 12 : 8), l3.version == 4 ? 8 : 32) == 0 &&
+                memcmp(p + flows[j].l3.l4_off, th, 4) == 0)
+            {
+                f = &flows[j];
+                break;
+            }
+        }
+        if (f != NULL)
+        {
+            if (pytun_gro_can_append(f, bufs[f->head].buf, q, &l3, hlen, max_size))
+            {
+                links[f->tail] = i;
+                f->tail = i;
+                f->count++;
+                f->total += payload;
+                f->last_len = payload;
+                f->next_seq += payload;
+                if (!(th[13] & PYTUN_TCP_PSH))
+                {
+                    continue;
+                }
+            }
+            else
+            {
+                if (pytun_gro_flush(hdr_type, list, fast, bufs, links, f) < 0)
+                {
+                    goto error;
+                }
+                f->count = 0;
+                f = NULL;
+            }
+            if (f != NULL)
+            {
+                /* Pushed segment, the flow is complete */
+                if (pytun_gro_flush(hdr_type, list, fast, bufs, links, f) < 0)
+                {
+                    goto error;
+                }
+            }
+            /* Forget the flushed flow */
+            for (k = j; k < nflows - 1; k++)
+            {
+                flows[k] = flows[k + 1];
+            }
+            nflows--;
+            if (f != NULL)
+            {
+                continue;
+            }
+        }
+
+        /* Start a new flow with this segment if more may follow it */
+        if (payload == 0 || th[13] != PYTUN_TCP_ACK || l3.len > (size_t)max_size)
+        {
+            if (pytun_gro_emit_one(hdr_type, list, fast, bufs, i) < 0)
+            {
+                goto error;
+            }
+            continue;
+        }
+        if (nflows == PYTUN_GRO_FLOWS)
+        {
+            if (pytun_gro_flush(hdr_type, list, fast, bufs, links, &flows[0]) < 0)
+            {
+                goto error;
+            }
+            for (k = 0; k < nflows - 1; k++)
+            {
+                flows[k] = flows[k + 1];
+            }
+            nflows--;
+        }
+        f = &flows[nflows++];
+        f->head = i;
+        f->tail = i;
+        f->count = 1;
+        f->l3 = l3;
+        f->hlen = hlen;
+        f->mss = payload;
+        f->total = payload;
+        f->last_len = payload;
+        f->next_seq = pytun_get32(th + 4) + payload;
+    }
+    for (j = 0; j < nflows; j++)
+    {
+        if (pytun_gro_flush(hdr_type, list, fast, bufs, links, &flows[j]) < 0)
+        {
+            goto error;
+        }
+    }
+    goto out;
+
+error:
+    Py_CLEAR(list);
+
+out:
+    for (i = 0; i < nbufs; i++)
+    {
+        PyBuffer_Release(&bufs[i]);
+    }
+    PyMem_Free(bufs);
+    PyMem_Free(links);
+    Py_DECREF(fast);
+
+    return list;
+}
+
+PyDoc_STRVAR(pytun_gro_coalesce_doc,
+"gro_coalesce(packets, max_size=65535) -> list of (VnetHeader, string).\n\
+Merge consecutive in-order TCP segments of the same flow found in the\n\
+iterable of IPv4/IPv6 packets into GSO packets of at most max_size bytes,\n\
+ready to be written with write_vnet(). Segments of different flows may be\n\
+interleaved. Packets which cannot be merged are returned unchanged with an\n\
+all-zero header.");
+
+/* Offsets and fields of the headers of a packet, -1 when absent */
+struct pytun_hdrs
+{
+    int pi_flags;
+    int pi_proto;
+    int eth_off;
+    int ethertype;
+    int vlan;
+    int l3_off;
+    int version;
+    int ip_proto;
+    int ip_len;
+    int ttl;
+    int fragment;
+    int l4_off;
+    int sport;
+    int dport;
+    int tcp_flags;
+    long long seq;
+    long long ack;
+    int icmp_type;
+    int icmp_code;
+    int payload_off;
+    int end;
+};
+typedef struct pytun_hdrs pytun_hdrs_t;
+
+/* Parse the headers of the packet p read from a device created with flags.
+   Headers are parsed as far as the packet allows, truncated or malformed
+   headers are left absent. */
+static void pytun_parse_headers(const unsigned char* p, size_t len, int flags, int vnet_hdr_sz,
+                                pytun_hdrs_t* h)
+{
+    pytun_l3_t l3;
+    size_t off = 0;
+    const unsigned char* l4;
+    size_t l4len;
+
+    memset(h, 0xff, sizeof(*h));
+    h->end = len;
+    if (!(flags & IFF_NO_PI))
+    {
+        if (len < 4)
+        {
+            return;
+        }
+        h->pi_flags = pytun_get16(p);
+        h->pi_proto = pytun_get16(p + 2);
+        off = 4;
+    }
+    if (flags & IFF_VNET_HDR)
+    {
+        off += vnet_hdr_sz;
+    }
+    if (flags & IFF_TAP)
+    {
+        if (off + ETH_HLEN > len)
+        {
+            return;
+        }
+        h->eth_off = off;
+        h->ethertype = pytun_get16(p + off + 12);
+        off += ETH_HLEN;
+        while (h->ethertype == 0x8100 || h->ethertype == 0x88a8)
+        {
+            if (off + 4 > len)
+            {
+                return;
+            }
+            if (h->vlan < 0)
+            {
+                h->vlan = pytun_get16(p + off) & 0x0fff;
+            }
+            h->ethertype = pytun_get16(p + off + 2);
+            off += 4;
+        }
+    }
+    else if (off < len)
+    {
+        if (h->pi_proto >= 0)
+        {
+            h->ethertype = h->pi_proto;
+        }
+        else if (p[off] >> 4 == 4)
+        {
+            h->ethertype = ETH_P_IP;
+        }
+        else if (p[off] >> 4 == 6)
+        {
+            h->ethertype = ETH_P_IPV6;
+        }
+    }
+    if (off > len || (h->ethertype != ETH_P_IP && h->ethertype != ETH_P_IPV6))
+    {
+        return;
+    }
+    h->l3_off = off;
+    if (pytun_parse_l3(p + off, len - off, &l3) < 0)
+    {
+        return;
+    }
+    h->version = l3.version;
+    h->ip_proto = l3.proto;
+    h->ip_len = l3.len;
+    h->ttl = l3.version == 4 ? p[off + 8] : p[off + 7];
+    h->fragment = l3.fragment;
+    h->end = off + l3.len;
+    h->payload_off = off + l3.l4_off;
+    if (l3.fragment)
+    {
+        return;
+    }
+
+    l4 = p + off + l3.l4_off;
+    l4len = l3.len - l3.l4_off;
+    switch (l3.proto)
+    {
+    case IPPROTO_TCP:
+        if (l4len < 20 || (size_t)(l4[12] >> 4) * 4 > l4len)
+        {
+            return;
+        }
+        h->sport = pytun_get16(l4);
+        h->dport = pytun_get16(l4 + 2);
+        h->seq = pytun_get32(l4 + 4);
+        h->ack = pytun_get32(l4 + 8);
+        h->tcp_flags = l4[13];
+        h->l4_off = h->payload_off;
+        h->payload_off += (l4[12] >> 4) * 4;
+        break;
+    case IPPROTO_UDP:
+        if (l4len < 8)
+        {
+            return;
+        }
+        h->sport = pytun_get16(l4);
+        h->dport = pytun_get16(l4 + 2);
+        h->l4_off = h->payload_off;
+        h->payload_off += 8;
+        break;
+    case IPPROTO_ICMP:
+    case IPPROTO_ICMPV6:
+        if (l4len < 8)
+        {
+            return;
+        }
+        h->icmp_type = l4[0];
+        h->icmp_code = l4[1];
+        h->l4_off = h->payload_off;
+        h->payload_off += 8;
+        break;
+    }
+}
+
+struct pytun_packet_view
+{
+    PyObject_HEAD
+    PyObject* obj;
+    Py_buffer view;
+    Py_ssize_t offset;
+    Py_ssize_t len;
+    int flags;
+    int vnet_hdr_sz;
+    int parsed;
+    pytun_hdrs_t hdrs;
+};
+typedef struct pytun_packet_view pytun_packet_view_t;
+
+static void pytun_packet_view_dealloc(PyObject* self)
+{
+    PyTypeObject* type = Py_TYPE(self);
+    pytun_packet_view_t* pv = (pytun_packet_view_t*)self;
+
+    if (pv->obj != NULL)
+    {
+        PyBuffer_Release(&pv->view);
+    }
+    type->tp_free(self);
+    PYTUN_TYPE_DECREF(type);
+}
+
+static PyObject* pytun_packet_view_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+    pytun_packet_view_t* pv;
+    PyObject* obj;
+    Py_ssize_t offset = 0;
+    Py_ssize_t len = -1;
+    int flags = IFF_TUN;
+    int vnet_hdr_sz = sizeof(struct virtio_net_hdr);
+    char* kwlist[] = {"buffer", "offset", "length", "flags", "vnet_hdr_sz", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|nnii:PacketView", kwlist,
+                                     &obj, &offset, &len, &flags, &vnet_hdr_sz))
+    {
+        return NULL;
+    }
+    pv = (pytun_packet_view_t*)type->tp_alloc(type, 0);
+    if (pv == NULL)
+    {
+        return NULL;
+    }
+    if (PyObject_GetBuffer(obj, &pv->view, PyBUF_SIMPLE) < 0)
+    {
+        Py_DECREF(pv);
+        return NULL;
+    }
+    pv->obj = pv->view.obj;
+    if (len < 0)
+    {
+        len = pv->view.len - offset;
+    }
+    if (offset < 0 || len < 0 || offset + len > pv->view.len)
+    {
+        PyErr_SetString(PyExc_ValueError, "offset and length out of the buffer");
+        Py_DECREF(pv);
+        return NULL;
+    }
+    pv->offset = offset;
+    pv->len = len;
+    pv->flags = flags;
+    pv->vnet_hdr_sz = vnet_hdr_sz;
+
+    return (PyObject*)pv;
+}
+
+static pytun_hdrs_t* pytun_packet_view_hdrs(pytun_packet_view_t* pv)
+{
+    if (!pv->parsed)
+    {
+        pytun_parse_headers((unsigned char*)pv->view.buf + pv->offset, pv->len, pv->flags,
+                            pv->vnet_hdr_sz, &pv->hdrs);
+        pv->parsed = 1;
+    }
+
+    return &pv->hdrs;
+}
+
+enum
+{
+    PYTUN_PV_PI_FLAGS,
+    PYTUN_PV_PI_PROTO,
+    PYTUN_PV_ETH_DST,
+    PYTUN_PV_ETH_SRC,
+    PYTUN_PV_ETHERTYPE,
+    PYTUN_PV_VLAN,
+    PYTUN_PV_VERSION,
+    PYTUN_PV_IP_PROTO,
+    PYTUN_PV_IP_LEN,
+    PYTUN_PV_TTL,
+    PYTUN_PV_FRAGMENT,
+    PYTUN_PV_SRC,
+    PYTUN_PV_DST,
+    PYTUN_PV_SPORT,
+    PYTUN_PV_DPORT,
+    PYTUN_PV_TCP_FLAGS,
+    PYTUN_PV_SEQ,
+    PYTUN_PV_ACK,
+    PYTUN_PV_ICMP_TYPE,
+    PYTUN_PV_ICMP_CODE,
+    PYTUN_PV_L3_OFFSET,
+    PYTUN_PV_L4_OFFSET,
+    PYTUN_PV_PAYLOAD_OFFSET,
+    PYTUN_PV_PAYLOAD
+};
+
+static PyObject* pytun_packet_view_get(PyObject* self, void* d)
+{
+    pytun_packet_view_t* pv = (pytun_packet_view_t*)self;
+    pytun_hdrs_t* h = pytun_packet_view_hdrs(pv);
+    const unsigned char* p = (unsigned char*)pv->view.buf + pv->offset;
+    char addr[INET6_ADDRSTRLEN];
+    PyObject* mv;
+    PyObject* res;
+    long long value;
+    int off;
+
+    switch ((int)(intptr_t)d)
+    {
+    case PYTUN_PV_PI_FLAGS: value = h->pi_flags; break;
+    case PYTUN_PV_PI_PROTO: value = h->pi_proto; break;
+    case PYTUN_PV_ETH_DST:
+    case PYTUN_PV_ETH_SRC:
+        if (h->eth_off < 0)
+        {
+            Py_RETURN_NONE;
+        }
+        return pytun_new_string(p + h->eth_off + ((intptr_t)d == PYTUN_PV_ETH_SRC ? ETH_ALEN : 0), ETH_ALEN);
+    case PYTUN_PV_ETHERTYPE: value = h->ethertype; break;
+    case PYTUN_PV_VLAN: value = h->vlan; break;
+    case PYTUN_PV_VERSION: value = h->version; break;
+    case PYTUN_PV_IP_PROTO: value = h->ip_proto; break;
+    case PYTUN_PV_IP_LEN: value = h->ip_len; break;
+    case PYTUN_PV_TTL: value = h->ttl; break;
+    case PYTUN_PV_FRAGMENT:
+        if (h->fragment < 0)
+        {
+            Py_RETURN_NONE;
+        }
+        return PyBool_FromLong(h->fragment);
+    case PYTUN_PV_SRC:
+    case PYTUN_PV_DST:
+        if (h->version < 0)
+        {
+            Py_RETURN_NONE;
+        }
+        if (h->version == 4)
+        {
+            off = h->l3_off + ((intptr_t)d == PYTUN_PV_SRC ? 12 : 16);
+            inet_ntop(AF_INET, p + off, addr, sizeof(addr));
+        }
+        else
+        {
+            off = h->l3_off + ((intptr_t)d == PYTUN_PV_SRC ? 8 : 24);
+            inet_ntop(AF_INET6, p + off, addr, sizeof(addr));
+        }
+#if PY_MAJOR_VERSION >= 3
+        return PyUnicode_FromString(addr);
+#else
+        return PyString_FromString(addr);
+#endif
+    case PYTUN_PV_SPORT: value = h->sport; break;
+    case PYTUN_PV_DPORT: value = h->dport; break;
+    case PYTUN_PV_TCP_FLAGS: value = h->tcp_flags; break;
+    case PYTUN_PV_SEQ: value = h->seq; break;
+    case PYTUN_PV_ACK: value = h->ack; break;
+    case PYTUN_PV_ICMP_TYPE: value = h->icmp_type; break;
+    case PYTUN_PV_ICMP_CODE: value = h->icmp_code; break;
+    case PYTUN_PV_L3_OFFSET: value = h->l3_off; break;
+    case PYTUN_PV_L4_OFFSET: value = h->l4_off; break;
+    case PYTUN_PV_PAYLOAD_OFFSET: value = h->payload_off; break;
+    case PYTUN_PV_PAYLOAD:
+        if (h->payload_off < 0)
+        {
+            Py_RETURN_NONE;
+        }
+        /* A slice of a memoryview of the underlying buffer, not a copy */
+        mv = PyMemoryView_FromObject(pv->obj);
+        if (mv == NULL)
+        {
+            return NULL;
+        }
+        res = PySequence_GetSlice(mv, pv->offset + h->payload_off, pv->offset + h->end);
+        Py_DECREF(mv);
+        return res;
+    default:
+        Py_RETURN_NONE;
+    }
+    if (value < 0)
+    {
+        Py_RETURN_NONE;
+    }
+
+    return PyLong_FromLongLong(value);
+}
+
+#define PYTUN_PV_FIELD(name, id, doc) \
+    {name, pytun_packet_view_get, NULL, doc, (void*)(intptr_t)id}
+
+static PyGetSetDef pytun_packet_view_prop[] =
+{
+    PYTUN_PV_FIELD("pi_flags", PYTUN_PV_PI_FLAGS, "flags of the tun_pi prefix"),
+    PYTUN_PV_FIELD("pi_proto", PYTUN_PV_PI_PROTO, "protocol of the tun_pi prefix"),
+    PYTUN_PV_FIELD("eth_dst", PYTUN_PV_ETH_DST, "destination MAC address"),
+    PYTUN_PV_FIELD("eth_src", PYTUN_PV_ETH_SRC, "source MAC address"),
+    PYTUN_PV_FIELD("ethertype", PYTUN_PV_ETHERTYPE, "protocol of the network layer"),
+    PYTUN_PV_FIELD("vlan", PYTUN_PV_VLAN, "VLAN ID of the outer 802.1Q tag"),
+    PYTUN_PV_FIELD("version", PYTUN_PV_VERSION, "IP version"),
+    PYTUN_PV_FIELD("ip_proto", PYTUN_PV_IP_PROTO, "upper-layer protocol"),
+    PYTUN_PV_FIELD("ip_len", PYTUN_PV_IP_LEN, "length of the IP packet"),
+    PYTUN_PV_FIELD("ttl", PYTUN_PV_TTL, "TTL or hop limit"),
+    PYTUN_PV_FIELD("fragment", PYTUN_PV_FRAGMENT, "True if the packet is a fragment"),
+    PYTUN_PV_FIELD("src", PYTUN_PV_SRC, "source IP address"),
+    PYTUN_PV_FIELD("dst", PYTUN_PV_DST, "destination IP address"),
+    PYTUN_PV_FIELD("sport", PYTUN_PV_SPORT, "TCP or UDP source port"),
+    PYTUN_PV_FIELD("dport", PYTUN_PV_DPORT, "TCP or UDP destination port"),
+    PYTUN_PV_FIELD("tcp_flags", PYTUN_PV_TCP_FLAGS, "TCP flags"),
+    PYTUN_PV_FIELD("seq", PYTUN_PV_SEQ, "TCP sequence number"),
+    PYTUN_PV_FIELD("ack", PYTUN_PV_ACK, "TCP acknowledgment number"),
+    PYTUN_PV_FIELD("icmp_type", PYTUN_PV_ICMP_TYPE, "ICMP type"),
+    PYTUN_PV_FIELD("icmp_code", PYTUN_PV_ICMP_CODE, "ICMP code"),
+    PYTUN_PV_FIELD("l3_offset", PYTUN_PV_L3_OFFSET, "offset of the IP header"),
+    PYTUN_PV_FIELD("l4_offset", PYTUN_PV_L4_OFFSET, "offset of the TCP, UDP or ICMP header"),
+    PYTUN_PV_FIELD("payload_offset", PYTUN_PV_PAYLOAD_OFFSET, "offset of the payload"),
+    PYTUN_PV_FIELD("payload", PYTUN_PV_PAYLOAD, "memoryview of the payload"),
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static Py_ssize_t pytun_packet_view_len(PyObject* self)
+{
+    return ((pytun_packet_view_t*)self)->len;
+}
+
+PyDoc_STRVAR(pytun_packet_view_doc,
+"PacketView(buffer, offset=0, length=-1, flags=IFF_TUN, vnet_hdr_sz=10) -> packet view object.\n\
+Parse the headers of the packet stored in buffer at offset, without copying\n\
+it. flags are the flags of the device the packet has been read from, they\n\
+tell whether the packet starts with a tun_pi prefix, a vnet header and an\n\
+Ethernet header. The tun_pi, Ethernet, 802.1Q, IPv4, IPv6, TCP, UDP and\n\
+ICMP headers are parsed on first access to an attribute. Attributes of\n\
+absent headers are None, offsets are relative to the start of the packet.\n\
+The buffer is locked as long as the view is alive.");
+
+static PyType_Slot pytun_packet_view_slots[] =
+{
+    {Py_tp_dealloc, pytun_packet_view_dealloc},
+    {Py_sq_length, pytun_packet_view_len},
+    {Py_tp_doc, (void*)pytun_packet_view_doc},
+    {Py_tp_getset, pytun_packet_view_prop},
+    {Py_tp_new, pytun_packet_view_new},
+    {0, NULL}
+};
+
+static PyType_Spec pytun_packet_view_spec =
+{
+    .name = "pytun.PacketView",
+    .basicsize = sizeof(pytun_packet_view_t),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = pytun_packet_view_slots
+};
+
+/* Columns returned by parse_many(), as array.array objects. Absent fields
+   are -1, the types are signed and wide enough for the field and -1. */
+#define PYTUN_PM_COLUMNS 12
+
+static const char* pytun_pm_names[PYTUN_PM_COLUMNS] =
+{
+    "length", "ethertype", "vlan", "version", "ip_proto", "ttl",
+    "l3_offset", "l4_offset", "payload_offset", "sport", "dport", "tcp_flags"
+};
+
+static const char pytun_pm_types[PYTUN_PM_COLUMNS] =
+{
+    'I', 'i', 'h', 'b', 'h', 'h', 'i', 'i', 'i', 'i', 'i', 'h'
+};
+
+/* Size of an item of a column */
+static size_t pytun_pm_itemsize(char type)
+{
+    switch (type)
+    {
+    case 'b':
+        return sizeof(signed char);
+    case 'h':
+        return sizeof(short);
+    case 'i':
+        return sizeof(int);
+    default:
+        return sizeof(unsigned int);
+    }
+}
+
+static void pytun_pm_store(char** cols, Py_ssize_t i, size_t len, const pytun_hdrs_t* h)
+{
+    const int values[PYTUN_PM_COLUMNS] =
+    {
+        (int)len, h->ethertype, h->vlan, h->version, h->ip_proto, h->ttl,
+        h->l3_off, h->l4_off, h->payload_off, h->sport, h->dport, h->tcp_flags
+    };
+    int c;
+
+    for (c = 0; c < PYTUN_PM_COLUMNS; c++)
+    {
+        switch (pytun_pm_types[c])
+        {
+        case 'b':
+            ((signed char*)cols[c])[i] = values[c];
+            break;
+        case 'h':
+            ((short*)cols[c])[i] = values[c];
+            break;
+        case 'i':
+            ((int*)cols[c])[i] = values[c];
+            break;
+        default:
+            ((unsigned int*)cols[c])[i] = values[c];
+            break;
+        }
+    }
+}
+
+/* Copy the source and destination addresses of the packet at p, IPv4
+   addresses being mapped to IPv6 */
+static void pytun_pm_store_addrs(unsigned char* src, unsigned char* dst, const unsigned char* p,
+                                 const pytun_hdrs_t* h)
+{
+    memset(src, 0, 16);
+    memset(dst, 0, 16);
+    if (h->version == 4)
+    {
+        src[10] = src[11] = dst[10] = dst[11] = 0xff;
+        memcpy(src + 12, p + h->l3_off + 12, 4);
+        memcpy(dst + 12, p + h->l3_off + 16, 4);
+    }
+    else if (h->version == 6)
+    {
+        memcpy(src, p + h->l3_off + 8, 16);
+        memcpy(dst, p + h->l3_off + 24, 16);
+    }
+}
+
+static PyObject* pytun_parse_many(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    PyObject* packets;
+    PyObject* offsets_obj = Py_None;
+    int flags = IFF_TUN;
+    int vnet_hdr_sz = sizeof(struct virtio_net_hdr);
+    char* kwlist[] = {"packets", "offsets", "flags", "vnet_hdr_sz", NULL};
+    Py_buffer buf;
+    PyObject* seq = NULL;
+    Py_ssize_t* offsets = NULL;
+    Py_ssize_t n;
+    Py_ssize_t i;
+    const unsigned char* p;
+    size_t len;
+    pytun_hdrs_t h;
+    char* cols[PYTUN_PM_COLUMNS + 2];
+    PyObject* raw[PYTUN_PM_COLUMNS + 2];
+    PyObject* array_mod = NULL;
+    PyObject* res = NULL;
+    PyObject* col;
+    int have_buf = 0;
+    int c;
+
+    memset(raw, 0, sizeof(raw));
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|Oii:parse_many", kwlist,
+                                     &packets, &offsets_obj, &flags, &vnet_hdr_sz))
+    {
+        return NULL;
+    }
+    if (offsets_obj != Py_None)
+    {
+        if (PyObject_GetBuffer(packets, &buf, PyBUF_SIMPLE) < 0)
+        {
+            return NULL;
+        }
+        have_buf = 1;
+        offsets = pytun_parse_offsets(offsets_obj, buf.len, &n);
+        if (offsets == NULL)
+        {
+            goto out;
+        }
+    }
+    else
+    {
+        seq = PySequence_Fast(packets, "packets must be an iterable");
+        if (seq == NULL)
+        {
+            return NULL;
+        }
+        n = PySequence_Fast_GET_SIZE(seq);
+    }
+
+    /* Columns are filled in place in bytes objects, then turned into
+       arrays. src and dst are packed 16-byte addresses. */
+    for (c = 0; c < PYTUN_PM_COLUMNS + 2; c++)
+    {
+        raw[c] = pytun_new_string(NULL, n * (c >= PYTUN_PM_COLUMNS ? 16 : pytun_pm_itemsize(pytun_pm_types[c])));
+        if (raw[c] == NULL)
+        {
+            goto out;
+        }
+        cols[c] = (char*)pytun_string_data(raw[c]);
+    }
+    for (i = 0; i < n; i++)
+    {
+        Py_buffer pkt;
+
+        if (have_buf)
+        {
+            p = (unsigned char*)buf.buf + offsets[i];
+            len = offsets[i + 1] - offsets[i];
+        }
+        else
+        {
+            if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(seq, i), &pkt, PyBUF_SIMPLE) < 0)
+            {
+                goto out;
+            }
+            p = pkt.buf;
+            len = pkt.len;
+        }
+        pytun_parse_headers(p, len, flags, vnet_hdr_sz, &h);
+        pytun_pm_store(cols, i, len, &h);
+        pytun_pm_store_addrs((unsigned char*)cols[PYTUN_PM_COLUMNS] + i * 16,
+                             (unsigned char*)cols[PYTUN_PM_COLUMNS + 1] + i * 16, p, &h);
+        if (!have_buf)
+        {
+            PyBuffer_Release(&pkt);
+        }
+    }
+
+    array_mod = PyImport_ImportModule("array");
+    if (array_mod == NULL)
+    {
+        goto out;
+    }
+    res = PyDict_New();
+    if (res == NULL)
+    {
+        goto out;
+    }
+    for (c = 0; c < PYTUN_PM_COLUMNS; c++)
+    {
+        col = PyObject_CallMethod(array_mod, "array", "(s#O)", &pytun_pm_types[c], (Py_ssize_t)1, raw[c]);
+        if (col == NULL || PyDict_SetItemString(res, pytun_pm_names[c], col) < 0)
+        {
+            Py_XDECREF(col);
+            Py_CLEAR(res);
+            goto out;
+        }
+        Py_DECREF(col);
+    }
+    if (PyDict_SetItemString(res, "src", raw[PYTUN_PM_COLUMNS]) < 0 ||
+        PyDict_SetItemString(res, "dst", raw[PYTUN_PM_COLUMNS + 1]) < 0)
+    {
+        Py_CLEAR(res);
+    }
+
+out:
+    for (c = 0; c < PYTUN_PM_COLUMNS + 2; c++)
+    {
+        Py_XDECREF(raw[c]);
+    }
+    Py_XDECREF(array_mod);
+    Py_XDECREF(seq);
+    PyMem_Free(offsets);
+    if (have_buf)
+    {
+        PyBuffer_Release(&buf);
+    }
+
+    return res;
+}
+
+PyDoc_STRVAR(pytun_parse_many_doc,
+"parse_many(packets, offsets=None, flags=IFF_TUN, vnet_hdr_sz=10) -> dict.\n\
+Parse the headers of a batch of packets, either an iterable of buffers (as\n\
+returned by read_many()) or a buffer and a list of offsets (as returned by\n\
+read_many_into()). Return a dict of array.array objects with one item per\n\
+packet: length, ethertype, vlan, version, ip_proto, ttl, l3_offset,\n\
+l4_offset, payload_offset, sport, dport and tcp_flags (-1 when absent), and\n\
+the bytes objects src and dst holding 16-byte addresses (IPv4 addresses\n\
+are mapped to IPv6, absent addresses are zeroed).");
+
+static PyObject* pytun_checksum(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    Py_buffer buf;
+    unsigned PY_LONG_LONG initial = 0;
+    const char* kernel = NULL;
+    char* kwlist[] = {"buffer", "initial", "kernel", NULL};
+    const pytun_csum_impl_t* impl = __atomic_load_n(&pytun_csum_impl, __ATOMIC_RELAXED);
+    uint64_t sum;
+    size_t i;
+
+#if PY_MAJOR_VERSION >= 3
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|Kz:checksum", kwlist, &buf, &initial, &kernel))
+#else
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s*|Kz:checksum", kwlist, &buf, &initial, &kernel))
+#endif
+    {
+        return NULL;
+    }
+    if (kernel != NULL)
+    {
+        impl = NULL;
+        for (i = 0; i < PYTUN_CSUM_NIMPLS; i++)
+        {
+            if (strcmp(pytun_csum_impls[i].name, kernel) == 0 && pytun_csum_supported(&pytun_csum_impls[i]))
+            {
+                impl = &pytun_csum_impls[i];
+                break;
+            }
+        }
+        if (impl == NULL)
+        {
+            PyBuffer_Release(&buf);
+            raise_error(pytun_module_state(self), "Unsupported checksum kernel");
+            return NULL;
+        }
+    }
+    sum = initial + ntohs(pytun_csum_fold(impl->sum(buf.buf, buf.len)));
+    PyBuffer_Release(&buf);
+
+#if PY_MAJOR_VERSION >= 3
+    return PyLong_FromLong(~pytun_csum_fold(sum) & 0xffff);
+#else
+    return PyInt_FromLong(~pytun_csum_fold(sum) & 0xffff);
+#endif
+}
+
+PyDoc_STRVAR(pytun_checksum_doc,
+"checksum(buffer, initial=0, kernel=None) -> int.\n\
+Return the Internet checksum (RFC 1071) of buffer. initial is added to the\n\
+sum of its 16-bit words, e.g the sum of a pseudo-header. kernel forces the\n\
+use of one of the kernels listed in CHECKSUM_KERNELS, the first one being\n\
+used by default.");
+
+/* Update the checksum csum after 16-bit words summing to old_sum have been
+   replaced by words summing to new_sum (RFC 1624, eqn. 3) */
+static unsigned int pytun_csum_update(unsigned int csum, uint64_t old_sum, uint64_t new_sum)
+{
+    return ~pytun_csum_fold((~csum & 0xffff) + (~pytun_csum_fold(old_sum) & 0xffff) + new_sum) & 0xffff;
+}
+
+static PyObject* pytun_checksum_update(PyObject* self, PyObject* args)
+{
+    unsigned int csum;
+    PyObject* old;
+    PyObject* new;
+    Py_buffer oldbuf;
+    Py_buffer newbuf;
+    uint64_t old_sum;
+    uint64_t new_sum;
+
+    if (!PyArg_ParseTuple(args, "IOO:checksum_update", &csum, &old, &new))
+    {
+        return NULL;
+    }
+    if (csum > 0xffff)
+    {
+        PyErr_SetString(PyExc_ValueError, "checksum must be a 16-bit value");
+        return NULL;
+    }
+    if (PyObject_CheckBuffer(old) && PyObject_CheckBuffer(new))
+    {
+        if (PyObject_GetBuffer(old, &oldbuf, PyBUF_SIMPLE) < 0)
+        {
+            return NULL;
+        }
+        if (PyObject_GetBuffer(new, &newbuf, PyBUF_SIMPLE) < 0)
+        {
+            PyBuffer_Release(&oldbuf);
+            return NULL;
+        }
+        if (oldbuf.len != newbuf.len)
+        {
+            PyBuffer_Release(&oldbuf);
+            PyBuffer_Release(&newbuf);
+            PyErr_SetString(PyExc_ValueError, "old and new must have the same length");
+            return NULL;
+        }
+        old_sum = pytun_csum_add(0, oldbuf.buf, oldbuf.len);
+        new_sum = pytun_csum_add(0, newbuf.buf, newbuf.len);
+        PyBuffer_Release(&oldbuf);
+        PyBuffer_Release(&newbuf);
+    }
+    else
+    {
+        old_sum = PyLong_AsUnsignedLong(old);
+        if (PyErr_Occurred())
+        {
+            return NULL;
+        }
+        new_sum = PyLong_AsUnsignedLong(new);
+        if (PyErr_Occurred())
+        {
+            return NULL;
+        }
+        if (old_sum > 0xffff || new_sum > 0xffff)
+        {
+            PyErr_SetString(PyExc_ValueError, "old and new must be 16-bit values");
+            return NULL;
+        }
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    return PyLong_FromLong(pytun_csum_update(csum, old_sum, new_sum));
+#else
+    return PyInt_FromLong(pytun_csum_update(csum, old_sum, new_sum));
+#endif
+}
+
+PyDoc_STRVAR(pytun_checksum_update_doc,
+"checksum_update(csum, old, new) -> int.\n\
+Return the checksum csum updated after old has been replaced by new in the\n\
+checksummed data (RFC 1624), old and new being either 16-bit values or\n\
+buffers of the same length starting at an even offset of the data.");
+
+/* Verify (fix == 0) or fill in (fix != 0) the checksums of the IPv4 header
+   and of the TCP, UDP, ICMP or ICMPv6 header of the packet p. Return 1 if
+   they are correct or have been filled in, 0 if one of them is wrong and -1
+   if the packet has no checksum which could be handled. */
+static int pytun_csum_packet(unsigned char* p, size_t len, int flags, int vnet_hdr_sz, int fix)
+{
+    pytun_hdrs_t h;
+    unsigned char* ip;
+    unsigned char* l4;
+    size_t l4len;
+    size_t field;
+    uint64_t sum;
+    unsigned int csum;
+    int ret = -1;
+
+    pytun_parse_headers(p, len, flags, vnet_hdr_sz, &h);
+    if (h.version < 0)
+    {
+        return -1;
+    }
+    ip = p + h.l3_off;
+    if (h.version == 4)
+    {
+        if (fix)
+        {
+            pytun_put16(ip + 10, 0);
+            pytun_put16(ip + 10, ~pytun_csum_fold(pytun_csum_add(0, ip, (ip[0] & 0xf) * 4)) & 0xffff);
+        }
+        else if (pytun_csum_fold(pytun_csum_add(0, ip, (ip[0] & 0xf) * 4)) != 0xffff)
+        {
+            return 0;
+        }
+        ret = 1;
+    }
+    if (h.fragment || h.l4_off < 0)
+    {
+        return ret;
+    }
+
+    l4 = p + h.l4_off;
+    l4len = h.end - h.l4_off;
+    switch (h.ip_proto)
+    {
+    case IPPROTO_TCP:
+        field = 16;
+        break;
+    case IPPROTO_UDP:
+        field = 6;
+        break;
+    case IPPROTO_ICMP:
+        if (h.version != 4)
+        {
+            return ret;
+        }
+        field = 2;
+        break;
+    case IPPROTO_ICMPV6:
+        if (h.version != 6)
+        {
+            return ret;
+        }
+        field = 2;
+        break;
+    default:
+        return ret;
+    }
+    sum = h.ip_proto == IPPROTO_ICMP ? 0 : pytun_csum_pseudo(ip, h.version, h.ip_proto, l4len);
+    if (fix)
+    {
+        pytun_put16(l4 + field, 0);
+        csum = ~pytun_csum_fold(pytun_csum_add(sum, l4, l4len)) & 0xffff;
+        if (csum == 0 && h.ip_proto == IPPROTO_UDP)
+        {
+            csum = 0xffff;
+        }
+        pytun_put16(l4 + field, csum);
+    }
+    else if (h.ip_proto == IPPROTO_UDP && h.version == 4 && pytun_get16(l4 + field) == 0)
+    {
+        /* No checksum */
+    }
+    else if (pytun_csum_fold(pytun_csum_add(sum, l4, l4len)) != 0xffff)
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Implementation of verify_checksums() and fix_checksums() */
+static PyObject* pytun_csum_many(PyObject* args, PyObject* kwds, int fix)
+{
+    PyObject* packets;
+    PyObject* offsets_obj = Py_None;
+    int flags = IFF_TUN;
+    int vnet_hdr_sz = sizeof(struct virtio_net_hdr);
+    char* kwlist[] = {"packets", "offsets", "flags", "vnet_hdr_sz", NULL};
+    int bufflags = fix ? PyBUF_WRITABLE : PyBUF_SIMPLE;
+    Py_buffer buf;
+    Py_buffer pkt;
+    PyObject* seq = NULL;
+    Py_ssize_t* offsets = NULL;
+    Py_ssize_t n;
+    Py_ssize_t i;
+    Py_ssize_t count = 0;
+    unsigned char* p;
+    size_t len;
+    PyObject* raw = NULL;
+    signed char* results = NULL;
+    PyObject* array_mod;
+    PyObject* res = NULL;
+    int have_buf = 0;
+    int ret;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, fix ? "O|Oii:fix_checksums" : "O|Oii:verify_checksums",
+                                     kwlist, &packets, &offsets_obj, &flags, &vnet_hdr_sz))
+    {
+        return NULL;
+    }
+    if (offsets_obj != Py_None)
+    {
+        if (PyObject_GetBuffer(packets, &buf, bufflags) < 0)
+        {
+            return NULL;
+        }
+        have_buf = 1;
+        offsets = pytun_parse_offsets(offsets_obj, buf.len, &n);
+        if (offsets == NULL)
+        {
+            goto out;
+        }
+    }
+    else
+    {
+        seq = PySequence_Fast(packets, "packets must be an iterable");
+        if (seq == NULL)
+        {
+            return NULL;
+        }
+        n = PySequence_Fast_GET_SIZE(seq);
+    }
+    if (!fix)
+    {
+        raw = pytun_new_string(NULL, n);
+        if (raw == NULL)
+        {
+            goto out;
+        }
+        results = (signed char*)pytun_string_data(raw);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if (have_buf)
+        {
+            p = (unsigned char*)buf.buf + offsets[i];
+            len = offsets[i + 1] - offsets[i];
+        }
+        else
+        {
+            if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(seq, i), &pkt, bufflags) < 0)
+            {
+                goto out;
+            }
+            p = pkt.buf;
+            len = pkt.len;
+        }
+        ret = pytun_csum_packet(p, len, flags, vnet_hdr_sz, fix);
+        if (fix)
+        {
+            count += ret > 0;
+        }
+        else
+        {
+            results[i] = ret;
+        }
+        if (!have_buf)
+        {
+            PyBuffer_Release(&pkt);
+        }
+    }
+
+    if (fix)
+    {
+#if PY_MAJOR_VERSION >= 3
+        res = PyLong_FromSsize_t(count);
+#else
+        res = PyInt_FromSsize_t(count);
+#endif
+    }
+    else
+    {
+        array_mod = PyImport_ImportModule("array");
+        if (array_mod == NULL)
+        {
+            goto out;
+        }
+        res = PyObject_CallMethod(array_mod, "array", "(s#O)", "b", (Py_ssize_t)1, raw);
+        Py_DECREF(array_mod);
+    }
+
+out:
+    Py_XDECREF(raw);
+    Py_XDECREF(seq);
+    PyMem_Free(offsets);
+    if (have_buf)
+    {
+        PyBuffer_Release(&buf);
+    }
+
+    return res;
+}
+
+static PyObject* pytun_verify_checksums(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    return pytun_csum_many(args, kwds, 0);
+}
+
+PyDoc_STRVAR(pytun_verify_checksums_doc,
+"verify_checksums(packets, offsets=None, flags=IFF_TUN, vnet_hdr_sz=10) -> array.array.\n\
+Verify the checksums of the IPv4 header and of the TCP, UDP, ICMP or ICMPv6\n\
+header of a batch of packets, either an iterable of buffers or a buffer and\n\
+a list of offsets. Return an array of signed bytes with one item per\n\
+packet: 1 if the checksums are correct, 0 if one of them is wrong and -1 if\n\
+the packet has no checksum to verify. Partial checksums of packets read\n\
+with a vnet header asking for checksum completion are reported as wrong.");
+
+static PyObject* pytun_fix_checksums(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    return pytun_csum_many(args, kwds, 1);
+}
+
+PyDoc_STRVAR(pytun_fix_checksums_doc,
+"fix_checksums(packets, offsets=None, flags=IFF_TUN, vnet_hdr_sz=10) -> int.\n\
+Compute in place the checksums of the IPv4 header and of the TCP, UDP, ICMP\n\
+or ICMPv6 header of a batch of packets stored in writable buffers, either\n\
+an iterable of buffers or a buffer and a list of offsets. Return the number\n\
+of packets whose checksums have been computed.");
+
+/* Key of a flow. IPv4 addresses are mapped to IPv6, ports are 0 for other
+   protocols than TCP and UDP. */
+struct pytun_flow_key
+{
+    unsigned char src[16];
+    unsigned char dst[16];
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t proto;
+};
+typedef struct pytun_flow_key pytun_flow_key_t;
+
+#define PYTUN_FLOW_EMPTY 0
+#define PYTUN_FLOW_USED 1
+#define PYTUN_FLOW_DELETED 2
+
+struct pytun_flow
+{
+    pytun_flow_key_t key;
+    int state;
+    PY_LONG_LONG value;
+    double last;
+    double timeout;
+};
+typedef struct pytun_flow pytun_flow_t;
+
+struct pytun_flow_table
+{
+    PyObject_HEAD
+    pytun_flow_t* slots;
+    size_t mask;
+    size_t used;
+    size_t deleted;
+    double timeout;
+    int flags;
+    int vnet_hdr_sz;
+    int symmetric;
+    unsigned PY_LONG_LONG hits;
+    unsigned PY_LONG_LONG misses;
+    unsigned PY_LONG_LONG expired;
+};
+typedef struct pytun_flow_table pytun_flow_table_t;
+
+static double pytun_monotonic(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t pytun_flow_hash(const pytun_flow_key_t* key)
+{
+    uint64_t words[5];
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    int i;
+
+    memcpy(words, key, sizeof(words));
+    for (i = 0; i < 5; i++)
+    {
+        h ^= words[i] * 0xbf58476d1ce4e5b9ULL;
+        h = (h << 27 | h >> 37) * 0x94d049bb133111ebULL;
+    }
+    h ^= h >> 31;
+
+    return h;
+}
+
+/* Put the endpoints of the key in a canonical order, so that both
+   directions of a flow have the same key */
+static void pytun_flow_key_symmetric(pytun_flow_key_t* key)
+{
+    unsigned char addr[16];
+    uint16_t port;
+    int cmp;
+
+    cmp = memcmp(key->src, key->dst, 16);
+    if (cmp > 0 || (cmp == 0 && key->sport > key->dport))
+    {
+        memcpy(addr, key->src, 16);
+        memcpy(key->src, key->dst, 16);
+        memcpy(key->dst, addr, 16);
+        port = key->sport;
+        key->sport = key->dport;
+        key->dport = port;
+    }
+}
+
+/* Build the key of the packet p. Returns -1 if it is not an IP packet. */
+static int pytun_flow_key_from_packet(pytun_flow_table_t* ft, const unsigned char* p, size_t len,
+                                      pytun_flow_key_t* key)
+{
+    pytun_hdrs_t h;
+
+    pytun_parse_headers(p, len, ft->flags, ft->vnet_hdr_sz, &h);
+    if (h.version < 0)
+    {
+        return -1;
+    }
+    memset(key, 0, sizeof(*key));
+    pytun_pm_store_addrs(key->src, key->dst, p, &h);
+    key->proto = h.ip_proto;
+    if (h.sport >= 0 && (h.ip_proto == IPPROTO_TCP || h.ip_proto == IPPROTO_UDP))
+    {
+        key->sport = h.sport;
+        key->dport = h.dport;
+    }
+    if (ft->symmetric)
+    {
+        pytun_flow_key_symmetric(key);
+    }
+
+    return 0;
+}
+
+/* Find the slot of key, or the slot where it should be inserted if absent */
+static pytun_flow_t* pytun_flow_find(pytun_flow_table_t* ft, const pytun_flow_key_t* key)
+{
+    size_t i = pytun_flow_hash(key) & ft->mask;
+    pytun_flow_t* tombstone = NULL;
+    pytun_flow_t* slot;
+
+    for (;;)
+    {
+        slot = &ft->slots[i];
+        if (slot->state == PYTUN_FLOW_EMPTY)
+        {
+            return tombstone != NULL ? tombstone : slot;
+        }
+        if (slot->state == PYTUN_FLOW_DELETED)
+        {
+            if (tombstone == NULL)
+            {
+                tombstone = slot;
+            }
+        }
+        else if (memcmp(&slot->key, key, sizeof(*key)) == 0)
+        {
+            return slot;
+        }
+        i = (i + 1) & ft->mask;
+    }
+}
+
+static void pytun_flow_delete(pytun_flow_table_t* ft, pytun_flow_t* slot)
+{
+    slot->state = PYTUN_FLOW_DELETED;
+    ft->used--;
+    ft->deleted++;
+}
+
+/* Return the value of the flow of key, or -1 if absent or expired */
+static PY_LONG_LONG pytun_flow_lookup(pytun_flow_table_t* ft, const pytun_flow_key_t* key, double now)
+{
+    pytun_flow_t* slot = pytun_flow_find(ft, key);
+
+    if (slot->state != PYTUN_FLOW_USED)
+    {
+        ft->misses++;
+        return -1;
+    }
+    if (slot->timeout > 0 && now - slot->last > slot->timeout)
+    {
+        pytun_flow_delete(ft, slot);
+        ft->expired++;
+        ft->misses++;
+        return -1;
+    }
+    slot->last = now;
+    ft->hits++;
+
+    return slot->value;
+}
+
+/* Rehash the table in a table of capacity slots, dropping tombstones */
+static int pytun_flow_resize(pytun_flow_table_t* ft, size_t capacity)
+{
+    pytun_flow_t* old = ft->slots;
+    size_t old_len = ft->mask + 1;
+    pytun_flow_t* slot;
+    size_t i;
+
+    ft->slots = PyMem_New(pytun_flow_t, capacity);
+    if (ft->slots == NULL)
+    {
+        ft->slots = old;
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(ft->slots, 0, capacity * sizeof(pytun_flow_t));
+    ft->mask = capacity - 1;
+    ft->deleted = 0;
+    for (i = 0; old != NULL && i < old_len; i++)
+    {
+        if (old[i].state == PYTUN_FLOW_USED)
+        {
+            slot = pytun_flow_find(ft, &old[i].key);
+            *slot = old[i];
+        }
+    }
+    PyMem_Free(old);
+
+    return 0;
+}
+
+static int pytun_flow_insert(pytun_flow_table_t* ft, const pytun_flow_key_t* key, PY_LONG_LONG value,
+                             double timeout, double now)
+{
+    pytun_flow_t* slot;
+
+    /* Keep at least a quarter of the slots empty for probing */
+    if ((ft->used + ft->deleted + 1) * 4 > (ft->mask + 1) * 3)
+    {
+        if (pytun_flow_resize(ft, ft->used * 2 + 2 > ft->mask + 1 ? (ft->mask + 1) * 2 : ft->mask + 1) < 0)
+        {
+            return -1;
+        }
+    }
+    slot = pytun_flow_find(ft, key);
+    if (slot->state != PYTUN_FLOW_USED)
+    {
+        if (slot->state == PYTUN_FLOW_DELETED)
+        {
+            ft->deleted--;
+        }
+        ft->used++;
+        slot->key = *key;
+        slot->state = PYTUN_FLOW_USED;
+    }
+    slot->value = value;
+    slot->timeout = timeout;
+    slot->last = now;
+
+    return 0;
+}
+
+static int pytun_flow_parse_addr(pytun_state_t* state, PyObject* obj, unsigned char* addr)
+{
+    PyObject* tmp = NULL;
+    const char* str;
+    int ret = -1;
+
+#if PY_MAJOR_VERSION >= 3
+    tmp = PyUnicode_AsASCIIString(obj);
+    str = tmp != NULL ? PyBytes_AS_STRING(tmp) : NULL;
+#else
+    str = PyString_AsString(obj);
+#endif
+    if (str == NULL)
+    {
+        goto out;
+    }
+    memset(addr, 0, 16);
+    if (inet_pton(AF_INET, str, addr + 12) == 1)
+    {
+        addr[10] = addr[11] = 0xff;
+    }
+    else if (inet_pton(AF_INET6, str, addr) != 1)
+    {
+        raise_error(state, "Bad IP address");
+        goto out;
+    }
+    ret = 0;
+
+out:
+    Py_XDECREF(tmp);
+
+    return ret;
+}
+
+/* Convert a (src, dst, proto, sport, dport) tuple to a key */
+static int pytun_flow_key_from_tuple(pytun_flow_table_t* ft, PyObject* tuple, pytun_flow_key_t* key)
+{
+    PyObject* src;
+    PyObject* dst;
+    unsigned int proto;
+    unsigned short sport = 0;
+    unsigned short dport = 0;
+
+    if (!PyArg_ParseTuple(tuple, "OOI|HH:flow key", &src, &dst, &proto, &sport, &dport))
+    {
+        return -1;
+    }
+    memset(key, 0, sizeof(*key));
+    if (pytun_flow_parse_addr(pytun_state_of(ft), src, key->src) < 0 ||
+        pytun_flow_parse_addr(pytun_state_of(ft), dst, key->dst) < 0)
+    {
+        return -1;
+    }
+    key->proto = proto & 0xff;
+    if (key->proto == IPPROTO_TCP || key->proto == IPPROTO_UDP)
+    {
+        key->sport = sport;
+        key->dport = dport;
+    }
+    if (ft->symmetric)
+    {
+        pytun_flow_key_symmetric(key);
+    }
+
+    return 0;
+}
+
+static void pytun_flow_table_dealloc(PyObject* self)
+{
+    PyTypeObject* type = Py_TYPE(self);
+
+    PyMem_Free(((pytun_flow_table_t*)self)->slots);
+    type->tp_free(self);
+    PYTUN_TYPE_DECREF(type);
+}
+
+static PyObject* pytun_flow_table_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+    pytun_flow_table_t* ft;
+    Py_ssize_t capacity = 1024;
+    double timeout = 0.0;
+    int flags = IFF_TUN;
+    int vnet_hdr_sz = sizeof(struct virtio_net_hdr);
+    int symmetric = 0;
+    char* kwlist[] = {"capacity", "timeout", "flags", "vnet_hdr_sz", "symmetric", NULL};
+    size_t size = 16;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ndiii:FlowTable", kwlist,
+                                     &capacity, &timeout, &flags, &vnet_hdr_sz, &symmetric))
+    {
+        return NULL;
+    }
+    if (capacity <= 0 || capacity > ((Py_ssize_t)1 << 30))
+    {
+        PyErr_SetString(PyExc_ValueError, "capacity out of range");
+        return NULL;
+    }
+    /* Room for capacity flows at a load factor of 3/4 */
+    while (size * 3 < (size_t)capacity * 4)
+    {
+        size *= 2;
+    }
+
+    ft = (pytun_flow_table_t*)type->tp_alloc(type, 0);
+    if (ft == NULL)
+    {
+        return NULL;
+    }
+    ft->timeout = timeout;
+    ft->flags = flags;
+    ft->vnet_hdr_sz = vnet_hdr_sz;
+    ft->symmetric = symmetric;
+    if (pytun_flow_resize(ft, size) < 0)
+    {
+        Py_DECREF(ft);
+        return NULL;
+    }
+
+    return (PyObject*)ft;
+}
+
+static PyObject* pytun_flow_table_add(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    pytun_flow_table_t* ft = (pytun_flow_table_t*)self;
+    PyObject* key_obj;
+    PY_LONG_LONG value;
+    PyObject* timeout_obj = Py_None;
+    char* kwlist[] = {"key", "value", "timeout", NULL};
+    pytun_flow_key_t key;
+    double timeout = ft->timeout;
+    int ret;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!L|O:add", kwlist, &PyTuple_Type, &key_obj,
+                                     &value, &timeout_obj))
+    {
+        return NULL;
+    }
+    if (value < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "value must be >= 0");
+        return NULL;
+    }
+    if (timeout_obj != Py_None)
+    {
+        timeout = PyFloat_AsDouble(timeout_obj);
+        if (timeout == -1.0 && PyErr_Occurred())
+        {
+            return NULL;
+        }
+    }
+    if (pytun_flow_key_from_tuple(ft, key_obj, &key) < 0)
+    {
+        return NULL;
+    }
+    Py_BEGIN_CRITICAL_SECTION(self);
+    ret = pytun_flow_insert(ft, &key, value, timeout, pytun_monotonic());
+    Py_END_CRITICAL_SECTION();
+    if (ret < 0)
+    {
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pytun_flow_table_add_doc,
+"add(key, value, timeout=None) -> None.\n\
+Add or replace the flow key, a (src, dst, proto, sport, dport) tuple\n\
+(ports may be omitted), with value, an integer >= 0. The flow expires after\n\
+timeout seconds without a packet, the default timeout of the table is used\n\
+if timeout is None, 0 means never.");
+
+static PyObject* pytun_flow_table_add_packet(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    pytun_flow_table_t* ft = (pytun_flow_table_t*)self;
+    Py_buffer pkt;
+    PY_LONG_LONG value;
+    PyObject* timeout_obj = Py_None;
+    char* kwlist[] = {"packet", "value", "timeout", NULL};
+    pytun_flow_key_t key;
+    double timeout = ft->timeout;
+    int ret;
+
+#if PY_MAJOR_VERSION >= 3
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*L|O:add_packet", kwlist, &pkt, &value, &timeout_obj))
+#else
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s*L|O:add_packet", kwlist, &pkt, &value, &timeout_obj))
+#endif
+    {
+        return NULL;
+    }
+    ret = pytun_flow_key_from_packet(ft, pkt.buf, pkt.len, &key);
+    PyBuffer_Release(&pkt);
+    if (ret < 0)
+    {
+        raise_error(pytun_state_of(self), "Not an IP packet");
+        return NULL;
+    }
+    if (value < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "value must be >= 0");
+        return NULL;
+    }
+    if (timeout_obj != Py_None)
+    {
+        timeout = PyFloat_AsDouble(timeout_obj);
+        if (timeout == -1.0 && PyErr_Occurred())
+        {
+            return NULL;
+        }
+    }
+    Py_BEGIN_CRITICAL_SECTION(self);
+    ret = pytun_flow_insert(ft, &key, value, timeout, pytun_monotonic());
+    Py_END_CRITICAL_SECTION();
+    if (ret < 0)
+    {
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pytun_flow_table_add_packet_doc,
+"add_packet(packet, value, timeout=None) -> None.\n\
+Same as add() with the flow of packet, typically a packet which missed.");
+
+static PyObject* pytun_flow_table_lookup(PyObject* self, PyObject* args)
+{
+    pytun_flow_table_t* ft = (pytun_flow_table_t*)self;
+    PyObject* key_obj;
+    pytun_flow_key_t key;
+    PY_LONG_LONG value;
+
+    if (!PyArg_ParseTuple(args, "O!:lookup", &PyTuple_Type, &key_obj))
+    {
+        return NULL;
+    }
+    if (pytun_flow_key_from_tuple(ft, key_obj, &key) < 0)
+    {
+        return NULL;
+    }
+    Py_BEGIN_CRITICAL_SECTION(self);
+    value = pytun_flow_lookup(ft, &key, pytun_monotonic());
+    Py_END_CRITICAL_SECTION();
+    if (value < 0)
+    {
+        Py_RETURN_NONE;
+    }
+
+    return PyLong_FromLongLong(value);
+}
+
+PyDoc_STRVAR(pytun_flow_table_lookup_doc,
+"lookup(key) -> value or None.\n\
+Return the value of the flow key, or None if absent or expired.");
+
+static PyObject* pytun_flow_table_remove(PyObject* self, PyObject* args)
+{
+    pytun_flow_table_t* ft = (pytun_flow_table_t*)self;
+    PyObject* key_obj;
+    pytun_flow_key_t key;
+    pytun_flow_t* slot;
+    int found;
+
+    if (!PyArg_ParseTuple(args, "O!:remove", &PyTuple_Type, &key_obj))
+    {
+        return NULL;
+    }
+    if (pytun_flow_key_from_tuple(ft, key_obj, &key) < 0)
+    {
+        return NULL;
+    }
+    Py_BEGIN_CRITICAL_SECTION(self);
+    slot = pytun_flow_find(ft, &key);
+    found = slot->state == PYTUN_FLOW_USED;
+    if (found)
+    {
+        pytun_flow_delete(ft, slot);
+    }
+    Py_END_CRITICAL_SECTION();
+    if (!found)
+    {
+        PyErr_SetObject(PyExc_KeyError, key_obj);
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pytun_flow_table_remove_doc,
+"remove(key) -> None.\n\
+Remove the flow key, raise KeyError if absent.");
+
+static PyObject* pytun_flow_table_expire(PyObject* self)
+{
+    pytun_flow_table_t* ft = (pytun_flow_table_t*)self;
+    double now = pytun_monotonic();
+    Py_ssize_t n = 0;
+    size_t i;
+    pytun_flow_t* slot;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    for (i = 0; i <= ft->mask; i++)
+    {
+        slot = &ft->slots[i];
+        if (slot->state == PYTUN_FLOW_USED && slot->timeout > 0 && now - slot->last > slot->timeout)
+        {
+            pytun_flow_delete(ft, slot);
+            n++;
+        }
+    }
+    ft->expired += n;
+    Py_END_CRITICAL_SECTION();
+
+    return PyLong_FromSsize_t(n);
+}
+
+PyDoc_STRVAR(pytun_flow_table_expire_doc,
+"expire() -> number of flows removed.\n\
+Remove the idle flows. Idle flows are also removed when looked up.");
+
+static PyObject* pytun_flow_table_clear(PyObject* self)
+{
+    pytun_flow_table_t* ft = (pytun_flow_table_t*)self;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    memset(ft->slots, 0, (ft->mask + 1) * sizeof(pytun_flow_t));
+    ft->used = 0;
+    ft->deleted = 0;
+    Py_END_CRITICAL_SECTION();
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pytun_flow_table_clear_doc,
+"clear() -> None.\n\
+Remove all the flows.");
+
+/* Look up the flow of each packet of a batch, either an iterable of buffers
+   or a buffer and a list of offsets. The value of the flow of packet i, or
+   -1, is stored in values[i]. */
+static PY_LONG_LONG* pytun_flow_classify_batch(pytun_flow_table_t* ft, PyObject* packets,
+                                               PyObject* offsets_obj, PyObject** seq, Py_ssize_t* n)
+{
+    Py_buffer buf;
+    Py_buffer pkt;
+    Py_ssize_t* offsets = NULL;
+    PY_LONG_LONG* values = NULL;
+    pytun_flow_key_t key;
+    double now = pytun_monotonic();
+    Py_ssize_t i;
+    int ret;
+
+    *seq = NULL;
+    if (offsets_obj != Py_None)
+    {
+        if (PyObject_GetBuffer(packets, &buf, PyBUF_SIMPLE) < 0)
+        {
+            return NULL;
+        }
+        offsets = pytun_parse_offsets(offsets_obj, buf.len, n);
+        values = offsets != NULL ? PyMem_New(PY_LONG_LONG, *n > 0 ? *n : 1) : NULL;
+        if (offsets != NULL && values == NULL)
+        {
+            PyErr_NoMemory();
+        }
+        for (i = 0; values != NULL && i < *n; i++)
+        {
+            ret = pytun_flow_key_from_packet(ft, (unsigned char*)buf.buf + offsets[i],
+                                             offsets[i + 1] - offsets[i], &key);
+            values[i] = ret < 0 ? (ft->misses++, -1) : pytun_flow_lookup(ft, &key, now);
+        }
+        PyMem_Free(offsets);
+        PyBuffer_Release(&buf);
+        return values;
+    }
+
+    *seq = PySequence_Fast(packets, "packets must be an iterable");
+    if (*seq == NULL)
+    {
+        return NULL;
+    }
+    *n = PySequence_Fast_GET_SIZE(*seq);
+    values = PyMem_New(PY_LONG_LONG, *n > 0 ? *n : 1);
+    if (values == NULL)
+    {
+        PyErr_NoMemory();
+        goto error;
+    }
+    for (i = 0; i < *n; i++)
+    {
+        if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(*seq, i), &pkt, PyBUF_SIMPLE) < 0)
+        {
+            goto error;
+        }
+        ret = pytun_flow_key_from_packet(ft, pkt.buf, pkt.len, &key);
+        PyBuffer_Release(&pkt);
+        values[i] = ret < 0 ? (ft->misses++, -1) : pytun_flow_lookup(ft, &key, now);
+    }
+
+    return values;
+
+error:
+    PyMem_Free(values);
+    Py_CLEAR(*seq);
+
+    return NULL;
+}
+
+static PyObject* pytun_flow_table_classify(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    PyObject* packets;
+    PyObject* offsets = Py_None;
+    char* kwlist[] = {"packets", "offsets", NULL};
+    PyObject* seq;
+    PY_LONG_LONG* values;
+    Py_ssize_t n;
+    PyObject* raw;
+    PyObject* array_mod;
+    PyObject* res;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O:classify", kwlist, &packets, &offsets))
+    {
+        return NULL;
+    }
+    Py_BEGIN_CRITICAL_SECTION(self);
+    values = pytun_flow_classify_batch((pytun_flow_table_t*)self, packets, offsets, &seq, &n);
+    Py_END_CRITICAL_SECTION();
+    if (values == NULL)
+    {
+        return NULL;
+    }
+    Py_XDECREF(seq);
+#if PY_MAJOR_VERSION >= 3
+    raw = pytun_new_string(values, n * sizeof(PY_LONG_LONG));
+#else
+    /* The array module of Python 2 has no 'q' type */
+    {
+        long* lvalues = (long*)values;
+        Py_ssize_t i;
+
+        for (i = 0; i < n; i++)
+        {
+            lvalues[i] = (long)values[i];
+        }
+        raw = pytun_new_string(values, n * sizeof(long));
+    }
+#endif
+    PyMem_Free(values);
+    if (raw == NULL)
+    {
+        return NULL;
+    }
+    array_mod = PyImport_ImportModule("array");
+    if (array_mod == NULL)
+    {
+        Py_DECREF(raw);
+        return NULL;
+    }
+#if PY_MAJOR_VERSION >= 3
+    res = PyObject_CallMethod(array_mod, "array", "(sO)", "q", raw);
+#else
+    res = PyObject_CallMethod(array_mod, "array", "(sO)", "l", raw);
+#endif
+    Py_DECREF(array_mod);
+    Py_DECREF(raw);
+
+    return res;
+}
+
+PyDoc_STRVAR(pytun_flow_table_classify_doc,
+"classify(packets, offsets=None) -> array.array of values.\n\
+Look up the flow of each packet of a batch, either an iterable of buffers\n\
+(as returned by read_many()) or a buffer and a list of offsets (as returned\n\
+by read_many_into()). The value of the flow of each packet is returned, -1\n\
+for the packets which missed.");
+
+static PyObject* pytun_flow_table_split(PyObject* self, PyObject* args)
+{
+    PyObject* packets;
+    PyObject* seq;
+    PY_LONG_LONG* values;
+    Py_ssize_t n;
+    Py_ssize_t i;
+    PyObject* res;
+    PyObject* key;
+    PyObject* group;
+    int ret;
+
+    if (!PyArg_ParseTuple(args, "O:split", &packets))
+    {
+        return NULL;
+    }
+    Py_BEGIN_CRITICAL_SECTION(self);
+    values = pytun_flow_classify_batch((pytun_flow_table_t*)self, packets, Py_None, &seq, &n);
+    Py_END_CRITICAL_SECTION();
+    if (values == NULL)
+    {
+        return NULL;
+    }
+    res = PyDict_New();
+    for (i = 0; res != NULL && i < n; i++)
+    {
+        if (values[i] < 0)
+        {
+            Py_INCREF(Py_None);
+            key = Py_None;
+        }
+        else
+        {
+            key = PyLong_FromLongLong(values[i]);
+        }
+        group = key != NULL ? PyDict_GetItem(res, key) : NULL;
+        if (key != NULL && group == NULL)
+        {
+            group = PyList_New(0);
+            ret = group != NULL ? PyDict_SetItem(res, key, group) : -1;
+            Py_XDECREF(group);
+            if (ret < 0)
+            {
+                group = NULL;
+            }
+        }
+        Py_XDECREF(key);
+        if (group == NULL || PyList_Append(group, PySequence_Fast_GET_ITEM(seq, i)) < 0)
+        {
+            Py_CLEAR(res);
+        }
+    }
+    PyMem_Free(values);
+    Py_DECREF(seq);
+
+    return res;
+}
+
+PyDoc_STRVAR(pytun_flow_table_split_doc,
+"split(packets) -> dict.\n\
+Group the packets of an iterable by the value of their flow. The packets\n\
+which missed are grouped under None.");
+
+static Py_ssize_t pytun_flow_table_len(PyObject* self)
+{
+    return ((pytun_flow_table_t*)self)->used;
+}
+
+static PyMethodDef pytun_flow_table_meth[] =
+{
+    {
+     "add",
+     (PyCFunction)pytun_flow_table_add,
+     METH_VARARGS | METH_KEYWORDS,
+     pytun_flow_table_add_doc
+    },
+    {
+     "add_packet",
+     (PyCFunction)pytun_flow_table_add_packet,
+     METH_VARARGS | METH_KEYWORDS,
+     pytun_flow_table_add_packet_doc
+    },
+    {
+     "lookup",
+     (PyCFunction)pytun_flow_table_lookup,
+     METH_VARARGS,
+     pytun_flow_table_lookup_doc
+    },
+    {
+     "remove",
+     (PyCFunction)pytun_flow_table_remove,
+     METH_VARARGS,
+     pytun_flow_table_remove_doc
+    },
+    {
+     "expire",
+     (PyCFunction)pytun_flow_table_expire,
+     METH_NOARGS,
+     pytun_flow_table_expire_doc
+    },
+    {
+     "clear",
+     (PyCFunction)pytun_flow_table_clear,
+     METH_NOARGS,
+     pytun_flow_table_clear_doc
+    },
+    {
+     "classify",
+     (PyCFunction)pytun_flow_table_classify,
+     METH_VARARGS | METH_KEYWORDS,
+     pytun_flow_table_classify_doc
+    },
+    {
+     "split",
+     (PyCFunction)pytun_flow_table_split,
+     METH_VARARGS,
+     pytun_flow_table_split_doc
+    },
+    {NULL, NULL, 0, NULL}
+};
+
+static PyMemberDef pytun_flow_table_members[] =
+{
+    {
+     "hits",
+     T_ULONGLONG,
+     offsetof(pytun_flow_table_t, hits),
+     READONLY,
+     "number of lookups which found a flow"
+    },
+    {
+     "misses",
+     T_ULONGLONG,
+     offsetof(pytun_flow_table_t, misses),
+     READONLY,
+     "number of lookups which found no flow"
+    },
+    {
+     "expired",
+     T_ULONGLONG,
+     offsetof(pytun_flow_table_t, expired),
+     READONLY,
+     "number of flows removed after their idle timeout"
+    },
+    {NULL, 0, 0, 0, NULL}
+};
+
+PyDoc_STRVAR(pytun_flow_table_doc,
+"FlowTable(capacity=1024, timeout=0.0, flags=IFF_TUN, vnet_hdr_sz=10, symmetric=False) -> flow table object.\n\
+Map flows, identified by their 5-tuple, to integer values in an open\n\
+addressing hash table sized for capacity flows (it grows if needed).\n\
+Flows expire after timeout seconds without a packet, 0 means never.\n\
+flags are the flags of the device the packets are read from, see\n\
+PacketView. If symmetric is true, both directions of a flow share the same\n\
+entry.");
+
+static PyType_Slot pytun_flow_table_slots[] =
+{
+    {Py_tp_dealloc, pytun_flow_table_dealloc},
+    {Py_sq_length, pytun_flow_table_len},
+    {Py_tp_doc, (void*)pytun_flow_table_doc},
+    {Py_tp_methods, pytun_flow_table_meth},
+    {Py_tp_members, pytun_flow_table_members},
+    {Py_tp_new, pytun_flow_table_new},
+    {0, NULL}
+};
+
+static PyType_Spec pytun_flow_table_spec =
+{
+    .name = "pytun.FlowTable",
+    .basicsize = sizeof(pytun_flow_table_t),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = pytun_flow_table_slots
+};
+
+/* Rule of a Rewriter. Addresses of IPv4 rules use the first 4 bytes, an
+   empty prefix matches any address. */
+struct pytun_rw_rule
+{
+    int version;
+    int proto;
+    unsigned char src[16];
+    int src_len;
+    unsigned char dst[16];
+    int dst_len;
+    int sport;
+    int dport;
+    int set_src;
+    unsigned char new_src[16];
+    int set_dst;
+    unsigned char new_dst[16];
+    int new_sport;
+    int new_dport;
+    unsigned PY_LONG_LONG hits;
+};
+typedef struct pytun_rw_rule pytun_rw_rule_t;
+
+struct pytun_rewriter
+{
+    PyObject_HEAD
+    pytun_rw_rule_t* rules;
+    Py_ssize_t nrules;
+    Py_ssize_t size;
+    int flags;
+    int vnet_hdr_sz;
+    unsigned PY_LONG_LONG misses;
+    unsigned PY_LONG_LONG skipped;
+};
+typedef struct pytun_rewriter pytun_rewriter_t;
+
+static int pytun_prefix_match(const unsigned char* addr, const unsigned char* prefix, int len)
+{
+    int bytes = len / 8;
+    int bits = len % 8;
+
+    if (memcmp(addr, prefix, bytes) != 0)
+    {
+        return 0;
+    }
+
+    return bits == 0 || ((addr[bytes] ^ prefix[bytes]) & (0xff00 >> bits) & 0xff) == 0;
+}
+
+static int pytun_rw_match(const pytun_rw_rule_t* r, const unsigned char* p, const pytun_hdrs_t* h)
+{
+    const unsigned char* ip = p + h->l3_off;
+
+    if ((r->version != 0 && r->version != h->version) ||
+        (r->proto >= 0 && r->proto != h->ip_proto) ||
+        (r->sport >= 0 && r->sport != h->sport) ||
+        (r->dport >= 0 && r->dport != h->dport) ||
+        ((r->new_sport >= 0 || r->new_dport >= 0) && h->sport < 0))
+    {
+        return 0;
+    }
+    if (r->src_len > 0 && !pytun_prefix_match(ip + (h->version == 4 ? 12 : 8), r->src, r->src_len))
+    {
+        return 0;
+    }
+    if (r->dst_len > 0 && !pytun_prefix_match(ip + (h->version == 4 ? 16 : 24), r->dst, r->dst_len))
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Replace the 16-bit field at p with value, accounting for the change in
+   the sums old_sum and new_sum */
+static void pytun_rw_put16(unsigned char* p, unsigned int value, uint64_t* old_sum, uint64_t* new_sum)
+{
+    *old_sum += pytun_get16(p);
+    *new_sum += value;
+    pytun_put16(p, value);
+}
+
+/* Rewrite the packet p matched by r, updating its checksums */
+static void pytun_rw_apply(const pytun_rw_rule_t* r, unsigned char* p, const pytun_hdrs_t* h)
+{
+    unsigned char* ip = p + h->l3_off;
+    unsigned char* l4 = p + h->l4_off;
+    unsigned char* csum = NULL;
+    size_t alen = h->version == 4 ? 4 : 16;
+    uint64_t old_sum = 0;
+    uint64_t new_sum = 0;
+    uint64_t old_l4 = 0;
+    uint64_t new_l4 = 0;
+    unsigned int c;
+
+    if (r->set_src)
+    {
+        old_sum = pytun_csum_add(old_sum, ip + (h->version == 4 ? 12 : 8), alen);
+        new_sum = pytun_csum_add(new_sum, r->new_src, alen);
+        memcpy(ip + (h->version == 4 ? 12 : 8), r->new_src, alen);
+    }
+    if (r->set_dst)
+    {
+        old_sum = pytun_csum_add(old_sum, ip + (h->version == 4 ? 16 : 24), alen);
+        new_sum = pytun_csum_add(new_sum, r->new_dst, alen);
+        memcpy(ip + (h->version == 4 ? 16 : 24), r->new_dst, alen);
+    }
+    if (h->version == 4 && (r->set_src || r->set_dst))
+    {
+        pytun_put16(ip + 10, pytun_csum_update(pytun_get16(ip + 10), old_sum, new_sum));
+    }
+    if (h->l4_off < 0)
+    {
+        return;
+    }
+
+    /* The TCP, UDP and ICMPv6 checksums cover the addresses through the
+       pseudo-header */
+    switch (h->ip_proto)
+    {
+    case IPPROTO_TCP:
+        csum = l4 + 16;
+        break;
+    case IPPROTO_UDP:
+        csum = l4 + 6;
+        break;
+    case IPPROTO_ICMPV6:
+        csum = h->version == 6 ? l4 + 2 : NULL;
+        break;
+    }
+    if (csum != NULL)
+    {
+        old_l4 = old_sum;
+        new_l4 = new_sum;
+    }
+    if (r->new_sport >= 0)
+    {
+        pytun_rw_put16(l4, r->new_sport, &old_l4, &new_l4);
+    }
+    if (r->new_dport >= 0)
+    {
+        pytun_rw_put16(l4 + 2, r->new_dport, &old_l4, &new_l4);
+    }
+    if (csum == NULL)
+    {
+        return;
+    }
+    c = pytun_get16(csum);
+    if (h->ip_proto == IPPROTO_UDP && h->version == 4 && c == 0)
+    {
+        /* No checksum */
+        return;
+    }
+    c = pytun_csum_update(c, old_l4, new_l4);
+    if (c == 0 && h->ip_proto == IPPROTO_UDP)
+    {
+        c = 0xffff;
+    }
+    pytun_put16(csum, c);
+}
+
+static void pytun_rewriter_dealloc(PyObject* self)
+{
+    PyTypeObject* type = Py_TYPE(self);
+
+    PyMem_Free(((pytun_rewriter_t*)self)->rules);
+    type->tp_free(self);
+    PYTUN_TYPE_DECREF(type);
+}
+
+static PyObject* pytun_rewriter_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+    pytun_rewriter_t* rw;
+    int flags = IFF_TUN;
+    int vnet_hdr_sz = sizeof(struct virtio_net_hdr);
+    char* kwlist[] = {"flags", "vnet_hdr_sz", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ii:Rewriter", kwlist, &flags, &vnet_hdr_sz))
+    {
+        return NULL;
+    }
+    rw = (pytun_rewriter_t*)type->tp_alloc(type, 0);
+    if (rw == NULL)
+    {
+        return NULL;
+    }
+    rw->flags = flags;
+    rw->vnet_hdr_sz = vnet_hdr_sz;
+
+    return (PyObject*)rw;
+}
+
+/* Parse the address or prefix of key in the rule dict d. Return 1 if it is
+   present, 0 if not and -1 on error. */
+static int pytun_rw_parse_addr(pytun_state_t* state, PyObject* d, const char* key, int* version,
+                               unsigned char* addr, int* prefixlen)
+{
+    PyObject* obj;
+    int family;
+    int v;
+
+    obj = PyDict_GetItemString(d, key);
+    if (obj == NULL || obj == Py_None)
+    {
+        return 0;
+    }
+    memset(addr, 0, 16);
+    if (pytun_nl_parse_addr(state, obj, &family, addr, prefixlen) < 0)
+    {
+        return -1;
+    }
+    v = family == AF_INET ? 4 : 6;
+    if (*version != 0 && *version != v)
+    {
+        raise_error(state, "Address family doesn't match the IP version of the rule");
+        return -1;
+    }
+    *version = v;
+
+    return 1;
+}
+
+/* Parse the integer of key in the rule dict d, leaving value unchanged if
+   it is absent */
+static int pytun_rw_parse_int(pytun_state_t* state, PyObject* d, const char* key, long max, int* value)
+{
+    PyObject* obj;
+    long v;
+
+    obj = PyDict_GetItemString(d, key);
+    if (obj == NULL || obj == Py_None)
+    {
+        return 0;
+    }
+    v = PyLong_AsLong(obj);
+    if (v == -1 && PyErr_Occurred())
+    {
+        return -1;
+    }
+    if (v < 0 || v > max)
+    {
+        raise_error(state, "Bad rewrite rule");
+        return -1;
+    }
+    *value = v;
+
+    return 0;
+}
+
+static PyObject* pytun_rewriter_add_rule(PyObject* self, PyObject* args)
+{
+    pytun_rewriter_t* rw = (pytun_rewriter_t*)self;
+    PyObject* match;
+    PyObject* action;
+    pytun_rw_rule_t r;
+    pytun_rw_rule_t* rules;
+    Py_ssize_t size;
+    Py_ssize_t index;
+    int full;
+    int ret;
+
+    if (!PyArg_ParseTuple(args, "O!O!:add_rule", &PyDict_Type, &match, &PyDict_Type, &action))
+    {
+        return NULL;
+    }
+    memset(&r, 0, sizeof(r));
+    r.proto = r.sport = r.dport = r.new_sport = r.new_dport = -1;
+    if (pytun_rw_parse_int(pytun_state_of(self), match, "version", 6, &r.version) < 0 ||
+        pytun_rw_parse_int(pytun_state_of(self), match, "proto", 255, &r.proto) < 0 ||
+        pytun_rw_parse_int(pytun_state_of(self), match, "sport", 65535, &r.sport) < 0 ||
+        pytun_rw_parse_int(pytun_state_of(self), match, "dport", 65535, &r.dport) < 0 ||
+        pytun_rw_parse_int(pytun_state_of(self), action, "sport", 65535, &r.new_sport) < 0 ||
+        pytun_rw_parse_int(pytun_state_of(self), action, "dport", 65535, &r.new_dport) < 0)
+    {
+        return NULL;
+    }
+    if (r.version != 0 && r.version != 4 && r.version != 6)
+    {
+        raise_error(pytun_state_of(self), "Bad rewrite rule");
+        return NULL;
+    }
+    if (pytun_rw_parse_addr(pytun_state_of(self), match, "src", &r.version, r.src, &r.src_len) < 0 ||
+        pytun_rw_parse_addr(pytun_state_of(self), match, "dst", &r.version, r.dst, &r.dst_len) < 0)
+    {
+        return NULL;
+    }
+    ret = pytun_rw_parse_addr(pytun_state_of(self), action, "src", &r.version, r.new_src, &full);
+    if (ret < 0)
+    {
+        return NULL;
+    }
+    r.set_src = ret;
+    if (ret && full != (r.version == 4 ? 32 : 128))
+    {
+        raise_error(pytun_state_of(self), "Bad rewrite rule");
+        return NULL;
+    }
+    ret = pytun_rw_parse_addr(pytun_state_of(self), action, "dst", &r.version, r.new_dst, &full);
+    if (ret < 0)
+    {
+        return NULL;
+    }
+    r.set_dst = ret;
+    if (ret && full != (r.version == 4 ? 32 : 128))
+    {
+        raise_error(pytun_state_of(self), "Bad rewrite rule");
+        return NULL;
+    }
+
+    index = -1;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    rules = rw->rules;
+    if (rw->nrules == rw->size)
+    {
+        size = rw->size ? rw->size * 2 : 16;
+        rules = PyMem_Realloc(rules, size * sizeof(pytun_rw_rule_t));
+        if (rules != NULL)
+        {
+            rw->rules = rules;
+            rw->size = size;
+        }
+    }
+    if (rules != NULL)
+    {
+        index = rw->nrules++;
+        rw->rules[index] = r;
+    }
+    Py_END_CRITICAL_SECTION();
+    if (index < 0)
+    {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    return PyLong_FromSsize_t(index);
+#else
+    return PyInt_FromSsize_t(index);
+#endif
+}
+
+PyDoc_STRVAR(pytun_rewriter_add_rule_doc,
+"add_rule(match, action) -> index of the rule.\n\
+Add a rule rewriting the packets matched by match, a dict with the optional\n\
+keys version, proto, src, dst (addresses of the form 'addr[/prefixlen]'),\n\
+sport and dport. action is a dict with the optional keys src, dst, sport\n\
+and dport giving the new values of these fields. Rules are tried in the\n\
+order they have been added, the first matching rule is applied.");
+
+static PyObject* pytun_rewriter_clear(PyObject* self)
+{
+    pytun_rewriter_t* rw = (pytun_rewriter_t*)self;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    rw->nrules = 0;
+    rw->misses = 0;
+    rw->skipped = 0;
+    Py_END_CRITICAL_SECTION();
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pytun_rewriter_clear_doc,
+"clear() -> None.\n\
+Remove all the rules and reset the counters.");
+
+static PyObject* pytun_rewriter_rewrite(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    pytun_rewriter_t* rw = (pytun_rewriter_t*)self;
+    PyObject* packets;
+    PyObject* offsets_obj = Py_None;
+    char* kwlist[] = {"packets", "offsets", NULL};
+    Py_buffer buf;
+    Py_buffer pkt;
+    PyObject* seq = NULL;
+    Py_ssize_t* offsets = NULL;
+    Py_ssize_t n;
+    Py_ssize_t i;
+    Py_ssize_t j;
+    Py_ssize_t count = 0;
+    unsigned char* p;
+    size_t len;
+    pytun_hdrs_t h;
+    PyObject* res = NULL;
+    int have_buf = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O:rewrite", kwlist, &packets, &offsets_obj))
+    {
+        return NULL;
+    }
+    if (offsets_obj != Py_None)
+    {
+        if (PyObject_GetBuffer(packets, &buf, PyBUF_WRITABLE) < 0)
+        {
+            return NULL;
+        }
+        have_buf = 1;
+        offsets = pytun_parse_offsets(offsets_obj, buf.len, &n);
+        if (offsets == NULL)
+        {
+            goto out;
+        }
+    }
+    else
+    {
+        seq = PySequence_Fast(packets, "packets must be an iterable");
+        if (seq == NULL)
+        {
+            return NULL;
+        }
+        n = PySequence_Fast_GET_SIZE(seq);
+    }
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    for (i = 0; i < n; i++)
+    {
+        if (have_buf)
+        {
+            p = (unsigned char*)buf.buf + offsets[i];
+            len = offsets[i + 1] - offsets[i];
+        }
+        else
+        {
+            if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(seq, i), &pkt, PyBUF_WRITABLE) < 0)
+            {
+                break;
+            }
+            p = pkt.buf;
+            len = pkt.len;
+        }
+        pytun_parse_headers(p, len, rw->flags, rw->vnet_hdr_sz, &h);
+        if (h.version < 0 || h.fragment)
+        {
+            rw->skipped++;
+        }
+        else
+        {
+            for (j = 0; j < rw->nrules; j++)
+            {
+                if (pytun_rw_match(&rw->rules[j], p, &h))
+                {
+                    pytun_rw_apply(&rw->rules[j], p, &h);
+                    rw->rules[j].hits++;
+                    count++;
+                    break;
+                }
+            }
+            if (j == rw->nrules)
+            {
+                rw->misses++;
+            }
+        }
+        if (!have_buf)
+        {
+            PyBuffer_Release(&pkt);
+        }
+    }
+    Py_END_CRITICAL_SECTION();
+    if (i < n)
+    {
+        goto out;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    res = PyLong_FromSsize_t(count);
+#else
+    res = PyInt_FromSsize_t(count);
+#endif
+
+out:
+    Py_XDECREF(seq);
+    PyMem_Free(offsets);
+    if (have_buf)
+    {
+        PyBuffer_Release(&buf);
+    }
+
+    return res;
+}
+
+PyDoc_STRVAR(pytun_rewriter_rewrite_doc,
+"rewrite(packets, offsets=None) -> number of packets rewritten.\n\
+Apply the rules to a batch of packets, either an iterable of writable\n\
+buffers or a writable buffer and a list of offsets (as returned by\n\
+read_many_into()). Packets are modified in place and their IPv4, TCP, UDP\n\
+and ICMPv6 checksums are updated incrementally. IP fragments and non-IP\n\
+packets are left untouched.");
+
+static PyObject* pytun_rewriter_get_hits(PyObject* self, void* d)
+{
+    pytun_rewriter_t* rw = (pytun_rewriter_t*)self;
+    PyObject* hits;
+    PyObject* hit;
+    Py_ssize_t i;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    hits = PyList_New(rw->nrules);
+    for (i = 0; hits != NULL && i < rw->nrules; i++)
+    {
+        hit = PyLong_FromUnsignedLongLong(rw->rules[i].hits);
+        if (hit == NULL)
+        {
+            Py_CLEAR(hits);
+            break;
+        }
+        PyList_SET_ITEM(hits, i, hit);
+    }
+    Py_END_CRITICAL_SECTION();
+
+    return hits;
+}
+
+static Py_ssize_t pytun_rewriter_len(PyObject* self)
+{
+    return ((pytun_rewriter_t*)self)->nrules;
+}
+
+static PyMethodDef pytun_rewriter_meth[] =
+{
+    {
+     "add_rule",
+     (PyCFunction)pytun_rewriter_add_rule,
+     METH_VARARGS,
+     pytun_rewriter_add_rule_doc
+    },
+    {
+     "clear",
+     (PyCFunction)pytun_rewriter_clear,
+     METH_NOARGS,
+     pytun_rewriter_clear_doc
+    },
+    {
+     "rewrite",
+     (PyCFunction)pytun_rewriter_rewrite,
+     METH_VARARGS | METH_KEYWORDS,
+     pytun_rewriter_rewrite_doc
+    },
+    {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef pytun_rewriter_prop[] =
+{
+    {"hits", pytun_rewriter_get_hits, NULL, "number of packets rewritten by each rule", NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyMemberDef pytun_rewriter_members[] =
+{
+    {
+     "misses",
+     T_ULONGLONG,
+     offsetof(pytun_rewriter_t, misses),
+     READONLY,
+     "number of packets matched by no rule"
+    },
+    {
+     "skipped",
+     T_ULONGLONG,
+     offsetof(pytun_rewriter_t, skipped),
+     READONLY,
+     "number of non-IP packets and IP fragments"
+    },
+    {NULL, 0, 0, 0, NULL}
+};
+
+PyDoc_STRVAR(pytun_rewriter_doc,
+"Rewriter(flags=IFF_TUN, vnet_hdr_sz=10) -> rewriter object.\n\
+Table of rules rewriting the addresses and ports of packets in place, e.g\n\
+to translate addresses between two networks. flags are the flags of the\n\
+device the packets have been read from. The number of packets rewritten by\n\
+each rule is available in the hits attribute.");
+
+static PyType_Slot pytun_rewriter_slots[] =
+{
+    {Py_tp_dealloc, pytun_rewriter_dealloc},
+    {Py_sq_length, pytun_rewriter_len},
+    {Py_tp_doc, (void*)pytun_rewriter_doc},
+    {Py_tp_methods, pytun_rewriter_meth},
+    {Py_tp_members, pytun_rewriter_members},
+    {Py_tp_getset, pytun_rewriter_prop},
+    {Py_tp_new, pytun_rewriter_new},
+    {0, NULL}
+};
+
+static PyType_Spec pytun_rewriter_spec =
+{
+    .name = "pytun.Rewriter",
+    .basicsize = sizeof(pytun_rewriter_t),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = pytun_rewriter_slots
+};
+
+static void pytun_shaper_dealloc(PyObject* self)
+{
+    PyTypeObject* type = Py_TYPE(self);
+    pytun_shaper_t* shaper = (pytun_shaper_t*)self;
+
+    pytun_tb_decref(shaper->tb);
+    Py_XDECREF(shaper->parent);
+    type->tp_free(self);
+    PYTUN_TYPE_DECREF(type);
+}
+
+static PyObject* pytun_shaper_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+    pytun_shaper_t* shaper;
+    pytun_tb_t* tb;
+    pytun_tb_t* p;
+    double rate;
+    double burst = 0;
+    double queue_limit = -1;
+    PyObject* parent = NULL;
+    int depth = 1;
+    char* kwlist[] = {"rate", "burst", "queue_limit", "parent", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "d|ddO:Shaper", kwlist, &rate, &burst, &queue_limit,
+                                     &parent))
+    {
+        return NULL;
+    }
+    if (parent == Py_None)
+    {
+        parent = NULL;
+    }
+    if (parent != NULL && !PyObject_TypeCheck(parent, pytun_state_of_type(type)->shaper_type))
+    {
+        PyErr_SetString(PyExc_TypeError, "parent must be a Shaper or None");
+        return NULL;
+    }
+    if (!(rate > 0) || burst < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "rate must be positive and burst >= 0");
+        return NULL;
+    }
+    if (parent != NULL)
+    {
+        for (p = ((pytun_shaper_t*)parent)->tb; p != NULL; p = p->parent)
+        {
+            depth++;
+        }
+        if (depth > PYTUN_TB_MAX_DEPTH)
+        {
+            PyErr_SetString(PyExc_ValueError, "too many levels of shapers");
+            return NULL;
+        }
+    }
+    /* By default, 10ms worth of tokens but at least 64KiB (a GSO packet) */
+    if (burst == 0)
+    {
+        burst = rate / 100 > 65536 ? rate / 100 : 65536;
+    }
+    if (queue_limit < 0)
+    {
+        queue_limit = burst;
+    }
+
+    shaper = (pytun_shaper_t*)type->tp_alloc(type, 0);
+    if (shaper == NULL)
+    {
+        return NULL;
+    }
+    tb = calloc(1, sizeof(*tb));
+    if (tb == NULL)
+    {
+        Py_DECREF(shaper);
+        return PyErr_NoMemory();
+    }
+    pthread_mutex_init(&tb->lock, NULL);
+    tb->refs = 1;
+    tb->rate = rate;
+    tb->burst = burst;
+    tb->queue_limit = queue_limit;
+    tb->tokens = burst;
+    tb->last = pytun_now_ns();
+    if (parent != NULL)
+    {
+        tb->parent = ((pytun_shaper_t*)parent)->tb;
+        pytun_tb_incref(tb->parent);
+        Py_INCREF(parent);
+        shaper->parent = parent;
+    }
+    shaper->tb = tb;
+
+    return (PyObject*)shaper;
+}
+
+static PyObject* pytun_shaper_stats(PyObject* self)
+{
+    pytun_tb_t* tb = ((pytun_shaper_t*)self)->tb;
+    PyObject* res;
+
+    pthread_mutex_lock(&tb->lock);
+    pytun_tb_refill(tb, pytun_now_ns());
+    res = Py_BuildValue("{sKsKsKsKsKsKsd}",
+                        "packets", tb->packets,
+                        "bytes", tb->bytes,
+                        "delayed", tb->delayed,
+                        "delay_ns", tb->delay_ns,
+                        "dropped", tb->dropped,
+                        "dropped_bytes", tb->dropped_bytes,
+                        "tokens", tb->tokens);
+    pthread_mutex_unlock(&tb->lock);
+
+    return res;
+}
+
+PyDoc_STRVAR(pytun_shaper_stats_doc,
+"stats() -> dict.\n\
+Return the counters of the shaper: the packets and bytes admitted, how many\n\
+of them had to wait and the total wait (delay_ns), the packets and bytes\n\
+dropped because the queue limit was exceeded, and the current number of\n\
+tokens (negative when packets are queued).");
+
+static PyObject* pytun_shaper_get(PyObject* self, void* d)
+{
+    pytun_tb_t* tb = ((pytun_shaper_t*)self)->tb;
+    double value;
+
+    pthread_mutex_lock(&tb->lock);
+    value = *(double*)((char*)tb + (size_t)d);
+    pthread_mutex_unlock(&tb->lock);
+
+    return PyFloat_FromDouble(value);
+}
+
+static int pytun_shaper_set(PyObject* self, PyObject* value, void* d)
+{
+    pytun_tb_t* tb = ((pytun_shaper_t*)self)->tb;
+    double v;
+
+    if (value == NULL)
+    {
+        PyErr_SetString(PyExc_TypeError, "can't delete the attribute");
+        return -1;
+    }
+    v = PyFloat_AsDouble(value);
+    if (v == -1 && PyErr_Occurred())
+    {
+        return -1;
+    }
+    if (v < 0 || ((size_t)d != offsetof(pytun_tb_t, queue_limit) && !(v > 0)))
+    {
+        PyErr_SetString(PyExc_ValueError, "rate and burst must be positive, queue_limit >= 0");
+        return -1;
+    }
+
+    /* Account the tokens earned at the old rate before changing it */
+    pthread_mutex_lock(&tb->lock);
+    pytun_tb_refill(tb, pytun_now_ns());
+    *(double*)((char*)tb + (size_t)d) = v;
+    if (tb->tokens > tb->burst)
+    {
+        tb->tokens = tb->burst;
+    }
+    pthread_mutex_unlock(&tb->lock);
+
+    return 0;
+}
+
+static PyObject* pytun_shaper_get_parent(PyObject* self, void* d)
+{
+    PyObject* parent = ((pytun_shaper_t*)self)->parent;
+
+    if (parent == NULL)
+    {
+        parent = Py_None;
+    }
+    Py_INCREF(parent);
+
+    return parent;
+}
+
+static PyMethodDef pytun_shaper_meth[] =
+{
+    {
+     "stats",
+     (PyCFunction)pytun_shaper_stats,
+     METH_NOARGS,
+     pytun_shaper_stats_doc
+    },
+    {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef pytun_shaper_prop[] =
+{
+    {
+     "rate",
+     pytun_shaper_get,
+     pytun_shaper_set,
+     "rate in bytes per second",
+     (void*)offsetof(pytun_tb_t, rate)
+    },
+    {
+     "burst",
+     pytun_shaper_get,
+     pytun_shaper_set,
+     "maximum number of bytes written at once after an idle period",
+     (void*)offsetof(pytun_tb_t, burst)
+    },
+    {
+     "queue_limit",
+     pytun_shaper_get,
+     pytun_shaper_set,
+     "maximum number of bytes waiting for tokens before packets are dropped",
+     (void*)offsetof(pytun_tb_t, queue_limit)
+    },
+    {"parent", pytun_shaper_get_parent, NULL, "parent shaper, or None", NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+PyDoc_STRVAR(pytun_shaper_doc,
+"Shaper(rate, burst=0, queue_limit=-1, parent=None) -> shaper object.\n\
+Token bucket limiting the writes to the devices it is set on (with their\n\
+shaper attribute) to rate bytes per second, with bursts of at most burst\n\
+bytes (by default 10ms worth of tokens, at least 64KiB). Writes exceeding\n\
+the rate wait with the GIL released until they conform, unless more than\n\
+queue_limit bytes (by default burst) are already waiting, in which case\n\
+the packet is dropped. try_write() returns None instead of waiting, a\n\
+packet larger than burst being let through once the bucket is full, and\n\
+the tokens of a write which fails are given back. A shaper may be shared\n\
+by several devices or queues and may have a parent shaper, e.g one per\n\
+class of traffic under a shaper of the whole link: a packet must then be\n\
+admitted by all its ancestors.");
+
+static PyType_Slot pytun_shaper_slots[] =
+{
+    {Py_tp_dealloc, pytun_shaper_dealloc},
+    {Py_tp_doc, (void*)pytun_shaper_doc},
+    {Py_tp_methods, pytun_shaper_meth},
+    {Py_tp_getset, pytun_shaper_prop},
+    {Py_tp_new, pytun_shaper_new},
+    {0, NULL}
+};
+
+static PyType_Spec pytun_shaper_spec =
+{
+    .name = "pytun.Shaper",
+    .basicsize = sizeof(pytun_shaper_t),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = pytun_shaper_slots
+};
+
+/* Classic BPF code generation for compile_filter(). Jumps to the next rule
+   are recorded with this placeholder and patched at the end of the rule. */
+#define PYTUN_BPF_FAIL 0xff
+#define PYTUN_BPF_RULE_MAX 64
+
+struct pytun_bpf_rule
+{
+    struct sock_filter insns[PYTUN_BPF_RULE_MAX];
+    unsigned int n;
+};
+typedef struct pytun_bpf_rule pytun_bpf_rule_t;
+
+static void pytun_bpf_emit(pytun_bpf_rule_t* r, unsigned short code, unsigned char jt,
+                           unsigned char jf, unsigned int k)
+{
+    struct sock_filter insn = BPF_JUMP(code, k, jt, jf);
+
+    r->insns[r->n++] = insn;
+}
+
+/* Load the 32-bit word at off, masked with mask, and fail if it differs
+   from value */
+static void pytun_bpf_match_word(pytun_bpf_rule_t* r, unsigned int off, uint32_t value, uint32_t mask)
+{
+    if (mask == 0)
+    {
+        return;
+    }
+    pytun_bpf_emit(r, BPF_LD | BPF_W | BPF_ABS, 0, 0, off);
+    if (mask != 0xffffffff)
+    {
+        pytun_bpf_emit(r, BPF_ALU | BPF_AND | BPF_K, 0, 0, mask);
+    }
+    pytun_bpf_emit(r, BPF_JMP | BPF_JEQ | BPF_K, 0, PYTUN_BPF_FAIL, value & mask);
+}
+
+/* Match the address prefix "addr[/prefixlen]" at off */
+static int pytun_bpf_match_addr(pytun_state_t* state, pytun_bpf_rule_t* r, PyObject* obj, int version, unsigned int off)
+{
+    unsigned char addr[16];
+    int family;
+    int prefixlen;
+    int i;
+    int bits;
+
+    if (pytun_nl_parse_addr(state, obj, &family, addr, &prefixlen) < 0)
+    {
+        return -1;
+    }
+    if ((family == AF_INET) != (version == 4))
+    {
+        raise_error(state, "Address family doesn't match the IP version of the rule");
+        return -1;
+    }
+    for (i = 0; i < (family == AF_INET ? 1 : 4); i++)
+    {
+        bits = prefixlen - i * 32;
+        bits = bits < 0 ? 0 : bits > 32 ? 32 : bits;
+        pytun_bpf_match_word(r, off + i * 4, pytun_get32(addr + i * 4),
+                             bits == 0 ? 0 : (uint32_t)(0xffffffffULL << (32 - bits)));
+    }
+
+    return 0;
+}
+
+/* Parse the integer of key in the rule dict d, leaving value unchanged if
+   it is absent. Unlike the default value -1, a negative value is an error. */
+static int pytun_bpf_parse_int(pytun_state_t* state, PyObject* d, const char* key, long max, long* value)
+{
+    PyObject* obj;
+    long v;
+
+    obj = PyDict_GetItemString(d, key);
+    if (obj == NULL || obj == Py_None)
+    {
+        return 0;
+    }
+    v = PyLong_AsLong(obj);
+    if (v == -1 && PyErr_Occurred())
+    {
+        return -1;
+    }
+    if (v < 0 || v > max)
+    {
+        raise_error(state, "Bad filter rule");
+        return -1;
+    }
+    *value = v;
+
+    return 0;
+}
+
+/* Compile a rule, a dict with the optional keys version, proto, src, dst,
+   sport and dport. The rule ends by accepting the packet. */
+static int pytun_bpf_compile_rule(pytun_state_t* state, pytun_bpf_rule_t* r, PyObject* rule, int tap)
+{
+    PyObject* obj;
+    unsigned int l3 = tap ? ETH_HLEN : 0;
+    long version = 4;
+    long proto = -1;
+    long sport = -1;
+    long dport = -1;
+    unsigned int i;
+
+    if (!PyDict_Check(rule))
+    {
+        PyErr_SetString(PyExc_TypeError, "rules must be dicts");
+        return -1;
+    }
+    r->n = 0;
+    if (pytun_bpf_parse_int(state, rule, "version", 6, &version) < 0 ||
+        pytun_bpf_parse_int(state, rule, "proto", 255, &proto) < 0 ||
+        pytun_bpf_parse_int(state, rule, "sport", 65535, &sport) < 0 ||
+        pytun_bpf_parse_int(state, rule, "dport", 65535, &dport) < 0)
+    {
+        return -1;
+    }
+    if (version != 4 && version != 6)
+    {
+        raise_error(state, "Bad filter rule");
+        return -1;
+    }
+
+    /* IP version */
+    if (tap)
+    {
+        pytun_bpf_emit(r, BPF_LD | BPF_H | BPF_ABS, 0, 0, 12);
+        pytun_bpf_emit(r, BPF_JMP | BPF_JEQ | BPF_K, 0, PYTUN_BPF_FAIL, version == 4 ? ETH_P_IP : ETH_P_IPV6);
+    }
+    else
+    {
+        pytun_bpf_emit(r, BPF_LD | BPF_B | BPF_ABS, 0, 0, 0);
+        pytun_bpf_emit(r, BPF_ALU | BPF_AND | BPF_K, 0, 0, 0xf0);
+        pytun_bpf_emit(r, BPF_JMP | BPF_JEQ | BPF_K, 0, PYTUN_BPF_FAIL, version << 4);
+    }
+
+    /* Protocol, ports imply TCP or UDP. IPv6 extension headers are not
+       followed. */
+    pytun_bpf_emit(r, BPF_LD | BPF_B | BPF_ABS, 0, 0, l3 + (version == 4 ? 9 : 6));
+    if (proto >= 0)
+    {
+        pytun_bpf_emit(r, BPF_JMP | BPF_JEQ | BPF_K, 0, PYTUN_BPF_FAIL, proto);
+    }
+    else if (sport >= 0 || dport >= 0)
+    {
+        pytun_bpf_emit(r, BPF_JMP | BPF_JEQ | BPF_K, 1, 0, IPPROTO_TCP);
+        pytun_bpf_emit(r, BPF_JMP | BPF_JEQ | BPF_K, 0, PYTUN_BPF_FAIL, IPPROTO_UDP);
+    }
+
+    obj = PyDict_GetItemString(rule, "src");
+    if (obj != NULL && obj != Py_None &&
+        pytun_bpf_match_addr(state, r, obj, version, l3 + (version == 4 ? 12 : 8)) < 0)
+    {
+        return -1;
+    }
+    obj = PyDict_GetItemString(rule, "dst");
+    if (obj != NULL && obj != Py_None &&
+        pytun_bpf_match_addr(state, r, obj, version, l3 + (version == 4 ? 16 : 24)) < 0)
+    {
+        return -1;
+    }
+
+    if (sport >= 0 || dport >= 0)
+    {
+        if (version == 4)
+        {
+            /* Only the first fragment holds the ports */
+            pytun_bpf_emit(r, BPF_LD | BPF_H | BPF_ABS, 0, 0, l3 + 6);
+            pytun_bpf_emit(r, BPF_JMP | BPF_JSET | BPF_K, PYTUN_BPF_FAIL, 0, 0x1fff);
+            pytun_bpf_emit(r, BPF_LDX | BPF_B | BPF_MSH, 0, 0, l3);
+        }
+        else
+        {
+            pytun_bpf_emit(r, BPF_LDX | BPF_W | BPF_IMM, 0, 0, 40);
+        }
+        if (sport >= 0)
+        {
+            pytun_bpf_emit(r, BPF_LD | BPF_H | BPF_IND, 0, 0, l3);
+            pytun_bpf_emit(r, BPF_JMP | BPF_JEQ | BPF_K, 0, PYTUN_BPF_FAIL, sport);
+        }
+        if (dport >= 0)
+        {
+            pytun_bpf_emit(r, BPF_LD | BPF_H | BPF_IND, 0, 0, l3 + 2);
+            pytun_bpf_emit(r, BPF_JMP | BPF_JEQ | BPF_K, 0, PYTUN_BPF_FAIL, dport);
+        }
+    }
+    pytun_bpf_emit(r, BPF_RET | BPF_K, 0, 0, 0xffffffff);
+
+    /* Failed checks jump to the instruction following the rule */
+    for (i = 0; i < r->n; i++)
+    {
+        if (BPF_CLASS(r->insns[i].code) != BPF_JMP)
+        {
+            continue;
+        }
+        if (r->insns[i].jt == PYTUN_BPF_FAIL)
+        {
+            r->insns[i].jt = r->n - i - 1;
+        }
+        if (r->insns[i].jf == PYTUN_BPF_FAIL)
+        {
+            r->insns[i].jf = r->n - i - 1;
+        }
+    }
+
+    return 0;
+}
+
+static PyObject* pytun_compile_filter(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    int flags = IFF_TUN;
+    PyObject* flags_obj;
+    pytun_bpf_rule_t rule;
+    struct sock_filter* insns;
+    struct sock_filter ret_insn = BPF_STMT(BPF_RET | BPF_K, 0);
+    Py_ssize_t nrules = PyTuple_GET_SIZE(args);
+    Py_ssize_t n = 0;
+    Py_ssize_t i;
+    PyObject* res = NULL;
+
+    if (kwds != NULL)
+    {
+        flags_obj = PyDict_GetItemString(kwds, "flags");
+        if (flags_obj == NULL || PyDict_Size(kwds) != 1)
+        {
+            PyErr_SetString(PyExc_TypeError, "compile_filter() only takes a flags keyword argument");
+            return NULL;
+        }
+        flags = PyLong_AsLong(flags_obj);
+        if (flags == -1 && PyErr_Occurred())
+        {
+            return NULL;
+        }
+    }
+    if (nrules == 0)
+    {
+        /* Accept everything */
+        ret_insn.k = 0xffffffff;
+        return pytun_new_string(&ret_insn, sizeof(ret_insn));
+    }
+
+    insns = PyMem_New(struct sock_filter, nrules * PYTUN_BPF_RULE_MAX + 1);
+    if (insns == NULL)
+    {
+        return PyErr_NoMemory();
+    }
+    for (i = 0; i < nrules; i++)
+    {
+        if (pytun_bpf_compile_rule(pytun_module_state(self), &rule, PyTuple_GET_ITEM(args, i), flags & IFF_TAP) < 0)
+        {
+            goto out;
+        }
+        memcpy(insns + n, rule.insns, rule.n * sizeof(struct sock_filter));
+        n += rule.n;
+    }
+    insns[n++] = ret_insn;
+    if (n > BPF_MAXINSNS)
+    {
+        raise_error(pytun_module_state(self), "Too many filter rules");
+        goto out;
+    }
+    res = pytun_new_string(insns, n * sizeof(struct sock_filter));
+
+out:
+    PyMem_Free(insns);
+
+    return res;
+}
+
+PyDoc_STRVAR(pytun_compile_filter_doc,
+"compile_filter(*rules, flags=IFF_TUN) -> classic BPF program.\n\
+Compile rules to a classic BPF program accepting the packets which match\n\
+any of them, for a device created with flags. Each rule is a dict with the\n\
+optional keys version (4, the default, or 6), proto, src and dst (address\n\
+prefixes of the form 'addr[/prefixlen]'), sport and dport. A packet\n\
+matches a rule if it matches all its keys. Without rules, all the packets\n\
+are accepted. IPv6 extension headers are not followed.");
+
+/* Queue the configuration of each (device, config) pair of items, the
+   devices being instances of tuntap_type */
+static int pytun_nl_config_items(pytun_nl_batch_t* b, PyTypeObject* tuntap_type, PyObject* items)
+{
+    PyObject* seq;
+    PyObject* item;
+    Py_ssize_t i;
+
+    seq = PySequence_Fast(items, "items must be an iterable of (device, config) pairs");
+    if (seq == NULL)
+    {
+        return -1;
+    }
+    for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++)
+    {
+        item = PySequence_Fast_GET_ITEM(seq, i);
+        if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2 ||
+            !PyObject_TypeCheck(PyTuple_GET_ITEM(item, 0), tuntap_type))
+        {
+            PyErr_SetString(PyExc_TypeError, "items must be (device, config) pairs");
+            goto error;
+        }
+        if (PyTuple_GET_ITEM(item, 1) == Py_None)
+        {
+            continue;
+        }
+        if (pytun_nl_config(b, (pytun_tuntap_t*)PyTuple_GET_ITEM(item, 0), PyTuple_GET_ITEM(item, 1)) < 0)
+        {
+            goto error;
+        }
+    }
+    Py_DECREF(seq);
+
+    return 0;
+
+error:
+    Py_DECREF(seq);
+
+    return -1;
+}
+
+static PyObject* pytun_configure_many(PyObject* self, PyObject* args)
+{
+    pytun_nl_batch_t b;
+    PyObject* items;
+    PyObject* res = NULL;
+
+    if (!PyArg_ParseTuple(args, "O:configure_many", &items))
+    {
+        return NULL;
+    }
+    if (pytun_nl_batch_init(&b) < 0)
+    {
+        return NULL;
+    }
+    if (pytun_nl_config_items(&b, pytun_module_state(self)->tuntap_type, items) < 0 ||
+        pytun_nl_batch_send(pytun_module_state(self), &b) < 0)
+    {
+        goto out;
+    }
+    Py_INCREF(Py_None);
+    res = Py_None;
+
+out:
+    pytun_nl_batch_free(&b);
+
+    return res;
+}
+
+PyDoc_STRVAR(pytun_configure_many_doc,
+"configure_many(items) -> None.\n\
+Configure many devices with batched rtnetlink requests. items is an\n\
+iterable of (device, config) pairs, config being a dict with the optional\n\
+keys mtu, hwaddr, addrs (an address or a list of addresses of the form\n\
+'addr[/prefixlen]', IPv4 or IPv6), dstaddr (IPv4 peer address) and up.\n\
+If a request fails, pytun.Error is raised with the errno, its description\n\
+and the name of the device.");
+
+static PyObject* pytun_create_many(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    PyObject* pattern;
+    Py_ssize_t count;
+    int flags = IFF_TAP;
+    PyObject* config = Py_None;
+    const char* dev = "/dev/net/tun";
+    char* kwlist[] = {"name_pattern", "count", "flags", "config", "dev", NULL};
+    pytun_nl_batch_t b;
+    PyObject* devices;
+    PyObject* items = NULL;
+    PyObject* index;
+    PyObject* name;
+    PyObject* device;
+    PyObject* cfg;
+    Py_ssize_t i;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "On|iOs:create_many", kwlist,
+                                     &pattern, &count, &flags, &config, &dev))
+    {
+        return NULL;
+    }
+    if (count < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "count must be >= 0");
+        return NULL;
+    }
+    devices = PyList_New(count);
+    if (devices == NULL)
+    {
+        return NULL;
+    }
+    items = PyList_New(count);
+    if (items == NULL)
+    {
+        goto error;
+    }
+
+    /* Each device needs its own TUNSETIFF, only their configuration is
+       batched */
+    for (i = 0; i < count; i++)
+    {
+        index = PyLong_FromSsize_t(i);
+        if (index == NULL)
+        {
+            goto error;
+        }
+        name = PyNumber_Remainder(pattern, index);
+        if (name == NULL)
+        {
+            Py_DECREF(index);
+            goto error;
+        }
+        device = PyObject_CallFunction((PyObject*)pytun_module_state(self)->tuntap_type, "Ois", name, flags, dev);
+        Py_DECREF(name);
+        if (device == NULL)
+        {
+            Py_DECREF(index);
+            goto error;
+        }
+        PyList_SET_ITEM(devices, i, device);
+        if (PyCallable_Check(config))
+        {
+            cfg = PyObject_CallFunctionObjArgs(config, index, NULL);
+        }
+        else
+        {
+            cfg = config;
+            Py_INCREF(cfg);
+        }
+        Py_DECREF(index);
+        if (cfg == NULL)
+        {
+            goto error;
+        }
+        PyList_SET_ITEM(items, i, Py_BuildValue("(ON)", device, cfg));
+        if (PyList_GET_ITEM(items, i) == NULL)
+        {
+            goto error;
+        }
+    }
+
+    if (pytun_nl_batch_init(&b) < 0)
+    {
+        goto error;
+    }
+    if (pytun_nl_config_items(&b, pytun_module_state(self)->tuntap_type, items) < 0 ||
+        pytun_nl_batch_send(pytun_module_state(self), &b) < 0)
+    {
+        pytun_nl_batch_free(&b);
+        goto error;
+    }
+    pytun_nl_batch_free(&b);
+    Py_DECREF(items);
+
+    return devices;
+
+error:
+    Py_XDECREF(items);
+    Py_DECREF(devices);
+
+    return NULL;
+}
+
+PyDoc_STRVAR(pytun_create_many_doc,
+"create_many(name_pattern, count, flags=IFF_TAP, config=None, dev='/dev/net/tun') -> list of devices.\n\
+Create count devices named name_pattern % index and configure them with\n\
+batched rtnetlink requests, see configure_many(). config is either a dict\n\
+applied to all the devices or a callable returning the config of the\n\
+device of the given index (or None).");
+
+/* A packet of a capture file to replay. data and len exclude the link
+   layer header, proto is the ethertype of the packet for the tun_pi. */
+struct pytun_replay_pkt
+{
+    const unsigned char* data;
+    uint32_t len;
+    uint16_t proto;
+    uint64_t ts;
+};
+typedef struct pytun_replay_pkt pytun_replay_pkt_t;
+
+/* Interface of a pcapng section, or the link type of a pcap file */
+struct pytun_replay_iface
+{
+    int linktype;
+    /* The timestamps are in units of 10^-tsres seconds, or 2^-tsres
+       seconds if tsres_bin is set */
+    int tsres_bin;
+    unsigned int tsres;
+};
+typedef struct pytun_replay_iface pytun_replay_iface_t;
+
+#define PYTUN_REPLAY_MAX_IFACES 64
+
+struct pytun_replay
+{
+    int tap;
+    pytun_replay_pkt_t* pkts;
+    size_t n;
+    size_t cap;
+    size_t skipped;
+};
+typedef struct pytun_replay pytun_replay_t;
+
+static uint32_t pytun_replay_rd32(const unsigned char* p, int swap)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t pytun_replay_rd16(const unsigned char* p, int swap)
+{
+    uint16_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return swap ? __builtin_bswap16(v) : v;
+}
+
+/* Convert a timestamp in the units of iface to nanoseconds */
+static uint64_t pytun_replay_ts(const pytun_replay_iface_t* iface, uint64_t ts)
+{
+    uint64_t div = 1;
+    unsigned int i;
+
+    if (iface->tsres_bin)
+    {
+        return (ts >> iface->tsres) * 1000000000 +
+               (((ts & ((1ULL << iface->tsres) - 1)) * 1000000000) >> iface->tsres);
+    }
+    if (iface->tsres <= 9)
+    {
+        for (i = iface->tsres; i < 9; i++)
+        {
+            ts *= 10;
+        }
+        return ts;
+    }
+    for (i = 9; i < iface->tsres && i < 19; i++)
+    {
+        div *= 10;
+    }
+    return ts / div;
+}
+
+/* Add a packet captured on an interface of type linktype, removing its link
+   layer header if the device is a TUN device. Packets which can't be
+   written to the device are skipped. Returns -1 if out of memory. */
+static int pytun_replay_add(pytun_replay_t* r, int linktype, const unsigned char* data,
+                            uint32_t len, uint64_t ts)
+{
+    pytun_replay_pkt_t* pkts;
+    uint32_t hdrlen = 0;
+    int ethertype = -1;
+    uint16_t proto = 0;
+
+    if (r->tap)
+    {
+        /* LINKTYPE_ETHERNET only */
+        if (linktype != 1)
+        {
+            r->skipped++;
+            return 0;
+        }
+    }
+    else
+    {
+        switch (linktype)
+        {
+        case 0:   /* LINKTYPE_NULL */
+        case 108: /* LINKTYPE_LOOP */
+            hdrlen = 4;
+            break;
+        case 1: /* LINKTYPE_ETHERNET */
+            hdrlen = 14;
+            if (len >= 18 && data[12] == 0x81 && data[13] == 0x00)
+            {
+                hdrlen = 18;
+            }
+            if (len >= hdrlen)
+            {
+                ethertype = (data[hdrlen - 2] << 8) | data[hdrlen - 1];
+            }
+            break;
+        case 113: /* LINKTYPE_LINUX_SLL */
+            hdrlen = 16;
+            if (len >= hdrlen)
+            {
+                ethertype = (data[14] << 8) | data[15];
+            }
+            break;
+        case 12:  /* LINKTYPE_RAW on some platforms */
+        case 14:
+        case 101: /* LINKTYPE_RAW */
+        case 228: /* LINKTYPE_IPV4 */
+        case 229: /* LINKTYPE_IPV6 */
+            break;
+        default:
+            r->skipped++;
+            return 0;
+        }
+        if (len <= hdrlen)
+        {
+            r->skipped++;
+            return 0;
+        }
+        switch (data[hdrlen] >> 4)
+        {
+        case 4:
+            proto = ETH_P_IP;
+            break;
+        case 6:
+            proto = ETH_P_IPV6;
+            break;
+        }
+        if (proto == 0 || (ethertype != -1 && ethertype != proto))
+        {
+            r->skipped++;
+            return 0;
+        }
+    }
+
+    if (r->n == r->cap)
+    {
+        r->cap = r->cap ? r->cap * 2 : 1024;
+        pkts = realloc(r->pkts, r->cap * sizeof(*pkts));
+        if (pkts == NULL)
+        {
+            return -1;
+        }
+        r->pkts = pkts;
+    }
+    r->pkts[r->n].data = data + hdrlen;
+    r->pkts[r->n].len = len - hdrlen;
+    r->pkts[r->n].proto = proto;
+    r->pkts[r->n].ts = ts;
+    r->n++;
+
+    return 0;
+}
+
+/* Index the packets of a pcap file */
+static int pytun_replay_index_pcap(pytun_replay_t* r, const unsigned char* map, size_t size,
+                                   const char** errmsg)
+{
+    pytun_replay_iface_t iface;
+    uint32_t magic = pytun_replay_rd32(map, 0);
+    int swap = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+    size_t off = 24;
+    uint32_t caplen;
+    uint64_t ts;
+
+    if (size < 24)
+    {
+        *errmsg = "Truncated pcap header";
+        return -1;
+    }
+    iface.linktype = pytun_replay_rd32(map + 20, swap) & 0xffff;
+    iface.tsres_bin = 0;
+    iface.tsres = (magic == 0xa1b23c4d || magic == 0x4d3cb2a1) ? 9 : 6;
+    while (off + 16 <= size)
+    {
+        caplen = pytun_replay_rd32(map + off + 8, swap);
+        if (caplen > size - off - 16)
+        {
+            /* Truncated file, keep the packets read so far */
+            break;
+        }
+        ts = (uint64_t)pytun_replay_rd32(map + off, swap) * (iface.tsres == 9 ? 1000000000 : 1000000) +
+             pytun_replay_rd32(map + off + 4, swap);
+        if (pytun_replay_add(r, iface.linktype, map + off + 16, caplen, pytun_replay_ts(&iface, ts)) < 0)
+        {
+            return -1;
+        }
+        off += 16 + caplen;
+    }
+
+    return 0;
+}
+
+/* Index the packets of a pcapng file */
+static int pytun_replay_index_pcapng(pytun_replay_t* r, const unsigned char* map, size_t size,
+                                     const char** errmsg)
+{
+    pytun_replay_iface_t ifaces[PYTUN_REPLAY_MAX_IFACES];
+    unsigned int nifaces = 0;
+    int swap = 0;
+    size_t off = 0;
+    size_t opt;
+    uint32_t type;
+    uint32_t len;
+    uint32_t ifid;
+    uint32_t caplen;
+    uint16_t code;
+    uint16_t optlen;
+    uint64_t ts = 0;
+
+    while (off + 12 <= size)
+    {
+        type = pytun_replay_rd32(map + off, swap);
+        if (type == PYTUN_PCAPNG_SHB)
+        {
+            if (off + 28 > size)
+            {
+                break;
+            }
+            swap = pytun_replay_rd32(map + off + 8, 0) != 0x1A2B3C4D;
+            nifaces = 0;
+        }
+        len = pytun_replay_rd32(map + off + 4, swap);
+        if (len < 12 || len % 4 != 0 || len > size - off)
+        {
+            if (off == 0)
+            {
+                *errmsg = "Bad pcapng block length";
+                return -1;
+            }
+            /* Truncated file, keep the packets read so far */
+            break;
+        }
+
+        switch (type)
+        {
+        case PYTUN_PCAPNG_IDB:
+            if (len < 20 || nifaces == PYTUN_REPLAY_MAX_IFACES)
+            {
+                break;
+            }
+            ifaces[nifaces].linktype = pytun_replay_rd16(map + off + 8, swap);
+            ifaces[nifaces].tsres_bin = 0;
+            ifaces[nifaces].tsres = 6;
+            for (opt = off + 16; opt + 4 <= off + len - 4; opt += 4 + PYTUN_PCAPNG_PAD(optlen))
+            {
+                code = pytun_replay_rd16(map + opt, swap);
+                optlen = pytun_replay_rd16(map + opt + 2, swap);
+                if (code == 0)
+                {
+                    break;
+                }
+                if (code == 9 && optlen >= 1)
+                {
+                    ifaces[nifaces].tsres_bin = map[opt + 4] >> 7;
+                    ifaces[nifaces].tsres = map[opt + 4] & 0x7f;
+                    if (ifaces[nifaces].tsres_bin && ifaces[nifaces].tsres > 63)
+                    {
+                        ifaces[nifaces].tsres = 63;
+                    }
+                }
+            }
+            nifaces++;
+            break;
+        case PYTUN_PCAPNG_EPB:
+        case 2: /* Obsolete packet block */
+            if (len < 32)
+            {
+                break;
+            }
+            ifid = type == 2 ? pytun_replay_rd16(map + off + 8, swap) : pytun_replay_rd32(map + off + 8, swap);
+            ts = ((uint64_t)pytun_replay_rd32(map + off + 12, swap) << 32) | pytun_replay_rd32(map + off + 16, swap);
+            caplen = pytun_replay_rd32(map + off + 20, swap);
+            if (caplen > len - 32 || ifid >= nifaces)
+            {
+                r->skipped++;
+                break;
+            }
+            if (pytun_replay_add(r, ifaces[ifid].linktype, map + off + 28, caplen,
+                                 pytun_replay_ts(&ifaces[ifid], ts)) < 0)
+            {
+                return -1;
+            }
+            break;
+        case 3: /* Simple packet block, without timestamp */
+            if (len < 16 || nifaces == 0)
+            {
+                break;
+            }
+            caplen = pytun_replay_rd32(map + off + 8, swap);
+            if (caplen > len - 16)
+            {
+                caplen = len - 16;
+            }
+            if (pytun_replay_add(r, ifaces[0].linktype, map + off + 12, caplen,
+                                 r->n ? r->pkts[r->n - 1].ts : 0) < 0)
+            {
+                return -1;
+            }
+            break;
+        }
+        off += len;
+    }
+
+    return 0;
+}
+
+static int pytun_replay_cmp_err(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Interval between two checks for signals during a replay */
+#define PYTUN_REPLAY_CHECK_NS 100000000
+
+/* Wait until target, sleeping then spinning for the last microseconds.
+   Returns 1 once target is reached, 0 if the sleep stopped at deadline
+   first and -1 if it was interrupted by a signal. */
+static int pytun_replay_wait(uint64_t target, uint64_t deadline)
+{
+    const uint64_t spin = 50000;
+    struct timespec ts;
+    uint64_t now = pytun_now_ns();
+    uint64_t wake;
+
+    if (now + spin < target)
+    {
+        wake = target - spin < deadline ? target - spin : deadline;
+        ts.tv_sec = wake / 1000000000;
+        ts.tv_nsec = wake % 1000000000;
+        if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        {
+            return -1;
+        }
+        if (wake != target - spin)
+        {
+            return 0;
+        }
+    }
+    while (pytun_now_ns() < target)
+    {
+    }
+
+    return 1;
+}
+
+static PyObject* pytun_replay(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    PyObject* device;
+    pytun_tuntap_t* tuntap;
+    const char* path;
+    double speed = 1.0;
+    unsigned int batch = 64;
+    char* kwlist[] = {"device", "path", "speed", "batch", NULL};
+    pytun_replay_t r;
+    const char* errmsg = NULL;
+    unsigned char* map = MAP_FAILED;
+    struct stat st;
+    int fd = -1;
+    int dev_fd;
+    int64_t* errs = NULL;
+    size_t nerrs = 0;
+    PyThreadState* tstate;
+    struct tun_pi pi;
+    unsigned char vnet[PYTUN_VNET_HDR_MAX];
+    struct iovec iov[3];
+    int iovcnt;
+    int prefix;
+    size_t pilen;
+    size_t vnetlen;
+    size_t i;
+    size_t j;
+    uint64_t start;
+    uint64_t end;
+    uint64_t now;
+    uint64_t target = 0;
+    uint64_t last_check;
+    uint64_t nogil_start;
+    uint64_t base;
+    unsigned PY_LONG_LONG written = 0;
+    unsigned PY_LONG_LONG bytes = 0;
+    unsigned PY_LONG_LONG failed = 0;
+    unsigned PY_LONG_LONG shaped = 0;
+    pytun_tb_t* tb = NULL;
+    double recorded;
+    double elapsed;
+    ssize_t ret;
+    int err = 0;
+    int interrupted = 0;
+    int check = 0;
+    int slack;
+    struct pollfd pfd;
+    PyObject* res;
+    PyObject* value;
+    double sum = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!s|dI:replay", kwlist,
+                                     pytun_module_state(self)->tuntap_type, &device, &path, &speed, &batch))
+    {
+        return NULL;
+    }
+    if (speed < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "speed must be >= 0");
+        return NULL;
+    }
+    if (batch == 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "batch must be positive");
+        return NULL;
+    }
+    tuntap = (pytun_tuntap_t*)device;
+    memset(&r, 0, sizeof(r));
+    r.tap = (tuntap->flags & IFF_TAP) != 0;
+
+    /* Map the file and index its packets */
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        goto error;
+    }
+    if (st.st_size < 4)
+    {
+        errmsg = "Not a pcap or pcapng file";
+        goto error;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
     Py_END_ALLOW_THREADS
+    if (map == MAP_FAILED)
+    {
+        goto error;
+    }
+    switch (pytun_replay_rd32(map, 0))
+    {
+    case 0xa1b2c3d4:
+    case 0xd4c3b2a1:
+    case 0xa1b23c4d:
+    case 0x4d3cb2a1:
+        ret = pytun_replay_index_pcap(&r, map, st.st_size, &errmsg);
+        break;
+    case PYTUN_PCAPNG_SHB:
+        ret = pytun_replay_index_pcapng(&r, map, st.st_size, &errmsg);
+        break;
+    default:
+        errmsg = "Not a pcap or pcapng file";
+        goto error;
+    }
     if (ret < 0)
     {
-        raise_error_from_errno();
-        return NULL;
+        if (errmsg == NULL)
+        {
+            PyErr_NoMemory();
+        }
+        goto error;
+    }
+    if (speed > 0 && r.n != 0)
+    {
+        errs = malloc(r.n * sizeof(*errs));
+        if (errs == NULL)
+        {
+            PyErr_NoMemory();
+            goto error;
+        }
     }
 
-    Py_RETURN_NONE;
+    /* Prepend the packet information and a vnet header if the device
+       expects them */
+    pilen = (tuntap->flags & IFF_NO_PI) ? 0 : sizeof(pi);
+    vnetlen = (tuntap->flags & IFF_VNET_HDR) ? (size_t)tuntap->vnet_hdr_sz : 0;
+    memset(&pi, 0, sizeof(pi));
+    memset(vnet, 0, sizeof(vnet));
+    prefix = pilen != 0 || vnetlen != 0;
+
+    /* Packets whose timestamp goes backwards are written without delay */
+    for (i = 1; i < r.n; i++)
+    {
+        if (r.pkts[i].ts < r.pkts[i - 1].ts)
+        {
+            r.pkts[i].ts = r.pkts[i - 1].ts;
+        }
+    }
+    base = r.n ? r.pkts[0].ts : 0;
+    recorded = r.n ? (r.pkts[r.n - 1].ts - base) / 1e9 : 0;
+    /* Hold the descriptor of the device for the whole replay, close()
+       stops it at the next burst */
+    dev_fd = pytun_tuntap_get_fd(tuntap);
+    if (dev_fd < 0)
+    {
+        goto error;
+    }
+    pfd.fd = dev_fd;
+    pfd.events = POLLOUT;
+    tb = pytun_tuntap_shaper(tuntap);
+
+    tstate = PyEval_SaveThread();
+    /* The default timer slack (50us) would delay each wake up */
+    slack = prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0);
+    if (speed > 0)
+    {
+        prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0);
+    }
+    start = last_check = nogil_start = pytun_now_ns();
+    for (i = 0; i < r.n && !err && !interrupted; )
+    {
+        /* Check for signals from time to time, including during long gaps
+           between packets */
+        now = pytun_now_ns();
+        if (check || now - last_check >= PYTUN_REPLAY_CHECK_NS)
+        {
+            PYTUN_STAT_ADD(&tuntap->stats, nogil_ns, now - nogil_start);
+            PyEval_RestoreThread(tstate);
+            interrupted = PyErr_CheckSignals() < 0;
+            tstate = PyEval_SaveThread();
+            last_check = nogil_start = pytun_now_ns();
+            check = 0;
+            continue;
+        }
+        if (speed > 0)
+        {
+            target = start + (uint64_t)((r.pkts[i].ts - base) / speed);
+            ret = pytun_replay_wait(target, last_check + PYTUN_REPLAY_CHECK_NS);
+            if (ret <= 0)
+            {
+                check = ret < 0;
+                continue;
+            }
+        }
+        if (pytun_tuntap_closed(tuntap))
+        {
+            err = EBADF;
+            break;
+        }
+        /* Write this packet and the following ones which are due, at most
+           batch of them */
+        now = pytun_now_ns();
+        for (j = 0; j < batch && i < r.n; j++, i++)
+        {
+            if (speed > 0)
+            {
+                target = start + (uint64_t)((r.pkts[i].ts - base) / speed);
+                if (j > 0 && target > now)
+                {
+                    break;
+                }
+                errs[nerrs++] = (int64_t)(pytun_now_ns() - target);
+            }
+            iovcnt = 0;
+            if (prefix)
+            {
+                if (pilen)
+                {
+                    pi.proto = htons(r.pkts[i].proto);
+                    iov[iovcnt].iov_base = &pi;
+                    iov[iovcnt].iov_len = pilen;
+                    iovcnt++;
+                }
+                if (vnetlen)
+                {
+                    iov[iovcnt].iov_base = vnet;
+                    iov[iovcnt].iov_len = vnetlen;
+                    iovcnt++;
+                }
+            }
+            iov[iovcnt].iov_base = (void*)r.pkts[i].data;
+            iov[iovcnt].iov_len = r.pkts[i].len;
+            iovcnt++;
+            if (tb != NULL && !pytun_tb_admit(tb, pilen + vnetlen + r.pkts[i].len, 0))
+            {
+                pytun_stats_shaped(&tuntap->stats, 0);
+                shaped++;
+                continue;
+            }
+            do
+            {
+                ret = iovcnt == 1 ? write(dev_fd, r.pkts[i].data, r.pkts[i].len) :
+                                    writev(dev_fd, iov, iovcnt);
+                pytun_stats_write(&tuntap->stats, ret, pilen + vnetlen + r.pkts[i].len);
+                if (ret < 0 && errno == EAGAIN)
+                {
+                    poll(&pfd, 1, 100);
+                }
+            }
+            while (ret < 0 && (errno == EAGAIN || errno == EINTR));
+            if (ret < 0)
+            {
+                failed++;
+                if (tb != NULL)
+                {
+                    pytun_tb_refund(tb, pilen + vnetlen + r.pkts[i].len);
+                }
+                if (errno == EBADF || errno == EIO)
+                {
+                    err = errno;
+                    break;
+                }
+                continue;
+            }
+            pytun_capture_payload(&tuntap->capture, PYTUN_CAPTURE_IN, (const char*)r.pkts[i].data,
+                                  r.pkts[i].len);
+            written++;
+            bytes += r.pkts[i].len;
+        }
+    }
+    end = pytun_now_ns();
+    if (speed > 0 && slack > 0)
+    {
+        prctl(PR_SET_TIMERSLACK, slack, 0, 0, 0);
+    }
+    PYTUN_STAT_ADD(&tuntap->stats, nogil_ns, end - nogil_start);
+    PyEval_RestoreThread(tstate);
+    pytun_tuntap_put_fd(tuntap);
+    pytun_tb_decref(tb);
+    if (interrupted)
+    {
+        goto error;
+    }
+    if (err)
+    {
+        errno = err;
+        goto error;
+    }
+
+    elapsed = (end - start) / 1e9;
+    res = Py_BuildValue("{s:K,s:K,s:n,s:K,s:K,s:d,s:d,s:d,s:d}",
+                        "packets", written,
+                        "bytes", bytes,
+                        "skipped", (Py_ssize_t)r.skipped,
+                        "errors", failed,
+                        "shaped", shaped,
+                        "seconds", elapsed,
+                        "recorded_seconds", recorded,
+                        "pps", elapsed > 0 ? written / elapsed : 0.0,
+                        "gbps", elapsed > 0 ? bytes * 8 / elapsed / 1e9 : 0.0);
+    if (res != NULL && speed > 0 && nerrs != 0)
+    {
+        /* Lateness of each write compared to its scheduled time */
+        for (i = 0; i < nerrs; i++)
+        {
+            sum += errs[i];
+        }
+        qsort(errs, nerrs, sizeof(*errs), pytun_replay_cmp_err);
+        value = Py_BuildValue("{s:d,s:L,s:L,s:L}",
+                              "mean", sum / nerrs,
+                              "p50", (PY_LONG_LONG)errs[nerrs / 2],
+                              "p99", (PY_LONG_LONG)errs[(nerrs - 1) * 99 / 100],
+                              "max", (PY_LONG_LONG)errs[nerrs - 1]);
+        if (value == NULL || PyDict_SetItemString(res, "timing_error_ns", value) < 0)
+        {
+            Py_CLEAR(res);
+        }
+        Py_XDECREF(value);
+    }
+    free(errs);
+    free(r.pkts);
+    munmap(map, st.st_size);
+    close(fd);
+
+    return res;
+
+error:
+    if (errmsg != NULL)
+    {
+        raise_error(pytun_module_state(self), errmsg);
+    }
+    else if (!PyErr_Occurred())
+    {
+        raise_error_from_errno(pytun_module_state(self));
+    }
+    free(errs);
+    free(r.pkts);
+    if (map != MAP_FAILED)
+    {
+        munmap(map, st.st_size);
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    return NULL;
 }
 
-PyDoc_STRVAR(pytun_tuntap_mq_attach_doc,
-"mq_attach(flag) -> None.\n\
-Enable the queue if flags is True else\n\
-disable the queue.");
-#endif
+PyDoc_STRVAR(pytun_replay_doc,
+"replay(device, path, speed=1.0, batch=64) -> dict.\n\
+Write the packets of the pcap or pcapng file path to device, with the GIL\n\
+released. With speed 1.0 the packets are written with their original\n\
+timing, with another speed the timing is scaled (2.0 replays twice as fast)\n\
+and with speed 0 they are written as fast as possible. Packets due at the\n\
+same time are written in bursts of at most batch packets. Link layer\n\
+headers are removed for TUN devices, packets which can't be written to the\n\
+device (e.g not IP for a TUN device, not Ethernet for a TAP device) are\n\
+skipped. Packets whose timestamp goes backwards are written without delay.\n\
+If the device has a shaper, the packets are paced by it as well.\n\
+Returns the number of packets and bytes written, skipped, failed and\n\
+dropped by the shaper (shaped), the time taken and recorded, the achieved\n\
+rate and, unless speed is 0, how late the packets were written compared to\n\
+their schedule (timing_error_ns).");
 
-static PyMethodDef pytun_tuntap_meth[] =
+static PyMethodDef pytun_meth[] =
 {
     {
-     "close",
-     (PyCFunction)pytun_tuntap_close,
-     METH_NOARGS,
-     pytun_tuntap_close_doc
+     "gso_segment",
+     (PyCFunction)pytun_gso_segment,
+     METH_VARARGS,
+     pytun_gso_segment_doc
     },
     {
-     "up",
-     (PyCFunction)pytun_tuntap_up,
-     METH_NOARGS,
-     pytun_tuntap_up_doc
+     "gro_coalesce",
+     (PyCFunction)pytun_gro_coalesce,
+     METH_VARARGS | METH_KEYWORDS,
+     pytun_gro_coalesce_doc
     },
     {
-     "down",
-     (PyCFunction)pytun_tuntap_down,
-     METH_NOARGS,
-     pytun_tuntap_down_doc
+     "parse_many",
+     (PyCFunction)pytun_parse_many,
+     METH_VARARGS | METH_KEYWORDS,
+     pytun_parse_many_doc
     },
     {
-     "read",
-     (PyCFunction)pytun_tuntap_read,
+     "checksum",
+     (PyCFunction)pytun_checksum,
+     METH_VARARGS | METH_KEYWORDS,
+     pytun_checksum_doc
+    },
+    {
+     "checksum_update",
+     (PyCFunction)pytun_checksum_update,
      METH_VARARGS,
-     pytun_tuntap_read_doc
+     pytun_checksum_update_doc
     },
     {
-     "write",
-     (PyCFunction)pytun_tuntap_write,
+     "verify_checksums",
+     (PyCFunction)pytun_verify_checksums,
+     METH_VARARGS | METH_KEYWORDS,
+     pytun_verify_checksums_doc
+    },
+    {
+     "fix_checksums",
+     (PyCFunction)pytun_fix_checksums,
+     METH_VARARGS | METH_KEYWORDS,
+     pytun_fix_checksums_doc
+    },
+    {
+     "compile_filter",
+     (PyCFunction)pytun_compile_filter,
+     METH_VARARGS | METH_KEYWORDS,
+     pytun_compile_filter_doc
+    },
+    {
+     "configure_many",
+     (PyCFunction)pytun_configure_many,
      METH_VARARGS,
-     pytun_tuntap_write_doc
+     pytun_configure_many_doc
     },
     {
-     "fileno",
-     (PyCFunction)pytun_tuntap_fileno,
-     METH_NOARGS,
-     pytun_tuntap_fileno_doc
+     "create_many",
+     (PyCFunction)pytun_create_many,
+     METH_VARARGS | METH_KEYWORDS,
+     pytun_create_many_doc
+    },
+    {
+     "replay",
+     (PyCFunction)pytun_replay,
+     METH_VARARGS | METH_KEYWORDS,
+     pytun_replay_doc
     },
+    {NULL, NULL, 0, NULL}
+};
+
+/* Create a type of the module m from its spec */
+static PyTypeObject* pytun_type_from_spec(PyObject* m, PyType_Spec* spec)
+{
+    PyTypeObject* type;
+#if PY_MAJOR_VERSION < 3 || PY_MINOR_VERSION < 10
+    PyType_Slot* slot;
+#endif
+#if PY_MAJOR_VERSION < 3
+    PySequenceMethods* seq;
+    PyBufferProcs* buf;
+
+    /* Static-like types living as long as the process */
+    type = PyMem_Malloc(sizeof(*type));
+    seq = PyMem_Malloc(sizeof(*seq));
+    buf = PyMem_Malloc(sizeof(*buf));
+    if (type == NULL || seq == NULL || buf == NULL)
+    {
+        PyMem_Free(type);
+        PyMem_Free(seq);
+        PyMem_Free(buf);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    memset(type, 0, sizeof(*type));
+    memset(seq, 0, sizeof(*seq));
+    memset(buf, 0, sizeof(*buf));
+    PyObject_INIT((PyObject*)type, &PyType_Type);
+    type->tp_name = spec->name;
+    type->tp_basicsize = spec->basicsize;
+    type->tp_itemsize = spec->itemsize;
+    type->tp_flags = spec->flags;
+    for (slot = spec->slots; slot->slot != 0; slot++)
+    {
+        switch (slot->slot)
+        {
+        case Py_bf_getbuffer:
+            buf->bf_getbuffer = (getbufferproc)slot->pfunc;
+            type->tp_as_buffer = buf;
+            break;
+        case Py_bf_releasebuffer:
+            buf->bf_releasebuffer = (releasebufferproc)slot->pfunc;
+            type->tp_as_buffer = buf;
+            break;
+        case Py_sq_length:
+            seq->sq_length = (lenfunc)slot->pfunc;
+            type->tp_as_sequence = seq;
+            break;
+        case Py_tp_clear:
+            type->tp_clear = (inquiry)slot->pfunc;
+            break;
+        case Py_tp_dealloc:
+            type->tp_dealloc = (destructor)slot->pfunc;
+            break;
+        case Py_tp_doc:
+            type->tp_doc = (const char*)slot->pfunc;
+            break;
+        case Py_tp_iter:
+            type->tp_iter = (getiterfunc)slot->pfunc;
+            break;
+        case Py_tp_iternext:
+            type->tp_iternext = (iternextfunc)slot->pfunc;
+            break;
+        case Py_tp_methods:
+            type->tp_methods = (PyMethodDef*)slot->pfunc;
+            break;
+        case Py_tp_new:
+            type->tp_new = (newfunc)slot->pfunc;
+            break;
+        case Py_tp_traverse:
+            type->tp_traverse = (traverseproc)slot->pfunc;
+            break;
+        case Py_tp_members:
+            type->tp_members = (PyMemberDef*)slot->pfunc;
+            break;
+        case Py_tp_getset:
+            type->tp_getset = (PyGetSetDef*)slot->pfunc;
+            break;
+        }
+    }
+    if (type->tp_as_sequence != seq)
+    {
+        PyMem_Free(seq);
+    }
+    if (type->tp_as_buffer != buf)
+    {
+        PyMem_Free(buf);
+    }
+    if (PyType_Ready(type) < 0)
+    {
+        return NULL;
+    }
+#elif defined(PYTUN_MODULE_STATE)
+    type = (PyTypeObject*)PyType_FromModuleAndSpec(m, spec, NULL);
+    if (type == NULL)
+    {
+        return NULL;
+    }
+#else
+    PyType_Slot slots[32];
+    PyType_Spec copy = *spec;
+    PyBufferProcs procs;
+    int n = 0;
+
+    /* Create the type without the buffer slots, then set them */
+    memset(&procs, 0, sizeof(procs));
+    for (slot = spec->slots; slot->slot != 0; slot++)
+    {
+        if (slot->slot == Py_bf_getbuffer)
+        {
+            procs.bf_getbuffer = (getbufferproc)slot->pfunc;
+        }
+        else if (slot->slot == Py_bf_releasebuffer)
+        {
+            procs.bf_releasebuffer = (releasebufferproc)slot->pfunc;
+        }
+        else
+        {
+            slots[n++] = *slot;
+        }
+    }
+    slots[n] = *slot;
+    copy.slots = slots;
+    type = (PyTypeObject*)PyType_FromSpec(&copy);
+    if (type == NULL)
+    {
+        return NULL;
+    }
+    if (procs.bf_getbuffer != NULL)
+    {
+        *type->tp_as_buffer = procs;
+    }
+#endif
+#if PY_MAJOR_VERSION >= 3 && PY_MINOR_VERSION < 10
+    /* Heap types inherit tp_new, don't let the types without one be
+       instantiated */
+    for (slot = spec->slots; slot->slot != 0 && slot->slot != Py_tp_new; slot++)
     {
-     "persist",
-     (PyCFunction)pytun_tuntap_persist,
-     METH_VARARGS,
-     pytun_tuntap_persist_doc
-    },
-#ifdef IFF_MULTI_QUEUE
+    }
+    if (slot->slot == 0)
     {
-     "mq_attach",
-     (PyCFunction)pytun_tuntap_mq_attach,
-     METH_VARARGS,
-     pytun_tuntap_mq_attach_doc
-    },
+        type->tp_new = NULL;
+    }
 #endif
-    {NULL, NULL, 0, NULL}
-};
 
-PyDoc_STRVAR(pytun_tuntap_doc,
-"TunTapDevice(name='', flags=IFF_TUN, dev='/dev/net/tun') -> TUN/TAP device object.");
+    return type;
+}
 
-static PyTypeObject pytun_tuntap_type =
+/* Create a type from its spec and add it to the module m, under name if it
+   is not NULL. Returns a new reference to the type. */
+static PyTypeObject* pytun_add_type(PyObject* m, const char* name, PyType_Spec* spec)
 {
-    PyVarObject_HEAD_INIT(&PyType_Type, 0)
-    .tp_name = "pytun.TunTapDevice",
-    .tp_basicsize = sizeof(pytun_tuntap_t),
-    .tp_dealloc = pytun_tuntap_dealloc,
-    .tp_flags = Py_TPFLAGS_DEFAULT,
-    .tp_doc = pytun_tuntap_doc,
-    .tp_methods = pytun_tuntap_meth,
-    .tp_getset = pytun_tuntap_prop,
-    .tp_new = pytun_tuntap_new
-};
+    PyTypeObject* type = pytun_type_from_spec(m, spec);
 
-#if PY_MAJOR_VERSION >= 3
-static struct PyModuleDef pytun_module =
+    if (type == NULL || name == NULL)
+    {
+        return type;
+    }
+    Py_INCREF(type);
+    if (PyModule_AddObject(m, name, (PyObject*)type) != 0)
+    {
+        Py_DECREF(type);
+        Py_DECREF(type);
+        return NULL;
+    }
+
+    return type;
+}
+
+#ifndef PYTUN_MODULE_STATE
+static PyTypeObject pytun_legacy_stats_type;
+static PyTypeObject pytun_legacy_vnet_hdr_type;
+#endif
+
+/* Create a struct sequence type from its description and add it to the
+   module m under name. Older versions initialize the static type legacy
+   instead. Returns a new reference to the type. */
+static PyTypeObject* pytun_add_struct_sequence(PyObject* m, const char* name, PyStructSequence_Desc* desc,
+                                               PyTypeObject* legacy)
 {
-    .m_base = PyModuleDef_HEAD_INIT,
-    .m_name = "pytun",
-    .m_doc = NULL,
-    .m_size = -1,
-    .m_methods = NULL,
-#if PY_MINOR_VERSION <= 4
-    .m_reload = NULL,
+    PyTypeObject* type;
+
+#ifdef PYTUN_MODULE_STATE
+    type = PyStructSequence_NewType(desc);
+    if (type == NULL)
+    {
+        return NULL;
+    }
 #else
-    .m_slots = NULL,
+    type = legacy;
+#if PY_MAJOR_VERSION >= 3 && PY_MINOR_VERSION >= 4
+    if (PyStructSequence_InitType2(type, desc) != 0)
+    {
+        return NULL;
+    }
+#else
+    PyStructSequence_InitType(type, desc);
 #endif
-    .m_traverse = NULL,
-    .m_clear = NULL,
-    .m_free = NULL
-};
+    Py_INCREF(type);
 #endif
+    Py_INCREF(type);
+    if (PyModule_AddObject(m, name, (PyObject*)type) != 0)
+    {
+        Py_DECREF(type);
+        Py_DECREF(type);
+        return NULL;
+    }
 
-#if PY_MAJOR_VERSION >= 3
-PyMODINIT_FUNC PyInit_pytun(void)
-#else
-PyMODINIT_FUNC initpytun(void)
-#endif
+    return type;
+}
+
+/* The control socket is reopened in the child after a fork, whatever the
+   interpreter which imported the module first */
+static pthread_once_t pytun_atfork_once = PTHREAD_ONCE_INIT;
+static int pytun_atfork_err;
+
+static void pytun_atfork_register(void)
 {
-    PyObject* m;
-    PyObject* pytun_error_dict = NULL;
+    pytun_atfork_err = pthread_atfork(NULL, NULL, pytun_ctl_atfork_child);
+}
 
-#if PY_MAJOR_VERSION >= 3
-    m = PyModule_Create(&pytun_module);
-#else
-    m = Py_InitModule("pytun", NULL);
-#endif
-    if (m == NULL)
+/* Fill the state of the module m and add its objects */
+static int pytun_exec(PyObject* m)
+{
+    pytun_state_t* st = pytun_module_state(m);
+    PyObject* error_dict;
+    PyObject* kernels;
+
+    pthread_once(&pytun_atfork_once, pytun_atfork_register);
+    if (pytun_atfork_err != 0)
     {
-        goto error;
+        errno = pytun_atfork_err;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
     }
 
-    if (PyType_Ready(&pytun_tuntap_type) != 0)
+    error_dict = Py_BuildValue("{ss}", "__doc__", pytun_error_doc);
+    if (error_dict == NULL)
     {
-        goto error;
+        return -1;
     }
-    Py_INCREF((PyObject*)&pytun_tuntap_type);
-    if (PyModule_AddObject(m, "TunTapDevice", (PyObject*)&pytun_tuntap_type) != 0)
+    st->error = PyErr_NewException("pytun.Error", PyExc_IOError, error_dict);
+    Py_DECREF(error_dict);
+    if (st->error == NULL)
     {
-        Py_DECREF((PyObject*)&pytun_tuntap_type);
-        goto error;
+        return -1;
+    }
+    Py_INCREF(st->error);
+    if (PyModule_AddObject(m, "Error", st->error) != 0)
+    {
+        Py_DECREF(st->error);
+        return -1;
     }
 
-    pytun_error_dict = Py_BuildValue("{ss}", "__doc__", pytun_error_doc);
-    if (pytun_error_dict == NULL)
+    st->tuntap_type = pytun_add_type(m, "TunTapDevice", &pytun_tuntap_spec);
+    if (st->tuntap_type == NULL)
     {
-        goto error;
+        return -1;
     }
-    pytun_error = PyErr_NewException("pytun.Error", PyExc_IOError, pytun_error_dict);
-    Py_DECREF(pytun_error_dict);
-    if (pytun_error == NULL)
+    st->packet_slot_type = pytun_add_type(m, NULL, &pytun_packet_slot_spec);
+    if (st->packet_slot_type == NULL)
     {
-        goto error;
+        return -1;
     }
-    Py_INCREF(pytun_error);
-    if (PyModule_AddObject(m, "Error", pytun_error) != 0)
+    st->packet_ring_type = pytun_add_type(m, "PacketRing", &pytun_packet_ring_spec);
+    if (st->packet_ring_type == NULL)
     {
-        Py_DECREF(pytun_error);
-        goto error;
+        return -1;
+    }
+#ifdef PYTUN_MODULE_STATE
+    st->vnet_hdr_type = pytun_add_struct_sequence(m, "VnetHeader", &pytun_vnet_hdr_desc, NULL);
+#else
+    st->vnet_hdr_type = pytun_add_struct_sequence(m, "VnetHeader", &pytun_vnet_hdr_desc,
+                                                  &pytun_legacy_vnet_hdr_type);
+#endif
+    if (st->vnet_hdr_type == NULL)
+    {
+        return -1;
+    }
+#ifdef PYTUN_MODULE_STATE
+    st->stats_type = pytun_add_struct_sequence(m, "DeviceStats", &pytun_stats_desc, NULL);
+#else
+    st->stats_type = pytun_add_struct_sequence(m, "DeviceStats", &pytun_stats_desc, &pytun_legacy_stats_type);
+#endif
+    if (st->stats_type == NULL)
+    {
+        return -1;
+    }
+#ifdef IFF_MULTI_QUEUE
+    st->mq_type = pytun_add_type(m, "MultiQueueDevice", &pytun_mq_spec);
+    if (st->mq_type == NULL)
+    {
+        return -1;
+    }
+#endif
+    st->relay_type = pytun_add_type(m, "Relay", &pytun_relay_spec);
+    if (st->relay_type == NULL)
+    {
+        return -1;
+    }
+    st->packet_view_type = pytun_add_type(m, "PacketView", &pytun_packet_view_spec);
+    if (st->packet_view_type == NULL)
+    {
+        return -1;
+    }
+    st->flow_table_type = pytun_add_type(m, "FlowTable", &pytun_flow_table_spec);
+    if (st->flow_table_type == NULL)
+    {
+        return -1;
+    }
+    st->rewriter_type = pytun_add_type(m, "Rewriter", &pytun_rewriter_spec);
+    if (st->rewriter_type == NULL)
+    {
+        return -1;
+    }
+    st->shaper_type = pytun_add_type(m, "Shaper", &pytun_shaper_spec);
+    if (st->shaper_type == NULL)
+    {
+        return -1;
+    }
+    st->poller_type = pytun_add_type(m, "Poller", &pytun_poller_spec);
+    if (st->poller_type == NULL)
+    {
+        return -1;
+    }
+#ifdef PYTUN_HAVE_IO_URING
+    st->uring_type = pytun_add_type(m, "Uring", &pytun_uring_spec);
+    if (st->uring_type == NULL)
+    {
+        return -1;
+    }
+#endif
+
+    pytun_csum_select();
+    kernels = pytun_csum_kernels();
+    if (kernels == NULL || PyModule_AddObject(m, "CHECKSUM_KERNELS", kernels) != 0)
+    {
+        Py_XDECREF(kernels);
+        return -1;
     }
 
     if (PyModule_AddIntConstant(m, "IFF_TUN", IFF_TUN) != 0)
     {
-        goto error;
+        return -1;
     }
     if (PyModule_AddIntConstant(m, "IFF_TAP", IFF_TAP) != 0)
     {
-        goto error;
+        return -1;
     }
 #ifdef IFF_NO_PI
     if (PyModule_AddIntConstant(m, "IFF_NO_PI", IFF_NO_PI) != 0)
     {
-        goto error;
+        return -1;
     }
 #endif
 #ifdef IFF_ONE_QUEUE
     if (PyModule_AddIntConstant(m, "IFF_ONE_QUEUE", IFF_ONE_QUEUE) != 0)
     {
-        goto error;
+        return -1;
     }
 #endif
 #ifdef IFF_VNET_HDR
     if (PyModule_AddIntConstant(m, "IFF_VNET_HDR", IFF_VNET_HDR) != 0)
     {
-        goto error;
+        return -1;
     }
 #endif
 #ifdef IFF_TUN_EXCL
     if (PyModule_AddIntConstant(m, "IFF_TUN_EXCL", IFF_TUN_EXCL) != 0)
     {
-        goto error;
+        return -1;
     }
 #endif
 #ifdef IFF_MULTI_QUEUE
     if (PyModule_AddIntConstant(m, "IFF_MULTI_QUEUE", IFF_MULTI_QUEUE) != 0)
     {
-        goto error;
+        return -1;
     }
 #endif
 
-    goto out;
+#ifdef TUN_F_CSUM
+    if (PyModule_AddIntConstant(m, "TUN_F_CSUM", TUN_F_CSUM) != 0)
+    {
+        return -1;
+    }
+#endif
+#ifdef TUN_F_TSO4
+    if (PyModule_AddIntConstant(m, "TUN_F_TSO4", TUN_F_TSO4) != 0)
+    {
+        return -1;
+    }
+#endif
+#ifdef TUN_F_TSO6
+    if (PyModule_AddIntConstant(m, "TUN_F_TSO6", TUN_F_TSO6) != 0)
+    {
+        return -1;
+    }
+#endif
+#ifdef TUN_F_TSO_ECN
+    if (PyModule_AddIntConstant(m, "TUN_F_TSO_ECN", TUN_F_TSO_ECN) != 0)
+    {
+        return -1;
+    }
+#endif
+#ifdef TUN_F_UFO
+    if (PyModule_AddIntConstant(m, "TUN_F_UFO", TUN_F_UFO) != 0)
+    {
+        return -1;
+    }
+#endif
+#ifdef TUN_F_USO4
+    if (PyModule_AddIntConstant(m, "TUN_F_USO4", TUN_F_USO4) != 0)
+    {
+        return -1;
+    }
+#endif
+#ifdef TUN_F_USO6
+    if (PyModule_AddIntConstant(m, "TUN_F_USO6", TUN_F_USO6) != 0)
+    {
+        return -1;
+    }
+#endif
+    if (PyModule_AddIntConstant(m, "VIRTIO_NET_HDR_F_NEEDS_CSUM", VIRTIO_NET_HDR_F_NEEDS_CSUM) != 0)
+    {
+        return -1;
+    }
+    if (PyModule_AddIntConstant(m, "VIRTIO_NET_HDR_F_DATA_VALID", VIRTIO_NET_HDR_F_DATA_VALID) != 0)
+    {
+        return -1;
+    }
+    if (PyModule_AddIntConstant(m, "VIRTIO_NET_HDR_GSO_NONE", VIRTIO_NET_HDR_GSO_NONE) != 0)
+    {
+        return -1;
+    }
+    if (PyModule_AddIntConstant(m, "VIRTIO_NET_HDR_GSO_TCPV4", VIRTIO_NET_HDR_GSO_TCPV4) != 0)
+    {
+        return -1;
+    }
+    if (PyModule_AddIntConstant(m, "VIRTIO_NET_HDR_GSO_UDP", VIRTIO_NET_HDR_GSO_UDP) != 0)
+    {
+        return -1;
+    }
+    if (PyModule_AddIntConstant(m, "VIRTIO_NET_HDR_GSO_TCPV6", VIRTIO_NET_HDR_GSO_TCPV6) != 0)
+    {
+        return -1;
+    }
+#ifdef VIRTIO_NET_HDR_GSO_UDP_L4
+    if (PyModule_AddIntConstant(m, "VIRTIO_NET_HDR_GSO_UDP_L4", VIRTIO_NET_HDR_GSO_UDP_L4) != 0)
+    {
+        return -1;
+    }
+#endif
+    if (PyModule_AddIntConstant(m, "VIRTIO_NET_HDR_GSO_ECN", VIRTIO_NET_HDR_GSO_ECN) != 0)
+    {
+        return -1;
+    }
 
-error:
+    return 0;
+}
+
+#ifdef PYTUN_MODULE_STATE
+static int pytun_traverse(PyObject* m, visitproc visit, void* arg)
+{
+    pytun_state_t* st = pytun_module_state(m);
+
+    Py_VISIT(st->error);
+    Py_VISIT(st->tuntap_type);
+    Py_VISIT(st->stats_type);
+    Py_VISIT(st->vnet_hdr_type);
+    Py_VISIT(st->packet_slot_type);
+    Py_VISIT(st->packet_ring_type);
+    Py_VISIT(st->mq_type);
+    Py_VISIT(st->relay_type);
+    Py_VISIT(st->uring_type);
+    Py_VISIT(st->poller_type);
+    Py_VISIT(st->packet_view_type);
+    Py_VISIT(st->flow_table_type);
+    Py_VISIT(st->rewriter_type);
+    Py_VISIT(st->shaper_type);
+
+    return 0;
+}
+
+static int pytun_clear(PyObject* m)
+{
+    pytun_state_t* st = pytun_module_state(m);
+
+    Py_CLEAR(st->error);
+    Py_CLEAR(st->tuntap_type);
+    Py_CLEAR(st->stats_type);
+    Py_CLEAR(st->vnet_hdr_type);
+    Py_CLEAR(st->packet_slot_type);
+    Py_CLEAR(st->packet_ring_type);
+    Py_CLEAR(st->mq_type);
+    Py_CLEAR(st->relay_type);
+    Py_CLEAR(st->uring_type);
+    Py_CLEAR(st->poller_type);
+    Py_CLEAR(st->packet_view_type);
+    Py_CLEAR(st->flow_table_type);
+    Py_CLEAR(st->rewriter_type);
+    Py_CLEAR(st->shaper_type);
+
+    return 0;
+}
+
+static void pytun_free(void* m)
+{
+    pytun_clear((PyObject*)m);
+}
+
+static PyModuleDef_Slot pytun_slots[] =
+{
+    {Py_mod_exec, (void*)pytun_exec},
+#if PY_MINOR_VERSION >= 12
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#if PY_MINOR_VERSION >= 13
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL}
+};
+#endif
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef pytun_module =
+{
+    .m_base = PyModuleDef_HEAD_INIT,
+    .m_name = "pytun",
+    .m_doc = NULL,
+    .m_methods = pytun_meth,
+#ifdef PYTUN_MODULE_STATE
+    .m_size = sizeof(pytun_state_t),
+    .m_slots = pytun_slots,
+    .m_traverse = pytun_traverse,
+    .m_clear = pytun_clear,
+    .m_free = pytun_free
+#else
+    .m_size = -1,
+#if PY_MINOR_VERSION <= 4
+    .m_reload = NULL,
+#else
+    .m_slots = NULL,
+#endif
+    .m_traverse = NULL,
+    .m_clear = NULL,
+    .m_free = NULL
+#endif
+};
+#endif
+
+#if PY_MAJOR_VERSION >= 3
+PyMODINIT_FUNC PyInit_pytun(void)
+#else
+PyMODINIT_FUNC initpytun(void)
+#endif
+{
+#ifdef PYTUN_MODULE_STATE
+    return PyModuleDef_Init(&pytun_module);
+#else
+    PyObject* m;
+
+#if PY_MAJOR_VERSION >= 3
+    m = PyModule_Create(&pytun_module);
+#else
+    m = Py_InitModule("pytun", pytun_meth);
+#endif
+    if (m != NULL && pytun_exec(m) < 0)
+    {
 #if PY_MAJOR_VERSION >= 3
-    Py_XDECREF(pytun_error);
-    Py_XDECREF(m);
-    pytun_error = NULL;
-    m = NULL;
+        Py_CLEAR(m);
 #endif
+    }
 
-out:
 #if PY_MAJOR_VERSION >= 3
     return m;
-#else
-    return;
+#endif
 #endif
 }
-
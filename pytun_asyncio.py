@@ -0,0 +1,215 @@
+"""asyncio integration for pytun.
+
+AsyncDevice wraps a TunTapDevice, switches it to non-blocking mode and
+registers it with the event loop, so that a single loop can serve many
+devices without a thread per device::
+
+    dev = AsyncDevice(TunTapDevice(flags=IFF_TUN|IFF_NO_PI))
+    async for pkt in dev:
+        await dev.write(pkt)
+"""
+
+import asyncio
+import collections
+
+__all__ = ['AsyncDevice']
+
+try:
+    _get_running_loop = asyncio.get_running_loop
+except AttributeError:
+    # Python < 3.7
+    def _get_running_loop():
+        loop = asyncio._get_running_loop()
+        if loop is None:
+            raise RuntimeError('no running event loop')
+        return loop
+
+
+class AsyncDevice(object):
+    """AsyncDevice(device, batch=64, size=65536, max_queue=1024, loop=None)
+
+    When the device becomes readable, up to batch packets of at most size
+    bytes are drained at once with read_many(). At most max_queue packets
+    are kept waiting to be consumed; when the queue is full the device is
+    no longer polled until the consumer catches up. An error of read_many()
+    is raised by the next read(), then reading resumes. Writes that would block
+    are queued and flushed when the device becomes writable, or when its
+    shaper has enough tokens, write() waits while more than max_queue
+    packets are queued.
+
+    The device is registered with loop, which defaults to the running one:
+    without loop, the AsyncDevice must be created from a coroutine or a
+    callback running in the event loop.
+    """
+
+    def __init__(self, device, batch=64, size=65536, max_queue=1024, loop=None):
+        self.device = device
+        self.batch = batch
+        self.size = size
+        self.max_queue = max_queue
+        self._loop = loop if loop is not None else _get_running_loop()
+        self._fd = device.fileno()
+        self._rqueue = collections.deque()
+        self._rwaiters = []
+        self._rexc = None
+        self._reading = False
+        self._wqueue = collections.deque()
+        self._wwaiters = []
+        self._wexc = None
+        self._writing = False
+        self._wtimer = None
+        self._closed = False
+        device.nonblocking = True
+        self._resume_reading()
+
+    def _resume_reading(self):
+        if not self._reading and not self._closed:
+            self._loop.add_reader(self._fd, self._on_readable)
+            self._reading = True
+
+    def _pause_reading(self):
+        if self._reading:
+            self._loop.remove_reader(self._fd)
+            self._reading = False
+
+    def _wake_readers(self):
+        waiters, self._rwaiters = self._rwaiters, []
+        for waiter in waiters:
+            if not waiter.done():
+                waiter.set_result(None)
+
+    def _on_readable(self):
+        try:
+            room = self.max_queue - len(self._rqueue)
+            pkts = self.device.read_many(min(self.batch, room), self.size)
+        except Exception as exc:
+            # Reading resumes once the error has been raised by read()
+            self._rexc = exc
+            self._pause_reading()
+        else:
+            self._rqueue.extend(pkts)
+            if len(self._rqueue) >= self.max_queue:
+                self._pause_reading()
+        self._wake_readers()
+
+    def _shaper_delay(self, pkt):
+        """Return the time until the shaper of the device has enough tokens
+        for pkt, 0 if it already has or if the device has no shaper. A
+        packet larger than the burst of a shaper only needs it to be full,
+        as for try_write()."""
+        delay = 0
+        shaper = getattr(self.device, 'shaper', None)
+        while shaper is not None:
+            need = min(len(pkt), shaper.burst)
+            tokens = shaper.stats()['tokens']
+            if tokens < need:
+                delay = max(delay, (need - tokens) / shaper.rate)
+            shaper = shaper.parent
+        return delay
+
+    def _wait_writable(self, pkt):
+        # A device whose shaper lacks tokens is still writable, wait for the
+        # tokens instead of polling it
+        delay = self._shaper_delay(pkt)
+        if delay > 0:
+            if self._writing:
+                self._loop.remove_writer(self._fd)
+                self._writing = False
+            if self._wtimer is None:
+                self._wtimer = self._loop.call_later(delay, self._on_wtimer)
+        elif not self._writing and self._wtimer is None:
+            self._loop.add_writer(self._fd, self._on_writable)
+            self._writing = True
+
+    def _on_wtimer(self):
+        self._wtimer = None
+        self._on_writable()
+
+    def _on_writable(self):
+        try:
+            while self._wqueue:
+                if self.device.try_write(self._wqueue[0]) is None:
+                    self._wait_writable(self._wqueue[0])
+                    break
+                self._wqueue.popleft()
+        except Exception as exc:
+            self._wexc = exc
+            self._wqueue.clear()
+        if not self._wqueue and self._writing:
+            self._loop.remove_writer(self._fd)
+            self._writing = False
+        if len(self._wqueue) <= self.max_queue:
+            waiters, self._wwaiters = self._wwaiters, []
+            for waiter in waiters:
+                if not waiter.done():
+                    waiter.set_result(None)
+
+    async def read(self):
+        """Return the next packet read from the device."""
+        while not self._rqueue:
+            if self._rexc is not None:
+                exc, self._rexc = self._rexc, None
+                self._resume_reading()
+                raise exc
+            if self._closed:
+                raise EOFError('device closed')
+            waiter = self._loop.create_future()
+            self._rwaiters.append(waiter)
+            await waiter
+        pkt = self._rqueue.popleft()
+        if len(self._rqueue) < self.max_queue:
+            self._resume_reading()
+        return pkt
+
+    def __aiter__(self):
+        return self
+
+    async def __anext__(self):
+        try:
+            return await self.read()
+        except EOFError:
+            raise StopAsyncIteration
+
+    async def write(self, pkt):
+        """Write pkt to the device, waiting if too many writes are queued."""
+        if self._wexc is not None:
+            exc, self._wexc = self._wexc, None
+            raise exc
+        if self._closed:
+            raise EOFError('device closed')
+        if not self._wqueue and self.device.try_write(pkt) is not None:
+            return
+        self._wqueue.append(pkt)
+        if len(self._wqueue) == 1:
+            self._wait_writable(pkt)
+        if len(self._wqueue) > self.max_queue:
+            await self.drain()
+
+    async def drain(self):
+        """Wait until the queue of pending writes is below max_queue."""
+        while len(self._wqueue) > self.max_queue and not self._closed:
+            waiter = self._loop.create_future()
+            self._wwaiters.append(waiter)
+            await waiter
+        if self._wexc is not None:
+            exc, self._wexc = self._wexc, None
+            raise exc
+
+    def close(self):
+        """Unregister the device from the event loop and close it."""
+        if self._closed:
+            return
+        self._closed = True
+        self._pause_reading()
+        if self._writing:
+            self._loop.remove_writer(self._fd)
+            self._writing = False
+        if self._wtimer is not None:
+            self._wtimer.cancel()
+            self._wtimer = None
+        for waiter in self._wwaiters:
+            if not waiter.done():
+                waiter.set_result(None)
+        self._wwaiters = []
+        self._wake_readers()
+        self.device.close()
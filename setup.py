@@ -1,3 +1,5 @@
+import sys
+
 from setuptools import setup, Extension
 
 setup(name='python-pytun',
@@ -10,6 +12,7 @@ setup(name='python-pytun',
       long_description=open('README.rst').read(),
       version='2.4.1',
       ext_modules=[Extension('pytun', ['pytun.c'])],
+      py_modules=['pytun_asyncio'] if sys.version_info >= (3, 5) else [],
       classifiers=[
           'Development Status :: 5 - Production/Stable',
           'Intended Audience :: Developers',
@@ -0,0 +1,1358 @@
+"""Tests of the datapath of pytun devices.
+
+Unless stated otherwise, the devices are the two ends of a socket pair
+passed as dev, which behave like a TUN device without packet information
+and need no privileges:
+
+    python -m unittest discover -s test -p 'test_device.py'
+"""
+
+import array
+import errno
+import fcntl
+import importlib
+import os
+import socket
+import struct
+import sys
+import threading
+import time
+import unittest
+
+import pytun
+
+try:
+    import asyncio
+    import pytun_asyncio
+except (ImportError, SyntaxError):
+    # Python < 3.5
+    pytun_asyncio = None
+
+try:
+    import _testcapi
+except ImportError:
+    _testcapi = None
+
+TUN = pytun.IFF_TUN | pytun.IFF_NO_PI
+
+
+def packet(i, size=0):
+    """Return a packet numbered i, padded to size bytes"""
+    pkt = ('packet %d' % i).encode('ascii')
+    return pkt + b'.' * (size - len(pkt))
+
+
+def data(slot):
+    return memoryview(slot).tobytes()
+
+
+class DeviceTestCase(unittest.TestCase):
+
+    def pair(self, nonblocking=False):
+        """Return two devices connected to each other"""
+        a, b = socket.socketpair(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+        devs = (pytun.TunTapDevice(flags=TUN, dev=a.fileno(), nonblocking=nonblocking),
+                pytun.TunTapDevice(flags=TUN, dev=b.fileno(), nonblocking=nonblocking))
+        a.close()
+        b.close()
+        for dev in devs:
+            self.addCleanup(dev.close)
+        return devs
+
+    def vnet_pair(self):
+        """Return a device with IFF_VNET_HDR and a device without it, connected
+        to each other"""
+        a, b = socket.socketpair(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+        devs = (pytun.TunTapDevice(flags=TUN | pytun.IFF_VNET_HDR, dev=a.fileno()),
+                pytun.TunTapDevice(flags=TUN, dev=b.fileno()))
+        a.close()
+        b.close()
+        for dev in devs:
+            self.addCleanup(dev.close)
+        return devs
+
+    def tun(self, flags=TUN):
+        """Return a real TUN device, the test is skipped if it can't be
+        created (e.g without CAP_NET_ADMIN)"""
+        try:
+            dev = pytun.TunTapDevice(flags=flags)
+        except pytun.Error as e:
+            self.skipTest("can't create a TUN device: %s" % e)
+        self.addCleanup(dev.close)
+        return dev
+
+    def sysfs(self, dev, attr):
+        """Return the attribute attr of dev in /sys/class/net"""
+        with open('/sys/class/net/%s/%s' % (dev.name, attr)) as f:
+            return f.read().strip()
+
+    def route(self, dev, net):
+        """Give dev the address 10.net.0.1 with the peer 10.net.0.2 and return
+        a UDP socket: the datagrams it sends to the peer are read from dev"""
+        dev.configure(addr='10.%d.0.1' % net, dstaddr='10.%d.0.2' % net, netmask='255.255.255.255', up=True)
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.addCleanup(sock.close)
+        sock.bind(('10.%d.0.1' % net, 0))
+        return sock
+
+    def wait_for(self, cond, timeout=5.0):
+        """Wait until cond() is true"""
+        end = time.time() + timeout
+        while not cond():
+            if time.time() > end:
+                self.fail('timeout')
+            time.sleep(0.01)
+
+
+def is_udp(pkt):
+    return pkt[:1] == b'\x45' and pkt[9:10] == b'\x11'
+
+
+class ReadIntoTest(DeviceTestCase):
+
+    def test_read_into(self):
+        tx, rx = self.pair()
+        tx.write(b'hello')
+        buf = bytearray(10)
+        self.assertEqual(rx.read_into(buf), 5)
+        self.assertEqual(bytes(buf), b'hello' + b'\x00' * 5)
+
+    def test_offset_and_nbytes(self):
+        tx, rx = self.pair()
+        buf = bytearray(b'-' * 10)
+        tx.write(b'abcdef')
+        # The packet is truncated to nbytes
+        self.assertEqual(rx.read_into(buf, 3, offset=4), 3)
+        self.assertEqual(bytes(buf), b'----abc---')
+        tx.write(b'xyz')
+        self.assertEqual(rx.read_into(memoryview(buf)[8:]), 2)
+        self.assertEqual(bytes(buf), b'----abc-xy')
+
+    def test_bad_arguments(self):
+        tx, rx = self.pair()
+        self.assertRaises(TypeError, rx.read_into, b'read-only')
+        buf = bytearray(10)
+        self.assertRaises(ValueError, rx.read_into, buf, 0, 11)
+        self.assertRaises(ValueError, rx.read_into, buf, 0, -1)
+        self.assertRaises(ValueError, rx.read_into, buf, -1)
+        self.assertRaises(ValueError, rx.read_into, buf, 6, 5)
+
+
+class ReadManyTest(DeviceTestCase):
+
+    def test_read_many(self):
+        tx, rx = self.pair()
+        pkts = [packet(i, 20 + i) for i in range(5)]
+        for pkt in pkts:
+            tx.write(pkt)
+        self.assertEqual(rx.read_many(2, 100), pkts[:2])
+        # Only the first read may block
+        self.assertEqual(rx.read_many(64, 100), pkts[2:])
+        tx.write(packet(5, 50))
+        self.assertEqual(rx.read_many(64, 10), [packet(5, 50)[:10]])
+
+    def test_nonblocking(self):
+        tx, rx = self.pair(nonblocking=True)
+        self.assertEqual(rx.read_many(64, 100), [])
+        self.assertEqual(rx.read_many_into(bytearray(100)), [0])
+        pkts = [packet(i) for i in range(100)]
+        for pkt in pkts:
+            tx.write(pkt)
+        self.assertEqual(rx.read_many(64, 100), pkts[:64])
+        self.assertEqual(rx.read_many(64, 100), pkts[64:])
+
+    def test_read_many_into(self):
+        tx, rx = self.pair()
+        pkts = [packet(i, 20 + i) for i in range(4)]
+        for pkt in pkts:
+            tx.write(pkt)
+        buf = bytearray(1000)
+        offsets = rx.read_many_into(buf, 3)
+        self.assertEqual(offsets, [0, 20, 41, 63])
+        self.assertEqual(bytes(buf[:63]), b''.join(pkts[:3]))
+        self.assertEqual(rx.read_many_into(buf), [0, 23])
+        self.assertEqual(bytes(buf[:23]), pkts[3])
+
+    def test_read_many_into_size(self):
+        tx, rx = self.pair()
+        for i in range(5):
+            tx.write(packet(i, 30))
+        # Packets are truncated to size and at most len(buffer) // size of
+        # them are read
+        buf = bytearray(50)
+        self.assertEqual(rx.read_many_into(buf, size=20), [0, 20, 40])
+        self.assertEqual(bytes(buf[:40]), packet(0, 30)[:20] + packet(1, 30)[:20])
+        self.assertEqual(rx.read_many_into(buf, 64, 25), [0, 25, 50])
+
+    def test_read_many_into_small_packets(self):
+        tx, rx = self.pair()
+        for i in range(20):
+            tx.write(b'x')
+        # Reading stops once the buffer is full, however many packets were
+        # asked for
+        self.assertEqual(rx.read_many_into(bytearray(4), 1000), [0, 1, 2, 3, 4])
+        offsets = rx.read_many_into(bytearray(20))
+        self.assertEqual(offsets, list(range(len(offsets))))
+        self.assertTrue(len(offsets) > 1)
+
+    def test_bad_arguments(self):
+        tx, rx = self.pair()
+        self.assertRaises(ValueError, rx.read_many, 0, 100)
+        self.assertRaises(ValueError, rx.read_many, 10, 0)
+        self.assertRaises(ValueError, rx.read_many_into, bytearray(10), -1)
+        self.assertRaises(ValueError, rx.read_many_into, bytearray(10), 0, -1)
+        self.assertRaises(TypeError, rx.read_many_into, b'read-only')
+
+
+class WriteManyTest(DeviceTestCase):
+
+    def test_write_many(self):
+        tx, rx = self.pair()
+        pkts = [packet(0), bytearray(packet(1)), memoryview(packet(2))]
+        self.assertEqual(tx.write_many(pkts), 3)
+        self.assertEqual(tx.write_many([]), 0)
+        self.assertEqual(rx.read_many(64, 100), [packet(i) for i in range(3)])
+
+    def test_write_many_offsets(self):
+        tx, rx = self.pair()
+        buf = bytearray(packet(0, 10) + packet(1, 20) + packet(2, 30))
+        self.assertEqual(tx.write_many(buf, [0, 10, 30, 60]), 3)
+        self.assertEqual(tx.write_many(buf, (10, 30)), 1)
+        self.assertEqual(tx.write_many(buf, [60]), 0)
+        self.assertEqual(rx.read_many(64, 100), [packet(0, 10), packet(1, 20), packet(2, 30), packet(1, 20)])
+
+    def test_bad_offsets(self):
+        tx, rx = self.pair()
+        buf = bytearray(100)
+        self.assertRaises(ValueError, tx.write_many, buf, [])
+        self.assertRaises(ValueError, tx.write_many, buf, [0, 50, 40])
+        self.assertRaises(ValueError, tx.write_many, buf, [0, 101])
+        self.assertRaises(ValueError, tx.write_many, buf, [-1, 10])
+        self.assertRaises(TypeError, tx.write_many, [b'ok', 1])
+
+    def test_errors(self):
+        tx, rx = self.pair()
+        # The packets written before a failed write are counted, the error is
+        # raised if the first write fails
+        huge = b'x' * (1 << 24)
+        self.assertEqual(tx.write_many([packet(0), huge, packet(1)]), 1)
+        self.assertEqual(rx.read_many(64, 100), [packet(0)])
+        rx.close()
+        self.assertRaises(pytun.Error, tx.write_many, [packet(0)])
+
+    def test_error_after_drops(self):
+        tx, rx = self.pair()
+        rx.close()
+        # The first packet is dropped by the shaper, the write of the second
+        # one fails
+        tx.shaper = pytun.Shaper(1e6, burst=1000, queue_limit=500)
+        self.assertRaises(pytun.Error, tx.write_many, [packet(0, 2000), packet(1, 500)])
+        self.assertEqual(tx.stats().shaped, 1)
+
+
+class PacketRingTest(DeviceTestCase):
+
+    def test_fill(self):
+        tx, rx = self.pair()
+        ring = pytun.PacketRing(rx, 4, 100)
+        self.assertEqual((ring.slots, ring.slot_size), (4, 100))
+        for i in range(6):
+            tx.write(packet(i))
+        self.assertEqual(ring.fill(), 4)
+        self.assertEqual(len(ring), 4)
+        # No free slot left
+        self.assertEqual(ring.fill(), 0)
+        self.assertEqual(ring.overruns, 1)
+        slots = list(ring)
+        self.assertEqual([data(slot) for slot in slots], [packet(i) for i in range(4)])
+        self.assertEqual([slot.index for slot in slots], [0, 1, 2, 3])
+        self.assertEqual(ring.get(), None)
+        for slot in slots[:2]:
+            slot.release()
+        self.assertEqual(ring.fill(), 2)
+        self.assertEqual([data(slot) for slot in ring], [packet(4), packet(5)])
+        self.assertEqual((ring.filled, ring.consumed, ring.released), (6, 6, 2))
+
+    def test_fill_max_packets(self):
+        tx, rx = self.pair()
+        ring = pytun.PacketRing(rx, 4, 5)
+        for i in range(3):
+            tx.write(packet(i))
+        self.assertEqual(ring.fill(1), 1)
+        self.assertEqual(ring.fill(), 2)
+        # Packets are truncated to the size of the slots
+        self.assertEqual([data(slot) for slot in ring], [packet(i)[:5] for i in range(3)])
+
+    def test_nonblocking(self):
+        tx, rx = self.pair(nonblocking=True)
+        ring = pytun.PacketRing(rx, 64, 100)
+        self.assertEqual(ring.fill(), 0)
+        for i in range(10):
+            tx.write(packet(i))
+        self.assertEqual(ring.fill(), 10)
+
+    def test_release(self):
+        tx, rx = self.pair()
+        ring = pytun.PacketRing(rx, 2, 100)
+        tx.write(packet(0))
+        ring.fill()
+        slot = ring.get()
+        view = memoryview(slot)
+        self.assertEqual(view.tobytes(), packet(0))
+        # The slot can't be reused while it is exported
+        self.assertRaises(BufferError, slot.release)
+        del view
+        with slot:
+            self.assertEqual(len(slot), len(packet(0)))
+        self.assertEqual(ring.released, 1)
+        self.assertRaises(pytun.Error, slot.release)
+        self.assertRaises(BufferError, memoryview, slot)
+
+
+class VnetTest(DeviceTestCase):
+
+    def test_write_vnet(self):
+        vnet, raw = self.vnet_pair()
+        vnet.write_vnet((pytun.VIRTIO_NET_HDR_F_NEEDS_CSUM, pytun.VIRTIO_NET_HDR_GSO_TCPV4, 54, 1000, 34, 16),
+                        b'packet')
+        self.assertEqual(raw.read(100), struct.pack('=BBHHHH', 1, pytun.VIRTIO_NET_HDR_GSO_TCPV4, 54, 1000, 34, 16) +
+                         b'packet')
+        vnet.write_vnet(None, b'packet')
+        self.assertEqual(raw.read(100), b'\x00' * 10 + b'packet')
+
+    def test_read_vnet(self):
+        vnet, raw = self.vnet_pair()
+        raw.write(struct.pack('=BBHHHH', 1, pytun.VIRTIO_NET_HDR_GSO_TCPV6, 74, 1220, 54, 16) + b'packet')
+        hdr, pkt = vnet.read_vnet()
+        self.assertEqual(pkt, b'packet')
+        self.assertEqual(hdr, (1, pytun.VIRTIO_NET_HDR_GSO_TCPV6, 74, 1220, 54, 16))
+        self.assertEqual((hdr.gso_type, hdr.hdr_len, hdr.gso_size), (pytun.VIRTIO_NET_HDR_GSO_TCPV6, 74, 1220))
+        # Headers read are written back as is
+        vnet.write_vnet(hdr, pkt)
+        self.assertEqual(raw.read(100), struct.pack('=BBHHHH', *hdr) + b'packet')
+        raw.write(b'short')
+        self.assertRaises(pytun.Error, vnet.read_vnet)
+
+    def test_bad_arguments(self):
+        vnet, raw = self.vnet_pair()
+        self.assertRaises(TypeError, vnet.write_vnet, (1, 2, 3), b'packet')
+        self.assertRaises(TypeError, vnet.write_vnet, (0, 0, 0, 0, 0, 'x'), b'packet')
+        # The device must have been created with IFF_VNET_HDR
+        self.assertRaises(pytun.Error, raw.read_vnet)
+        self.assertRaises(pytun.Error, raw.write_vnet, None, b'packet')
+
+    def test_offload(self):
+        tun = self.tun(TUN | pytun.IFF_VNET_HDR)
+        tun.set_offload(pytun.TUN_F_CSUM | pytun.TUN_F_TSO4 | pytun.TUN_F_TSO6)
+        self.assertEqual(tun.vnet_hdr_sz, 10)
+        tun.vnet_hdr_sz = 12
+        self.assertEqual(tun.vnet_hdr_sz, 12)
+        self.assertRaises(pytun.Error, setattr, tun, 'vnet_hdr_sz', 9)
+        self.assertRaises(pytun.Error, setattr, tun, 'vnet_hdr_sz', 65)
+        self.assertRaises(TypeError, delattr, tun, 'vnet_hdr_sz')
+        self.assertEqual(tun.vnet_hdr_sz, 12)
+
+
+class MultiQueueDeviceTest(DeviceTestCase):
+
+    def mq(self, queues=2):
+        try:
+            mq = pytun.MultiQueueDevice(queues=queues, flags=TUN)
+        except pytun.Error as e:
+            self.skipTest("can't create a multi-queue device: %s" % e)
+        self.addCleanup(mq.close)
+        return mq
+
+    def test_queues(self):
+        mq = self.mq(3)
+        self.assertEqual(len(mq.queues), 3)
+        self.assertEqual(len(set(q.name for q in mq.queues)), 1)
+        self.assertEqual(len(set(q.fileno() for q in mq.queues)), 3)
+
+    def test_start(self):
+        mq = self.mq()
+        sock = self.route(mq.queues[0], 78)
+        got = []
+
+        def callback(index, pkts):
+            got.extend((index, pkt[28:]) for pkt in pkts if is_udp(pkt))
+
+        mq.start(callback, batch=8, size=2048)
+        self.assertRaises(pytun.Error, mq.start, callback)
+        for i in range(20):
+            sock.sendto(packet(i), ('10.78.0.2', 5000 + i))
+        self.wait_for(lambda: len(got) >= 20)
+        mq.stop()
+        self.assertEqual(sorted(pkt for index, pkt in got), sorted(packet(i) for i in range(20)))
+        self.assertTrue(set(index for index, pkt in got) <= set([0, 1]))
+        stats = mq.stats()
+        self.assertEqual(len(stats), 2)
+        self.assertTrue(sum(st['packets'] for st in stats) >= 20)
+        self.assertFalse(any(st['running'] for st in stats))
+
+    def test_stop_from_callback(self):
+        mq = self.mq()
+        sock = self.route(mq.queues[0], 79)
+        errors = []
+
+        def callback(index, pkts):
+            # Other packets may be sent by the kernel once the device is up
+            if not any(is_udp(pkt) for pkt in pkts):
+                return
+            try:
+                mq.start(callback)
+            except pytun.Error as e:
+                errors.append(e)
+            mq.stop()
+
+        mq.start(callback)
+        sock.sendto(b'stop', ('10.79.0.2', 5000))
+        self.wait_for(lambda: not any(st['running'] for st in mq.stats()))
+        self.assertEqual(len(errors), 1)
+        # The readers can be started again
+        got = []
+        mq.start(lambda index, pkts: got.extend(pkt[28:] for pkt in pkts if is_udp(pkt)))
+        sock.sendto(b'again', ('10.79.0.2', 5000))
+        self.wait_for(lambda: got)
+        mq.stop()
+        self.assertEqual(got, [b'again'])
+
+
+class RelayTest(DeviceTestCase):
+
+    def udp(self, family=socket.AF_INET, host='127.0.0.1'):
+        sock = socket.socket(family, socket.SOCK_DGRAM)
+        self.addCleanup(sock.close)
+        sock.bind((host, 0))
+        sock.settimeout(5)
+        return sock
+
+    def relay(self, *args, **kwargs):
+        relay = pytun.Relay(*args, **kwargs)
+        self.addCleanup(relay.stop)
+        return relay
+
+    def test_relay(self):
+        dev, other = self.pair()
+        sock = self.udp()
+        peer = self.udp()
+        events = []
+        relay = self.relay(dev, sock, peer.getsockname(), batch=4)
+        relay.start(lambda event, err: events.append((event, err)))
+        self.assertRaises(pytun.Error, relay.start)
+        # Device to socket
+        for i in range(10):
+            other.write(packet(i))
+        got = [peer.recvfrom(100) for i in range(10)]
+        self.assertEqual([pkt for pkt, addr in got], [packet(i) for i in range(10)])
+        self.assertEqual(set(addr for pkt, addr in got), set([sock.getsockname()]))
+        # Socket to device, only from the peer
+        foreign = self.udp()
+        foreign.sendto(b'foreign', sock.getsockname())
+        peer.sendto(b'from peer', sock.getsockname())
+        self.assertEqual(other.read(100), b'from peer')
+        relay.stop()
+        self.assertEqual(events, [('stopped', 0)])
+        stats = relay.stats()
+        self.assertEqual((stats['dev_rx_packets'], stats['sock_tx_packets']), (10, 10))
+        self.assertEqual((stats['sock_rx_packets'], stats['dev_tx_packets'], stats['foreign_drops']), (2, 1, 1))
+        self.assertFalse(stats['running'])
+        # It can be started again
+        relay.start()
+        other.write(packet(10))
+        self.assertEqual(peer.recv(100), packet(10))
+
+    def test_socket_closed(self):
+        dev, other = self.pair()
+        sock = self.udp()
+        addr = sock.getsockname()
+        peer = self.udp()
+        relay = self.relay(dev, sock, peer.getsockname())
+        relay.start()
+        # The relay keeps using the socket, not whatever descriptor reuses
+        # its number
+        sock.close()
+        self.udp()
+        other.write(packet(0))
+        self.assertEqual(peer.recvfrom(100), (packet(0), addr))
+        relay.stop()
+        self.assertEqual(relay.stats()['errno'], 0)
+        self.assertRaises((ValueError, socket.error), relay.start)
+
+    def test_stop_from_on_event(self):
+        dev, other = self.pair()
+        sock = self.udp()
+        events = []
+
+        def on_event(event, err):
+            events.append((event, err))
+            relay.stop()
+
+        relay = self.relay(dev, sock, ('127.0.0.1', 9))
+        relay.start(on_event)
+        # The relay fails once the device is closed by the other end
+        other.close()
+        self.wait_for(lambda: not relay.stats()['running'])
+        self.assertEqual(len(events), 1)
+        relay.start()
+
+    def test_ipv4_mapped_peer(self):
+        dev, other = self.pair()
+        try:
+            sock = self.udp(socket.AF_INET6, '::')
+        except socket.error as e:
+            self.skipTest('no IPv6: %s' % e)
+        peer = self.udp()
+        relay = self.relay(dev, sock, peer.getsockname())
+        relay.start()
+        # The datagrams of the IPv4 peer come from ::ffff:127.0.0.1
+        peer.sendto(b'mapped', ('127.0.0.1', sock.getsockname()[1]))
+        self.assertEqual(other.read(100), b'mapped')
+
+    def test_bad_arguments(self):
+        dev, other = self.pair()
+        sock = self.udp()
+        self.assertRaises(pytun.Error, pytun.Relay, dev, sock, ('not a host', 1))
+        self.assertRaises(ValueError, pytun.Relay, dev, sock, ('127.0.0.1', 1), 0)
+        self.assertRaises(TypeError, pytun.Relay, sock, sock, ('127.0.0.1', 1))
+
+
+@unittest.skipUnless(hasattr(pytun, 'Uring'), 'built without io_uring')
+class UringTest(DeviceTestCase):
+
+    def read(self, uring, count):
+        pkts = []
+        while len(pkts) < count:
+            pkts.extend(uring.read_many())
+        return pkts
+
+    def test_read_many(self):
+        tx, rx = self.pair()
+        uring = pytun.Uring(rx, 4, 100)
+        self.assertTrue(uring.backend in ('io_uring', 'syscall'))
+        for i in range(10):
+            tx.write(packet(i))
+        self.assertEqual(len(uring.read_many(1)), 1)
+        pkts = self.read(uring, 9)
+        self.assertEqual(pkts, [packet(i) for i in range(1, 10)])
+        # Packets are truncated to size
+        tx.write(packet(10, 150))
+        self.assertEqual(uring.read_many(), [packet(10, 150)[:100]])
+        self.assertEqual(uring.stats()['reads'], 11)
+
+    def test_write_many(self):
+        tx, rx = self.pair()
+        uring = pytun.Uring(tx, 4, 100)
+        pkts = [packet(i) for i in range(10)] + [bytearray(packet(10)), memoryview(packet(11))]
+        self.assertEqual(uring.write_many(pkts), 12)
+        self.assertEqual(rx.read_many(64, 100), [packet(i) for i in range(12)])
+        self.assertEqual(uring.write_many([]), 0)
+        self.assertEqual(uring.stats()['writes'], 12)
+        if uring.backend == 'io_uring':
+            self.assertRaises(ValueError, uring.write_many, [packet(0, 101)])
+
+    def test_closed(self):
+        tx, rx = self.pair()
+        uring = pytun.Uring(rx, 4, 100)
+        tx.write(packet(0))
+        self.assertEqual(uring.read_many(), [packet(0)])
+        rx.close()
+        self.assertRaises(pytun.Error, uring.read_many)
+        self.assertRaises(pytun.Error, uring.write_many, [packet(0)])
+        self.assertRaises(pytun.Error, pytun.Uring, rx)
+
+
+class NonBlockingTest(DeviceTestCase):
+
+    def test_try_read(self):
+        tx, rx = self.pair(nonblocking=True)
+        self.assertTrue(rx.nonblocking)
+        self.assertEqual(rx.try_read(100), None)
+        self.assertRaises(pytun.Error, rx.read, 100)
+        tx.write(packet(0))
+        self.assertEqual(rx.try_read(100), packet(0))
+
+    def test_try_write(self):
+        tx, rx = self.pair(nonblocking=True)
+        written = 0
+        while tx.try_write(packet(written, 100)) is not None:
+            written += 1
+        self.assertTrue(written > 0)
+        self.assertRaises(pytun.Error, tx.write, packet(0))
+        self.assertEqual(rx.read(100), packet(0, 100))
+        self.assertEqual(tx.try_write(b'abc'), 3)
+
+    def test_attribute(self):
+        tx, rx = self.pair()
+        self.assertFalse(rx.nonblocking)
+        rx.nonblocking = True
+        self.assertTrue(rx.nonblocking)
+        self.assertEqual(rx.read_many(64, 100), [])
+        rx.nonblocking = False
+        self.assertFalse(rx.nonblocking)
+        self.assertRaises(TypeError, delattr, rx, 'nonblocking')
+
+
+class PollerTest(DeviceTestCase):
+
+    def test_poll(self):
+        poller = pytun.Poller(budget=2, size=100)
+        tx1, rx1 = self.pair()
+        tx2, rx2 = self.pair()
+        poller.register(rx1)
+        poller.register(rx2, budget=8)
+        self.assertEqual(len(poller), 2)
+        self.assertEqual(poller.poll(0), [])
+        for i in range(3):
+            tx1.write(packet(i))
+            tx2.write(packet(i))
+        ready = dict(poller.poll(1))
+        self.assertEqual(ready[rx1], [packet(0), packet(1)])
+        self.assertEqual(ready[rx2], [packet(0), packet(1), packet(2)])
+        # rx1 has a packet pending over its budget
+        self.assertEqual(poller.poll(1), [(rx1, [packet(2)])])
+        self.assertEqual(poller.poll(0), [])
+
+    def test_modify(self):
+        poller = pytun.Poller(budget=1, size=100)
+        tx, rx = self.pair()
+        poller.register(rx)
+        poller.modify(rx, budget=4)
+        for i in range(4):
+            tx.write(packet(i))
+        self.assertEqual(poller.poll(1), [(rx, [packet(i) for i in range(4)])])
+
+    def test_unregister(self):
+        poller = pytun.Poller()
+        tx, rx = self.pair()
+        poller.register(rx)
+        poller.unregister(rx)
+        self.assertEqual(len(poller), 0)
+        self.assertRaises(KeyError, poller.unregister, rx)
+        tx.write(packet(0))
+        self.assertEqual(poller.poll(0), [])
+
+    def test_closed_device(self):
+        poller = pytun.Poller()
+        tx, rx = self.pair()
+        poller.register(rx)
+        rx.close()
+        tx.write(packet(0))
+        self.assertEqual(poller.poll(0), [])
+        poller.unregister(rx)
+
+    def test_timeout(self):
+        poller = pytun.Poller()
+        tx, rx = self.pair()
+        poller.register(rx)
+        start = time.time()
+        self.assertEqual(poller.poll(0.05), [])
+        self.assertGreaterEqual(time.time() - start, 0.04)
+        # A sub-millisecond timeout is rounded up, not turned into 0
+        start = time.time()
+        self.assertEqual(poller.poll(0.0001), [])
+        self.assertGreater(time.time() - start, 0.0005)
+        tx.write(packet(0))
+        self.assertEqual(poller.poll(1e10), [(rx, [packet(0)])])
+        tx.write(packet(1))
+        self.assertEqual(poller.poll(float('inf')), [(rx, [packet(1)])])
+        self.assertRaises(ValueError, poller.poll, float('nan'))
+
+    def test_bad_arguments(self):
+        self.assertRaises(ValueError, pytun.Poller, budget=0)
+        self.assertRaises(TypeError, pytun.Poller().register, object())
+
+
+class ConfigureTest(DeviceTestCase):
+    """Tests of a real device"""
+
+    def test_attributes(self):
+        tun = self.tun()
+        tun.addr = '10.80.0.1'
+        tun.dstaddr = '10.80.0.2'
+        tun.netmask = '255.255.255.255'
+        tun.mtu = 1400
+        self.assertEqual((tun.addr, tun.dstaddr, tun.netmask, tun.mtu),
+                         ('10.80.0.1', '10.80.0.2', '255.255.255.255', 1400))
+        self.assertEqual(self.sysfs(tun, 'mtu'), '1400')
+
+    def test_configure(self):
+        tun = self.tun()
+        tun.configure(addr='10.81.0.1', dstaddr='10.81.0.2', netmask='255.255.255.255',
+                      mtu=1300, up=True)
+        self.assertEqual((tun.addr, tun.dstaddr, tun.mtu), ('10.81.0.1', '10.81.0.2', 1300))
+        self.assertTrue(int(self.sysfs(tun, 'flags'), 16) & 1)
+        # Parameters left to None are not changed
+        tun.configure(up=False)
+        self.assertFalse(int(self.sysfs(tun, 'flags'), 16) & 1)
+        self.assertEqual(tun.mtu, 1300)
+        self.assertRaises(TypeError, tun.configure, mtu='1500')
+
+    def test_hwaddr(self):
+        tap = self.tun(pytun.IFF_TAP | pytun.IFF_NO_PI)
+        tap.configure(hwaddr=b'\x02\x11\x22\x33\x44\x55')
+        self.assertEqual(tap.hwaddr, b'\x02\x11\x22\x33\x44\x55')
+        self.assertEqual(self.sysfs(tap, 'address'), '02:11:22:33:44:55')
+
+    def test_mtu_changed_elsewhere(self):
+        tun = self.tun()
+        tun.mtu = 1400
+        with open('/sys/class/net/%s/mtu' % tun.name, 'w') as f:
+            f.write('1280')
+        self.assertEqual(tun.mtu, 1280)
+
+    def test_fork(self):
+        tun = self.tun()
+        tun.mtu
+        pid = os.fork()
+        if pid == 0:
+            # The control socket of the parent isn't shared with the child
+            try:
+                tun.mtu = 1350
+                os._exit(0 if tun.mtu == 1350 else 1)
+            except BaseException:
+                os._exit(2)
+        self.assertEqual(os.waitpid(pid, 0)[1], 0)
+        self.assertEqual(tun.mtu, 1350)
+
+
+class ConfigureManyTest(DeviceTestCase):
+    """Tests of real devices"""
+
+    def test_addr(self):
+        tun = self.tun()
+        tun.add_addr('10.82.0.1/24')
+        tun.add_addr('10.82.1.1/24')
+        tun.add_addr('fd00:82::1/64')
+        for addr in ('10.82.0.1', '10.82.1.1'):
+            sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+            self.addCleanup(sock.close)
+            sock.bind((addr, 0))
+        tun.del_addr('10.82.1.1/24')
+        tun.del_addr('fd00:82::1/64')
+        self.assertRaises(pytun.Error, tun.del_addr, '10.82.1.1/24')
+        self.assertRaises(pytun.Error, tun.add_addr, 'not an address')
+
+
+    def test_configure_many(self):
+        tun1 = self.tun()
+        tun2 = self.tun()
+        pytun.configure_many([
+            (tun1, {'addrs': ['10.83.0.1/32', 'fd00:83::1/64'], 'dstaddr': '10.83.0.2',
+                    'mtu': 1400, 'up': True}),
+            (tun2, {'addrs': '10.84.0.1/24', 'mtu': 1300}),
+        ])
+        self.assertEqual((tun1.addr, tun1.dstaddr, tun1.mtu), ('10.83.0.1', '10.83.0.2', 1400))
+        self.assertTrue(int(self.sysfs(tun1, 'flags'), 16) & 1)
+        self.assertEqual((tun2.addr, tun2.mtu), ('10.84.0.1', 1300))
+        self.assertFalse(int(self.sysfs(tun2, 'flags'), 16) & 1)
+        with self.assertRaises(pytun.Error) as cm:
+            pytun.configure_many([(tun2, {'mtu': 10})])
+        self.assertIn(tun2.name, str(cm.exception))
+
+    def test_create_many(self):
+        pattern = 'pyt%d_%%d' % (os.getpid() % 100000)
+        try:
+            devs = pytun.create_many(pattern, 3, TUN,
+                                     lambda i: {'addrs': '10.85.%d.1/24' % i, 'mtu': 1280 + i})
+        except pytun.Error as e:
+            self.skipTest("can't create a TUN device: %s" % e)
+        for dev in devs:
+            self.addCleanup(dev.close)
+        self.assertEqual([dev.name for dev in devs], [pattern % i for i in range(3)])
+        self.assertEqual([dev.mtu for dev in devs], [1280, 1281, 1282])
+        self.assertEqual([dev.addr for dev in devs], ['10.85.%d.1' % i for i in range(3)])
+        for dev in devs:
+            dev.close()
+        devs = pytun.create_many(pattern, 2, TUN, {'mtu': 1300, 'up': True})
+        for dev in devs:
+            self.addCleanup(dev.close)
+        self.assertEqual([dev.mtu for dev in devs], [1300, 1300])
+        self.assertEqual(pytun.create_many(pattern, 0), [])
+        self.assertRaises(ValueError, pytun.create_many, pattern, -1)
+
+
+class StatsTest(DeviceTestCase):
+
+    def test_counters(self):
+        tx, rx = self.pair()
+        for i in range(3):
+            tx.write(packet(i, 20))
+        tx.write_many([packet(i, 20) for i in range(3, 5)])
+        rx.read(100)
+        rx.read(5)
+        self.assertEqual(len(rx.read_many(64, 100)), 3)
+        st = tx.stats()
+        # write_many() makes a write per packet
+        self.assertEqual((st.writes, st.tx_packets, st.tx_bytes), (5, 5, 100))
+        st = rx.stats()
+        self.assertEqual((st.rx_packets, st.rx_bytes), (5, 85))
+        self.assertEqual(st.truncated_reads, 1)
+        self.assertEqual((st.read_errors, st.write_errors, st.short_writes), (0, 0, 0))
+        self.assertGreater(st.nogil_ns, 0)
+
+    def test_eagain(self):
+        tx, rx = self.pair(nonblocking=True)
+        self.assertEqual(rx.read_many(64, 100), [])
+        self.assertRaises(pytun.Error, rx.read, 100)
+        self.assertEqual(rx.stats().eagain, 2)
+
+    def test_errors(self):
+        tx, rx = self.pair()
+        rx.close()
+        self.assertRaises(pytun.Error, tx.write, packet(0))
+        self.assertEqual(tx.stats().write_errors, 1)
+        self.assertEqual(tx.stats().tx_packets, 0)
+
+    def test_reset(self):
+        tx, rx = self.pair()
+        tx.write(packet(0))
+        rx.read(100)
+        rx.reset_stats()
+        self.assertEqual(tuple(rx.stats()), (0,) * len(rx.stats()))
+        self.assertEqual(tx.stats().tx_packets, 1)
+
+    def test_kernel_stats(self):
+        tun = self.tun()
+        sock = self.route(tun, 86)
+        sock.sendto(b'x' * 10, ('10.86.0.2', 9))
+        self.wait_for(lambda: is_udp(tun.read(2048)))
+        st = tun.kernel_stats()
+        self.assertGreaterEqual(st['rx_packets'], 1)
+        self.assertGreaterEqual(st['kernel_tx_packets'], 1)
+        self.assertIn('kernel_tx_dropped', st)
+
+
+class DevFdTest(DeviceTestCase):
+
+    def test_dup(self):
+        a, b = socket.socketpair(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+        self.addCleanup(b.close)
+        dev = pytun.TunTapDevice(flags=TUN, dev=a.fileno())
+        self.addCleanup(dev.close)
+        self.assertNotEqual(dev.fileno(), a.fileno())
+        # The device keeps its own descriptor
+        a.close()
+        b.send(packet(0))
+        self.assertEqual(dev.read(100), packet(0))
+        dev.close()
+        self.assertRaises(socket.error, b.send, packet(1))
+
+    def test_nonblocking_shared(self):
+        a, b = socket.socketpair(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+        self.addCleanup(a.close)
+        self.addCleanup(b.close)
+        dev = pytun.TunTapDevice(flags=TUN, dev=a.fileno(), nonblocking=True)
+        self.addCleanup(dev.close)
+        self.assertTrue(fcntl.fcntl(a.fileno(), fcntl.F_GETFL) & os.O_NONBLOCK)
+        dev.nonblocking = False
+        self.assertFalse(fcntl.fcntl(a.fileno(), fcntl.F_GETFL) & os.O_NONBLOCK)
+
+    def test_bad_fd(self):
+        r, w = os.pipe()
+        os.close(r)
+        os.close(w)
+        self.assertRaises(pytun.Error, pytun.TunTapDevice, flags=TUN, dev=r)
+
+
+def pcapng_packets(path):
+    """Return the (direction, data, len) of the enhanced packet blocks of the
+    pcapng file path"""
+    with open(path, 'rb') as f:
+        buf = f.read()
+    pkts = []
+    off = 0
+    while off < len(buf):
+        btype, blen = struct.unpack_from('<II', buf, off)
+        if btype == 6:
+            caplen, pktlen = struct.unpack_from('<II', buf, off + 20)
+            opt = off + 28 + (caplen + 3) // 4 * 4
+            code, optlen, flags = struct.unpack_from('<HHI', buf, opt)
+            pkts.append((flags if code == 2 else 0, buf[off + 28:off + 28 + caplen], pktlen))
+        off += blen
+    return pkts
+
+
+class CaptureTest(DeviceTestCase):
+
+    def setUp(self):
+        self.path = '/tmp/pytun-test-%d.pcapng' % os.getpid()
+        self.addCleanup(lambda: os.path.exists(self.path) and os.unlink(self.path))
+
+    def test_capture(self):
+        tx, rx = self.pair()
+        rx.start_capture(self.path, snaplen=16)
+        self.assertRaises(pytun.Error, rx.start_capture, self.path)
+        tx.write(packet(0, 20))
+        tx.write(packet(1))
+        rx.read(100)
+        rx.read_many(64, 100)
+        rx.write(packet(2))
+        self.assertEqual(rx.capture_stats()['packets'], 3)
+        self.assertTrue(rx.capture_stats()['active'])
+        rx.stop_capture()
+        self.assertFalse(rx.capture_stats()['active'])
+        # Packets read from the device are outbound (2)
+        self.assertEqual(pcapng_packets(self.path),
+                         [(2, packet(0, 20)[:16], 20), (2, packet(1), len(packet(1))),
+                          (1, packet(2), len(packet(2)))])
+        with open(self.path, 'rb') as f:
+            self.assertEqual(f.read(4), b'\x0a\x0d\x0d\x0a')
+        # Stopping twice is harmless
+        rx.stop_capture()
+
+    def test_ring(self):
+        tx, rx = self.pair()
+        rx.start_capture(self.path, ring_bytes=4096)
+        for i in range(100):
+            tx.write(packet(i, 100))
+            rx.read(200)
+        rx.stop_capture()
+        st = rx.capture_stats()
+        self.assertEqual(st['packets'], 100)
+        self.assertGreater(st['overwritten'], 0)
+        pkts = pcapng_packets(self.path)
+        # The newest packets are kept, in order
+        self.assertEqual([data for flags, data, n in pkts],
+                         [packet(i, 100) for i in range(100 - len(pkts), 100)])
+        self.assertLessEqual(os.path.getsize(self.path), 4096)
+
+    def test_restart(self):
+        tx, rx = self.pair()
+        rx.start_capture(self.path)
+        rx.stop_capture()
+        rx.start_capture(self.path)
+        tx.write(packet(0))
+        rx.read(100)
+        rx.close()
+        # Closing the device stops the capture
+        self.assertEqual(pcapng_packets(self.path), [(2, packet(0), len(packet(0)))])
+
+    def test_bad_arguments(self):
+        tx, rx = self.pair()
+        self.assertRaises(ValueError, rx.start_capture, self.path, snaplen=0)
+        self.assertRaises(ValueError, rx.start_capture, self.path, ring_bytes=64)
+        self.assertRaises(pytun.Error, rx.start_capture, '/nonexistent/x.pcapng')
+        # A failed start doesn't prevent the next one
+        rx.start_capture(self.path)
+        rx.stop_capture()
+
+    def test_concurrent_start(self):
+        tx, rx = self.pair()
+        paths = ['%s.%d' % (self.path, i) for i in range(8)]
+        for path in paths:
+            self.addCleanup(lambda path=path: os.path.exists(path) and os.unlink(path))
+        started = []
+
+        def start(path):
+            try:
+                rx.start_capture(path, ring_bytes=1 << 20)
+                started.append(path)
+            except pytun.Error:
+                pass
+        for attempt in range(20):
+            threads = [threading.Thread(target=start, args=(path,)) for path in paths]
+            for t in threads:
+                t.start()
+            for t in threads:
+                t.join()
+            # Only one of the calls claims the capture
+            self.assertEqual(len(started), 1)
+            rx.stop_capture()
+            del started[:]
+
+
+def ip_packet(i):
+    """Return an IPv4 UDP packet numbered i"""
+    payload = packet(i)
+    return struct.pack('!BBHHHBBH4s4s', 0x45, 0, 20 + len(payload), i, 0, 64, 17, 0,
+                       socket.inet_aton('10.0.0.1'), socket.inet_aton('10.0.0.2')) + payload
+
+
+def write_pcap(path, pkts, linktype=101):
+    """Write the (timestamp, data) pairs pkts to the pcap file path"""
+    with open(path, 'wb') as f:
+        f.write(struct.pack('<IHHiIII', 0xa1b2c3d4, 2, 4, 0, 0, 65535, linktype))
+        for ts, pkt in pkts:
+            f.write(struct.pack('<IIII', int(ts), int(round(ts % 1 * 1e6)), len(pkt), len(pkt)) + pkt)
+
+
+class ReplayTest(DeviceTestCase):
+
+    def setUp(self):
+        self.path = '/tmp/pytun-test-%d.pcap' % os.getpid()
+        self.addCleanup(lambda: os.path.exists(self.path) and os.unlink(self.path))
+
+    def test_replay(self):
+        tx, rx = self.pair()
+        pkts = [ip_packet(i) for i in range(10)]
+        write_pcap(self.path, [(100 + i, pkt) for i, pkt in enumerate(pkts)])
+        res = pytun.replay(tx, self.path, speed=0)
+        self.assertEqual((res['packets'], res['bytes']), (10, sum(len(pkt) for pkt in pkts)))
+        self.assertEqual((res['skipped'], res['errors'], res['shaped']), (0, 0, 0))
+        self.assertEqual(res['recorded_seconds'], 9.0)
+        self.assertNotIn('timing_error_ns', res)
+        self.assertEqual(rx.read_many(64, 2048), pkts)
+        self.assertEqual(tx.stats().tx_packets, 10)
+
+    def test_timing(self):
+        tx, rx = self.pair()
+        write_pcap(self.path, [(0, ip_packet(0)), (0.05, ip_packet(1)), (0.1, ip_packet(2))])
+        res = pytun.replay(tx, self.path)
+        self.assertGreaterEqual(res['seconds'], 0.09)
+        self.assertEqual(sorted(res['timing_error_ns']), ['max', 'mean', 'p50', 'p99'])
+        self.assertEqual(rx.read_many(64, 2048), [ip_packet(i) for i in range(3)])
+        res = pytun.replay(tx, self.path, speed=2.0)
+        self.assertGreaterEqual(res['seconds'], 0.045)
+        self.assertLess(res['seconds'], 0.09)
+
+    def test_ethernet(self):
+        tx, rx = self.pair()
+        eth = b'\x02' * 12
+        write_pcap(self.path, [(0, eth + b'\x08\x00' + ip_packet(0)),
+                               (0, eth + b'\x08\x06' + b'\x00' * 28),
+                               (0, eth + b'\x08\x00' + ip_packet(1))], linktype=1)
+        res = pytun.replay(tx, self.path, speed=0)
+        # The link layer header is removed, the ARP packet is skipped
+        self.assertEqual((res['packets'], res['skipped']), (2, 1))
+        self.assertEqual(rx.read_many(64, 2048), [ip_packet(0), ip_packet(1)])
+
+    def test_pcapng(self):
+        tx, rx = self.pair()
+        path = self.path + 'ng'
+        self.addCleanup(lambda: os.path.exists(path) and os.unlink(path))
+        rx.start_capture(path)
+        for i in range(3):
+            tx.write(ip_packet(i))
+            rx.read(2048)
+        rx.stop_capture()
+        res = pytun.replay(tx, path, speed=0)
+        self.assertEqual(res['packets'], 3)
+        self.assertEqual(rx.read_many(64, 2048), [ip_packet(i) for i in range(3)])
+
+    def test_bad_file(self):
+        tx, rx = self.pair()
+        self.assertRaises(pytun.Error, pytun.replay, tx, '/nonexistent.pcap')
+        with open(self.path, 'wb') as f:
+            f.write(b'not a capture file')
+        self.assertRaises(pytun.Error, pytun.replay, tx, self.path)
+        write_pcap(self.path, [])
+        self.assertRaises(ValueError, pytun.replay, tx, self.path, speed=-1.0)
+        self.assertRaises(ValueError, pytun.replay, tx, self.path, batch=0)
+
+
+class ShaperTest(DeviceTestCase):
+
+    def test_rate(self):
+        tx, rx = self.pair()
+        tx.shaper = pytun.Shaper(1e5, burst=1000, queue_limit=10000)
+        start = time.time()
+        for i in range(10):
+            tx.write(packet(i, 500))
+        # 4000 bytes over the burst at 100kB/s
+        self.assertGreaterEqual(time.time() - start, 0.035)
+        st = tx.shaper.stats()
+        self.assertEqual((st['packets'], st['bytes'], st['dropped']), (10, 5000, 0))
+        self.assertGreater(st['delayed'], 0)
+        self.assertEqual(len(rx.read_many(64, 1000)), 10)
+
+    def test_drop(self):
+        tx, rx = self.pair()
+        tx.shaper = pytun.Shaper(1000, burst=100, queue_limit=0)
+        tx.write(packet(0, 100))
+        with self.assertRaises(pytun.Error) as cm:
+            tx.write(packet(1, 100))
+        self.assertEqual(cm.exception.args[0], errno.ENOBUFS)
+        self.assertEqual(tx.stats().shaped, 1)
+        self.assertEqual((tx.shaper.stats()['dropped'], tx.shaper.stats()['dropped_bytes']), (1, 100))
+        self.assertEqual(rx.read(1000), packet(0, 100))
+
+    def test_try_write(self):
+        tx, rx = self.pair()
+        tx.shaper = pytun.Shaper(1000, burst=200)
+        self.assertEqual(tx.try_write(packet(0, 150)), 150)
+        self.assertIsNone(tx.try_write(packet(1, 150)))
+        self.assertEqual(tx.shaper.stats()['packets'], 1)
+        self.wait_for(lambda: tx.try_write(packet(1, 150)) is not None)
+        self.assertEqual(rx.read_many(64, 1000), [packet(0, 150), packet(1, 150)])
+
+    def test_try_write_over_burst(self):
+        tx, rx = self.pair()
+        tx.shaper = pytun.Shaper(1e5, burst=1000)
+        # A packet larger than the burst only needs a full bucket
+        self.assertEqual(tx.try_write(packet(0, 2000)), 2000)
+        self.assertIsNone(tx.try_write(packet(1, 2000)))
+        self.assertLess(tx.shaper.stats()['tokens'], 0)
+        self.wait_for(lambda: tx.try_write(packet(1, 2000)) is not None)
+        self.assertEqual(len(rx.read_many(64, 4000)), 2)
+
+    def test_parent(self):
+        tx, rx = self.pair()
+        link = pytun.Shaper(1000, burst=100, queue_limit=0)
+        tx.shaper = pytun.Shaper(1e6, parent=link)
+        self.assertIs(tx.shaper.parent, link)
+        tx.write(packet(0, 100))
+        self.assertRaises(pytun.Error, tx.write, packet(1, 100))
+        self.assertEqual(link.stats()['dropped'], 1)
+        tx.shaper = None
+        tx.write(packet(1, 100))
+        self.assertEqual(len(rx.read_many(64, 1000)), 2)
+
+    def test_attributes(self):
+        shaper = pytun.Shaper(1e6)
+        self.assertEqual((shaper.rate, shaper.burst, shaper.queue_limit), (1e6, 65536, 65536))
+        shaper.rate = 2e6
+        shaper.burst = 1000
+        shaper.queue_limit = 0
+        self.assertEqual((shaper.rate, shaper.burst, shaper.queue_limit), (2e6, 1000, 0))
+        self.assertRaises(ValueError, setattr, shaper, 'rate', 0)
+        self.assertRaises(TypeError, delattr, shaper, 'burst')
+        self.assertRaises(ValueError, pytun.Shaper, -1)
+        self.assertRaises(TypeError, pytun.Shaper, 1e6, parent=object())
+        tx, rx = self.pair()
+        self.assertIsNone(tx.shaper)
+        self.assertRaises(TypeError, setattr, tx, 'shaper', object())
+
+
+class ThreadingTest(DeviceTestCase):
+
+    def test_close_during_read(self):
+        tx, rx = self.pair()
+        result = []
+        t = threading.Thread(target=lambda: result.append(rx.read(100)))
+        t.start()
+        time.sleep(0.05)
+        # The descriptor is released once the read returns
+        rx.close()
+        tx.write(packet(0))
+        t.join(5)
+        self.assertEqual(result, [packet(0)])
+        with self.assertRaises(pytun.Error) as cm:
+            rx.read(100)
+        self.assertEqual(cm.exception.args[0], errno.EBADF)
+        rx.close()
+
+    def test_concurrent_writes(self):
+        tx, rx = self.pair()
+        rx.nonblocking = True
+
+        def write(n):
+            for i in range(100):
+                tx.write(packet(n * 100 + i))
+        threads = [threading.Thread(target=write, args=(n,)) for n in range(4)]
+        got = []
+        for t in threads:
+            t.start()
+        while len(got) < 400:
+            got.extend(rx.read_many(64, 100))
+            time.sleep(0.001)
+        for t in threads:
+            t.join()
+        self.assertEqual(sorted(got), sorted(packet(i) for i in range(400)))
+        self.assertEqual(tx.stats().tx_packets, 400)
+
+    def test_module_objects(self):
+        # A module object created by a later import doesn't take over the
+        # exceptions raised by the devices of the first one
+        module = sys.modules.pop('pytun')
+        try:
+            other = importlib.import_module('pytun')
+        finally:
+            sys.modules['pytun'] = module
+        if other.Error is pytun.Error:
+            self.skipTest('single-phase initialization')
+        tx, rx = self.pair()
+        rx.close()
+        self.assertRaises(pytun.Error, rx.read, 100)
+        self.assertRaises(pytun.Error, pytun.compile_filter, {'version': 5}, flags=TUN)
+        a, b = socket.socketpair(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+        self.addCleanup(a.close)
+        self.addCleanup(b.close)
+        dev = other.TunTapDevice(flags=TUN, dev=a.fileno())
+        dev.close()
+        self.assertRaises(other.Error, dev.read, 100)
+
+    @unittest.skipUnless(hasattr(_testcapi, 'run_in_subinterp'), 'needs _testcapi.run_in_subinterp()')
+    def test_subinterpreter(self):
+        code = '\n'.join([
+            'import pytun, socket',
+            'a, b = socket.socketpair(socket.AF_UNIX, socket.SOCK_SEQPACKET)',
+            'dev = pytun.TunTapDevice(flags=pytun.IFF_TUN | pytun.IFF_NO_PI, dev=a.fileno())',
+            'b.send(b"packet")',
+            'assert dev.read(100) == b"packet"',
+            'dev.close()',
+            'try:',
+            '    dev.read(100)',
+            'except pytun.Error:',
+            '    pass',
+            'else:',
+            '    raise AssertionError',
+        ])
+        self.assertEqual(_testcapi.run_in_subinterp(code), 0)
+
+
+class ReadWriteTest(DeviceTestCase):
+
+    def test_write_buffers(self):
+        tx, rx = self.pair()
+        for buf in (packet(0), bytearray(packet(1)), memoryview(b'--' + packet(2))[2:],
+                    array.array('B', packet(3))):
+            self.assertEqual(tx.write(buf), len(packet(0)))
+        self.assertEqual(rx.read_many(64, 100), [packet(i) for i in range(4)])
+        if sys.version_info >= (3,):
+            # Strings are encoded in UTF-8
+            self.assertEqual(tx.write(u'\xe9t\xe9'), 5)
+            self.assertEqual(rx.read(100), u'\xe9t\xe9'.encode('utf-8'))
+            self.assertRaises(BufferError, tx.write, memoryview(packet(0))[::2])
+
+    def test_write_arguments(self):
+        tx, rx = self.pair()
+        self.assertRaises(TypeError, tx.write)
+        self.assertRaises(TypeError, tx.write, packet(0), packet(1))
+        self.assertRaises(TypeError, tx.write, 1)
+        self.assertRaises(TypeError, tx.try_write)
+
+    def test_read(self):
+        tx, rx = self.pair()
+        tx.write(packet(0))
+        tx.write(packet(1))
+        self.assertEqual(rx.read(100), packet(0))
+        self.assertIsInstance(rx.read(3), bytes)
+        self.assertRaises(TypeError, rx.read)
+        self.assertRaises(TypeError, rx.read, 'x')
+        self.assertRaises(OverflowError, rx.read, -1)
+        self.assertRaises(OverflowError, rx.read, 1 << 40)
+
+    def test_try_read_write(self):
+        tx, rx = self.pair(nonblocking=True)
+        self.assertIsNone(rx.try_read(100))
+        self.assertEqual(tx.try_write(packet(0)), len(packet(0)))
+        self.assertEqual(rx.try_read(100), packet(0))
+        self.assertRaises(TypeError, rx.try_read)
+
+
+@unittest.skipIf(pytun_asyncio is None, 'needs Python 3.5 or later')
+class AsyncDeviceTest(DeviceTestCase):
+
+    def setUp(self):
+        self.loop = asyncio.new_event_loop()
+        self.addCleanup(self.loop.close)
+
+    def run_coro(self, coro, timeout=5):
+        return self.loop.run_until_complete(asyncio.wait_for(coro, timeout))
+
+    def async_pair(self, **kwargs):
+        tx, rx = self.pair()
+        adev = pytun_asyncio.AsyncDevice(rx, loop=self.loop, **kwargs)
+        self.addCleanup(adev.close)
+        return tx, adev
+
+    def test_read(self):
+        tx, adev = self.async_pair(batch=2)
+        self.assertTrue(adev.device.nonblocking)
+        for i in range(5):
+            tx.write(packet(i))
+        self.assertEqual([self.run_coro(adev.read()) for i in range(5)], [packet(i) for i in range(5)])
+        adev.close()
+        self.assertRaises(EOFError, self.run_coro, adev.read())
+
+    def test_max_queue(self):
+        tx, adev = self.async_pair(batch=4, max_queue=3)
+        for i in range(10):
+            tx.write(packet(i))
+        self.assertEqual([self.run_coro(adev.read()) for i in range(10)], [packet(i) for i in range(10)])
+
+    def test_write(self):
+        rx, adev = self.async_pair()
+        self.run_coro(adev.write(packet(0)))
+        self.run_coro(adev.write(bytearray(packet(1))))
+        self.assertEqual(rx.read_many(64, 100), [packet(0), packet(1)])
+
+    def test_write_queue(self):
+        rx, adev = self.async_pair(max_queue=4)
+        count = 0
+        # Writes that would block are queued and flushed once the device is
+        # writable
+        while not adev._wqueue:
+            self.run_coro(adev.write(packet(count)))
+            count += 1
+        for i in range(3):
+            self.run_coro(adev.write(packet(count)))
+            count += 1
+        got = []
+        while len(got) < count:
+            self.loop.run_until_complete(asyncio.sleep(0.01))
+            got.extend(rx.read_many(64, 100))
+        self.assertEqual(got, [packet(i) for i in range(count)])
+
+    def test_shaper(self):
+        rx, adev = self.async_pair()
+        adev.device.shaper = pytun.Shaper(1e5, burst=1000)
+        for i in range(4):
+            self.run_coro(adev.write(packet(i, 500)))
+        # Writes over the burst wait for the tokens of the shaper
+        self.assertEqual(len(adev._wqueue), 2)
+        got = []
+        while len(got) < 4:
+            self.loop.run_until_complete(asyncio.sleep(0.01))
+            got.extend(rx.read_many(64, 1000))
+        self.assertEqual(got, [packet(i, 500) for i in range(4)])
+
+    def test_shaper_over_burst(self):
+        rx, adev = self.async_pair()
+        adev.device.shaper = pytun.Shaper(1e5, burst=1000)
+        self.run_coro(adev.write(packet(0, 500)))
+        self.run_coro(adev.write(packet(1, 2000)))
+        self.assertEqual(len(adev._wqueue), 1)
+        got = []
+        for i in range(100):
+            self.loop.run_until_complete(asyncio.sleep(0.01))
+            got.extend(rx.read_many(64, 4000))
+            if len(got) == 2:
+                break
+        self.assertEqual(got, [packet(0, 500), packet(1, 2000)])
+
+    def test_concurrent_reads(self):
+        tx, adev = self.async_pair()
+        reads = [self.loop.create_task(adev.read()) for i in range(3)]
+        for i in range(3):
+            self.loop.call_soon(tx.write, packet(i))
+        self.assertEqual(sorted(self.run_coro(read) for read in reads),
+                         [packet(i) for i in range(3)])
+
+    def test_read_error(self):
+        tx, rx = self.pair()
+        errors = [pytun.Error('transient')]
+        read_many = rx.read_many
+
+        class Device(object):
+            # rx with a read_many() failing once
+            nonblocking = True
+
+            def fileno(self):
+                return rx.fileno()
+
+            def read_many(self, max_packets, size):
+                if errors:
+                    raise errors.pop()
+                return read_many(max_packets, size)
+
+            def close(self):
+                pass
+
+        adev = pytun_asyncio.AsyncDevice(Device(), loop=self.loop)
+        self.addCleanup(adev.close)
+        tx.write(packet(0))
+        self.assertRaises(pytun.Error, self.run_coro, adev.read())
+        # Reading resumes once the error has been raised
+        tx.write(packet(1))
+        self.assertEqual(self.run_coro(adev.read()), packet(0))
+        self.assertEqual(self.run_coro(adev.read()), packet(1))
+
+    def test_running_loop(self):
+        tx, rx = self.pair()
+        self.assertRaises(RuntimeError, pytun_asyncio.AsyncDevice, rx)
+
+
+if __name__ == '__main__':
+    unittest.main()
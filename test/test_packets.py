@@ -0,0 +1,496 @@
+"""Tests of the packet processing functions of pytun.
+
+They only build packets in memory and need no device nor privileges:
+
+    python -m unittest discover -s test -p 'test_packets.py'
+"""
+
+import random
+import socket
+import struct
+import unittest
+
+import pytun
+
+TUN = pytun.IFF_TUN | pytun.IFF_NO_PI
+# Not exported by older headers
+VIRTIO_NET_HDR_GSO_UDP_L4 = 5
+
+
+def ref_checksum(data, initial=0):
+    """Internet checksum (RFC 1071) computed one 16-bit word at a time"""
+    data = bytearray(data)
+    if len(data) % 2:
+        data.append(0)
+    s = initial
+    for i in range(0, len(data), 2):
+        s += data[i] << 8 | data[i + 1]
+    while s >> 16:
+        s = (s & 0xffff) + (s >> 16)
+    return ~s & 0xffff
+
+
+def addr(a):
+    if ':' in a:
+        return socket.inet_pton(socket.AF_INET6, a)
+    return socket.inet_aton(a)
+
+
+def ip4(proto, payload, src='10.0.0.1', dst='10.0.0.2', ident=1, options=b''):
+    ihl = 5 + len(options) // 4
+    h = bytearray(struct.pack('!BBHHHBBH4s4s', 0x40 | ihl, 0, ihl * 4 + len(payload), ident, 0x4000, 64,
+                              proto, 0, addr(src), addr(dst)) + options)
+    struct.pack_into('!H', h, 10, ref_checksum(h))
+    return fill_l4(bytes(h) + payload)
+
+
+def ip6(nh, payload, src='fd00::1', dst='fd00::2'):
+    h = struct.pack('!IHBB16s16s', 6 << 28, len(payload), nh, 64, addr(src), addr(dst))
+    return fill_l4(h + payload)
+
+
+def tcp(payload=b'', seq=1000, flags=0x18, sport=1234, dport=80):
+    return struct.pack('!HHIIBBHHH', sport, dport, seq, 0, 5 << 4, flags, 65535, 0, 0) + payload
+
+
+def udp(payload=b'', sport=1234, dport=53):
+    return struct.pack('!HHHH', sport, dport, 8 + len(payload), 0) + payload
+
+
+def l4_offset(pkt):
+    if pkt[0] >> 4 == 4:
+        return (pkt[0] & 15) * 4, pkt[9]
+    return 40, pkt[6]
+
+
+def pseudo_sum(pkt, l4len):
+    pkt = bytearray(pkt)
+    off, proto = l4_offset(pkt)
+    if pkt[0] >> 4 == 4:
+        words = struct.unpack('!4H', bytes(pkt[12:20]))
+    else:
+        words = struct.unpack('!16H', bytes(pkt[8:40]))
+    return sum(words) + proto + l4len
+
+
+def fill_l4(pkt):
+    """Fill the TCP or UDP checksum of the IP packet pkt"""
+    pkt = bytearray(pkt)
+    off, proto = l4_offset(pkt)
+    if proto not in (6, 17):
+        return bytes(pkt)
+    csum_off = off + (16 if proto == 6 else 6)
+    struct.pack_into('!H', pkt, csum_off, 0)
+    struct.pack_into('!H', pkt, csum_off, ref_checksum(pkt[off:], pseudo_sum(pkt, len(pkt) - off)))
+    return bytes(pkt)
+
+
+def checksums_ok(pkt):
+    pkt = bytearray(pkt)
+    off, proto = l4_offset(pkt)
+    if pkt[0] >> 4 == 4 and ref_checksum(pkt[:off]) != 0:
+        return False
+    return proto not in (6, 17) or ref_checksum(pkt[off:], pseudo_sum(pkt, len(pkt) - off)) == 0
+
+
+def run_filter(prog, pkt):
+    """Run the classic BPF program prog on pkt and return its verdict"""
+    insns = [struct.unpack('HBBI', prog[i:i + 8]) for i in range(0, len(prog), 8)]
+    pkt = bytes(pkt)
+    mem = [0] * 16
+    a = x = pc = 0
+    while True:
+        code, jt, jf, k = insns[pc]
+        pc += 1
+        cls = code & 0x07
+        if cls in (0x00, 0x01):
+            mode = code & 0xe0
+            size = {0x00: 4, 0x08: 2, 0x10: 1}[code & 0x18]
+            if mode == 0x00:
+                val = k
+            elif mode == 0x60:
+                val = mem[k]
+            else:
+                off = k + (x if mode == 0x40 else 0)
+                if off + size > len(pkt):
+                    return 0
+                val = struct.unpack_from({4: '!I', 2: '!H', 1: '!B'}[size], pkt, off)[0]
+                if mode == 0xa0:
+                    val = (val & 15) * 4
+            if cls == 0x00:
+                a = val
+            else:
+                x = val
+        elif cls in (0x02, 0x03):
+            mem[k] = a if cls == 0x02 else x
+        elif cls == 0x04:
+            op = code & 0xf0
+            src = x if code & 0x08 else k
+            if op == 0x00:
+                a += src
+            elif op == 0x10:
+                a -= src
+            elif op == 0x40:
+                a |= src
+            elif op == 0x50:
+                a &= src
+            elif op == 0x60:
+                a <<= src
+            elif op == 0x70:
+                a >>= src
+            else:
+                raise AssertionError('unexpected ALU opcode %#x' % code)
+            a &= 0xffffffff
+        elif cls == 0x05:
+            op = code & 0xf0
+            src = x if code & 0x08 else k
+            if op == 0x00:
+                pc += k
+                continue
+            cond = {0x10: a == src, 0x20: a > src, 0x30: a >= src, 0x40: a & src != 0}[op]
+            pc += jt if cond else jf
+        elif cls == 0x06:
+            return a if code & 0x18 == 0x10 else k
+        else:
+            if code & 0xf8:
+                a = x
+            else:
+                x = a
+
+
+class OffloadTest(unittest.TestCase):
+
+    payload = bytes(bytearray(i & 0xff for i in range(3500)))
+
+    def segment(self, pkt, gso_type, gso_size):
+        off, proto = l4_offset(bytearray(pkt))
+        hlen = off + (20 if proto == 6 else 8)
+        hdr = (pytun.VIRTIO_NET_HDR_F_NEEDS_CSUM, gso_type, hlen, gso_size, off, 16 if proto == 6 else 6)
+        return pytun.gso_segment([(hdr, pkt)]), hlen
+
+    def check_tcp_segments(self, segs, hlen, gso_size):
+        self.assertEqual(len(segs), (len(self.payload) + gso_size - 1) // gso_size)
+        data = b''
+        for i, seg in enumerate(segs):
+            seg = bytearray(seg)
+            self.assertTrue(checksums_ok(seg))
+            off = hlen - 20
+            self.assertEqual(struct.unpack('!I', bytes(seg[off + 4:off + 8]))[0], 1000 + i * gso_size)
+            last = i == len(segs) - 1
+            # PSH is only kept on the last segment
+            self.assertEqual(seg[off + 13] & 0x08, 0x08 if last else 0)
+            if not last:
+                self.assertEqual(len(seg) - hlen, gso_size)
+            data += bytes(seg[hlen:])
+        self.assertEqual(data, self.payload)
+
+    def test_tcp4_round_trip(self):
+        pkt = ip4(6, tcp(self.payload))
+        segs, hlen = self.segment(pkt, pytun.VIRTIO_NET_HDR_GSO_TCPV4, 1000)
+        self.check_tcp_segments(segs, hlen, 1000)
+        ids = [struct.unpack('!H', seg[4:6])[0] for seg in segs]
+        self.assertEqual(ids, list(range(1, len(segs) + 1)))
+
+        merged = pytun.gro_coalesce(segs)
+        self.assertEqual(len(merged), 1)
+        hdr, pkt = merged[0]
+        self.assertEqual(hdr.gso_type, pytun.VIRTIO_NET_HDR_GSO_TCPV4)
+        self.assertEqual(hdr.gso_size, 1000)
+        self.assertEqual(hdr.hdr_len, hlen)
+        self.assertEqual(pkt[hlen:], self.payload)
+        self.assertEqual(pytun.gso_segment(merged), segs)
+
+    def test_tcp6_round_trip(self):
+        pkt = ip6(6, tcp(self.payload))
+        segs, hlen = self.segment(pkt, pytun.VIRTIO_NET_HDR_GSO_TCPV6, 1220)
+        self.check_tcp_segments(segs, hlen, 1220)
+        merged = pytun.gro_coalesce(segs)
+        self.assertEqual(len(merged), 1)
+        self.assertEqual(merged[0][0].gso_type, pytun.VIRTIO_NET_HDR_GSO_TCPV6)
+        self.assertEqual(pytun.gso_segment(merged), segs)
+
+    def test_udp_segments(self):
+        pkt = ip4(17, udp(self.payload))
+        segs, hlen = self.segment(pkt, VIRTIO_NET_HDR_GSO_UDP_L4, 1400)
+        self.assertEqual([len(seg) - hlen for seg in segs], [1400, 1400, 700])
+        for seg in segs:
+            self.assertTrue(checksums_ok(seg))
+            self.assertEqual(struct.unpack('!H', seg[24:26])[0], len(seg) - 20)
+        self.assertEqual(b''.join(seg[hlen:] for seg in segs), self.payload)
+
+    def test_not_gso(self):
+        pkt = ip4(6, tcp(b'abc'))
+        self.assertEqual(pytun.gso_segment([(None, pkt)]), [pkt])
+        # The checksum is completed when the header requests it
+        partial = bytearray(pkt)
+        struct.pack_into('!H', partial, 36, ~ref_checksum(b'', pseudo_sum(pkt, 23)) & 0xffff)
+        hdr = (pytun.VIRTIO_NET_HDR_F_NEEDS_CSUM, pytun.VIRTIO_NET_HDR_GSO_NONE, 0, 0, 20, 16)
+        self.assertEqual(pytun.gso_segment([(hdr, bytes(partial))]), [pkt])
+
+    def test_coalesce_interleaved_flows(self):
+        a = [ip4(6, tcp(self.payload[i:i + 500], seq=1000 + i, flags=0x10)) for i in range(0, 1500, 500)]
+        b = [ip4(6, tcp(self.payload[i:i + 500], seq=1000 + i, flags=0x10, sport=4321)) for i in range(0, 1500, 500)]
+        udp_pkt = ip4(17, udp(b'x'))
+        merged = pytun.gro_coalesce([a[0], b[0], a[1], udp_pkt, b[1], a[2], b[2]])
+        tcp_pkts = [pkt for hdr, pkt in merged if hdr.gso_type != pytun.VIRTIO_NET_HDR_GSO_NONE]
+        self.assertEqual(len(tcp_pkts), 2)
+        for pkt in tcp_pkts:
+            self.assertEqual(pkt[40:], self.payload[:1500])
+        others = [(tuple(hdr), pkt) for hdr, pkt in merged if hdr.gso_type == pytun.VIRTIO_NET_HDR_GSO_NONE]
+        self.assertEqual(others, [((0, 0, 0, 0, 0, 0), udp_pkt)])
+
+    def test_coalesce_gap(self):
+        # Out of order segments are not merged
+        pkts = [ip4(6, tcp(self.payload[:500], seq=1000, flags=0x10)),
+                ip4(6, tcp(self.payload[:500], seq=2000, flags=0x10))]
+        merged = pytun.gro_coalesce(pkts)
+        self.assertEqual([pkt for hdr, pkt in merged], pkts)
+
+    def test_coalesce_max_size(self):
+        pkts = [ip4(6, tcp(self.payload[i:i + 500], seq=1000 + i, flags=0x10)) for i in range(0, 3000, 500)]
+        merged = pytun.gro_coalesce(pkts, max_size=1500)
+        self.assertTrue(len(merged) > 1)
+        self.assertTrue(all(len(pkt) <= 1500 for hdr, pkt in merged))
+        self.assertEqual(b''.join(pkt[40:] for hdr, pkt in merged), self.payload[:3000])
+
+
+class ParseTest(unittest.TestCase):
+
+    def test_packet_view(self):
+        pkt = ip4(17, udp(b'hello', sport=5000, dport=53))
+        view = pytun.PacketView(pkt, flags=TUN)
+        self.assertEqual((view.version, view.ip_proto, view.sport, view.dport), (4, 17, 5000, 53))
+        self.assertEqual((view.l3_offset, view.l4_offset, view.payload_offset), (0, 20, 28))
+        self.assertEqual(view.payload.tobytes(), b'hello')
+        self.assertEqual(view.vlan, None)
+        self.assertEqual(view.tcp_flags, None)
+
+    def test_parse_many(self):
+        pkts = [ip4(17, udp(sport=5000, dport=0)), ip6(6, tcp(flags=0x02)), ip4(1, b'\x08' + b'\x00' * 7), b'\x45']
+        fields = pytun.parse_many(pkts, flags=TUN)
+        self.assertEqual(list(fields['length']), [len(pkt) for pkt in pkts])
+        self.assertEqual(list(fields['version']), [4, 6, 4, -1])
+        self.assertEqual(list(fields['l4_offset']), [20, 40, 20, -1])
+        self.assertEqual(list(fields['sport']), [5000, 1234, -1, -1])
+        self.assertEqual(list(fields['dport']), [0, 80, -1, -1])
+        self.assertEqual(list(fields['tcp_flags']), [-1, 0x02, -1, -1])
+        self.assertEqual(list(fields['vlan']), [-1, -1, -1, -1])
+        self.assertEqual(fields['src'][:16], b'\x00' * 10 + b'\xff\xff' + addr('10.0.0.1'))
+        self.assertEqual(fields['dst'][16:32], addr('fd00::2'))
+        for i, pkt in enumerate(pkts[:3]):
+            view = pytun.PacketView(pkt, flags=TUN)
+            self.assertEqual(fields['ip_proto'][i], view.ip_proto)
+            self.assertEqual(fields['payload_offset'][i], view.payload_offset)
+
+    def test_parse_many_offsets(self):
+        pkts = [ip4(17, udp(sport=i)) for i in range(5)]
+        offsets = [0]
+        for pkt in pkts:
+            offsets.append(offsets[-1] + len(pkt))
+        fields = pytun.parse_many(b''.join(pkts), offsets, flags=TUN)
+        self.assertEqual(list(fields['sport']), list(range(5)))
+
+
+class FlowTableTest(unittest.TestCase):
+
+    @staticmethod
+    def key(i):
+        return ('10.%d.%d.%d' % (i >> 16 & 255, i >> 8 & 255, i & 255), '192.168.0.1', 6, 1024 + i % 50000, 80)
+
+    def test_resize(self):
+        table = pytun.FlowTable(capacity=4)
+        for i in range(5000):
+            table.add(self.key(i), i)
+        self.assertEqual(len(table), 5000)
+        for i in range(5000):
+            self.assertEqual(table.lookup(self.key(i)), i)
+        self.assertEqual(table.lookup(self.key(5000)), None)
+
+    def test_tombstones(self):
+        table = pytun.FlowTable(capacity=8)
+        for i in range(4):
+            table.add(self.key(i), i)
+        # Far more insertions and removals than slots: lookups must still
+        # terminate and find the flows behind the removed ones
+        for i in range(4, 20000):
+            table.add(self.key(i), i)
+            table.remove(self.key(i))
+            self.assertEqual(len(table), 4)
+        for i in range(4):
+            self.assertEqual(table.lookup(self.key(i)), i)
+        self.assertEqual(table.lookup(self.key(4)), None)
+        self.assertRaises(KeyError, table.remove, self.key(4))
+        # Removed slots are reused
+        for i in range(0, 4, 2):
+            table.remove(self.key(i))
+        table.add(self.key(100), 100)
+        self.assertEqual([table.lookup(self.key(i)) for i in (0, 1, 2, 3, 100)], [None, 1, None, 3, 100])
+
+    def test_replace_and_clear(self):
+        table = pytun.FlowTable()
+        table.add(self.key(1), 1)
+        table.add(self.key(1), 2)
+        self.assertEqual(len(table), 1)
+        self.assertEqual(table.lookup(self.key(1)), 2)
+        table.clear()
+        self.assertEqual(len(table), 0)
+        self.assertEqual(table.lookup(self.key(1)), None)
+
+    def test_classify(self):
+        table = pytun.FlowTable(flags=TUN)
+        pkts = [ip4(6, tcp(sport=1000 + i)) for i in range(10)]
+        for i in range(0, 10, 2):
+            table.add_packet(pkts[i], i)
+        self.assertEqual(list(table.classify(pkts)), [i if i % 2 == 0 else -1 for i in range(10)])
+        offsets = [0]
+        for pkt in pkts:
+            offsets.append(offsets[-1] + len(pkt))
+        self.assertEqual(list(table.classify(b''.join(pkts), offsets)), list(table.classify(pkts)))
+        groups = table.split(pkts)
+        self.assertEqual(groups[4], [pkts[4]])
+        self.assertEqual(groups[None], pkts[1::2])
+
+    def test_symmetric(self):
+        table = pytun.FlowTable(flags=TUN, symmetric=True)
+        out = ip6(17, udp(sport=5000, dport=53))
+        back = ip6(17, udp(sport=53, dport=5000), src='fd00::2', dst='fd00::1')
+        table.add_packet(out, 7)
+        self.assertEqual(list(table.classify([out, back])), [7, 7])
+        self.assertEqual(list(pytun.FlowTable(flags=TUN).classify([back])), [-1])
+
+
+class FilterTest(unittest.TestCase):
+
+    def accepts(self, prog, pkt):
+        return run_filter(prog, pkt) != 0
+
+    def test_no_rule(self):
+        prog = pytun.compile_filter(flags=TUN)
+        self.assertTrue(self.accepts(prog, ip4(17, udp())))
+        self.assertTrue(self.accepts(prog, b'\x00'))
+
+    def test_ports_and_proto(self):
+        prog = pytun.compile_filter({'proto': 17, 'dport': 53}, flags=TUN)
+        self.assertTrue(self.accepts(prog, ip4(17, udp(dport=53))))
+        self.assertFalse(self.accepts(prog, ip4(17, udp(dport=54))))
+        self.assertFalse(self.accepts(prog, ip4(6, tcp(dport=53))))
+        # The transport header is found after IPv4 options
+        self.assertTrue(self.accepts(prog, ip4(17, udp(dport=53), options=b'\x01\x01\x01\x00')))
+        self.assertFalse(self.accepts(prog, ip4(17, udp(dport=54), options=b'\x01\x01\x01\x00')))
+
+    def test_prefixes(self):
+        prog = pytun.compile_filter({'src': '10.0.0.0/8', 'dst': '192.168.1.7'}, flags=TUN)
+        self.assertTrue(self.accepts(prog, ip4(6, tcp(), src='10.1.2.3', dst='192.168.1.7')))
+        self.assertFalse(self.accepts(prog, ip4(6, tcp(), src='11.1.2.3', dst='192.168.1.7')))
+        self.assertFalse(self.accepts(prog, ip4(6, tcp(), src='10.1.2.3', dst='192.168.1.8')))
+
+    def test_ipv6(self):
+        prog = pytun.compile_filter({'version': 6, 'src': 'fd00::/16', 'proto': 6, 'sport': 22}, flags=TUN)
+        self.assertTrue(self.accepts(prog, ip6(6, tcp(sport=22))))
+        self.assertFalse(self.accepts(prog, ip6(6, tcp(sport=23))))
+        self.assertFalse(self.accepts(prog, ip6(6, tcp(sport=22), src='fe80::1')))
+        self.assertFalse(self.accepts(prog, ip4(6, tcp(sport=22))))
+
+    def test_any_rule(self):
+        prog = pytun.compile_filter({'proto': 1}, {'version': 6}, flags=TUN)
+        self.assertTrue(self.accepts(prog, ip4(1, b'\x08\x00\x00\x00\x00\x00\x00\x00')))
+        self.assertTrue(self.accepts(prog, ip6(17, udp())))
+        self.assertFalse(self.accepts(prog, ip4(17, udp())))
+
+    def test_flags(self):
+        rule = {'proto': 17, 'dport': 53}
+        pkt = ip4(17, udp(dport=53))
+        other = ip4(17, udp(dport=54))
+        # The kernel runs the filters of TUN devices on the IP packet, the
+        # packet information prefix is not part of it
+        prog = pytun.compile_filter(rule, flags=pytun.IFF_TUN)
+        self.assertTrue(self.accepts(prog, pkt))
+        self.assertFalse(self.accepts(prog, other))
+        eth = b'\x02' * 12 + struct.pack('!H', 0x0800)
+        prog = pytun.compile_filter(rule, flags=pytun.IFF_TAP | pytun.IFF_NO_PI)
+        self.assertTrue(self.accepts(prog, eth + pkt))
+        self.assertFalse(self.accepts(prog, eth + other))
+        self.assertFalse(self.accepts(prog, b'\x02' * 12 + struct.pack('!H', 0x86dd) + pkt))
+
+    def test_truncated(self):
+        prog = pytun.compile_filter({'proto': 17, 'dport': 53}, flags=TUN)
+        self.assertFalse(self.accepts(prog, ip4(17, udp(dport=53))[:21]))
+
+    def test_bad_rule(self):
+        self.assertRaises(Exception, pytun.compile_filter, {'src': 'not an address'}, flags=TUN)
+        self.assertRaises(Exception, pytun.compile_filter, {'version': 5}, flags=TUN)
+        for key in ('proto', 'sport', 'dport'):
+            self.assertRaises(pytun.Error, pytun.compile_filter, {key: -1}, flags=TUN)
+            self.assertRaises(pytun.Error, pytun.compile_filter, {key: 65536}, flags=TUN)
+
+
+class ChecksumTest(unittest.TestCase):
+
+    def setUp(self):
+        rnd = random.Random(1)
+        self.data = bytes(bytearray(rnd.getrandbits(8) for i in range(4200)))
+
+    def test_kernels(self):
+        self.assertTrue(len(pytun.CHECKSUM_KERNELS) > 0)
+        for length in list(range(0, 70)) + [127, 128, 129, 1499, 1500, 4095, 4096]:
+            for offset in (0, 1, 2, 3, 7, 31):
+                data = self.data[offset:offset + length]
+                expected = ref_checksum(data)
+                self.assertEqual(pytun.checksum(data), expected)
+                for kernel in pytun.CHECKSUM_KERNELS:
+                    self.assertEqual(pytun.checksum(memoryview(self.data)[offset:offset + length], kernel=kernel),
+                                     expected, (kernel, length, offset))
+
+    def test_initial(self):
+        for initial in (0, 1, 0xffff, 0x12345, 0xffffffff):
+            for kernel in pytun.CHECKSUM_KERNELS:
+                self.assertEqual(pytun.checksum(self.data[:1001], initial, kernel=kernel),
+                                 ref_checksum(self.data[:1001], initial))
+
+    def test_bad_kernel(self):
+        self.assertRaises(pytun.Error, pytun.checksum, b'ab', kernel='nonexistent')
+
+    def test_update(self):
+        data = bytearray(self.data[:64])
+        csum = ref_checksum(data)
+        old = bytes(data[10:18])
+        data[10:18] = b'\x01\x02\x03\x04\xfe\xfd\xfc\xfb'
+        self.assertEqual(pytun.checksum_update(csum, old, bytes(data[10:18])), ref_checksum(data))
+        old = struct.unpack('!H', bytes(data[20:22]))[0]
+        data[20:22] = b'\xab\xcd'
+        self.assertEqual(pytun.checksum_update(ref_checksum(self.data[:64][:10] + bytes(data[10:20]) +
+                                                            self.data[20:64]), old, 0xabcd),
+                         ref_checksum(data))
+
+
+class RewriterTest(unittest.TestCase):
+
+    def test_rewrite(self):
+        rw = pytun.Rewriter(flags=TUN)
+        rw.add_rule({'dst': '10.0.0.2', 'proto': 6, 'dport': 80}, {'dst': '172.16.0.9', 'dport': 8080})
+        rw.add_rule({'version': 6, 'src': 'fd00::/16'}, {'src': 'fd01::5', 'sport': 999})
+        pkts = [bytearray(ip4(6, tcp(b'data'))), bytearray(ip4(6, tcp(b'data', dport=81))),
+                bytearray(ip6(17, udp(b'data'))), bytearray(b'\x00\x01')]
+        self.assertEqual(rw.rewrite(pkts), 2)
+        self.assertEqual(list(rw.hits), [1, 1])
+        self.assertEqual(rw.misses, 1)
+        self.assertEqual(rw.skipped, 1)
+        for pkt in pkts[:3]:
+            self.assertTrue(checksums_ok(pkt))
+        self.assertEqual(bytes(pkts[0]), ip4(6, tcp(b'data', dport=8080), dst='172.16.0.9'))
+        self.assertEqual(bytes(pkts[1]), ip4(6, tcp(b'data', dport=81)))
+        self.assertEqual(bytes(pkts[2]), ip6(17, udp(b'data', sport=999), src='fd01::5'))
+
+    def test_rewrite_offsets(self):
+        rw = pytun.Rewriter(flags=TUN)
+        rw.add_rule({'proto': 17}, {'sport': 7})
+        pkts = [ip4(17, udp(sport=i)) for i in range(3)]
+        buf = bytearray(b''.join(pkts))
+        self.assertEqual(rw.rewrite(buf, [0, len(pkts[0]), 2 * len(pkts[0]), 3 * len(pkts[0])]), 3)
+        self.assertEqual(bytes(buf), ip4(17, udp(sport=7)) * 3)
+        rw.clear()
+        self.assertEqual(rw.rewrite([bytearray(pkts[0])]), 0)
+
+
+if __name__ == '__main__':
+    unittest.main()